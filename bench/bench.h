@@ -0,0 +1,48 @@
+/* Cronometragem dos microbenchmarks. Cada função recebe o número de
+ * repetições e percorre sozinha suas entradas; o lote é calibrado para
+ * durar cerca de BENCH_ROUND_NS e o resultado é o melhor tempo por chamada
+ * entre BENCH_ROUNDS rodadas curtas, o que descarta interrupções e trocas de
+ * contexto. Cada resultado sai como uma linha "nome_ns": valor. */
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <stdio.h>
+#include <time.h>
+
+#define BENCH_ROUNDS 15
+#define BENCH_ROUND_NS 20000000LL
+
+/* Impede o compilador de descartar um resultado que não é usado */
+#define BENCH_KEEP(value) __asm__ volatile("" : : "g"(value) : "memory")
+
+typedef void (*bench_fn_t)(long iterations);
+
+static long long bench_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void bench_run(const char *name, bench_fn_t fn) {
+    long iterations = 1;
+    while (1) {
+        long long start = bench_now_ns();
+        fn(iterations);
+        long long elapsed = bench_now_ns() - start;
+        if (elapsed >= BENCH_ROUND_NS || iterations >= (1L << 40)) break;
+        iterations = elapsed > 0 && elapsed < BENCH_ROUND_NS / 16
+                     ? iterations * 16 : (long)(iterations * (double)BENCH_ROUND_NS / elapsed) + 1;
+    }
+    
+    double best = 0;
+    for (int round = 0; round < BENCH_ROUNDS; round++) {
+        long long start = bench_now_ns();
+        fn(iterations);
+        double per_call = (double)(bench_now_ns() - start) / iterations;
+        if (round == 0 || per_call < best) best = per_call;
+    }
+    printf("\"%s_ns\": %.2f\n", name, best);
+    fflush(stdout);
+}
+
+#endif
@@ -0,0 +1,67 @@
+#!/bin/sh
+# Compara o resultado do make bench com a linha de base. Métricas
+# terminadas em _ns e _us (tempos) pioram quando sobem e em _rps e _mbps
+# (vazão) quando descem; "errors" não pode passar da linha de base. Os
+# máximos, as latências de cenários com menos de 100 requisições e as
+# demais métricas são só informativos. Falha se alguma piorar mais que
+# TOLERÂNCIA por cento.
+#
+# Uso: bench/compare.sh LINHA_DE_BASE RESULTADO [TOLERÂNCIA]
+BASELINE=${1:?"uso: $0 LINHA_DE_BASE RESULTADO [TOLERÂNCIA]"}
+RESULT=${2:?"uso: $0 LINHA_DE_BASE RESULTADO [TOLERÂNCIA]"}
+TOLERANCE=${3:-25}
+
+if [ ! -f "$BASELINE" ]; then
+    echo "Sem linha de base em $BASELINE; grave o resultado atual com make bench-baseline"
+    exit 0
+fi
+
+awk -v tolerance="$TOLERANCE" '
+    function parse(line, parts) {
+        if (line !~ /^ *"[^"]+": *-?[0-9.]+,?$/) return 0
+        sub(/^ *"/, "", line)
+        sub(/,$/, "", line)
+        split(line, parts, /": */)
+        key = parts[1]
+        value = parts[2] + 0
+        return 1
+    }
+    FNR == NR {
+        if (parse($0)) base[key] = value
+        next
+    }
+    FNR == 1 {
+        printf "%-48s %14s %14s %9s\n", "métrica", "base", "atual", "variação"
+    }
+    parse($0) {
+        scenario = key
+        sub(/\.[^.]*$/, "", scenario)
+        if (key ~ /\.requests$/) requests[scenario] = value
+        if (!(key in base)) {
+            printf "%-48s %14s %14.2f %9s  nova\n", key, "-", value, "-"
+            next
+        }
+        old = base[key]
+        change = old != 0 ? (value - old) * 100 / old : 0
+        status = "ok"
+        if (key ~ /_max_us$/ || key !~ /(_ns|_us|_rps|_mbps|errors)$/ ||
+            (key ~ /_us$/ && (scenario in requests) && requests[scenario] < 100)) {
+            status = "info"
+        } else if (key ~ /(_ns|_us)$/ && change > tolerance) {
+            status = "REGRESSÃO"
+        } else if (key ~ /(_rps|_mbps)$/ && -change > tolerance) {
+            status = "REGRESSÃO"
+        } else if (key ~ /errors$/ && value > old) {
+            status = "REGRESSÃO"
+        }
+        if (status == "REGRESSÃO") regressions++
+        printf "%-48s %14.2f %14.2f %+8.1f%%  %s\n", key, old, value, change, status
+    }
+    END {
+        if (regressions > 0) {
+            printf "\n%d métrica(s) pioraram mais que a tolerância de %s%%\n", regressions, tolerance
+            exit 1
+        }
+        printf "\nSem regressões (tolerância de %s%%)\n", tolerance
+    }
+' "$BASELINE" "$RESULT"
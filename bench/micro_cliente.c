@@ -0,0 +1,42 @@
+/* Microbenchmarks das funções do cliente usadas a cada URL e resposta */
+#define main cliente_main
+#include "../cliente.c"
+#undef main
+
+#include "bench.h"
+
+#define COUNT(array) (sizeof(array) / sizeof((array)[0]))
+
+static const char *urls[] = {
+    "http://localhost:5050/",
+    "http://localhost:5050/index.html",
+    "http://exemplo.com.br/docs/manual/capitulo-3/figuras/diagrama.png",
+    "http://192.168.0.10:8080/api/v1/itens?pagina=2&tamanho=50",
+    "http://cdn.exemplo.net/static/js/app.min.js",
+};
+
+static const char *responses[] = {
+    "HTTP/1.1 200 OK\r\nContent-Type: text/html\r\nContent-Length: 52\r\n\r\n",
+    "HTTP/1.1 304 Not Modified\r\nETag: \"34-18df4044f0af18ef\"\r\n\r\n",
+    "HTTP/1.0 404 Not Found\r\nContent-Length: 0\r\n\r\n",
+    "HTTP/1.1 206 Partial Content\r\nContent-Range: bytes 0-99/1000\r\n\r\n",
+};
+
+static void bench_parse_url(long iterations) {
+    url_info_t info;
+    for (long i = 0; i < iterations; i++) {
+        BENCH_KEEP(parse_url(urls[i % COUNT(urls)], &info));
+    }
+}
+
+static void bench_get_http_status_code(long iterations) {
+    for (long i = 0; i < iterations; i++) {
+        BENCH_KEEP(get_http_status_code(responses[i % COUNT(responses)]));
+    }
+}
+
+int main(void) {
+    bench_run("micro.cliente.parse_url", bench_parse_url);
+    bench_run("micro.cliente.get_http_status_code", bench_get_http_status_code);
+    return 0;
+}
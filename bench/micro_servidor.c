@@ -0,0 +1,104 @@
+/* Microbenchmarks das funções do caminho de cada requisição no servidor.
+ * O servidor é incluído inteiro, com main renomeada, para medir as funções
+ * como são compiladas nele. */
+#define main servidor_main
+#include "../servidor.c"
+#undef main
+
+#include "bench.h"
+
+#define COUNT(array) (sizeof(array) / sizeof((array)[0]))
+
+static const char *targets[] = {
+    "/index.html",
+    "/static/js/app.min.js",
+    "/img/logo%20grande.png",
+    "/docs/relat%C3%B3rio+anual+2024.pdf",
+    "/a/b/c/d/e/f/g/h/i/j/k/l/m/n/o/p/q/r/s/t/u/v/w/x/y/z/arquivo.txt",
+};
+
+static const char *filenames[] = {
+    "index.html", "style.css", "app.js", "logo.png", "foto.jpeg",
+    "manual.pdf", "LEIAME", "dados.bin", "notas.txt", "anim.gif",
+};
+
+static const char *resolved_paths[] = {
+    "/srv/site/index.html",
+    "/srv/site/docs/manual.pdf",
+    "/srv/site2/segredo.txt",
+    "/etc/passwd",
+    "/srv/site",
+};
+
+static const char request[] =
+    "GET /static/js/app.min.js HTTP/1.1\r\n"
+    "Host: localhost:5050\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:128.0) Gecko/20100101 Firefox/128.0\r\n"
+    "Accept: */*\r\n"
+    "Accept-Language: pt-BR,pt;q=0.8,en-US;q=0.5,en;q=0.3\r\n"
+    "Accept-Encoding: gzip, deflate, br\r\n"
+    "Referer: http://localhost:5050/\r\n"
+    "Connection: keep-alive\r\n"
+    "If-None-Match: \"1f3a-18df4044f0af18ef\"\r\n"
+    "\r\n";
+
+static size_t target_lengths[COUNT(targets)];
+
+static void bench_url_decode(long iterations) {
+    char decoded[MAX_PATH_LENGTH];
+    for (long i = 0; i < iterations; i++) {
+        size_t k = i % COUNT(targets);
+        BENCH_KEEP(url_decode(decoded, sizeof(decoded), targets[k], target_lengths[k]));
+    }
+}
+
+static void bench_get_mime_type(long iterations) {
+    for (long i = 0; i < iterations; i++) {
+        BENCH_KEEP(get_mime_type(filenames[i % COUNT(filenames)]));
+    }
+}
+
+static void bench_is_safe_path(long iterations) {
+    for (long i = 0; i < iterations; i++) {
+        BENCH_KEEP(is_safe_path(resolved_paths[i % COUNT(resolved_paths)]));
+    }
+}
+
+static void bench_format_header_200(long iterations) {
+    file_meta_t meta = {
+        .size = 123456,
+        .mtime = 1700000000,
+        .etag = "\"1e240-18df4044f0af18ef\"",
+        .mime_type = "application/javascript",
+        .encoding = "gzip",
+        .vary = 1,
+    };
+    char header[BUFFER_SIZE];
+    for (long i = 0; i < iterations; i++) {
+        meta.size = 123456 + (i & 1023);
+        BENCH_KEEP(format_header_200(&meta, header, sizeof(header)));
+    }
+}
+
+static void bench_http_parse(long iterations) {
+    http_request_t parsed;
+    for (long i = 0; i < iterations; i++) {
+        http_parser_reset(&parsed);
+        BENCH_KEEP(http_parse(&parsed, request, sizeof(request) - 1));
+    }
+}
+
+int main(void) {
+    parser_init();
+    snprintf(resolved_base, sizeof(resolved_base), "/srv/site");
+    for (size_t i = 0; i < COUNT(targets); i++) {
+        target_lengths[i] = strlen(targets[i]);
+    }
+    
+    bench_run("micro.servidor.url_decode", bench_url_decode);
+    bench_run("micro.servidor.get_mime_type", bench_get_mime_type);
+    bench_run("micro.servidor.is_safe_path", bench_is_safe_path);
+    bench_run("micro.servidor.format_header_200", bench_format_header_200);
+    bench_run("micro.servidor.http_parse", bench_http_parse);
+    return 0;
+}
@@ -0,0 +1,140 @@
+#!/bin/sh
+# Harness do make bench: roda os microbenchmarks e os cenários de ponta a
+# ponta e grava todas as métricas em RESULTADO como um objeto JSON plano
+# ("nome": valor, um por linha).
+#
+# Uso: bench/run.sh RESULTADO
+#
+# Variáveis de ambiente (com os padrões):
+#   SERVIDOR, CLIENTE        binários medidos (./servidor, ./cliente)
+#   MICRO                    microbenchmarks a rodar
+#   BENCH_SITE               onde o site sintético é gerado (bench_site)
+#   BENCH_DURATION           segundos de cada cenário com duração (5)
+#   BENCH_CONNECTIONS        conexões simultâneas nos cenários pequenos (32)
+#   BENCH_BIG_COUNT          arquivos grandes (3)
+#   BENCH_BIG_SIZE           tamanho de cada um, para o truncate (2G)
+#   BENCH_SERVER_ARGS        opções do servidor (--epoll)
+#   BENCH_PORT               porta do servidor durante os cenários (5050)
+set -e
+
+RESULT=${1:?"uso: $0 RESULTADO"}
+SERVIDOR=${SERVIDOR:-./servidor}
+CLIENTE=${CLIENTE:-./cliente}
+MICRO=${MICRO:-"bench/micro_servidor bench/micro_cliente"}
+SITE=${BENCH_SITE:-bench_site}
+DURATION=${BENCH_DURATION:-5}
+CONNECTIONS=${BENCH_CONNECTIONS:-32}
+BIG_COUNT=${BENCH_BIG_COUNT:-3}
+BIG_SIZE=${BENCH_BIG_SIZE:-2G}
+SERVER_ARGS=${BENCH_SERVER_ARGS:---epoll}
+SMALL_COUNT=2000
+LISTING_COUNT=100000
+PORT=${BENCH_PORT:-5050}
+URL=http://127.0.0.1:$PORT
+
+case $SERVIDOR in */*) ;; *) SERVIDOR=./$SERVIDOR ;; esac
+case $CLIENTE in */*) ;; *) CLIENTE=./$CLIENTE ;; esac
+
+TMP=$(mktemp -d)
+SERVER_PID=
+cleanup() {
+    if [ -n "$SERVER_PID" ]; then
+        kill "$SERVER_PID" 2>/dev/null || true
+        wait "$SERVER_PID" 2>/dev/null || true
+    fi
+    rm -rf "$TMP"
+}
+trap cleanup EXIT
+trap 'exit 1' INT TERM
+
+# Site sintético, refeito só quando os parâmetros mudam: arquivos pequenos
+# de tamanhos variados, alguns arquivos grandes esparsos (não ocupam disco,
+# mas são lidos inteiros pelo servidor) e um diretório com 100 mil entradas
+generate_site() {
+    params="$SMALL_COUNT $BIG_COUNT $BIG_SIZE $LISTING_COUNT"
+    if [ "$(cat "$SITE/.parametros" 2>/dev/null)" = "$params" ]; then
+        return
+    fi
+    echo "Gerando o site sintético em $SITE..."
+    rm -rf "$SITE"
+    mkdir -p "$SITE/small" "$SITE/big" "$SITE/listing"
+    awk -v dir="$SITE/small" -v count=$SMALL_COUNT 'BEGIN {
+        line = "Lorem ipsum dolor sit amet, consectetur adipiscing elit, sed do eiusmod tempor.\n"
+        body = line
+        while (length(body) < 16640) body = body line
+        for (i = 0; i < count; i++) {
+            file = sprintf("%s/f%04d.%s", dir, i, i % 3 == 0 ? "html" : i % 3 == 1 ? "css" : "js")
+            printf "%s", substr(body, 1, 256 + (i * 7919) % 16384) > file
+            close(file)
+        }
+    }'
+    i=0
+    while [ $i -lt "$BIG_COUNT" ]; do
+        truncate -s "$BIG_SIZE" "$SITE/big/big$i.bin"
+        i=$((i + 1))
+    done
+    (cd "$SITE/listing" && seq -f "entrada%06g.txt" 0 $((LISTING_COUNT - 1)) | xargs touch)
+    echo "<html><body><h1>bench</h1></body></html>" > "$SITE/index.html"
+    echo "$params" > "$SITE/.parametros"
+}
+
+port_listening() {
+    awk -v port=":$(printf '%04X' $PORT)" '$2 ~ port "$" && $4 == "0A" { found = 1 } END { exit !found }' \
+        /proc/net/tcp /proc/net/tcp6 2>/dev/null
+}
+
+start_server() {
+    if port_listening; then
+        echo "Erro: a porta $PORT já está em uso" >&2
+        exit 1
+    fi
+    "$SERVIDOR" --port $PORT $SERVER_ARGS "$SITE" > "$TMP/servidor.log" 2>&1 &
+    SERVER_PID=$!
+    tries=0
+    until port_listening; do
+        tries=$((tries + 1))
+        if [ $tries -gt 50 ] || ! kill -0 "$SERVER_PID" 2>/dev/null; then
+            echo "Erro: o servidor não começou a escutar na porta $PORT" >&2
+            cat "$TMP/servidor.log" >&2
+            exit 1
+        fi
+        sleep 0.1
+    done
+}
+
+# Um cenário do modo bench do cliente; as métricas entram no resultado
+# como e2e.NOME.métrica
+scenario() {
+    name=$1
+    shift
+    echo "Cenário $name"
+    if ! "$CLIENTE" bench -k -x -j "$TMP/$name.json" "$@" > "$TMP/$name.txt" 2>&1; then
+        cat "$TMP/$name.txt" >&2
+        exit 1
+    fi
+    sed -n 's/^  "\([a-z0-9_]*\)": \([0-9.]*\),\{0,1\}$/"e2e.'"$name"'.\1": \2/p' "$TMP/$name.json" >> "$TMP/metrics"
+}
+
+: > "$TMP/metrics"
+for micro in $MICRO; do
+    echo "Microbenchmarks: $micro"
+    "$micro" >> "$TMP/metrics"
+done
+
+generate_site
+start_server
+
+# 64 arquivos pequenos sorteados a cada requisição (o máximo do --urls)
+ls "$SITE/small" | head -64 | sed "s|^|$URL/small/|" > "$TMP/small.urls"
+scenario small -c "$CONNECTIONS" -d "$DURATION" -u "$TMP/small.urls"
+scenario listing -c 8 -d "$DURATION" "$URL/listing/"
+ls "$SITE/big" | sed "s|^|$URL/big/|" > "$TMP/big.urls"
+scenario large -c "$BIG_COUNT" -n $((BIG_COUNT * 2)) -u "$TMP/big.urls"
+
+awk 'BEGIN { print "{" }
+     { lines[NR] = $0 }
+     END {
+         for (i = 1; i <= NR; i++) print "  " lines[i] (i < NR ? "," : "")
+         print "}"
+     }' "$TMP/metrics" > "$RESULT"
+echo "Resultado gravado em $RESULT"
@@ -0,0 +1,111 @@
+/* Formato do bundle: um site inteiro num só arquivo, gerado pelo
+ * empacotador e servido pelo servidor com --bundle a partir de um mmap.
+ *
+ *   cabeçalho (bundle_header_t)
+ *   corpos, cada um começando numa página (BUNDLE_ALIGN)
+ *   deslocamentos do hash perfeito (uint32_t por balde)
+ *   tabela de entradas (bundle_entry_t por posição)
+ *   cadeias: caminhos e tipos MIME, terminados em '\0'
+ *
+ * Os caminhos começam com '/' e não terminam em '/' (a raiz é "/"). A
+ * posição de um caminho na tabela sai de dois hashes: o primeiro escolhe o
+ * balde e o deslocamento guardado para o balde, usado como semente do
+ * segundo, dá a posição; o empacotador escolhe os deslocamentos de modo
+ * que nenhuma posição seja disputada. Posições vazias têm path_len 0.
+ * Os números ficam na ordem de bytes da máquina que gerou o bundle. */
+#ifndef BUNDLE_H
+#define BUNDLE_H
+
+#include <stdint.h>
+#include <string.h>
+
+#define BUNDLE_MAGIC "SRVBNDL1"
+#define BUNDLE_VERSION 1
+#define BUNDLE_ALIGN 4096
+#define BUNDLE_ETAG_SIZE 64
+
+/* Comprimir arquivos menores que isto não compensa */
+#define GZIP_MIN_SIZE 256
+
+/* bundle_entry_t.flags */
+#define BUNDLE_DIRECTORY 1       /* diretório: corpo é o index.html ou a listagem */
+#define BUNDLE_VARY 2            /* a representação depende de Accept-Encoding */
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t count;              /* caminhos guardados */
+    uint32_t slots;              /* posições da tabela de entradas */
+    uint32_t buckets;            /* baldes do hash perfeito */
+    uint64_t seed;               /* semente do primeiro hash */
+    uint64_t size;               /* tamanho do arquivo inteiro */
+    uint64_t displacements_offset;
+    uint64_t entries_offset;
+    uint64_t strings_offset;
+    uint64_t strings_size;
+} bundle_header_t;
+
+typedef struct {
+    uint64_t offset;             /* corpo, a partir do início do arquivo */
+    uint64_t length;
+    uint64_t gzip_offset;        /* versão gzip; gzip_length 0 se não houver */
+    uint64_t gzip_length;
+    int64_t mtime;
+    uint32_t path;               /* posições nas cadeias */
+    uint32_t path_len;
+    uint32_t mime_type;
+    uint32_t flags;
+    char etag[BUNDLE_ETAG_SIZE];
+    char gzip_etag[BUNDLE_ETAG_SIZE];
+} bundle_entry_t;
+
+/* FNV-1a com semente, misturado no final para espalhar os bits baixos
+ * usados no módulo */
+static inline uint64_t bundle_hash(const char *key, size_t len, uint64_t seed) {
+    uint64_t hash = 14695981039346656037ULL ^ (seed * 0x9e3779b97f4a7c15ULL);
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (unsigned char)key[i];
+        hash *= 1099511628211ULL;
+    }
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+    hash *= 0xc4ceb9fe1a85ec53ULL;
+    hash ^= hash >> 33;
+    return hash;
+}
+
+/* Posição do caminho na tabela, dado o deslocamento do seu balde */
+static inline uint32_t bundle_slot(const char *key, size_t len, uint32_t displacement, uint32_t slots) {
+    return bundle_hash(key, len, (uint64_t)displacement + 1) % slots;
+}
+
+static inline const char *get_mime_type(const char *filename) {
+    const char *ext = strrchr(filename, '.');
+    if (ext == NULL) return "application/octet-stream";
+    
+    if (strcmp(ext, ".html") == 0 || strcmp(ext, ".htm") == 0)
+        return "text/html";
+    else if (strcmp(ext, ".jpg") == 0 || strcmp(ext, ".jpeg") == 0)
+        return "image/jpeg";
+    else if (strcmp(ext, ".png") == 0)
+        return "image/png";
+    else if (strcmp(ext, ".gif") == 0)
+        return "image/gif";
+    else if (strcmp(ext, ".css") == 0)
+        return "text/css";
+    else if (strcmp(ext, ".js") == 0)
+        return "application/javascript";
+    else if (strcmp(ext, ".txt") == 0)
+        return "text/plain";
+    else if (strcmp(ext, ".pdf") == 0)
+        return "application/pdf";
+    else
+        return "application/octet-stream";
+}
+
+static inline int is_compressible(const char *mime_type) {
+    return strncmp(mime_type, "text/", 5) == 0 || strcmp(mime_type, "application/javascript") == 0;
+}
+
+#endif
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -6,6 +7,14 @@
 #include <netdb.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
 
 #define BUFFER_SIZE 4096
 #define MAX_REDIRECTS 5
@@ -64,28 +73,59 @@ char* get_filename(const char *path) {
     return strdup(filename + 1);
 }
 
-int create_connection(const char *host, int port) {
-    struct hostent *server;
-    struct sockaddr_in serv_addr;
+long long monotonic_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* Cache de resolução de nomes: cada host é resolvido uma única vez por execução */
+typedef struct dns_entry {
+    char host[256];
+    struct in_addr address;
+    struct dns_entry *next;
+} dns_entry_t;
+
+static dns_entry_t *dns_cache = NULL;
+
+int resolve_host(const char *host, int port, struct sockaddr_in *addr) {
+    dns_entry_t *entry = dns_cache;
+    while (entry != NULL && strcmp(entry->host, host) != 0) {
+        entry = entry->next;
+    }
     
-    server = gethostbyname(host);
-    if (server == NULL) {
-        fprintf(stderr, "Erro: Não foi possível resolver o host %s\n", host);
-        return -1;
+    if (entry == NULL) {
+        struct hostent *server = gethostbyname(host);
+        if (server == NULL) {
+            fprintf(stderr, "Erro: Não foi possível resolver o host %s\n", host);
+            return -1;
+        }
+        entry = calloc(1, sizeof(dns_entry_t));
+        if (entry == NULL) {
+            perror("Erro ao alocar");
+            return -1;
+        }
+        strncpy(entry->host, host, sizeof(entry->host) - 1);
+        memcpy(&entry->address, server->h_addr_list[0], sizeof(entry->address));
+        entry->next = dns_cache;
+        dns_cache = entry;
     }
     
+    memset(addr, 0, sizeof(*addr));
+    addr->sin_family = AF_INET;
+    addr->sin_port = htons(port);
+    addr->sin_addr = entry->address;
+    return 0;
+}
+
+int connect_address(const struct sockaddr_in *addr) {
     int sockfd = socket(AF_INET, SOCK_STREAM, 0);
     if (sockfd < 0) {
         perror("Erro ao criar socket");
         return -1;
     }
     
-    memset(&serv_addr, 0, sizeof(serv_addr));
-    serv_addr.sin_family = AF_INET;
-    serv_addr.sin_port = htons(port);
-    memcpy(&serv_addr.sin_addr.s_addr, server->h_addr_list[0], server->h_length);
-    
-    if (connect(sockfd, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) < 0) {
+    if (connect(sockfd, (const struct sockaddr *)addr, sizeof(*addr)) < 0) {
         perror("Erro ao conectar");
         close(sockfd);
         return -1;
@@ -94,18 +134,33 @@ int create_connection(const char *host, int port) {
     return sockfd;
 }
 
-int send_http_request(int sockfd, const url_info_t *url_info) {
-    char request[2048];
-    snprintf(request, sizeof(request),
-             "GET %s HTTP/1.1\r\n"
-             "Host: %s\r\n"
-             "User-Agent: MeuNavegador/1.0\r\n"
-             "Connection: close\r\n"
-             "\r\n",
-             url_info->path, url_info->host);
-    
+int create_connection(const char *host, int port) {
+    struct sockaddr_in serv_addr;
+    if (resolve_host(host, port, &serv_addr) != 0) {
+        return -1;
+    }
+    return connect_address(&serv_addr);
+}
+
+/* extra_headers: linhas adicionais já terminadas em CRLF (ou "") */
+int format_http_request_with(char *request, size_t size, const url_info_t *url_info, int keep_alive,
+                             const char *extra_headers) {
+    return snprintf(request, size,
+                    "GET %s HTTP/1.1\r\n"
+                    "Host: %s\r\n"
+                    "User-Agent: MeuNavegador/1.0\r\n"
+                    "Connection: %s\r\n"
+                    "%s"
+                    "\r\n",
+                    url_info->path, url_info->host, keep_alive ? "keep-alive" : "close", extra_headers);
+}
+
+int format_http_request(char *request, size_t size, const url_info_t *url_info, int keep_alive) {
+    return format_http_request_with(request, size, url_info, keep_alive, "");
+}
+
+int send_request(int sockfd, const char *request, int request_len) {
     int total_sent = 0;
-    int request_len = strlen(request);
     
     while (total_sent < request_len) {
         int sent = send(sockfd, request + total_sent, request_len - total_sent, 0);
@@ -119,6 +174,12 @@ int send_http_request(int sockfd, const url_info_t *url_info) {
     return 0;
 }
 
+int send_http_request(int sockfd, const url_info_t *url_info, int keep_alive) {
+    char request[2048];
+    int request_len = format_http_request(request, sizeof(request), url_info, keep_alive);
+    return send_request(sockfd, request, request_len);
+}
+
 int get_http_status_code(const char *response) {
     int status;
     if (sscanf(response, "HTTP/1.1 %d", &status) != 1) {
@@ -149,120 +210,633 @@ char* get_redirect_location(const char *response, int response_len) {
     return location;
 }
 
-int process_http_response(int sockfd, const char *filename, int redirect_count) {
-    if (redirect_count > MAX_REDIRECTS) {
-        fprintf(stderr, "Erro: Muitos redirecionamentos\n");
+/* Copia o valor do cabeçalho `name` (com ": " no fim) de uma resposta
+ * terminada em NUL; devolve 0 se ele não existe */
+int get_header_value(const char *response, const char *name, char *value, size_t size) {
+    const char *start = strcasestr(response, name);
+    if (start == NULL) return 0;
+    start += strlen(name);
+    size_t len = strcspn(start, "\r\n");
+    if (len >= size) return 0;
+    memcpy(value, start, len);
+    value[len] = '\0';
+    return 1;
+}
+
+void format_http_date(time_t t, char *buffer, size_t size) {
+    struct tm tm;
+    gmtime_r(&t, &tm);
+    strftime(buffer, size, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+}
+
+time_t parse_http_date(const char *value) {
+    struct tm tm;
+    memset(&tm, 0, sizeof(tm));
+    if (strptime(value, "%a, %d %b %Y %H:%M:%S GMT", &tm) == NULL) {
+        return 0;
+    }
+    return timegm(&tm);
+}
+
+/* Decodificador incremental do corpo da resposta: Content-Length,
+ * Transfer-Encoding: chunked ou até o fim da conexão. Os dados podem
+ * chegar em pedaços de qualquer tamanho, inclusive no meio do
+ * enquadramento dos chunks. */
+enum {
+    BODY_LENGTH,
+    BODY_UNTIL_CLOSE,
+    BODY_CHUNK_SIZE,
+    BODY_CHUNK_EXTENSION,
+    BODY_CHUNK_DATA,
+    BODY_CHUNK_END,
+    BODY_TRAILER,
+    BODY_DONE,
+    BODY_ERROR
+};
+
+typedef struct {
+    int state;
+    long long left;              /* bytes que faltam do corpo ou do chunk atual */
+    int digits;                  /* dígitos lidos do tamanho do chunk */
+    int line_len;                /* tamanho da linha atual do trailer */
+} body_decoder_t;
+
+void body_decoder_init(body_decoder_t *decoder, long long content_length, int chunked) {
+    memset(decoder, 0, sizeof(*decoder));
+    if (chunked) {
+        decoder->state = BODY_CHUNK_SIZE;
+    } else if (content_length < 0) {
+        decoder->state = BODY_UNTIL_CLOSE;
+    } else {
+        decoder->state = content_length > 0 ? BODY_LENGTH : BODY_DONE;
+        decoder->left = content_length;
+    }
+}
+
+int hex_value(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+/* Consome data[0..len) até o fim de um trecho contínuo do corpo, que é
+ * devolvido em body e body_len (vazio se só havia enquadramento); devolve
+ * quantos bytes de data foram consumidos */
+size_t body_decode(body_decoder_t *decoder, const char *data, size_t len, const char **body, size_t *body_len) {
+    *body_len = 0;
+    size_t i = 0;
+    while (i < len && decoder->state != BODY_DONE && decoder->state != BODY_ERROR) {
+        char c = data[i];
+        switch (decoder->state) {
+            case BODY_UNTIL_CLOSE:
+                *body = data + i;
+                *body_len = len - i;
+                return len;
+            case BODY_LENGTH:
+            case BODY_CHUNK_DATA: {
+                size_t n = len - i;
+                if ((long long)n > decoder->left) n = decoder->left;
+                *body = data + i;
+                *body_len = n;
+                decoder->left -= n;
+                if (decoder->left == 0) {
+                    decoder->state = decoder->state == BODY_LENGTH ? BODY_DONE : BODY_CHUNK_END;
+                }
+                return i + n;
+            }
+            case BODY_CHUNK_SIZE:
+                if (hex_value(c) >= 0 && decoder->digits < 15) {
+                    decoder->left = decoder->left * 16 + hex_value(c);
+                    decoder->digits++;
+                } else if (decoder->digits > 0 && (c == ';' || c == ' ' || c == '\t' || c == '\r')) {
+                    decoder->state = BODY_CHUNK_EXTENSION;
+                } else if (decoder->digits > 0 && c == '\n') {
+                    decoder->state = decoder->left > 0 ? BODY_CHUNK_DATA : BODY_TRAILER;
+                } else {
+                    decoder->state = BODY_ERROR;
+                }
+                break;
+            case BODY_CHUNK_EXTENSION:
+                if (c == '\n') {
+                    decoder->state = decoder->left > 0 ? BODY_CHUNK_DATA : BODY_TRAILER;
+                }
+                break;
+            case BODY_CHUNK_END:
+                if (c == '\n') {
+                    decoder->state = BODY_CHUNK_SIZE;
+                    decoder->digits = 0;
+                } else if (c != '\r') {
+                    decoder->state = BODY_ERROR;
+                }
+                break;
+            case BODY_TRAILER:
+                if (c == '\n') {
+                    if (decoder->line_len == 0) decoder->state = BODY_DONE;
+                    decoder->line_len = 0;
+                } else if (c != '\r') {
+                    decoder->line_len++;
+                }
+                break;
+        }
+        i++;
+    }
+    return i;
+}
+
+/* Decodifica tudo o que der de data[0..len) e grava os trechos do corpo
+ * em fd a partir de *offset com um único pwritev (fd < 0 só descarta).
+ * Devolve os bytes consumidos de data, ou -1 se a gravação falhar. */
+ssize_t body_write(body_decoder_t *decoder, const char *data, size_t len, int fd, long long *offset) {
+    struct iovec iov[64];
+    int count = 0;
+    size_t consumed = 0;
+    long long total = 0;
+    while (consumed < len && count < 64 && decoder->state != BODY_DONE && decoder->state != BODY_ERROR) {
+        const char *body;
+        size_t body_len;
+        consumed += body_decode(decoder, data + consumed, len - consumed, &body, &body_len);
+        if (body_len > 0) {
+            iov[count].iov_base = (void *)body;
+            iov[count].iov_len = body_len;
+            count++;
+            total += body_len;
+        }
+    }
+    if (fd >= 0 && count > 0 && pwritev(fd, iov, count, *offset) != total) {
         return -1;
     }
+    *offset += total;
+    return consumed;
+}
 
-    char buffer[BUFFER_SIZE];
-    FILE *file = NULL;
-    int content_started = 0;
-    int content_length = -1;
-    int bytes_received = 0;
-    int header_ended = 0;
-    int status_code;
+/* Lê do cabeçalho completo (buffer[0..header_size)) o status, como o corpo
+ * é delimitado e se o servidor vai fechar a conexão depois da resposta */
+int parse_response_header(char *buffer, size_t header_size, int *status, body_decoder_t *body, int *server_close) {
+    char saved = buffer[header_size];
+    buffer[header_size] = '\0';
+    *status = get_http_status_code(buffer);
     
-    while (!header_ended) {
-        int bytes = recv(sockfd, buffer, BUFFER_SIZE - 1, 0);
+    char *content_length = strcasestr(buffer, "\r\nContent-Length:");
+    char *transfer_encoding = strcasestr(buffer, "\r\nTransfer-Encoding:");
+    int chunked = transfer_encoding != NULL && strncasecmp(transfer_encoding + 20 + strspn(transfer_encoding + 20, " \t"), "chunked", 7) == 0;
+    body_decoder_init(body, content_length != NULL ? atoll(content_length + 17) : -1, chunked);
+    if (*status == 204 || *status == 304 || (*status >= 100 && *status < 200)) {
+        body_decoder_init(body, 0, 0);
+    }
+    *server_close = strcasestr(buffer, "\r\nConnection: close") != NULL;
+    buffer[header_size] = saved;
+    return *status < 0 ? -1 : 0;
+}
+
+/* Buffer de recepção grande e reaproveitado entre as respostas */
+#define RECEIVE_BUFFER_SIZE (256 * 1024)
+#define SPLICE_PIPE_SIZE (1024 * 1024)
+
+static char receive_buffer[RECEIVE_BUFFER_SIZE + 1];
+
+/* Lê até o fim do cabeçalho, que pode chegar em vários pedaços; devolve o
+ * tamanho do cabeçalho. Os bytes do corpo que vierem junto ficam em
+ * buffer[tamanho..*received). */
+ssize_t read_response_header(int sockfd, char *buffer, size_t size, size_t *received) {
+    size_t scanned = 0;
+    *received = 0;
+    while (1) {
+        char *header_end = memmem(buffer + scanned, *received - scanned, "\r\n\r\n", 4);
+        if (header_end != NULL) {
+            return header_end - buffer + 4;
+        }
+        scanned = *received > 3 ? *received - 3 : 0;
+        if (*received == size) {
+            fprintf(stderr, "Erro: cabeçalho de resposta muito grande\n");
+            return -1;
+        }
+        ssize_t bytes = recv(sockfd, buffer + *received, size - *received, 0);
         if (bytes <= 0) {
             fprintf(stderr, "Erro ao receber resposta\n");
             return -1;
         }
-        
-        buffer[bytes] = '\0';
-        
-        char *header_end = strstr(buffer, "\r\n\r\n");
-        if (header_end != NULL) {
-            header_ended = 1;
-            int header_size = header_end - buffer + 4;
-            
-            status_code = get_http_status_code(buffer);
-            if (status_code == -1) {
-                fprintf(stderr, "Erro: Não foi possível obter código de status\n");
-                return -1;
+        *received += bytes;
+    }
+}
+
+/* Corpo delimitado por tamanho (ou pelo fim da conexão, com left < 0):
+ * socket → pipe → arquivo com splice, sem copiar para o espaço do
+ * usuário. Se o kernel não permitir splice com esse socket ou arquivo,
+ * continua com recv e pwrite no buffer grande. */
+int stream_body(int sockfd, int fd, long long *offset, long long left) {
+    int pipefd[2] = { -1, -1 };
+    int use_splice = pipe2(pipefd, O_CLOEXEC) == 0;
+    if (use_splice) {
+        fcntl(pipefd[1], F_SETPIPE_SZ, SPLICE_PIPE_SIZE);
+    } else {
+        pipefd[0] = pipefd[1] = -1;
+    }
+    
+    int result = 0;
+    while (left != 0) {
+        size_t want = left < 0 || left > SPLICE_PIPE_SIZE ? SPLICE_PIPE_SIZE : (size_t)left;
+        ssize_t bytes;
+        if (use_splice) {
+            bytes = splice(sockfd, NULL, pipefd[1], NULL, want, SPLICE_F_MOVE | SPLICE_F_MORE);
+            if (bytes < 0 && errno == EINVAL) {
+                use_splice = 0;
+                continue;
             }
-            
-            if (status_code == 301 || status_code == 302) {
-                char *new_location = get_redirect_location(buffer, bytes);
-                if (new_location == NULL) {
-                    fprintf(stderr, "Erro: Redirecionamento sem cabeçalho Location\n");
-                    return -1;
+            for (ssize_t pending = bytes; pending > 0; ) {
+                loff_t file_offset = *offset;
+                ssize_t out = splice(pipefd[0], NULL, fd, &file_offset, pending, SPLICE_F_MOVE);
+                if (out > 0) *offset = file_offset;
+                if (out < 0 && errno == EINVAL) {
+                    /* Sem splice para o arquivo: esvazia o pipe com read */
+                    out = read(pipefd[0], receive_buffer, pending < RECEIVE_BUFFER_SIZE ? pending : RECEIVE_BUFFER_SIZE);
+                    if (out > 0 && pwrite(fd, receive_buffer, out, *offset) != out) out = -1;
+                    if (out > 0) *offset += out;
+                    use_splice = 0;
                 }
-                printf("Redirecionando para: %s\n", new_location);
-                close(sockfd);
-                int result = meu_navegador_redirect(new_location, redirect_count + 1);
-                free(new_location);
-                return result;
-            }
-            
-            if (status_code != 200) {
-                printf("Erro: Servidor retornou código %d\n", status_code);
-                return -1;
-            }
-            
-            char *cl_header = strstr(buffer, "Content-Length: ");
-            if (cl_header != NULL) {
-                content_length = atoi(cl_header + 16);
-            }
-            
-            file = fopen(filename, "wb");
-            if (file == NULL) {
-                perror("Erro ao criar arquivo");
-                return -1;
-            }
-            
-            int content_bytes = bytes - header_size;
-            if (content_bytes > 0) {
-                fwrite(buffer + header_size, 1, content_bytes, file);
-                bytes_received += content_bytes;
-            }
-            
-        } else if (!content_started) {
-            status_code = get_http_status_code(buffer);
-            if (status_code == -1) {
-                fprintf(stderr, "Erro: Não foi possível obter código de status\n");
-                return -1;
+                if (out <= 0) {
+                    perror("Erro ao gravar arquivo");
+                    result = -1;
+                    goto done;
+                }
+                pending -= out;
             }
-            
-            if (status_code == 301 || status_code == 302) {
-                continue;
+        } else {
+            if (want > RECEIVE_BUFFER_SIZE) want = RECEIVE_BUFFER_SIZE;
+            bytes = recv(sockfd, receive_buffer, want, 0);
+            if (bytes > 0) {
+                if (pwrite(fd, receive_buffer, bytes, *offset) != bytes) {
+                    perror("Erro ao gravar arquivo");
+                    result = -1;
+                    goto done;
+                }
+                *offset += bytes;
             }
-            
-            if (status_code != 200) {
-                printf("Erro: Servidor retornou código %d\n", status_code);
-                return -1;
+        }
+        if (bytes == 0 && left < 0) {
+            break;
+        }
+        if (bytes <= 0) {
+            fprintf(stderr, "Erro ao receber resposta\n");
+            result = -1;
+            break;
+        }
+        if (left > 0) {
+            left -= bytes;
+        }
+    }
+    
+done:
+    if (pipefd[0] >= 0) {
+        close(pipefd[0]);
+        close(pipefd[1]);
+    }
+    return result;
+}
+
+uint64_t hash_string(const char *s) {
+    uint64_t hash = 1469598103934665603ULL;
+    while (*s) {
+        hash ^= (unsigned char)*s++;
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+int mkdir_parents(const char *path) {
+    char dir[2048];
+    snprintf(dir, sizeof(dir), "%s", path);
+    for (char *slash = strchr(dir + 1, '/'); slash != NULL; slash = strchr(slash + 1, '/')) {
+        *slash = '\0';
+        if (mkdir(dir, 0755) != 0 && errno != EEXIST) {
+            return -1;
+        }
+        *slash = '/';
+    }
+    return 0;
+}
+
+/* ---- Cache HTTP em disco (--cache) ---- */
+
+/* Cada URL ocupa dois arquivos no diretório do cache, nomeados pelo hash
+ * de "host:porta/caminho": o corpo e, ao lado, HASH.meta com os
+ * validadores e a validade da última resposta */
+typedef struct {
+    char etag[256];
+    char last_modified[64];
+    long long max_age;           /* -1 sem max-age */
+    int no_cache;                /* toda reutilização exige revalidação */
+    int no_store;
+} cache_policy_t;
+
+typedef struct {
+    char key[1300];
+    char body_path[1100];
+    char meta_path[1110];
+    cache_policy_t policy;
+    time_t stored;               /* quando a resposta foi obtida ou revalidada */
+    long long size;
+    int valid;                   /* há uma entrada utilizável no disco */
+} cache_entry_t;
+
+static struct {
+    char dir[1024];              /* vazio com o cache desligado */
+    int fresh;                   /* servidas sem acessar a rede */
+    int revalidated;             /* confirmadas pelo servidor com 304 */
+    int misses;
+    long long bytes_saved;
+} http_cache;
+
+int cache_open(const char *dir) {
+    const char *base = getenv("XDG_CACHE_HOME");
+    if (dir != NULL) {
+        snprintf(http_cache.dir, sizeof(http_cache.dir), "%s/", dir);
+    } else if (base != NULL && *base != '\0') {
+        snprintf(http_cache.dir, sizeof(http_cache.dir), "%s/meunavegador/", base);
+    } else {
+        base = getenv("HOME");
+        snprintf(http_cache.dir, sizeof(http_cache.dir), "%s/.cache/meunavegador/", base != NULL ? base : ".");
+    }
+    if (mkdir_parents(http_cache.dir) != 0) {
+        perror("Erro ao criar diretório do cache");
+        http_cache.dir[0] = '\0';
+        return -1;
+    }
+    return 0;
+}
+
+void cache_parse_policy(const char *header, cache_policy_t *policy) {
+    memset(policy, 0, sizeof(*policy));
+    policy->max_age = -1;
+    get_header_value(header, "\r\nETag: ", policy->etag, sizeof(policy->etag));
+    get_header_value(header, "\r\nLast-Modified: ", policy->last_modified, sizeof(policy->last_modified));
+    char value[256];
+    if (get_header_value(header, "\r\nCache-Control: ", value, sizeof(value))) {
+        policy->no_store = strcasestr(value, "no-store") != NULL;
+        policy->no_cache = strcasestr(value, "no-cache") != NULL;
+        const char *max_age = strcasestr(value, "max-age=");
+        if (max_age != NULL) policy->max_age = atoll(max_age + 8);
+    }
+}
+
+/* Preenche a chave e os caminhos da URL e carrega os metadados, se
+ * houver; devolve 1 quando a entrada é utilizável */
+int cache_lookup(const url_info_t *url, cache_entry_t *entry) {
+    memset(entry, 0, sizeof(*entry));
+    entry->policy.max_age = -1;
+    snprintf(entry->key, sizeof(entry->key), "%s:%d%s", url->host, url->port, url->path);
+    snprintf(entry->body_path, sizeof(entry->body_path), "%s%016llx", http_cache.dir,
+             (unsigned long long)hash_string(entry->key));
+    snprintf(entry->meta_path, sizeof(entry->meta_path), "%s.meta", entry->body_path);
+
+    FILE *meta = fopen(entry->meta_path, "r");
+    if (meta == NULL) return 0;
+    char line[1400];
+    int same_key = 0;
+    while (fgets(line, sizeof(line), meta) != NULL) {
+        line[strcspn(line, "\n")] = '\0';
+        char *value = strchr(line, ' ');
+        if (value == NULL) continue;
+        *value++ = '\0';
+        if (strcmp(line, "url") == 0) same_key = strcmp(value, entry->key) == 0;
+        else if (strcmp(line, "etag") == 0) snprintf(entry->policy.etag, sizeof(entry->policy.etag), "%s", value);
+        else if (strcmp(line, "last-modified") == 0) snprintf(entry->policy.last_modified, sizeof(entry->policy.last_modified), "%s", value);
+        else if (strcmp(line, "max-age") == 0) entry->policy.max_age = atoll(value);
+        else if (strcmp(line, "no-cache") == 0) entry->policy.no_cache = atoi(value);
+        else if (strcmp(line, "stored") == 0) entry->stored = atoll(value);
+        else if (strcmp(line, "size") == 0) entry->size = atoll(value);
+    }
+    fclose(meta);
+
+    /* Colisão de hash ou corpo incompleto: a entrada é ignorada */
+    struct stat st;
+    entry->valid = same_key && stat(entry->body_path, &st) == 0 && st.st_size == entry->size;
+    return entry->valid;
+}
+
+int cache_is_fresh(const cache_entry_t *entry) {
+    return entry->valid && !entry->policy.no_cache && entry->policy.max_age >= 0 &&
+           time(NULL) - entry->stored < entry->policy.max_age;
+}
+
+/* Cabeçalhos condicionais para revalidar a entrada (ou "") */
+void cache_validators(const cache_entry_t *entry, char *headers, size_t size) {
+    int len = 0;
+    headers[0] = '\0';
+    if (!entry->valid) return;
+    if (entry->policy.etag[0] != '\0') {
+        len += snprintf(headers, size, "If-None-Match: %s\r\n", entry->policy.etag);
+    }
+    if (entry->policy.last_modified[0] != '\0') {
+        snprintf(headers + len, size - len, "If-Modified-Since: %s\r\n", entry->policy.last_modified);
+    }
+}
+
+int cache_write_meta(const cache_entry_t *entry) {
+    char temp[1200];
+    snprintf(temp, sizeof(temp), "%s.tmp", entry->meta_path);
+    FILE *meta = fopen(temp, "w");
+    if (meta == NULL) return -1;
+    fprintf(meta, "url %s\netag %s\nlast-modified %s\nmax-age %lld\nno-cache %d\nstored %lld\nsize %lld\n",
+            entry->key, entry->policy.etag, entry->policy.last_modified, entry->policy.max_age,
+            entry->policy.no_cache, (long long)entry->stored, entry->size);
+    if (fclose(meta) != 0 || rename(temp, entry->meta_path) != 0) {
+        unlink(temp);
+        return -1;
+    }
+    return 0;
+}
+
+/* Copia um arquivo inteiro; copy_file_range evita passar os dados pelo
+ * espaço do usuário (e clona os blocos em sistemas de arquivos que
+ * permitem) */
+long long copy_file(const char *from, const char *to) {
+    int in = open(from, O_RDONLY | O_CLOEXEC);
+    if (in < 0) return -1;
+    int out = open(to, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (out < 0) {
+        close(in);
+        return -1;
+    }
+    long long total = 0;
+    ssize_t copied;
+    while ((copied = copy_file_range(in, NULL, out, NULL, 1 << 30, 0)) > 0) {
+        total += copied;
+    }
+    if (copied < 0 && total == 0 && (errno == EXDEV || errno == ENOSYS || errno == EINVAL || errno == EOPNOTSUPP)) {
+        char buffer[BUFFER_SIZE * 16];
+        while ((copied = read(in, buffer, sizeof(buffer))) > 0) {
+            if (write(out, buffer, copied) != copied) {
+                copied = -1;
+                break;
             }
+            total += copied;
         }
     }
+    close(in);
+    if (close(out) != 0 || copied < 0) return -1;
+    return total;
+}
+
+/* Grava no cache o arquivo recém-baixado, se a resposta permite reuso */
+void cache_store(cache_entry_t *entry, const cache_policy_t *policy, const char *filename, long long size) {
+    http_cache.misses++;
+    if (policy->no_store || (policy->etag[0] == '\0' && policy->last_modified[0] == '\0' && policy->max_age <= 0)) {
+        unlink(entry->meta_path);
+        unlink(entry->body_path);
+        entry->valid = 0;
+        return;
+    }
+    char temp[1200];
+    snprintf(temp, sizeof(temp), "%s.tmp", entry->body_path);
+    if (copy_file(filename, temp) != size || rename(temp, entry->body_path) != 0) {
+        perror("Erro ao gravar no cache");
+        unlink(temp);
+        return;
+    }
+    entry->policy = *policy;
+    entry->stored = time(NULL);
+    entry->size = size;
+    entry->valid = cache_write_meta(entry) == 0;
+}
+
+/* Resposta 304: os cabeçalhos novos atualizam os guardados e a entrada
+ * volta a contar como recém-obtida */
+void cache_refresh(cache_entry_t *entry, const cache_policy_t *policy) {
+    if (policy->etag[0] != '\0') strcpy(entry->policy.etag, policy->etag);
+    if (policy->last_modified[0] != '\0') strcpy(entry->policy.last_modified, policy->last_modified);
+    if (policy->max_age >= 0 || policy->no_cache) {
+        entry->policy.max_age = policy->max_age;
+        entry->policy.no_cache = policy->no_cache;
+    }
+    entry->stored = time(NULL);
+    cache_write_meta(entry);
+    http_cache.revalidated++;
+}
+
+/* Copia o corpo guardado para o arquivo de saída */
+int cache_use(const cache_entry_t *entry, const char *filename, const char *how) {
+    if (copy_file(entry->body_path, filename) != entry->size) {
+        perror("Erro ao copiar do cache");
+        return -1;
+    }
+    http_cache.bytes_saved += entry->size;
+    printf("Arquivo '%s' %s (%lld bytes)\n", filename, how, entry->size);
+    return 0;
+}
+
+void cache_report(void) {
+    if (http_cache.dir[0] == '\0') return;
+    printf("Cache: %d acerto(s) sem rede, %d revalidado(s) com 304, %d falta(s); %lld bytes não transferidos\n",
+           http_cache.fresh, http_cache.revalidated, http_cache.misses, http_cache.bytes_saved);
+}
+
+/* cache: entrada da URL com o cache ligado (NULL se desligado) */
+int process_http_response(int sockfd, const char *filename, cache_entry_t *cache, int redirect_count) {
+    if (redirect_count > MAX_REDIRECTS) {
+        fprintf(stderr, "Erro: Muitos redirecionamentos\n");
+        return -1;
+    }
     
-    if (!header_ended) {
-        file = fopen(filename, "wb");
-        if (file == NULL) {
-            perror("Erro ao criar arquivo");
+    long long start = monotonic_us();
+    char *buffer = receive_buffer;
+    size_t received;
+    ssize_t header_size = read_response_header(sockfd, buffer, RECEIVE_BUFFER_SIZE, &received);
+    if (header_size < 0) {
+        return -1;
+    }
+    
+    int status_code;
+    int server_close;
+    body_decoder_t body;
+    if (parse_response_header(buffer, header_size, &status_code, &body, &server_close) != 0) {
+        fprintf(stderr, "Erro: Não foi possível obter código de status\n");
+        return -1;
+    }
+    
+    cache_policy_t policy;
+    if (cache != NULL) {
+        char saved = buffer[header_size];
+        buffer[header_size] = '\0';
+        cache_parse_policy(buffer, &policy);
+        buffer[header_size] = saved;
+    }
+    
+    if (status_code == 304 && cache != NULL && cache->valid) {
+        cache_refresh(cache, &policy);
+        return cache_use(cache, filename, "revalidado no cache");
+    }
+    
+    if (status_code == 301 || status_code == 302) {
+        buffer[header_size] = '\0';
+        char *new_location = get_redirect_location(buffer, header_size);
+        if (new_location == NULL) {
+            fprintf(stderr, "Erro: Redirecionamento sem cabeçalho Location\n");
             return -1;
         }
+        printf("Redirecionando para: %s\n", new_location);
+        int result = meu_navegador_redirect(new_location, redirect_count + 1);
+        free(new_location);
+        return result;
     }
     
-    while (1) {
-        int bytes = recv(sockfd, buffer, BUFFER_SIZE, 0);
-        if (bytes <= 0) {
-            break;
+    if (status_code != 200) {
+        printf("Erro: Servidor retornou código %d\n", status_code);
+        return -1;
+    }
+    
+    int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        perror("Erro ao criar arquivo");
+        return -1;
+    }
+    
+    /* Primeiro o que veio junto com o cabeçalho, depois o resto: com
+     * tamanho conhecido (ou até o fim da conexão) via splice, com chunked
+     * decodificando cada leitura do buffer grande */
+    long long bytes_received = 0;
+    size_t offset = header_size;
+    int result = 0;
+    while (result == 0 && body.state != BODY_DONE) {
+        if (offset == received) {
+            if (body.state == BODY_LENGTH || body.state == BODY_UNTIL_CLOSE) {
+                result = stream_body(sockfd, fd, &bytes_received, body.state == BODY_LENGTH ? body.left : -1);
+                break;
+            }
+            ssize_t bytes = recv(sockfd, buffer, RECEIVE_BUFFER_SIZE, 0);
+            if (bytes <= 0) {
+                fprintf(stderr, "Erro ao receber resposta\n");
+                result = -1;
+                break;
+            }
+            offset = 0;
+            received = bytes;
         }
-        
-        fwrite(buffer, 1, bytes, file);
-        bytes_received += bytes;
-        
-        if (content_length > 0 && bytes_received >= content_length) {
-            break;
+        ssize_t consumed = body_write(&body, buffer + offset, received - offset, fd, &bytes_received);
+        if (consumed < 0) {
+            perror("Erro ao gravar arquivo");
+            result = -1;
+        } else if (body.state == BODY_ERROR) {
+            fprintf(stderr, "Erro: codificação chunked inválida\n");
+            result = -1;
+        } else {
+            offset += consumed;
         }
     }
-    
-    if (file != NULL) {
-        fclose(file);
+    close(fd);
+    if (result != 0) {
+        return -1;
     }
     
-    printf("Arquivo '%s' baixado com sucesso (%d bytes)\n", filename, bytes_received);
+    double elapsed = (monotonic_us() - start) / 1e6;
+    printf("Arquivo '%s' baixado com sucesso (%lld bytes", filename, bytes_received);
+    if (elapsed > 0 && bytes_received >= 1024 * 1024) {
+        printf(", %.1f MB/s", bytes_received / elapsed / (1024 * 1024));
+    }
+    printf(")\n");
+    if (cache != NULL) {
+        cache_store(cache, &policy, filename, bytes_received);
+    }
     return 0;
 }
 
@@ -279,6 +853,20 @@ int meu_navegador_redirect(const char *url, int redirect_count) {
         return -1;
     }
     
+    /* Entrada ainda válida dispensa a rede; vencida vai com validadores */
+    cache_entry_t cached;
+    char headers[512] = "";
+    if (http_cache.dir[0] != '\0') {
+        cache_lookup(&url_info, &cached);
+        if (cache_is_fresh(&cached)) {
+            http_cache.fresh++;
+            int result = cache_use(&cached, filename, "obtido do cache");
+            free(filename);
+            return result;
+        }
+        cache_validators(&cached, headers, sizeof(headers));
+    }
+    
     printf("Conectando a %s:%d...\n", url_info.host, url_info.port);
     printf("Baixando: %s\n", url_info.path);
     printf("Salvando como: %s\n", filename);
@@ -289,13 +877,15 @@ int meu_navegador_redirect(const char *url, int redirect_count) {
         return -1;
     }
     
-    if (send_http_request(sockfd, &url_info) != 0) {
+    char request[2048];
+    int request_len = format_http_request_with(request, sizeof(request), &url_info, 0, headers);
+    if (send_request(sockfd, request, request_len) != 0) {
         close(sockfd);
         free(filename);
         return -1;
     }
     
-    int result = process_http_response(sockfd, filename, redirect_count);
+    int result = process_http_response(sockfd, filename, http_cache.dir[0] != '\0' ? &cached : NULL, redirect_count);
     
     close(sockfd);
     free(filename);
@@ -307,16 +897,2052 @@ int meu_navegador(const char *url) {
     return meu_navegador_redirect(url, 0);
 }
 
-int main(int argc, char *argv[]) {
-    if (argc != 2) {
-        fprintf(stderr, "Uso: %s <URL>\n", argv[0]);
-        fprintf(stderr, "Exemplo: %s http://www.ufsj.edu.br/teste/imagem.jpg\n", argv[0]);
-        return 1;
+/* ---- Download concorrente de várias URLs ---- */
+
+#define DOWNLOAD_BUFFER_SIZE (64 * 1024)
+#define DOWNLOAD_MAX_PIPELINE 8
+#define DOWNLOAD_MAX_ATTEMPTS 3
+#define DOWNLOAD_MAX_EVENTS 64
+
+typedef struct download_job {
+    url_info_t url;
+    char *filename;
+    int redirect_count;
+    int attempts;
+    int redirected;              /* a resposta foi um redirecionamento seguido */
+    time_t if_modified_since;    /* cópia local existente (modo espelho) */
+    cache_entry_t *cache;        /* entrada no cache (--cache) */
+    struct download_job *next;
+} download_job_t;
+
+typedef struct {
+    download_job_t *head;
+    download_job_t *tail;
+    int count;
+} job_queue_t;
+
+typedef struct download_host download_host_t;
+
+/* Conexão persistente com um host. As requisições são encadeadas
+ * (pipelining) e as respostas chegam na mesma ordem da fila sent */
+typedef struct {
+    int fd;
+    download_host_t *host;
+    int connecting;
+    job_queue_t sent;
+    char out[DOWNLOAD_MAX_PIPELINE * 2048];
+    size_t out_len;
+    size_t out_sent;
+    char in[DOWNLOAD_BUFFER_SIZE + 1];
+    size_t in_len;
+    int header_done;
+    int status;
+    body_decoder_t body;
+    int server_close;
+    int announced_close;         /* a última resposta trouxe "Connection: close" */
+    int output_fd;
+    long long received;
+    time_t last_modified;
+    int html;
+    cache_policy_t cache_policy;
+} download_conn_t;
+
+struct download_host {
+    char name[256];
+    int port;
+    struct sockaddr_in addr;
+    job_queue_t queue;
+    download_conn_t *conns;
+    struct download_host *next;
+};
+
+typedef struct mirror mirror_t;
+
+typedef struct {
+    int epoll_fd;
+    int per_host;
+    int pipeline;
+    download_host_t *hosts;
+    int pending;
+    int completed;
+    int failed;
+    long long bytes;
+    mirror_t *mirror;            /* NULL fora do modo --mirror */
+} downloader_t;
+
+void job_queue_push(job_queue_t *queue, download_job_t *job) {
+    job->next = NULL;
+    if (queue->tail != NULL) queue->tail->next = job;
+    else queue->head = job;
+    queue->tail = job;
+    queue->count++;
+}
+
+download_job_t *job_queue_pop(job_queue_t *queue) {
+    download_job_t *job = queue->head;
+    if (job != NULL) {
+        queue->head = job->next;
+        if (queue->head == NULL) queue->tail = NULL;
+        queue->count--;
+    }
+    return job;
+}
+
+void download_job_free(download_job_t *job) {
+    free(job->cache);
+    free(job->filename);
+    free(job);
+}
+
+void download_job_failed(downloader_t *dl, download_job_t *job) {
+    dl->failed++;
+    dl->pending--;
+    download_job_free(job);
+}
+
+download_host_t *downloader_host(downloader_t *dl, const url_info_t *url) {
+    for (download_host_t *host = dl->hosts; host != NULL; host = host->next) {
+        if (host->port == url->port && strcmp(host->name, url->host) == 0) return host;
     }
     
-    const char *url = argv[1];
+    download_host_t *host = calloc(1, sizeof(download_host_t));
+    if (host == NULL) {
+        perror("Erro ao alocar");
+        return NULL;
+    }
+    if (resolve_host(url->host, url->port, &host->addr) != 0) {
+        free(host);
+        return NULL;
+    }
+    host->conns = calloc(dl->per_host, sizeof(download_conn_t));
+    if (host->conns == NULL) {
+        perror("Erro ao alocar");
+        free(host);
+        return NULL;
+    }
+    strcpy(host->name, url->host);
+    host->port = url->port;
+    for (int i = 0; i < dl->per_host; i++) {
+        host->conns[i].fd = -1;
+        host->conns[i].output_fd = -1;
+        host->conns[i].host = host;
+    }
+    host->next = dl->hosts;
+    dl->hosts = host;
+    return host;
+}
+
+void downloader_schedule(downloader_t *dl, download_host_t *host);
+
+/* Coloca na fila do host um job com url e filename preenchidos */
+int downloader_enqueue(downloader_t *dl, download_job_t *job) {
+    download_host_t *host = downloader_host(dl, &job->url);
+    if (host == NULL) {
+        download_job_free(job);
+        dl->failed++;
+        return -1;
+    }
+    job_queue_push(&host->queue, job);
+    dl->pending++;
+    return 0;
+}
+
+int downloader_add(downloader_t *dl, const char *url, int redirect_count) {
+    download_job_t *job = calloc(1, sizeof(download_job_t));
+    if (job == NULL) {
+        perror("Erro ao alocar");
+        return -1;
+    }
+    job->redirect_count = redirect_count;
+    if (parse_url(url, &job->url) != 0) {
+        free(job);
+        dl->failed++;
+        return -1;
+    }
+    job->filename = get_filename(job->url.path);
+    if (http_cache.dir[0] != '\0' && dl->mirror == NULL) {
+        job->cache = malloc(sizeof(cache_entry_t));
+        if (job->cache == NULL) {
+            perror("Erro ao alocar");
+            download_job_free(job);
+            dl->failed++;
+            return -1;
+        }
+        cache_lookup(&job->url, job->cache);
+        if (cache_is_fresh(job->cache)) {
+            http_cache.fresh++;
+            int result = cache_use(job->cache, job->filename, "obtido do cache");
+            if (result == 0) dl->completed++;
+            else dl->failed++;
+            download_job_free(job);
+            return result;
+        }
+    }
+    return downloader_enqueue(dl, job);
+}
+
+void download_conn_update_events(downloader_t *dl, download_conn_t *conn) {
+    struct epoll_event ev;
+    ev.events = conn->connecting ? EPOLLOUT : EPOLLIN | (conn->out_sent < conn->out_len ? EPOLLOUT : 0);
+    ev.data.ptr = conn;
+    epoll_ctl(dl->epoll_fd, EPOLL_CTL_MOD, conn->fd, &ev);
+}
+
+int download_conn_flush(downloader_t *dl, download_conn_t *conn) {
+    while (conn->out_sent < conn->out_len) {
+        ssize_t sent = send(conn->fd, conn->out + conn->out_sent, conn->out_len - conn->out_sent, MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EAGAIN) break;
+            return -1;
+        }
+        conn->out_sent += sent;
+    }
+    if (conn->out_sent == conn->out_len) {
+        conn->out_sent = conn->out_len = 0;
+    }
+    download_conn_update_events(dl, conn);
+    return 0;
+}
+
+void mirror_discard_partial(const download_job_t *job);
+int mirror_open_partial(const download_job_t *job);
+int mirror_commit(const download_job_t *job, int fd, time_t last_modified);
+int mirror_add(downloader_t *dl, const char *base_path, const char *link, int redirect_count);
+void mirror_parse_page(downloader_t *dl, const download_job_t *job);
+void mirror_unchanged(downloader_t *dl, const download_job_t *job);
+
+/* Fecha a conexão e devolve à fila do host as requisições sem resposta
+ * completa (o servidor pode fechar no meio de um encadeamento, por exemplo
+ * ao atingir o limite de requisições por conexão). Só a primeira delas,
+ * cuja resposta era esperada, conta como tentativa falha, e nem ela quando
+ * o servidor avisou com "Connection: close". */
+void download_conn_close(downloader_t *dl, download_conn_t *conn) {
+    if (conn->output_fd >= 0) {
+        close(conn->output_fd);
+        conn->output_fd = -1;
+        if (dl->mirror != NULL) {
+            mirror_discard_partial(conn->sent.head);
+        }
+    }
+    download_job_t *job;
+    job_queue_t retry = {0};
+    int blame = !conn->announced_close;
+    while ((job = job_queue_pop(&conn->sent)) != NULL) {
+        if (blame && ++job->attempts >= DOWNLOAD_MAX_ATTEMPTS) {
+            fprintf(stderr, "Erro: %s%s: conexão encerrada pelo servidor\n", job->url.host, job->url.path);
+            download_job_failed(dl, job);
+        } else {
+            job_queue_push(&retry, job);
+        }
+        blame = 0;
+    }
+    if (retry.head != NULL) {
+        retry.tail->next = conn->host->queue.head;
+        if (conn->host->queue.tail == NULL) conn->host->queue.tail = retry.tail;
+        conn->host->queue.head = retry.head;
+        conn->host->queue.count += retry.count;
+    }
+    
+    if (conn->fd >= 0) {
+        epoll_ctl(dl->epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+        close(conn->fd);
+        conn->fd = -1;
+    }
+    conn->connecting = 0;
+    conn->announced_close = 0;
+    conn->out_len = conn->out_sent = 0;
+    conn->in_len = 0;
+    conn->header_done = 0;
+}
+
+int download_conn_open(downloader_t *dl, download_conn_t *conn) {
+    conn->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (conn->fd < 0) {
+        perror("Erro ao criar socket");
+        return -1;
+    }
+    const struct sockaddr_in *addr = &conn->host->addr;
+    conn->connecting = connect(conn->fd, (const struct sockaddr *)addr, sizeof(*addr)) < 0;
+    if (conn->connecting && errno != EINPROGRESS) {
+        perror("Erro ao conectar");
+        close(conn->fd);
+        conn->fd = -1;
+        return -1;
+    }
+    struct epoll_event ev;
+    ev.events = EPOLLOUT;
+    ev.data.ptr = conn;
+    epoll_ctl(dl->epoll_fd, EPOLL_CTL_ADD, conn->fd, &ev);
+    return 0;
+}
+
+/* Distribui a fila do host entre as conexões: primeiro abre conexões
+ * novas (até o limite por host) para os arquivos que esperam, depois
+ * encadeia as requisições em rodízio, no máximo `pipeline` por conexão */
+void downloader_schedule(downloader_t *dl, download_host_t *host) {
+    int claimed = 0;
+    for (int i = 0; i < dl->per_host; i++) {
+        if (host->conns[i].connecting) claimed++;
+    }
+    for (int i = 0; i < dl->per_host && host->queue.count > claimed; i++) {
+        download_conn_t *conn = &host->conns[i];
+        if (conn->fd >= 0) continue;
+        if (download_conn_open(dl, conn) != 0) {
+            int alive = 0;
+            for (int j = 0; j < dl->per_host; j++) alive |= host->conns[j].fd >= 0;
+            if (alive) break;
+            /* Sem nenhuma conexão com o host, os arquivos dele falham */
+            download_job_t *job;
+            while ((job = job_queue_pop(&host->queue)) != NULL) {
+                fprintf(stderr, "Erro: %s%s: falha ao conectar\n", job->url.host, job->url.path);
+                download_job_failed(dl, job);
+            }
+            return;
+        }
+        claimed++;
+    }
+    
+    for (int depth = 1; depth <= dl->pipeline && host->queue.count > 0; depth++) {
+        for (int i = 0; i < dl->per_host && host->queue.count > 0; i++) {
+            download_conn_t *conn = &host->conns[i];
+            if (conn->fd < 0 || conn->connecting || conn->sent.count >= depth) continue;
+            
+            download_job_t *job = job_queue_pop(&host->queue);
+            char headers[512] = "";
+            if (job->cache != NULL) {
+                cache_validators(job->cache, headers, sizeof(headers));
+            } else if (job->if_modified_since != 0) {
+                char date[64];
+                format_http_date(job->if_modified_since, date, sizeof(date));
+                snprintf(headers, sizeof(headers), "If-Modified-Since: %s\r\n", date);
+            }
+            int len = format_http_request_with(conn->out + conn->out_len, sizeof(conn->out) - conn->out_len, &job->url, 1, headers);
+            conn->out_len += len;
+            job_queue_push(&conn->sent, job);
+        }
+    }
+    
+    for (int i = 0; i < dl->per_host; i++) {
+        download_conn_t *conn = &host->conns[i];
+        if (conn->fd < 0 || conn->connecting) continue;
+        /* Conexão ociosa sem mais nada na fila é fechada logo, liberando o
+         * servidor (no modo bloqueante ele atende uma conexão por vez) */
+        if (conn->sent.count == 0 || (conn->out_len > conn->out_sent && download_conn_flush(dl, conn) != 0)) {
+            download_conn_close(dl, conn);
+        }
+    }
+}
+
+void download_conn_connected(downloader_t *dl, download_conn_t *conn) {
+    int error = 0;
+    socklen_t len = sizeof(error);
+    getsockopt(conn->fd, SOL_SOCKET, SO_ERROR, &error, &len);
+    if (error != 0) {
+        fprintf(stderr, "Erro ao conectar a %s:%d: %s\n", conn->host->name, conn->host->port, strerror(error));
+        download_conn_close(dl, conn);
+        /* Outra tentativa com as conexões restantes, ou falha de todos os arquivos */
+        for (int i = 0; i < dl->per_host; i++) {
+            if (conn->host->conns[i].fd >= 0) {
+                downloader_schedule(dl, conn->host);
+                return;
+            }
+        }
+        download_job_t *job;
+        while ((job = job_queue_pop(&conn->host->queue)) != NULL) {
+            download_job_failed(dl, job);
+        }
+        return;
+    }
+    conn->connecting = 0;
+    download_conn_update_events(dl, conn);
+    downloader_schedule(dl, conn->host);
+}
+
+/* Trata o cabeçalho da resposta (conn->in[header_start..header_end)) ao
+ * primeiro job da fila sent */
+void download_start_body(downloader_t *dl, download_conn_t *conn, size_t header_start, size_t header_end) {
+    download_job_t *job = conn->sent.head;
+    conn->received = 0;
+    conn->last_modified = 0;
+    conn->html = 0;
+    
+    char saved = conn->in[header_end];
+    conn->in[header_end] = '\0';
+    const char *header = conn->in + header_start;
+    char value[128];
+    if (get_header_value(header, "\r\nLast-Modified: ", value, sizeof(value))) {
+        conn->last_modified = parse_http_date(value);
+    }
+    if (get_header_value(header, "\r\nContent-Type: ", value, sizeof(value))) {
+        conn->html = strncasecmp(value, "text/html", 9) == 0;
+    }
+    if (job->cache != NULL) {
+        cache_parse_policy(header, &conn->cache_policy);
+    }
+    char *location = conn->status == 301 || conn->status == 302 ? get_redirect_location(header, header_end - header_start) : NULL;
+    conn->in[header_end] = saved;
+    
+    if (conn->status == 301 || conn->status == 302) {
+        if (location == NULL) {
+            fprintf(stderr, "Erro: Redirecionamento sem cabeçalho Location\n");
+        } else if (job->redirect_count >= MAX_REDIRECTS) {
+            fprintf(stderr, "Erro: Muitos redirecionamentos\n");
+        } else if (dl->mirror != NULL) {
+            job->redirected = mirror_add(dl, job->url.path, location, job->redirect_count + 1) >= 0;
+        } else {
+            printf("Redirecionando para: %s\n", location);
+            job->redirected = downloader_add(dl, location, job->redirect_count + 1) == 0;
+        }
+        free(location);
+    } else if (conn->status == 200) {
+        conn->output_fd = dl->mirror != NULL ? mirror_open_partial(job) :
+                          open(job->filename, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (conn->output_fd < 0) {
+            perror("Erro ao criar arquivo");
+        }
+    } else if (conn->status == 304 && (dl->mirror != NULL || (job->cache != NULL && job->cache->valid))) {
+        /* A cópia local (ou a do cache) está atualizada */
+    } else {
+        printf("Erro: %s%s: servidor retornou código %d\n", job->url.host, job->url.path, conn->status);
+    }
+}
+
+void download_finish_job(downloader_t *dl, download_conn_t *conn) {
+    download_job_t *job = job_queue_pop(&conn->sent);
+    conn->header_done = 0;
+    
+    if (conn->output_fd >= 0) {
+        int saved = dl->mirror == NULL || mirror_commit(job, conn->output_fd, conn->last_modified) == 0;
+        close(conn->output_fd);
+        conn->output_fd = -1;
+        if (!saved) {
+            download_job_failed(dl, job);
+            return;
+        }
+        printf("Arquivo '%s' baixado com sucesso (%lld bytes)\n", job->filename, conn->received);
+        dl->completed++;
+        dl->bytes += conn->received;
+        if (job->cache != NULL) {
+            cache_store(job->cache, &conn->cache_policy, job->filename, conn->received);
+        }
+        if (dl->mirror != NULL && conn->html) {
+            mirror_parse_page(dl, job);
+        }
+    } else if (conn->status == 304 && dl->mirror != NULL) {
+        mirror_unchanged(dl, job);
+    } else if (conn->status == 304 && job->cache != NULL && job->cache->valid) {
+        cache_refresh(job->cache, &conn->cache_policy);
+        if (cache_use(job->cache, job->filename, "revalidado no cache") != 0) {
+            download_job_failed(dl, job);
+            return;
+        }
+        dl->completed++;
+    } else if (!job->redirected) {
+        download_job_failed(dl, job);
+        return;
+    }
+    dl->pending--;
+    download_job_free(job);
+}
+
+void download_conn_readable(downloader_t *dl, download_conn_t *conn) {
+    if (conn->connecting) return;
+    ssize_t bytes = recv(conn->fd, conn->in + conn->in_len, DOWNLOAD_BUFFER_SIZE - conn->in_len, 0);
+    if (bytes < 0 && errno == EAGAIN) return;
+    if (bytes <= 0) {
+        /* Sem Content-Length o corpo termina com a conexão */
+        if (bytes == 0 && conn->header_done && conn->body.state == BODY_UNTIL_CLOSE) {
+            download_finish_job(dl, conn);
+        }
+        download_conn_close(dl, conn);
+        downloader_schedule(dl, conn->host);
+        return;
+    }
+    conn->in_len += bytes;
+    
+    /* O buffer pode conter o fim de uma resposta e o início das próximas */
+    size_t offset = 0;
+    while (offset < conn->in_len && conn->sent.head != NULL) {
+        if (!conn->header_done) {
+            char *header_end = memmem(conn->in + offset, conn->in_len - offset, "\r\n\r\n", 4);
+            if (header_end == NULL) {
+                if (offset == 0 && conn->in_len == DOWNLOAD_BUFFER_SIZE) {
+                    fprintf(stderr, "Erro: cabeçalho de resposta muito grande\n");
+                    download_conn_close(dl, conn);
+                    downloader_schedule(dl, conn->host);
+                    return;
+                }
+                break;
+            }
+            size_t header_size = header_end - (conn->in + offset) + 4;
+            if (parse_response_header(conn->in + offset, header_size, &conn->status, &conn->body, &conn->server_close) != 0) {
+                fprintf(stderr, "Erro: Não foi possível obter código de status\n");
+                download_conn_close(dl, conn);
+                downloader_schedule(dl, conn->host);
+                return;
+            }
+            conn->header_done = 1;
+            download_start_body(dl, conn, offset, offset + header_size);
+            offset += header_size;
+        }
+        
+        ssize_t consumed = body_write(&conn->body, conn->in + offset, conn->in_len - offset, conn->output_fd, &conn->received);
+        if (consumed < 0 || conn->body.state == BODY_ERROR) {
+            fprintf(stderr, consumed < 0 ? "Erro ao gravar arquivo\n" : "Erro: codificação chunked inválida\n");
+            download_conn_close(dl, conn);
+            downloader_schedule(dl, conn->host);
+            return;
+        }
+        offset += consumed;
+        
+        if (conn->body.state == BODY_DONE) {
+            int server_close = conn->server_close;
+            download_finish_job(dl, conn);
+            if (server_close) {
+                conn->announced_close = 1;
+                download_conn_close(dl, conn);
+                downloader_schedule(dl, conn->host);
+                return;
+            }
+        }
+    }
+    
+    memmove(conn->in, conn->in + offset, conn->in_len - offset);
+    conn->in_len -= offset;
+    downloader_schedule(dl, conn->host);
+}
+
+int downloader_init(downloader_t *dl, int per_host, int pipeline) {
+    memset(dl, 0, sizeof(*dl));
+    dl->per_host = per_host;
+    dl->pipeline = pipeline;
+    dl->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (dl->epoll_fd < 0) {
+        perror("Erro ao criar epoll");
+        return -1;
+    }
+    return 0;
+}
+
+/* Atende as conexões até todos os jobs terminarem; jobs novos podem
+ * entrar na fila durante a execução (redirecionamentos, espelhamento) */
+void downloader_run(downloader_t *dl) {
+    for (download_host_t *host = dl->hosts; host != NULL; host = host->next) {
+        downloader_schedule(dl, host);
+    }
+    
+    struct epoll_event events[DOWNLOAD_MAX_EVENTS];
+    while (dl->pending > 0) {
+        int n = epoll_wait(dl->epoll_fd, events, DOWNLOAD_MAX_EVENTS, -1);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("Erro no epoll_wait");
+            break;
+        }
+        for (int i = 0; i < n; i++) {
+            download_conn_t *conn = events[i].data.ptr;
+            if (conn->fd < 0) continue;
+            if (conn->connecting) {
+                download_conn_connected(dl, conn);
+                continue;
+            }
+            if ((events[i].events & EPOLLOUT) && download_conn_flush(dl, conn) != 0) {
+                download_conn_close(dl, conn);
+                downloader_schedule(dl, conn->host);
+                continue;
+            }
+            if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+                download_conn_readable(dl, conn);
+            }
+        }
+    }
+}
+
+void downloader_cleanup(downloader_t *dl) {
+    while (dl->hosts != NULL) {
+        download_host_t *host = dl->hosts;
+        dl->hosts = host->next;
+        for (int i = 0; i < dl->per_host; i++) {
+            download_conn_close(dl, &host->conns[i]);
+        }
+        free(host->conns);
+        free(host);
+    }
+    close(dl->epoll_fd);
+}
+
+int download_urls(char **urls, int url_count, const char *list_path, int per_host, int pipeline) {
+    downloader_t dl;
+    if (downloader_init(&dl, per_host, pipeline) != 0) {
+        return -1;
+    }
+    
+    for (int i = 0; i < url_count; i++) {
+        downloader_add(&dl, urls[i], 0);
+    }
+    if (list_path != NULL) {
+        FILE *list = strcmp(list_path, "-") == 0 ? stdin : fopen(list_path, "r");
+        if (list == NULL) {
+            perror("Erro ao abrir lista de URLs");
+            return -1;
+        }
+        char line[2048];
+        while (fgets(line, sizeof(line), list) != NULL) {
+            line[strcspn(line, "\r\n")] = '\0';
+            char *url = line + strspn(line, " \t");
+            if (*url != '\0' && *url != '#') downloader_add(&dl, url, 0);
+        }
+        if (list != stdin) fclose(list);
+    }
+    
+    long long start = monotonic_us();
+    downloader_run(&dl);
+    
+    double elapsed = (monotonic_us() - start) / 1e6;
+    printf("%d arquivo(s) baixado(s), %lld bytes em %.2f s", dl.completed, dl.bytes, elapsed);
+    if (dl.failed > 0) printf(", %d falha(s)", dl.failed);
+    printf("\n");
+    cache_report();
+    
+    downloader_cleanup(&dl);
+    return dl.failed > 0 ? -1 : 0;
+}
+
+/* ---- Espelhamento de sites (--mirror) ---- */
+
+#define MIRROR_MAX_PAGE_SIZE (16 * 1024 * 1024)
+#define PARTIAL_SUFFIX ".parcial"
+
+struct mirror {
+    char host[256];
+    int port;
+    char root[300];              /* diretório local: host ou host:porta */
+    char scope[1024];            /* só caminhos abaixo do diretório inicial */
+    char **seen;                 /* conjunto de caminhos já enfileirados */
+    size_t seen_size;
+    size_t seen_count;
+    int unchanged;
+};
+
+/* Insere no conjunto; devolve 1 se o caminho é novo, 0 se já existia */
+int mirror_seen_insert(mirror_t *mirror, const char *key) {
+    if (mirror->seen_count * 2 >= mirror->seen_size) {
+        size_t new_size = mirror->seen_size != 0 ? mirror->seen_size * 2 : 1024;
+        char **table = calloc(new_size, sizeof(char *));
+        if (table == NULL) return -1;
+        for (size_t i = 0; i < mirror->seen_size; i++) {
+            if (mirror->seen[i] == NULL) continue;
+            size_t j = hash_string(mirror->seen[i]) & (new_size - 1);
+            while (table[j] != NULL) j = (j + 1) & (new_size - 1);
+            table[j] = mirror->seen[i];
+        }
+        free(mirror->seen);
+        mirror->seen = table;
+        mirror->seen_size = new_size;
+    }
+    
+    size_t i = hash_string(key) & (mirror->seen_size - 1);
+    while (mirror->seen[i] != NULL) {
+        if (strcmp(mirror->seen[i], key) == 0) return 0;
+        i = (i + 1) & (mirror->seen_size - 1);
+    }
+    mirror->seen[i] = strdup(key);
+    if (mirror->seen[i] == NULL) return -1;
+    mirror->seen_count++;
+    return 1;
+}
+
+/* Decodifica %XX e remove os segmentos "." e ".." do caminho; devolve -1
+ * para escapes inválidos ou %00 */
+int normalize_path(const char *path, char *out, size_t size) {
+    char decoded[2048];
+    size_t len = 0;
+    for (const char *p = path; *p != '\0'; p++) {
+        char c = *p;
+        if (c == '%') {
+            int high = hex_value(p[1]);
+            int low = high >= 0 ? hex_value(p[2]) : -1;
+            if (low < 0 || (high | low) == 0) return -1;
+            c = (char)(high * 16 + low);
+            p += 2;
+        }
+        if (len + 1 >= sizeof(decoded)) return -1;
+        decoded[len++] = c;
+    }
+    decoded[len] = '\0';
+    
+    size_t out_len = 0;
+    char *segment = decoded;
+    while (segment != NULL) {
+        char *slash = strchr(segment, '/');
+        if (slash != NULL) *slash = '\0';
+        int last = slash == NULL;
+        
+        if (strcmp(segment, "..") == 0) {
+            while (out_len > 0 && out[out_len - 1] != '/') out_len--;
+            if (out_len > 0) out_len--;
+            while (out_len > 0 && out[out_len - 1] != '/') out_len--;
+        } else if (strcmp(segment, ".") != 0 && (segment[0] != '\0' || last)) {
+            size_t segment_len = strlen(segment);
+            if (out_len + segment_len + 2 >= size) return -1;
+            memcpy(out + out_len, segment, segment_len);
+            out_len += segment_len;
+            if (!last) out[out_len++] = '/';
+        }
+        segment = last ? NULL : slash + 1;
+    }
+    if (out_len == 0 || out[0] != '/') {
+        memmove(out + 1, out, out_len);
+        out[0] = '/';
+        out_len++;
+    }
+    out[out_len] = '\0';
+    return 0;
+}
+
+/* Resolve um link (absoluto ou relativo a base_path, ainda codificado) e
+ * devolve em out o caminho decodificado, seguido de "?consulta" se houver;
+ * devolve -1 para links de outros hosts, outros esquemas ou inválidos */
+int mirror_resolve(const mirror_t *mirror, const char *base_path, const char *link, char *out, size_t size) {
+    char raw[2048];
+    size_t len = 0;
+    /* Entidades HTML mais comuns em atributos */
+    for (const char *p = link; *p != '\0' && *p != '#' && len + 1 < sizeof(raw); p++) {
+        if (strncmp(p, "&amp;", 5) == 0) { raw[len++] = '&'; p += 4; }
+        else if (strncmp(p, "&#39;", 5) == 0) { raw[len++] = '\''; p += 4; }
+        else if (strncmp(p, "&quot;", 6) == 0) { raw[len++] = '"'; p += 5; }
+        else raw[len++] = *p;
+    }
+    while (len > 0 && (raw[len - 1] == ' ' || raw[len - 1] == '\n' || raw[len - 1] == '\r' || raw[len - 1] == '\t')) len--;
+    raw[len] = '\0';
+    
+    char joined[2048];
+    const char *target = raw + strspn(raw, " \t\r\n");
+    if (strncasecmp(target, "http://", 7) == 0) {
+        url_info_t url;
+        if (parse_url(target, &url) != 0 || url.port != mirror->port || strcasecmp(url.host, mirror->host) != 0) {
+            return -1;
+        }
+        snprintf(joined, sizeof(joined), "%s", url.path);
+    } else if (target[0] == '/' && target[1] == '/') {
+        return -1;
+    } else if (target[strcspn(target, ":/?")] == ':') {
+        return -1;                   /* mailto:, javascript:, https: ... */
+    } else if (target[0] == '/') {
+        snprintf(joined, sizeof(joined), "%s", target);
+    } else {
+        size_t base_len = base_path != NULL ? strcspn(base_path, "?") : 0;
+        if (target[0] != '?' && target[0] != '\0') {
+            while (base_len > 0 && base_path[base_len - 1] != '/') base_len--;
+        }
+        snprintf(joined, sizeof(joined), "%.*s%s", (int)base_len, base_path != NULL ? base_path : "", target);
+    }
+    
+    char *query = strchr(joined, '?');
+    if (query != NULL) *query++ = '\0';
+    if (normalize_path(joined, out, size) != 0) return -1;
+    if (query != NULL && *query != '\0') {
+        size_t path_len = strlen(out);
+        if (path_len + strlen(query) + 2 > size) return -1;
+        snprintf(out + path_len, size - path_len, "?%s", query);
+    }
+    return 0;
+}
+
+/* Codifica o caminho decodificado para a linha de requisição */
+void encode_path(const char *path, char *out, size_t size) {
+    static const char *hex = "0123456789ABCDEF";
+    const char *query = strchr(path, '?');
+    size_t len = 0;
+    for (const char *p = path; *p != '\0' && len + 4 < size; p++) {
+        unsigned char c = *p;
+        if (p >= query && query != NULL) {
+            out[len++] = c == ' ' ? '+' : c;
+        } else if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') ||
+                   strchr("/-._~!$&'()*+,;=:@", c) != NULL) {
+            out[len++] = c;
+        } else {
+            out[len++] = '%';
+            out[len++] = hex[c >> 4];
+            out[len++] = hex[c & 15];
+        }
+    }
+    out[len] = '\0';
+}
+
+/* Enfileira o link se ele é do mesmo host, está abaixo do diretório
+ * inicial e ainda não foi visto; devolve 1 se enfileirou, 0 se ignorou */
+int mirror_add(downloader_t *dl, const char *base_path, const char *link, int redirect_count) {
+    mirror_t *mirror = dl->mirror;
+    char path[1024];
+    if (mirror_resolve(mirror, base_path, link, path, sizeof(path)) != 0 ||
+        strncmp(path, mirror->scope, strlen(mirror->scope)) != 0) {
+        return 0;
+    }
+    int inserted = mirror_seen_insert(mirror, path);
+    if (inserted <= 0) {
+        return inserted;
+    }
+    
+    download_job_t *job = calloc(1, sizeof(download_job_t));
+    if (job == NULL) {
+        perror("Erro ao alocar");
+        return -1;
+    }
+    job->redirect_count = redirect_count;
+    strcpy(job->url.protocol, "http");
+    strcpy(job->url.host, mirror->host);
+    job->url.port = mirror->port;
+    encode_path(path, job->url.path, sizeof(job->url.path));
+    
+    /* Diretórios viram index.html; a consulta (paginação de listagens)
+     * entra no nome do arquivo */
+    char *query = strchr(path, '?');
+    if (query != NULL) *query++ = '\0';
+    size_t path_len = strlen(path);
+    if (asprintf(&job->filename, "%s%s%s%s%s", mirror->root, path, path[path_len - 1] == '/' ? "index.html" : "",
+                 query != NULL ? "?" : "", query != NULL ? query : "") < 0) {
+        free(job);
+        return -1;
+    }
+    
+    struct stat local;
+    if (stat(job->filename, &local) == 0 && S_ISREG(local.st_mode)) {
+        job->if_modified_since = local.st_mtime;
+    }
+    return downloader_enqueue(dl, job) == 0 ? 1 : -1;
+}
+
+/* O corpo vai para arquivo.parcial e só substitui a cópia local quando
+ * chega inteiro, com a data de modificação do servidor; assim uma
+ * execução interrompida não deixa para trás um arquivo truncado com data
+ * recente, que seria tomado como atualizado */
+int mirror_open_partial(const download_job_t *job) {
+    char partial[2100];
+    snprintf(partial, sizeof(partial), "%s" PARTIAL_SUFFIX, job->filename);
+    if (mkdir_parents(partial) != 0) {
+        return -1;
+    }
+    return open(partial, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+}
+
+void mirror_discard_partial(const download_job_t *job) {
+    char partial[2100];
+    if (job != NULL) {
+        snprintf(partial, sizeof(partial), "%s" PARTIAL_SUFFIX, job->filename);
+        unlink(partial);
+    }
+}
+
+int mirror_commit(const download_job_t *job, int fd, time_t last_modified) {
+    char partial[2100];
+    snprintf(partial, sizeof(partial), "%s" PARTIAL_SUFFIX, job->filename);
+    if (last_modified != 0) {
+        struct timespec times[2] = { { last_modified, 0 }, { last_modified, 0 } };
+        futimens(fd, times);
+    }
+    if (rename(partial, job->filename) != 0) {
+        perror("Erro ao gravar arquivo");
+        unlink(partial);
+        return -1;
+    }
+    return 0;
+}
+
+int is_html_name(const char *filename) {
+    const char *name = strrchr(filename, '/');
+    name = name != NULL ? name + 1 : filename;
+    const char *dot = strrchr(name, '.');
+    return strncmp(name, "index.html", 10) == 0 ||
+           (dot != NULL && (strcasecmp(dot, ".html") == 0 || strcasecmp(dot, ".htm") == 0));
+}
+
+void mirror_unchanged(downloader_t *dl, const download_job_t *job) {
+    printf("Arquivo '%s' inalterado\n", job->filename);
+    dl->mirror->unchanged++;
+    /* Uma página inalterada ainda leva aos arquivos que podem ter mudado */
+    if (is_html_name(job->filename)) {
+        mirror_parse_page(dl, job);
+    }
+}
+
+/* Extrai os valores de href= e src= da página salva (inclusive das linhas
+ * <a href='...'> das listagens de diretório do servidor) */
+void mirror_parse_page(downloader_t *dl, const download_job_t *job) {
+    int fd = open(job->filename, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return;
+    char *page = malloc(MIRROR_MAX_PAGE_SIZE + 1);
+    ssize_t len = page != NULL ? read(fd, page, MIRROR_MAX_PAGE_SIZE) : -1;
+    close(fd);
+    if (len <= 0) {
+        free(page);
+        return;
+    }
+    page[len] = '\0';
+    
+    for (char *p = page; *p != '\0'; p++) {
+        size_t name_len;
+        if (strncasecmp(p, "href", 4) == 0) name_len = 4;
+        else if (strncasecmp(p, "src", 3) == 0) name_len = 3;
+        else continue;
+        if (p > page && !strchr(" \t\r\n", p[-1])) continue;
+        
+        char *value = p + name_len;
+        value += strspn(value, " \t\r\n");
+        if (*value != '=') continue;
+        value++;
+        value += strspn(value, " \t\r\n");
+        
+        char *end;
+        if (*value == '"' || *value == '\'') {
+            end = strchr(value + 1, *value);
+            value++;
+        } else {
+            end = value + strcspn(value, " \t\r\n>");
+        }
+        if (end == NULL) break;
+        
+        char saved = *end;
+        *end = '\0';
+        mirror_add(dl, job->url.path, value, 0);
+        *end = saved;
+        p = end;
+        if (*p == '\0') break;
+    }
+    free(page);
+}
+
+int mirror_site(const char *url, int per_host, int pipeline) {
+    mirror_t mirror;
+    memset(&mirror, 0, sizeof(mirror));
+    url_info_t start_url;
+    if (parse_url(url, &start_url) != 0) {
+        return -1;
+    }
+    strcpy(mirror.host, start_url.host);
+    mirror.port = start_url.port;
+    if (mirror.port == 80) snprintf(mirror.root, sizeof(mirror.root), "%s", mirror.host);
+    else snprintf(mirror.root, sizeof(mirror.root), "%s:%d", mirror.host, mirror.port);
+    
+    /* Escopo: o diretório da URL inicial */
+    if (mirror_resolve(&mirror, NULL, start_url.path, mirror.scope, sizeof(mirror.scope)) != 0) {
+        fprintf(stderr, "Erro: caminho inválido %s\n", start_url.path);
+        return -1;
+    }
+    mirror.scope[strcspn(mirror.scope, "?")] = '\0';
+    *(strrchr(mirror.scope, '/') + 1) = '\0';
+    
+    downloader_t dl;
+    if (downloader_init(&dl, per_host, pipeline) != 0) {
+        return -1;
+    }
+    dl.mirror = &mirror;
+    printf("Espelhando %s em %s/\n", url, mirror.root);
+    
+    long long start = monotonic_us();
+    if (mirror_add(&dl, NULL, start_url.path, 0) == 1) {
+        downloader_run(&dl);
+    }
+    
+    double elapsed = (monotonic_us() - start) / 1e6;
+    printf("%d arquivo(s) baixado(s) (%lld bytes), %d inalterado(s) em %.2f s", dl.completed, dl.bytes,
+           mirror.unchanged, elapsed);
+    if (dl.failed > 0) printf(", %d falha(s)", dl.failed);
+    printf("\n");
+    
+    downloader_cleanup(&dl);
+    for (size_t i = 0; i < mirror.seen_size; i++) {
+        free(mirror.seen[i]);
+    }
+    free(mirror.seen);
+    return dl.failed > 0 ? -1 : 0;
+}
+
+/* ---- Download segmentado de um arquivo grande ---- */
+
+#define SEGMENT_MAX 64
+#define SEGMENT_MIN_SIZE (1024 * 1024)
+#define SEGMENT_MAX_ATTEMPTS 5
+#define PROGRESS_SUFFIX ".progresso"
+
+typedef struct {
+    long long start;
+    long long end;               /* inclusivo */
+    long long done;              /* bytes já gravados a partir de start */
+    int fd;
+    int connecting;
+    int attempts;
+    int header_done;
+    char buffer[DOWNLOAD_BUFFER_SIZE + 1];
+    size_t len;
+} segment_t;
+
+typedef struct {
+    url_info_t url;
+    char *filename;
+    char progress_path[1100];
+    long long size;
+    char validator[256];         /* ETag (ou Last-Modified) para If-Range */
+    struct sockaddr_in addr;
+    int output_fd;
+    int progress_fd;
+    int epoll_fd;
+    segment_t *segments;
+    int segment_count;
+} segmented_t;
+
+/* Pede o primeiro byte para descobrir o tamanho, o validador e se o
+ * servidor aceita Range. Devolve 1 se aceita, 0 se não (ou se o tamanho
+ * é desconhecido) e -1 em erro. Segue redirecionamentos. */
+int segmented_probe(segmented_t *job, int redirect_count) {
+    if (resolve_host(job->url.host, job->url.port, &job->addr) != 0) return -1;
+    int sockfd = connect_address(&job->addr);
+    if (sockfd < 0) return -1;
+    
+    char request[2048];
+    int len = format_http_request_with(request, sizeof(request), &job->url, 0, "Range: bytes=0-0\r\n");
+    if (send_request(sockfd, request, len) != 0) {
+        close(sockfd);
+        return -1;
+    }
+    
+    char response[BUFFER_SIZE];
+    size_t received = 0;
+    char *header_end = NULL;
+    while (header_end == NULL && received < sizeof(response) - 1) {
+        ssize_t bytes = recv(sockfd, response + received, sizeof(response) - 1 - received, 0);
+        if (bytes <= 0) break;
+        received += bytes;
+        response[received] = '\0';
+        header_end = strstr(response, "\r\n\r\n");
+    }
+    close(sockfd);
+    if (header_end == NULL) {
+        fprintf(stderr, "Erro ao receber resposta\n");
+        return -1;
+    }
+    header_end[2] = '\0';
+    
+    int status = get_http_status_code(response);
+    if (status == 301 || status == 302) {
+        char location[1100];
+        if (redirect_count >= MAX_REDIRECTS || !get_header_value(response, "\r\nLocation: ", location, sizeof(location))) {
+            fprintf(stderr, "Erro: redirecionamento inválido\n");
+            return -1;
+        }
+        printf("Redirecionando para: %s\n", location);
+        if (parse_url(location, &job->url) != 0) return -1;
+        return segmented_probe(job, redirect_count + 1);
+    }
+    /* 416 no primeiro byte: arquivo vazio, que não precisa de segmentos */
+    if (status == 200 || status == 416) {
+        return 0;
+    }
+    if (status != 206) {
+        printf("Erro: Servidor retornou código %d\n", status);
+        return -1;
+    }
+    
+    char content_range[128];
+    long long first, last;
+    if (!get_header_value(response, "\r\nContent-Range: ", content_range, sizeof(content_range)) ||
+        sscanf(content_range, "bytes %lld-%lld/%lld", &first, &last, &job->size) != 3) {
+        return 0;
+    }
+    if (!get_header_value(response, "\r\nETag: ", job->validator, sizeof(job->validator)) &&
+        !get_header_value(response, "\r\nLast-Modified: ", job->validator, sizeof(job->validator))) {
+        strcpy(job->validator, "-");
+    }
+    return 1;
+}
+
+/* Arquivo de progresso, ao lado do destino:
+ *   <tamanho> <validador>
+ *   <início> <fim> <feito>   (uma linha por segmento) */
+void segmented_save_progress(segmented_t *job) {
+    char text[SEGMENT_MAX * 64 + 512];
+    int len = snprintf(text, sizeof(text), "%lld %s\n", job->size, job->validator);
+    for (int i = 0; i < job->segment_count; i++) {
+        segment_t *segment = &job->segments[i];
+        len += snprintf(text + len, sizeof(text) - len, "%lld %lld %lld\n", segment->start, segment->end, segment->done);
+    }
+    if (pwrite(job->progress_fd, text, len, 0) != len || ftruncate(job->progress_fd, len) != 0) {
+        perror("Erro ao gravar progresso");
+    }
+}
+
+/* Retoma um download interrompido se o arquivo de progresso corresponde
+ * ao mesmo tamanho e validador; devolve o número de segmentos lidos */
+int segmented_load_progress(segmented_t *job) {
+    FILE *file = fopen(job->progress_path, "r");
+    if (file == NULL) return 0;
+    
+    long long size;
+    char validator[256];
+    char line[512];
+    int count = 0;
+    if (fgets(line, sizeof(line), file) != NULL && sscanf(line, "%lld %255[^\n]", &size, validator) == 2 &&
+        size == job->size && strcmp(validator, job->validator) == 0) {
+        while (count < SEGMENT_MAX && fgets(line, sizeof(line), file) != NULL) {
+            segment_t *segment = &job->segments[count];
+            if (sscanf(line, "%lld %lld %lld", &segment->start, &segment->end, &segment->done) != 3 ||
+                segment->start < 0 || segment->end >= size || segment->done < 0 ||
+                segment->done > segment->end - segment->start + 1) {
+                count = 0;
+                break;
+            }
+            count++;
+        }
+    }
+    fclose(file);
+    return count;
+}
+
+int segment_connect(segmented_t *job, segment_t *segment) {
+    segment->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (segment->fd < 0) {
+        perror("Erro ao criar socket");
+        return -1;
+    }
+    segment->connecting = connect(segment->fd, (const struct sockaddr *)&job->addr, sizeof(job->addr)) < 0;
+    if (segment->connecting && errno != EINPROGRESS) {
+        perror("Erro ao conectar");
+        close(segment->fd);
+        segment->fd = -1;
+        return -1;
+    }
+    segment->header_done = 0;
+    segment->len = 0;
+    struct epoll_event ev;
+    ev.events = EPOLLOUT;
+    ev.data.ptr = segment;
+    epoll_ctl(job->epoll_fd, EPOLL_CTL_ADD, segment->fd, &ev);
+    return 0;
+}
+
+void segment_close(segmented_t *job, segment_t *segment) {
+    if (segment->fd >= 0) {
+        epoll_ctl(job->epoll_fd, EPOLL_CTL_DEL, segment->fd, NULL);
+        close(segment->fd);
+        segment->fd = -1;
+    }
+    segment->connecting = 0;
+}
+
+int segment_remaining(const segment_t *segment) {
+    return segment->done < segment->end - segment->start + 1;
+}
+
+/* Envia a requisição do trecho que falta; If-Range garante que o
+ * servidor só manda o intervalo se o arquivo não mudou */
+int segment_send(segmented_t *job, segment_t *segment) {
+    char headers[512];
+    char request[2048];
+    int len = snprintf(headers, sizeof(headers), "Range: bytes=%lld-%lld\r\n", segment->start + segment->done, segment->end);
+    if (strcmp(job->validator, "-") != 0) {
+        snprintf(headers + len, sizeof(headers) - len, "If-Range: %s\r\n", job->validator);
+    }
+    len = format_http_request_with(request, sizeof(request), &job->url, 0, headers);
+    
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = segment;
+    epoll_ctl(job->epoll_fd, EPOLL_CTL_MOD, segment->fd, &ev);
+    return send(segment->fd, request, len, MSG_NOSIGNAL) == len ? 0 : -1;
+}
+
+/* Lê o que chegou; devolve 1 quando o segmento terminou, 0 se ainda
+ * falta e -1 se a conexão falhou (o segmento é retomado depois) */
+int segment_read(segmented_t *job, segment_t *segment) {
+    ssize_t bytes = recv(segment->fd, segment->buffer + segment->len, DOWNLOAD_BUFFER_SIZE - segment->len, 0);
+    if (bytes < 0 && errno == EAGAIN) return 0;
+    if (bytes <= 0) return -1;
+    segment->len += bytes;
+    
+    size_t offset = 0;
+    if (!segment->header_done) {
+        char *header_end = memmem(segment->buffer, segment->len, "\r\n\r\n", 4);
+        if (header_end == NULL) {
+            return segment->len == DOWNLOAD_BUFFER_SIZE ? -1 : 0;
+        }
+        offset = header_end - segment->buffer + 4;
+        header_end[2] = '\0';
+        
+        int status = get_http_status_code(segment->buffer);
+        char content_range[128];
+        long long first = -1;
+        if (get_header_value(segment->buffer, "\r\nContent-Range: ", content_range, sizeof(content_range))) {
+            sscanf(content_range, "bytes %lld-", &first);
+        }
+        if (status != 206 || first != segment->start + segment->done) {
+            fprintf(stderr, "Erro: o servidor não devolveu o intervalo pedido (código %d); o arquivo mudou?\n", status);
+            segment->attempts = SEGMENT_MAX_ATTEMPTS;
+            return -1;
+        }
+        segment->header_done = 1;
+    }
+    
+    size_t available = segment->len - offset;
+    long long left = segment->end - segment->start + 1 - segment->done;
+    if ((long long)available > left) available = left;
+    if (available > 0) {
+        ssize_t written = pwrite(job->output_fd, segment->buffer + offset, available, segment->start + segment->done);
+        if (written != (ssize_t)available) {
+            perror("Erro ao gravar arquivo");
+            segment->attempts = SEGMENT_MAX_ATTEMPTS;
+            return -1;
+        }
+        segment->done += available;
+    }
+    segment->len = 0;
+    return segment_remaining(segment) ? 0 : 1;
+}
+
+void segmented_print_progress(const segmented_t *job, long long start_us) {
+    long long done = 0;
+    for (int i = 0; i < job->segment_count; i++) done += job->segments[i].done;
+    double elapsed = (monotonic_us() - start_us) / 1e6;
+    fprintf(stderr, "\r%3d%%  %lld de %lld MB  %.1f MB/s   ", job->size > 0 ? (int)(done * 100 / job->size) : 100,
+            done / (1024 * 1024), job->size / (1024 * 1024), elapsed > 0 ? done / elapsed / (1024 * 1024) : 0.0);
+}
+
+int download_segmented(const char *url, int segment_count) {
+    segmented_t job;
+    memset(&job, 0, sizeof(job));
+    job.output_fd = job.progress_fd = job.epoll_fd = -1;
+    if (parse_url(url, &job.url) != 0) return -1;
+    
+    int ranges = segmented_probe(&job, 0);
+    if (ranges < 0) return -1;
+    if (ranges == 0) {
+        printf("Download segmentado indisponível (sem suporte a Range ou arquivo vazio); baixando com uma única conexão\n");
+        return meu_navegador(url);
+    }
+    
+    job.filename = get_filename(job.url.path);
+    snprintf(job.progress_path, sizeof(job.progress_path), "%s" PROGRESS_SUFFIX, job.filename);
+    job.segments = calloc(SEGMENT_MAX, sizeof(segment_t));
+    if (job.segments == NULL) {
+        perror("Erro ao alocar");
+        free(job.filename);
+        return -1;
+    }
+    for (int i = 0; i < SEGMENT_MAX; i++) {
+        job.segments[i].fd = -1;
+    }
+    
+    /* Trechos de pelo menos 1 MB; com progresso salvo, retoma de onde parou.
+     * Sem ETag nem Last-Modified não há If-Range que perceba uma mudança no
+     * arquivo entre as execuções, então o download sempre recomeça. */
+    int protected = strcmp(job.validator, "-") != 0;
+    job.segment_count = protected ? segmented_load_progress(&job) : 0;
+    int resuming = job.segment_count > 0;
+    if (resuming) {
+        /* Os trechos marcados como feitos só valem se o destino ainda
+         * existe com o tamanho reservado; senão seriam buracos zerados */
+        struct stat output_stat;
+        job.output_fd = open(job.filename, O_RDWR | O_CLOEXEC);
+        if (job.output_fd < 0 || fstat(job.output_fd, &output_stat) != 0 || output_stat.st_size != job.size) {
+            printf("Progresso salvo descartado: '%s' não existe mais ou mudou de tamanho\n", job.filename);
+            if (job.output_fd >= 0) close(job.output_fd);
+            job.output_fd = -1;
+            resuming = 0;
+        }
+    }
+    if (!resuming) {
+        long long by_size = job.size / SEGMENT_MIN_SIZE;
+        job.segment_count = by_size < segment_count ? (by_size > 0 ? (int)by_size : 1) : segment_count;
+        for (int i = 0; i < job.segment_count; i++) {
+            job.segments[i].start = job.size * i / job.segment_count;
+            job.segments[i].end = job.size * (i + 1) / job.segment_count - 1;
+        }
+    }
+    
+    int result = -1;
+    if (!resuming) {
+        job.output_fd = open(job.filename, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    }
+    job.progress_fd = open(job.progress_path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    job.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (job.output_fd < 0 || job.progress_fd < 0 || job.epoll_fd < 0) {
+        perror("Erro ao criar arquivo");
+        goto done;
+    }
+    /* Reserva o espaço de uma vez: os trechos chegam fora de ordem */
+    if (!resuming && job.size > 0 && posix_fallocate(job.output_fd, 0, job.size) != 0 &&
+        ftruncate(job.output_fd, job.size) != 0) {
+        perror("Erro ao reservar espaço");
+        goto done;
+    }
+    segmented_save_progress(&job);
+    
+    printf("Baixando: %s (%lld bytes) em %d segmentos%s\n", job.url.path, job.size, job.segment_count,
+           resuming ? ", retomando o progresso salvo" : "");
+    printf("Salvando como: %s\n", job.filename);
+    
+    int active = 0;
+    for (int i = 0; i < job.segment_count; i++) {
+        if (segment_remaining(&job.segments[i])) {
+            if (segment_connect(&job, &job.segments[i]) != 0) goto done;
+            active++;
+        }
+    }
+    
+    long long start = monotonic_us();
+    long long last_report = start;
+    struct epoll_event events[SEGMENT_MAX];
+    while (active > 0) {
+        int n = epoll_wait(job.epoll_fd, events, SEGMENT_MAX, 1000);
+        if (n < 0 && errno != EINTR) {
+            perror("Erro no epoll_wait");
+            goto done;
+        }
+        for (int i = 0; i < n; i++) {
+            segment_t *segment = events[i].data.ptr;
+            if (segment->fd < 0) continue;
+            
+            int state;
+            if (segment->connecting) {
+                int error = 0;
+                socklen_t len = sizeof(error);
+                getsockopt(segment->fd, SOL_SOCKET, SO_ERROR, &error, &len);
+                segment->connecting = 0;
+                state = error == 0 && segment_send(&job, segment) == 0 ? 0 : -1;
+            } else {
+                state = segment_read(&job, segment);
+            }
+            
+            if (state == 1) {
+                segment_close(&job, segment);
+                active--;
+            } else if (state < 0) {
+                segment_close(&job, segment);
+                if (++segment->attempts >= SEGMENT_MAX_ATTEMPTS || segment_connect(&job, segment) != 0) {
+                    fprintf(stderr, "\nErro: segmento %lld-%lld falhou\n", segment->start, segment->end);
+                    goto done;
+                }
+            }
+        }
+        
+        long long now = monotonic_us();
+        if (now - last_report >= 1000000) {
+            last_report = now;
+            segmented_save_progress(&job);
+            segmented_print_progress(&job, start);
+        }
+    }
+    
+    segmented_print_progress(&job, start);
+    fprintf(stderr, "\n");
+    printf("Arquivo '%s' baixado com sucesso (%lld bytes)\n", job.filename, job.size);
+    unlink(job.progress_path);
+    result = 0;
+    
+done:
+    if (result != 0 && job.progress_fd >= 0) {
+        segmented_save_progress(&job);
+        fprintf(stderr, protected ? "Download interrompido; execute novamente para continuar de onde parou\n"
+                                  : "Download interrompido; sem ETag nem Last-Modified, a próxima execução recomeça do zero\n");
+    }
+    for (int i = 0; i < job.segment_count; i++) {
+        if (job.segments[i].fd >= 0) close(job.segments[i].fd);
+    }
+    if (job.output_fd >= 0) close(job.output_fd);
+    if (job.progress_fd >= 0) close(job.progress_fd);
+    if (job.epoll_fd >= 0) close(job.epoll_fd);
+    free(job.segments);
+    free(job.filename);
+    return result;
+}
+
+/* ---- Modo bench: gerador de carga ---- */
+
+#define BENCH_MAX_URLS 64
+#define BENCH_BUFFER_SIZE (64 * 1024)
+#define BENCH_MAX_EVENTS 256
+
+/* Histograma de latências em microssegundos no estilo HDR (o mesmo do
+ * servidor): exato até 31 e 16 faixas por potência de 2 acima disso */
+#define HIST_SUB_BUCKETS 16
+#define HIST_MAX_EXPONENT 40
+#define HIST_BUCKETS (2 * HIST_SUB_BUCKETS + (HIST_MAX_EXPONENT - 4) * HIST_SUB_BUCKETS)
+
+typedef struct {
+    uint64_t counts[HIST_BUCKETS];
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+} histogram_t;
+
+int histogram_index(uint64_t value) {
+    if (value < 2 * HIST_SUB_BUCKETS) return (int)value;
+    int exponent = 63 - __builtin_clzll(value);
+    if (exponent > HIST_MAX_EXPONENT) return HIST_BUCKETS - 1;
+    int sub = (value >> (exponent - 4)) & (HIST_SUB_BUCKETS - 1);
+    return 2 * HIST_SUB_BUCKETS + (exponent - 5) * HIST_SUB_BUCKETS + sub;
+}
+
+uint64_t histogram_upper(int index) {
+    if (index < 2 * HIST_SUB_BUCKETS) return index;
+    int exponent = (index - 2 * HIST_SUB_BUCKETS) / HIST_SUB_BUCKETS + 5;
+    int sub = (index - 2 * HIST_SUB_BUCKETS) % HIST_SUB_BUCKETS;
+    return ((uint64_t)(HIST_SUB_BUCKETS + sub + 1) << (exponent - 4)) - 1;
+}
+
+void histogram_record(histogram_t *h, uint64_t value) {
+    h->counts[histogram_index(value)]++;
+    h->count++;
+    h->sum += value;
+    if (value > h->max) h->max = value;
+}
+
+uint64_t histogram_percentile(const histogram_t *h, double percentile) {
+    uint64_t target = (uint64_t)(percentile / 100.0 * h->count + 0.5);
+    if (target == 0) target = 1;
+    uint64_t seen = 0;
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        seen += h->counts[i];
+        if (seen >= target) {
+            uint64_t upper = histogram_upper(i);
+            return upper < h->max ? upper : h->max;
+        }
+    }
+    return h->max;
+}
+
+typedef struct {
+    url_info_t url;
+    unsigned weight;
+    int output_fd;               /* -1 com --discard */
+} bench_url_t;
+
+typedef struct {
+    int fd;
+    int busy;                    /* requisição em andamento */
+    int connecting;              /* connect() ainda não concluído */
+    int url_index;
+    long long sent_us;           /* envio de fato */
+    long long intended_us;       /* envio previsto pela taxa (--rate) */
+    char buffer[BENCH_BUFFER_SIZE + 1];
+    size_t len;
+    int header_done;
+    int status;
+    int server_close;            /* resposta com "Connection: close" */
+    body_decoder_t body;
+    long long body_offset;
+} bench_conn_t;
+
+typedef struct {
+    int connections;
+    double duration;
+    long long total_requests;    /* 0: limitado só pela duração */
+    int keep_alive;
+    int discard;
+    const char *json_path;       /* resultado também em JSON ("-" para a saída padrão) */
+    double rate;                 /* requisições por segundo; 0 sem limite */
+    bench_url_t urls[BENCH_MAX_URLS];
+    int url_count;
+    unsigned total_weight;
+    struct sockaddr_in addr;
+    int epoll_fd;
+    bench_conn_t *conns;
+    uint64_t random_state;
+    long long issued;
+    long long completed;
+    long long bytes;
+    long long status_errors;
+    long long connect_errors;
+    long long read_errors;
+    int failed_in_a_row;
+    long long next_intended_us;
+    long long interval_us;
+    histogram_t latency;         /* desde o envio previsto (corrigida) */
+    histogram_t service;         /* desde o envio de fato */
+} bench_t;
+
+int bench_add_url(bench_t *bench, const char *url, unsigned weight) {
+    if (bench->url_count == BENCH_MAX_URLS) {
+        fprintf(stderr, "Erro: no máximo %d URLs\n", BENCH_MAX_URLS);
+        return -1;
+    }
+    bench_url_t *entry = &bench->urls[bench->url_count];
+    if (parse_url(url, &entry->url) != 0) {
+        return -1;
+    }
+    const url_info_t *first = &bench->urls[0].url;
+    if (bench->url_count > 0 && (strcmp(entry->url.host, first->host) != 0 || entry->url.port != first->port)) {
+        fprintf(stderr, "Erro: todas as URLs devem ser do mesmo host e porta (%s:%d)\n", first->host, first->port);
+        return -1;
+    }
+    entry->weight = weight;
+    entry->output_fd = -1;
+    bench->total_weight += weight;
+    bench->url_count++;
+    return 0;
+}
+
+/* Arquivo com uma URL por linha, opcionalmente precedida do peso */
+int bench_load_urls(bench_t *bench, const char *path) {
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        perror("Erro ao abrir lista de URLs");
+        return -1;
+    }
+    char line[2048];
+    int result = 0;
+    while (result == 0 && fgets(line, sizeof(line), file) != NULL) {
+        line[strcspn(line, "\r\n")] = '\0';
+        char *url = line + strspn(line, " \t");
+        if (*url == '\0' || *url == '#') continue;
+        
+        unsigned weight = 1;
+        if (*url >= '0' && *url <= '9') {
+            char *end;
+            weight = strtoul(url, &end, 10);
+            url = end + strspn(end, " \t");
+        }
+        if (weight == 0) continue;
+        result = bench_add_url(bench, url, weight);
+    }
+    fclose(file);
+    return result;
+}
+
+int bench_pick_url(bench_t *bench) {
+    if (bench->url_count == 1) return 0;
+    /* xorshift64 */
+    uint64_t x = bench->random_state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    bench->random_state = x;
+    
+    unsigned target = x % bench->total_weight;
+    for (int i = 0; i < bench->url_count; i++) {
+        if (target < bench->urls[i].weight) return i;
+        target -= bench->urls[i].weight;
+    }
+    return bench->url_count - 1;
+}
+
+void bench_disconnect(bench_t *bench, bench_conn_t *conn) {
+    if (conn->fd >= 0) {
+        epoll_ctl(bench->epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+        close(conn->fd);
+        conn->fd = -1;
+    }
+    conn->busy = 0;
+    conn->connecting = 0;
+}
+
+void bench_connect_failed(bench_t *bench, bench_conn_t *conn) {
+    /* Só o primeiro erro é mostrado; os demais entram no relatório */
+    if (bench->connect_errors++ == 0) perror("Erro ao conectar");
+    bench->failed_in_a_row++;
+    bench->issued--;
+    bench_disconnect(bench, conn);
+}
+
+void bench_send(bench_t *bench, bench_conn_t *conn) {
+    if (send_http_request(conn->fd, &bench->urls[conn->url_index].url, bench->keep_alive) != 0) {
+        bench->read_errors++;
+        bench_disconnect(bench, conn);
+    }
+}
+
+/* Conexão não bloqueante: um handshake lento (SYN retransmitido, fila de
+ * accept cheia) não pode parar as outras conexões */
+int bench_connect(bench_t *bench, bench_conn_t *conn) {
+    conn->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (conn->fd < 0) {
+        return -1;
+    }
+    conn->connecting = connect(conn->fd, (const struct sockaddr *)&bench->addr, sizeof(bench->addr)) < 0;
+    if (conn->connecting && errno != EINPROGRESS) {
+        return -1;
+    }
+    struct epoll_event ev;
+    ev.events = conn->connecting ? EPOLLOUT : EPOLLIN;
+    ev.data.ptr = conn;
+    epoll_ctl(bench->epoll_fd, EPOLL_CTL_ADD, conn->fd, &ev);
+    return 0;
+}
+
+void bench_on_connected(bench_t *bench, bench_conn_t *conn) {
+    int error = 0;
+    socklen_t len = sizeof(error);
+    getsockopt(conn->fd, SOL_SOCKET, SO_ERROR, &error, &len);
+    if (error != 0) {
+        errno = error;
+        bench_connect_failed(bench, conn);
+        return;
+    }
+    conn->connecting = 0;
+    bench->failed_in_a_row = 0;
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = conn;
+    epoll_ctl(bench->epoll_fd, EPOLL_CTL_MOD, conn->fd, &ev);
+    bench_send(bench, conn);
+}
+
+int bench_can_issue(const bench_t *bench) {
+    return bench->total_requests == 0 || bench->issued < bench->total_requests;
+}
+
+void bench_start_request(bench_t *bench, bench_conn_t *conn, long long intended_us) {
+    conn->url_index = bench_pick_url(bench);
+    conn->len = 0;
+    conn->header_done = 0;
+    conn->server_close = 0;
+    conn->body_offset = 0;
+    conn->sent_us = monotonic_us();
+    conn->intended_us = intended_us != 0 ? intended_us : conn->sent_us;
+    conn->busy = 1;
+    bench->issued++;
+    
+    if (conn->fd < 0 && bench_connect(bench, conn) != 0) {
+        bench_connect_failed(bench, conn);
+        return;
+    }
+    if (!conn->connecting) {
+        bench_send(bench, conn);
+    }
+}
+
+void bench_finish_request(bench_t *bench, bench_conn_t *conn) {
+    long long now = monotonic_us();
+    histogram_record(&bench->latency, now - conn->intended_us);
+    histogram_record(&bench->service, now - conn->sent_us);
+    bench->completed++;
+    if (conn->status < 200 || conn->status >= 400) {
+        bench->status_errors++;
+    }
+    
+    conn->busy = 0;
+    if (!bench->keep_alive || conn->server_close || conn->body.state != BODY_DONE) {
+        bench_disconnect(bench, conn);
+    }
+    /* Sem taxa fixa, cada conexão manda a próxima assim que a anterior volta */
+    if (bench->rate == 0 && bench_can_issue(bench)) {
+        bench_start_request(bench, conn, 0);
+    }
+}
+
+int bench_consume_body(bench_t *bench, bench_conn_t *conn, const char *data, size_t len) {
+    int output_fd = conn->status == 200 ? bench->urls[conn->url_index].output_fd : -1;
+    long long before = conn->body_offset;
+    size_t consumed = 0;
+    while (consumed < len && conn->body.state != BODY_DONE) {
+        ssize_t bytes = body_write(&conn->body, data + consumed, len - consumed, output_fd, &conn->body_offset);
+        if (bytes < 0 || conn->body.state == BODY_ERROR) {
+            return -1;
+        }
+        consumed += bytes;
+    }
+    bench->bytes += conn->body_offset - before;
+    return 0;
+}
+
+void bench_on_readable(bench_t *bench, bench_conn_t *conn) {
+    if (!conn->header_done) {
+        ssize_t bytes = recv(conn->fd, conn->buffer + conn->len, BENCH_BUFFER_SIZE - conn->len, 0);
+        if (bytes < 0 && errno == EAGAIN) return;
+        if (bytes <= 0) {
+            bench->read_errors++;
+            bench_disconnect(bench, conn);
+            return;
+        }
+        conn->len += bytes;
+        
+        char *header_end = memmem(conn->buffer, conn->len, "\r\n\r\n", 4);
+        if (header_end == NULL) {
+            if (conn->len == BENCH_BUFFER_SIZE) {
+                bench->read_errors++;
+                bench_disconnect(bench, conn);
+            }
+            return;
+        }
+        
+        size_t header_size = header_end - conn->buffer + 4;
+        bench->bytes += header_size;
+        if (parse_response_header(conn->buffer, header_size, &conn->status, &conn->body, &conn->server_close) != 0 ||
+            bench_consume_body(bench, conn, conn->buffer + header_size, conn->len - header_size) != 0) {
+            bench->read_errors++;
+            bench_disconnect(bench, conn);
+            return;
+        }
+        conn->header_done = 1;
+    } else {
+        ssize_t bytes = recv(conn->fd, conn->buffer, BENCH_BUFFER_SIZE, 0);
+        if (bytes < 0 && errno == EAGAIN) return;
+        if (bytes < 0 || (bytes == 0 && conn->body.state != BODY_UNTIL_CLOSE) ||
+            bench_consume_body(bench, conn, conn->buffer, bytes) != 0) {
+            bench->read_errors++;
+            bench_disconnect(bench, conn);
+            return;
+        }
+        if (bytes == 0) {
+            bench_finish_request(bench, conn);
+            return;
+        }
+    }
+    
+    if (conn->body.state == BODY_DONE) {
+        bench_finish_request(bench, conn);
+    }
+}
+
+/* Com --rate, a k-ésima requisição está prevista para início + k/taxa e
+ * vai para a primeira conexão livre. Se todas estiverem ocupadas ela
+ * espera, e a espera entra na latência: é a correção da omissão
+ * coordenada (um servidor lento não reduz a carga que deveria receber). */
+long long bench_dispatch_scheduled(bench_t *bench, long long now) {
+    for (int i = 0; i < bench->connections && bench->next_intended_us <= now && bench_can_issue(bench); i++) {
+        bench_conn_t *conn = &bench->conns[i];
+        if (conn->busy) continue;
+        bench_start_request(bench, conn, bench->next_intended_us);
+        bench->next_intended_us += bench->interval_us;
+    }
+    return bench->next_intended_us - now;
+}
+
+void bench_report(const bench_t *bench, double elapsed) {
+    printf("\n%lld requisições em %.2f s, %d conexões%s\n", bench->completed, elapsed,
+           bench->connections, bench->keep_alive ? " (keep-alive)" : "");
+    printf("Requisições/s: %.1f\n", bench->completed / elapsed);
+    printf("Transferência: %.2f MB/s (%lld bytes)\n", bench->bytes / elapsed / (1024 * 1024), bench->bytes);
+    printf("Erros: conexão %lld, leitura %lld, status fora de 2xx/3xx %lld\n",
+           bench->connect_errors, bench->read_errors, bench->status_errors);
+    
+    const histogram_t *histograms[2] = { &bench->latency, &bench->service };
+    const char *titles[2] = {
+        bench->rate > 0 ? "Latência (µs, desde o envio previsto)" : "Latência (µs)",
+        "Tempo de serviço (µs, desde o envio)"
+    };
+    for (int i = 0; i < (bench->rate > 0 ? 2 : 1); i++) {
+        const histogram_t *h = histograms[i];
+        printf("%s:\n", titles[i]);
+        printf("  média %llu  p50 %llu  p90 %llu  p99 %llu  p99.9 %llu  máx %llu\n",
+               (unsigned long long)(h->count > 0 ? h->sum / h->count : 0),
+               (unsigned long long)histogram_percentile(h, 50), (unsigned long long)histogram_percentile(h, 90),
+               (unsigned long long)histogram_percentile(h, 99), (unsigned long long)histogram_percentile(h, 99.9),
+               (unsigned long long)h->max);
+    }
+    if (bench->rate == 0) {
+        printf("(sem --rate a carga é em laço fechado e as latências não corrigem a omissão coordenada)\n");
+    }
+}
+
+/* O mesmo relatório como um objeto JSON plano, um campo por linha, para
+ * ser comparado entre execuções (make bench) */
+int bench_report_json(const bench_t *bench, double elapsed, const char *path) {
+    FILE *out = strcmp(path, "-") == 0 ? stdout : fopen(path, "w");
+    if (out == NULL) {
+        perror("Erro ao criar arquivo JSON");
+        return -1;
+    }
+    const histogram_t *h = &bench->latency;
+    fprintf(out, "{\n");
+    fprintf(out, "  \"requests\": %lld,\n", bench->completed);
+    fprintf(out, "  \"elapsed_s\": %.3f,\n", elapsed);
+    fprintf(out, "  \"throughput_rps\": %.1f,\n", bench->completed / elapsed);
+    fprintf(out, "  \"transfer_mbps\": %.2f,\n", bench->bytes / elapsed / (1024 * 1024));
+    fprintf(out, "  \"errors\": %lld,\n", bench->connect_errors + bench->read_errors + bench->status_errors);
+    fprintf(out, "  \"latency_mean_us\": %llu,\n", (unsigned long long)(h->count > 0 ? h->sum / h->count : 0));
+    fprintf(out, "  \"latency_p50_us\": %llu,\n", (unsigned long long)histogram_percentile(h, 50));
+    fprintf(out, "  \"latency_p90_us\": %llu,\n", (unsigned long long)histogram_percentile(h, 90));
+    fprintf(out, "  \"latency_p99_us\": %llu,\n", (unsigned long long)histogram_percentile(h, 99));
+    fprintf(out, "  \"latency_p999_us\": %llu,\n", (unsigned long long)histogram_percentile(h, 99.9));
+    fprintf(out, "  \"latency_max_us\": %llu\n", (unsigned long long)h->max);
+    fprintf(out, "}\n");
+    if (out != stdout && fclose(out) != 0) {
+        perror("Erro ao gravar arquivo JSON");
+        return -1;
+    }
+    return 0;
+}
+
+void print_bench_usage(const char *program) {
+    fprintf(stderr, "Uso: %s bench [opções] <URL> [URL...]\n", program);
+    fprintf(stderr, "Opções:\n");
+    fprintf(stderr, "  -c, --connections N  conexões simultâneas (padrão 10)\n");
+    fprintf(stderr, "  -d, --duration S     duração do teste em segundos (padrão 10)\n");
+    fprintf(stderr, "  -n, --requests N     para depois de N requisições\n");
+    fprintf(stderr, "  -k, --keepalive      reaproveita as conexões entre requisições\n");
+    fprintf(stderr, "  -r, --rate R         taxa fixa de R requisições/s, com correção da omissão coordenada\n");
+    fprintf(stderr, "  -u, --urls ARQ       lista de URLs, uma por linha, opcionalmente precedida do peso\n");
+    fprintf(stderr, "  -x, --discard        descarta os corpos em vez de gravá-los\n");
+    fprintf(stderr, "  -j, --json ARQ       grava também o resultado em JSON (\"-\" para a saída padrão)\n");
+}
+
+int run_bench(int argc, char *argv[], const char *program) {
+    static const struct option long_options[] = {
+        {"connections", required_argument, NULL, 'c'},
+        {"duration", required_argument, NULL, 'd'},
+        {"requests", required_argument, NULL, 'n'},
+        {"keepalive", no_argument, NULL, 'k'},
+        {"rate", required_argument, NULL, 'r'},
+        {"urls", required_argument, NULL, 'u'},
+        {"discard", no_argument, NULL, 'x'},
+        {"json", required_argument, NULL, 'j'},
+        {NULL, 0, NULL, 0}
+    };
+    
+    bench_t *bench = calloc(1, sizeof(bench_t));
+    if (bench == NULL) {
+        perror("Erro ao alocar");
+        return 1;
+    }
+    bench->connections = 10;
+    bench->duration = 10;
+    
+    int option;
+    while ((option = getopt_long(argc, argv, "c:d:n:kr:u:xj:", long_options, NULL)) != -1) {
+        switch (option) {
+            case 'c':
+                bench->connections = atoi(optarg);
+                break;
+            case 'd':
+                bench->duration = atof(optarg);
+                break;
+            case 'n':
+                bench->total_requests = atoll(optarg);
+                bench->duration = 0;
+                break;
+            case 'k':
+                bench->keep_alive = 1;
+                break;
+            case 'r':
+                bench->rate = atof(optarg);
+                break;
+            case 'u':
+                if (bench_load_urls(bench, optarg) != 0) return 1;
+                break;
+            case 'x':
+                bench->discard = 1;
+                break;
+            case 'j':
+                bench->json_path = optarg;
+                break;
+            default:
+                print_bench_usage(program);
+                return 1;
+        }
+    }
+    for (int i = optind; i < argc; i++) {
+        if (bench_add_url(bench, argv[i], 1) != 0) return 1;
+    }
+    if (bench->url_count == 0 || bench->connections < 1 || bench->rate < 0 ||
+        (bench->duration <= 0 && bench->total_requests <= 0)) {
+        print_bench_usage(program);
+        return 1;
+    }
+    
+    if (resolve_host(bench->urls[0].url.host, bench->urls[0].url.port, &bench->addr) != 0) {
+        return 1;
+    }
+    if (!bench->discard) {
+        for (int i = 0; i < bench->url_count; i++) {
+            char *filename = get_filename(bench->urls[i].url.path);
+            bench->urls[i].output_fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+            if (bench->urls[i].output_fd < 0) {
+                perror("Erro ao criar arquivo");
+                return 1;
+            }
+            free(filename);
+        }
+    }
+    
+    bench->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    bench->conns = calloc(bench->connections, sizeof(bench_conn_t));
+    if (bench->epoll_fd < 0 || bench->conns == NULL) {
+        perror("Erro ao preparar conexões");
+        return 1;
+    }
+    bench->random_state = 0x9e3779b97f4a7c15ULL ^ (uint64_t)monotonic_us();
+    
+    printf("Testando %s:%d com %d URL(s), %d conexões", bench->urls[0].url.host, bench->urls[0].url.port,
+           bench->url_count, bench->connections);
+    if (bench->total_requests > 0) printf(", %lld requisições", bench->total_requests);
+    else printf(", %.1f s", bench->duration);
+    if (bench->rate > 0) printf(", %.1f req/s", bench->rate);
+    printf("\n");
+    fflush(stdout);
+    
+    long long start = monotonic_us();
+    long long end = bench->duration > 0 ? start + (long long)(bench->duration * 1e6) : 0;
+    for (int i = 0; i < bench->connections; i++) {
+        bench->conns[i].fd = -1;
+    }
+    if (bench->rate > 0) {
+        bench->interval_us = (long long)(1e6 / bench->rate);
+        if (bench->interval_us < 1) bench->interval_us = 1;
+        bench->next_intended_us = start;
+    } else {
+        for (int i = 0; i < bench->connections && bench_can_issue(bench); i++) {
+            bench_start_request(bench, &bench->conns[i], 0);
+        }
+    }
+    
+    struct epoll_event events[BENCH_MAX_EVENTS];
+    int result = 0;
+    while (1) {
+        long long now = monotonic_us();
+        if (end != 0 && now >= end) break;
+        if (bench->failed_in_a_row > bench->connections + 100) {
+            fprintf(stderr, "Erro: servidor não aceita conexões, teste interrompido\n");
+            result = 1;
+            break;
+        }
+        if (bench->total_requests > 0 && !bench_can_issue(bench)) {
+            int busy = 0;
+            for (int i = 0; i < bench->connections; i++) busy |= bench->conns[i].busy;
+            if (!busy) break;
+        }
+        
+        long long wait_us = end != 0 ? end - now : 1000000;
+        if (bench->rate > 0 && bench_can_issue(bench)) {
+            long long until_next = bench_dispatch_scheduled(bench, now);
+            if (until_next < wait_us) wait_us = until_next;
+        } else if (bench->rate == 0) {
+            /* Conexões perdidas por erro voltam ao trabalho; se a conexão
+             * falhar de novo, tenta outra vez em 10 ms */
+            for (int i = 0; i < bench->connections && bench_can_issue(bench); i++) {
+                if (!bench->conns[i].busy) bench_start_request(bench, &bench->conns[i], 0);
+                if (!bench->conns[i].busy && wait_us > 10000) wait_us = 10000;
+            }
+        }
+        
+        /* epoll_pwait2 espera com resolução de microssegundos; com epoll_wait
+         * o arredondamento para milissegundos atrasaria os envios do --rate */
+        if (wait_us < 0) wait_us = 0;
+        struct timespec timeout = { wait_us / 1000000, (wait_us % 1000000) * 1000 };
+        int n = epoll_pwait2(bench->epoll_fd, events, BENCH_MAX_EVENTS, &timeout, NULL);
+        if (n < 0 && errno == ENOSYS) {
+            n = epoll_wait(bench->epoll_fd, events, BENCH_MAX_EVENTS, (int)((wait_us + 999) / 1000));
+        }
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("Erro no epoll_wait");
+            break;
+        }
+        for (int i = 0; i < n; i++) {
+            bench_conn_t *conn = events[i].data.ptr;
+            if (conn->connecting) {
+                bench_on_connected(bench, conn);
+            } else {
+                bench_on_readable(bench, conn);
+            }
+        }
+    }
+    
+    double elapsed = (monotonic_us() - start) / 1e6;
+    bench_report(bench, elapsed);
+    if (bench->json_path != NULL && bench_report_json(bench, elapsed, bench->json_path) != 0) {
+        result = 1;
+    }
+    for (int i = 0; i < bench->connections; i++) {
+        bench_disconnect(bench, &bench->conns[i]);
+    }
+    for (int i = 0; i < bench->url_count; i++) {
+        if (bench->urls[i].output_fd >= 0) close(bench->urls[i].output_fd);
+    }
+    close(bench->epoll_fd);
+    free(bench->conns);
+    free(bench);
+    return result;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc >= 2 && strcmp(argv[1], "bench") == 0) {
+        return run_bench(argc - 1, argv + 1, argv[0]);
+    }
+    
+    static const struct option long_options[] = {
+        {"input", required_argument, NULL, 'i'},
+        {"per-host", required_argument, NULL, 'p'},
+        {"pipeline", required_argument, NULL, 'P'},
+        {"segments", required_argument, NULL, 's'},
+        {"mirror", no_argument, NULL, 'm'},
+        {"cache", optional_argument, NULL, 'c'},
+        {NULL, 0, NULL, 0}
+    };
+    
+    const char *list_path = NULL;
+    int per_host = 6;
+    int pipeline = 2;
+    int segments = 1;
+    int mirror = 0;
+    int cache = 0;
+    const char *cache_dir = NULL;
+    int option;
+    while ((option = getopt_long(argc, argv, "i:p:P:s:mc::", long_options, NULL)) != -1) {
+        switch (option) {
+            case 'i':
+                list_path = optarg;
+                break;
+            case 'p':
+                per_host = atoi(optarg);
+                break;
+            case 'P':
+                pipeline = atoi(optarg);
+                break;
+            case 's':
+                segments = atoi(optarg);
+                break;
+            case 'm':
+                mirror = 1;
+                break;
+            case 'c':
+                cache = 1;
+                cache_dir = optarg;
+                break;
+            default:
+                per_host = 0;
+                break;
+        }
+    }
+    
+    int url_count = argc - optind;
+    if ((url_count < 1 && list_path == NULL) || per_host < 1 || pipeline < 1 || pipeline > DOWNLOAD_MAX_PIPELINE ||
+        segments < 1 || segments > SEGMENT_MAX || ((segments > 1 || mirror) && (url_count != 1 || list_path != NULL))) {
+        fprintf(stderr, "Uso: %s [opções] <URL> [URL...]\n", argv[0]);
+        fprintf(stderr, "     %s bench [opções] <URL> [URL...]\n", argv[0]);
+        fprintf(stderr, "Opções:\n");
+        fprintf(stderr, "  -i, --input ARQ      lê as URLs de ARQ, uma por linha (- para a entrada padrão)\n");
+        fprintf(stderr, "  -p, --per-host N     conexões simultâneas por host (padrão 6)\n");
+        fprintf(stderr, "  -P, --pipeline N     requisições encadeadas por conexão, de 1 a %d (padrão 2)\n", DOWNLOAD_MAX_PIPELINE);
+        fprintf(stderr, "  -s, --segments K     baixa uma única URL em K trechos paralelos (até %d)\n", SEGMENT_MAX);
+        fprintf(stderr, "  -m, --mirror         espelha o site a partir da URL, seguindo os links\n");
+        fprintf(stderr, "  -c, --cache[=DIR]    reutiliza respostas guardadas em DIR (padrão ~/.cache/meunavegador)\n");
+        fprintf(stderr, "Exemplo: %s http://www.ufsj.edu.br/teste/imagem.jpg\n", argv[0]);
+        return 1;
+    }
+    
+    /* O cache vale para os downloads simples e os de várias URLs; o
+     * espelhamento e os trechos paralelos já retomam pelo que há no disco */
+    if (cache && !mirror && segments == 1 && cache_open(cache_dir) != 0) {
+        return 1;
+    }
+    
+    /* Várias URLs são baixadas em paralelo, reaproveitando as conexões */
+    if (url_count > 1 || list_path != NULL) {
+        return download_urls(argv + optind, url_count, list_path, per_host, pipeline) == 0 ? 0 : 1;
+    }
+    
+    const char *url = argv[optind];
+    
+    if (mirror) {
+        return mirror_site(url, per_host, pipeline) == 0 ? 0 : 1;
+    }
+    if (segments > 1) {
+        return download_segmented(url, segments) == 0 ? 0 : 1;
+    }
     
-    if (meu_navegador(url) != 0) {
+    int result = meu_navegador(url);
+    cache_report();
+    if (result != 0) {
         fprintf(stderr, "Erro ao baixar o arquivo\n");
         return 1;
     }
@@ -0,0 +1,668 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <dirent.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <sys/stat.h>
+#include <zlib.h>
+#include "bundle.h"
+
+#define BUFFER_SIZE 4096
+#define MAX_PATH_LENGTH 2048
+#define COPY_CHUNK (64 * 1024)
+#define BUCKET_KEYS 4                /* chaves por balde, em média */
+#define MAX_DISPLACEMENT (1u << 24)  /* tentativas por balde antes de trocar a semente */
+#define MAX_SEEDS 16
+
+/* Caminho já gravado no bundle, com a entrada que irá para a tabela */
+typedef struct {
+    char *path;
+    const char *mime_type;
+    bundle_entry_t entry;
+} packed_t;
+
+typedef struct {
+    int fd;
+    uint64_t end;                /* fim do que já foi gravado */
+    packed_t *items;
+    size_t count;
+    size_t cap;
+    size_t gzip_count;
+    char root[MAX_PATH_LENGTH];  /* diretório do site, já resolvido */
+} packer_t;
+
+/* Entrada de um diretório, para a listagem */
+typedef struct {
+    char *name;
+    struct stat st;
+} child_t;
+
+typedef struct {
+    char *data;
+    size_t len;
+    size_t cap;
+} buffer_t;
+
+int buffer_append(buffer_t *buf, const char *data, size_t len) {
+    if (buf->len + len > buf->cap) {
+        size_t new_cap = buf->cap ? buf->cap : BUFFER_SIZE;
+        while (new_cap < buf->len + len) {
+            new_cap *= 2;
+        }
+        char *new_data = realloc(buf->data, new_cap);
+        if (new_data == NULL) return -1;
+        buf->data = new_data;
+        buf->cap = new_cap;
+    }
+    memcpy(buf->data + buf->len, data, len);
+    buf->len += len;
+    return 0;
+}
+
+int buffer_printf(buffer_t *buf, const char *fmt, ...) {
+    char line[BUFFER_SIZE];
+    va_list args;
+    va_start(args, fmt);
+    int length = vsnprintf(line, sizeof(line), fmt, args);
+    va_end(args);
+    if (length < 0 || length >= (int)sizeof(line)) return -1;
+    return buffer_append(buf, line, length);
+}
+
+int write_at(int fd, const char *data, size_t len, uint64_t offset) {
+    while (len > 0) {
+        ssize_t written = pwrite(fd, data, len, offset);
+        if (written < 0 && errno == EINTR) continue;
+        if (written <= 0) return -1;
+        data += written;
+        len -= written;
+        offset += written;
+    }
+    return 0;
+}
+
+/* Próximo corpo começa numa página nova */
+uint64_t packer_next_blob(packer_t *p) {
+    return (p->end + BUNDLE_ALIGN - 1) & ~(uint64_t)(BUNDLE_ALIGN - 1);
+}
+
+/* Copia length bytes de in (a partir de in_offset) para o bundle em
+ * offset; copy_file_range evita passar os dados pelo espaço do usuário */
+int copy_range(int in, uint64_t in_offset, int out, uint64_t offset, uint64_t length) {
+    loff_t from = in_offset, to = offset;
+    while (length > 0) {
+        ssize_t copied = copy_file_range(in, &from, out, &to, length > (1 << 30) ? (1 << 30) : length, 0);
+        if (copied < 0 && errno == EINTR) continue;
+        if (copied < 0 && (errno == EXDEV || errno == ENOSYS || errno == EINVAL || errno == EOPNOTSUPP)) break;
+        if (copied <= 0) return -1;
+        length -= copied;
+    }
+    
+    char buffer[COPY_CHUNK];
+    while (length > 0) {
+        ssize_t got = pread(in, buffer, length < sizeof(buffer) ? length : sizeof(buffer), from);
+        if (got < 0 && errno == EINTR) continue;
+        if (got <= 0 || write_at(out, buffer, got, to) != 0) return -1;
+        from += got;
+        to += got;
+        length -= got;
+    }
+    return 0;
+}
+
+/* Comprime length bytes de in para o bundle em offset, no formato gzip.
+ * Devolve o tamanho comprimido ou -1. */
+long long gzip_range(int in, uint64_t in_offset, uint64_t length, int out, uint64_t offset) {
+    z_stream stream;
+    memset(&stream, 0, sizeof(stream));
+    if (deflateInit2(&stream, Z_BEST_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        return -1;
+    }
+    
+    char input[COPY_CHUNK], output[COPY_CHUNK];
+    long long total = 0;
+    int result = Z_OK;
+    while (result != Z_STREAM_END) {
+        int flush = Z_NO_FLUSH;
+        if (stream.avail_in == 0) {
+            ssize_t got = 0;
+            if (length > 0) {
+                got = pread(in, input, length < sizeof(input) ? length : sizeof(input), in_offset);
+                if (got < 0 && errno == EINTR) continue;
+                if (got <= 0) break;
+                in_offset += got;
+                length -= got;
+            }
+            stream.next_in = (Bytef *)input;
+            stream.avail_in = got;
+        }
+        if (length == 0) flush = Z_FINISH;
+        
+        stream.next_out = (Bytef *)output;
+        stream.avail_out = sizeof(output);
+        result = deflate(&stream, flush);
+        if (result == Z_STREAM_ERROR) break;
+        size_t produced = sizeof(output) - stream.avail_out;
+        if (write_at(out, output, produced, offset + total) != 0) break;
+        total += produced;
+    }
+    deflateEnd(&stream);
+    return result == Z_STREAM_END ? total : -1;
+}
+
+/* Mesmo formato de ETag do servidor: tamanho e mtime em nanossegundos */
+void format_etag(char *buffer, size_t size, const struct stat *st, const char *suffix) {
+    snprintf(buffer, size, "\"%llx-%llx%s\"",
+             (unsigned long long)st->st_size,
+             (unsigned long long)st->st_mtim.tv_sec * 1000000000ULL + st->st_mtim.tv_nsec, suffix);
+}
+
+packed_t *packer_add(packer_t *p, const char *path, const char *mime_type) {
+    if (p->count == p->cap) {
+        size_t new_cap = p->cap ? p->cap * 2 : 256;
+        packed_t *items = realloc(p->items, new_cap * sizeof(packed_t));
+        if (items == NULL) return NULL;
+        p->items = items;
+        p->cap = new_cap;
+    }
+    packed_t *item = &p->items[p->count];
+    memset(item, 0, sizeof(*item));
+    item->path = strdup(path);
+    if (item->path == NULL) return NULL;
+    item->mime_type = mime_type;
+    p->count++;
+    return item;
+}
+
+/* Grava a versão gzip do corpo que acabou de ser gravado: o arquivo .gz ao
+ * lado do original, se houver, ou o corpo comprimido agora, se ficar
+ * menor. fs_path é NULL para as listagens. */
+int pack_gzip(packer_t *p, bundle_entry_t *entry, const char *fs_path) {
+    char sidecar[MAX_PATH_LENGTH];
+    struct stat sidecar_stat;
+    uint64_t offset = packer_next_blob(p);
+    
+    if (fs_path != NULL && snprintf(sidecar, sizeof(sidecar), "%s.gz", fs_path) < (int)sizeof(sidecar) &&
+        stat(sidecar, &sidecar_stat) == 0 && S_ISREG(sidecar_stat.st_mode)) {
+        int fd = open(sidecar, O_RDONLY | O_CLOEXEC);
+        if (fd < 0 || copy_range(fd, 0, p->fd, offset, sidecar_stat.st_size) != 0) {
+            perror(sidecar);
+            if (fd >= 0) close(fd);
+            return -1;
+        }
+        close(fd);
+        entry->gzip_length = sidecar_stat.st_size;
+        format_etag(entry->gzip_etag, sizeof(entry->gzip_etag), &sidecar_stat, "-gz");
+    } else {
+        if (entry->length < GZIP_MIN_SIZE) return 0;
+        long long compressed = gzip_range(p->fd, entry->offset, entry->length, p->fd, offset);
+        if (compressed < 0) {
+            fprintf(stderr, "Erro ao comprimir '%s'\n", fs_path != NULL ? fs_path : "listagem");
+            return -1;
+        }
+        if ((uint64_t)compressed >= entry->length) return 0;
+        entry->gzip_length = compressed;
+        size_t len = strlen(entry->etag);
+        snprintf(entry->gzip_etag, sizeof(entry->gzip_etag), "%.*s-gzip\"", (int)len - 1, entry->etag);
+    }
+    entry->gzip_offset = offset;
+    p->end = offset + entry->gzip_length;
+    p->gzip_count++;
+    return 0;
+}
+
+int pack_file(packer_t *p, const char *fs_path, const char *key, const struct stat *st) {
+    int fd = open(fs_path, O_RDONLY | O_CLOEXEC);
+    uint64_t offset = packer_next_blob(p);
+    if (fd < 0 || copy_range(fd, 0, p->fd, offset, st->st_size) != 0) {
+        perror(fs_path);
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+    close(fd);
+    p->end = offset + st->st_size;
+    
+    const char *mime_type = get_mime_type(key);
+    packed_t *item = packer_add(p, key, mime_type);
+    if (item == NULL) {
+        perror("Erro ao alocar a tabela");
+        return -1;
+    }
+    bundle_entry_t *entry = &item->entry;
+    entry->offset = offset;
+    entry->length = st->st_size;
+    entry->mtime = st->st_mtim.tv_sec;
+    format_etag(entry->etag, sizeof(entry->etag), st, "");
+    if (is_compressible(mime_type)) {
+        entry->flags |= BUNDLE_VARY;
+        return pack_gzip(p, entry, fs_path);
+    }
+    return 0;
+}
+
+void format_size(off_t file_size, char *buffer, size_t size) {
+    if (file_size < 1024) {
+        snprintf(buffer, size, "%ld bytes", file_size);
+    } else if (file_size < 1024 * 1024) {
+        snprintf(buffer, size, "%.1f KB", file_size / 1024.0);
+    } else {
+        snprintf(buffer, size, "%.1f MB", file_size / (1024.0 * 1024.0));
+    }
+}
+
+/* A mesma página que o servidor monta para um diretório sem index.html */
+int render_listing(buffer_t *out, const char *key, const child_t *children, size_t count) {
+    const char *request_path = key + 1;
+    const char *link_prefix = strcmp(key, "/") == 0 ? "" : key;
+    buffer_printf(out,
+        "<html><head><title>Listagem do Diretório</title></head>\n"
+        "<body><h1>Listagem do Diretório: %s</h1>\n"
+        "<table border='1' style='border-collapse: collapse;'>\n"
+        "<tr><th>Nome</th><th>Tipo</th><th>Tamanho</th><th>Modificado</th></tr>\n",
+        request_path);
+    
+    char time_str[64];
+    for (size_t i = 0; i < count; i++) {
+        const child_t *child = &children[i];
+        struct tm tm;
+        localtime_r(&child->st.st_mtime, &tm);
+        strftime(time_str, sizeof(time_str), "%Y-%m-%d %H:%M:%S", &tm);
+        
+        if (S_ISDIR(child->st.st_mode)) {
+            buffer_printf(out,
+                "<tr><td><a href='%s/%s/'>%s/</a></td><td>DIR</td><td>-</td><td>%s</td></tr>\n",
+                link_prefix, child->name, child->name, time_str);
+        } else {
+            char size_str[30];
+            format_size(child->st.st_size, size_str, sizeof(size_str));
+            buffer_printf(out,
+                "<tr><td><a href='%s/%s'>%s</a></td><td>FILE</td><td>%s</td><td>%s</td></tr>\n",
+                link_prefix, child->name, child->name, size_str, time_str);
+        }
+    }
+    return buffer_printf(out, "</table>\n</body></html>\n");
+}
+
+int pack_listing(packer_t *p, const char *key, const child_t *children, size_t count, const struct stat *dir_stat) {
+    buffer_t page = { 0 };
+    uint64_t offset = packer_next_blob(p);
+    if (render_listing(&page, key, children, count) != 0 || write_at(p->fd, page.data, page.len, offset) != 0) {
+        perror("Erro ao gravar a listagem");
+        free(page.data);
+        return -1;
+    }
+    p->end = offset + page.len;
+    
+    packed_t *item = packer_add(p, key, "text/html; charset=utf-8");
+    if (item == NULL) {
+        perror("Erro ao alocar a tabela");
+        free(page.data);
+        return -1;
+    }
+    bundle_entry_t *entry = &item->entry;
+    entry->offset = offset;
+    entry->length = page.len;
+    entry->mtime = dir_stat->st_mtim.tv_sec;
+    entry->flags = BUNDLE_DIRECTORY | BUNDLE_VARY;
+    /* Sem arquivo por trás: o ETag usa o tamanho da página e o mtime do
+     * diretório */
+    struct stat page_stat = *dir_stat;
+    page_stat.st_size = page.len;
+    format_etag(entry->etag, sizeof(entry->etag), &page_stat, "");
+    free(page.data);
+    return pack_gzip(p, entry, NULL);
+}
+
+/* Mesma regra do servidor no modo diretório: um link simbólico só entra se
+ * o destino resolvido ficar dentro do diretório do site */
+int link_inside_root(const packer_t *p, const char *path) {
+    char resolved[MAX_PATH_LENGTH];
+    if (realpath(path, resolved) == NULL) return 0;
+    size_t root_len = strlen(p->root);
+    if (strncmp(resolved, p->root, root_len) != 0) return 0;
+    return resolved[root_len] == '\0' || resolved[root_len] == '/' || p->root[root_len - 1] == '/';
+}
+
+int compare_children(const void *a, const void *b) {
+    return strcmp(((const child_t *)a)->name, ((const child_t *)b)->name);
+}
+
+/* Grava os arquivos e subdiretórios e, por último, o próprio diretório:
+ * o corpo do index.html, se houver, ou a listagem */
+int pack_directory(packer_t *p, const char *fs_path, const char *key, const struct stat *dir_stat) {
+    DIR *dir = opendir(fs_path);
+    if (dir == NULL) {
+        perror(fs_path);
+        return -1;
+    }
+    
+    child_t *children = NULL;
+    size_t count = 0, cap = 0;
+    int result = 0;
+    struct dirent *dirent;
+    while ((dirent = readdir(dir)) != NULL) {
+        if (strcmp(dirent->d_name, ".") == 0 || strcmp(dirent->d_name, "..") == 0) continue;
+        
+        struct stat st;
+        if (fstatat(dirfd(dir), dirent->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0) continue;
+        if (S_ISLNK(st.st_mode)) {
+            char link_path[MAX_PATH_LENGTH];
+            if (snprintf(link_path, sizeof(link_path), "%s/%s", fs_path, dirent->d_name) >= (int)sizeof(link_path)) {
+                continue;
+            }
+            if (!link_inside_root(p, link_path)) {
+                fprintf(stderr, "Aviso: link simbólico quebrado ou para fora do site ignorado: %s\n", link_path);
+                continue;
+            }
+            if (fstatat(dirfd(dir), dirent->d_name, &st, 0) != 0) continue;
+        }
+        if (count == cap) {
+            cap = cap ? cap * 2 : 64;
+            child_t *new_children = realloc(children, cap * sizeof(child_t));
+            if (new_children == NULL) {
+                result = -1;
+                break;
+            }
+            children = new_children;
+        }
+        children[count].name = strdup(dirent->d_name);
+        children[count].st = st;
+        if (children[count].name == NULL) {
+            result = -1;
+            break;
+        }
+        count++;
+    }
+    closedir(dir);
+    if (result != 0) {
+        perror("Erro ao ler o diretório");
+        goto out;
+    }
+    qsort(children, count, sizeof(child_t), compare_children);
+    
+    ssize_t index_item = -1;
+    for (size_t i = 0; i < count && result == 0; i++) {
+        char child_path[MAX_PATH_LENGTH];
+        char child_key[MAX_PATH_LENGTH];
+        const child_t *child = &children[i];
+        if (snprintf(child_path, sizeof(child_path), "%s/%s", fs_path, child->name) >= (int)sizeof(child_path) ||
+            snprintf(child_key, sizeof(child_key), "%s/%s", strcmp(key, "/") == 0 ? "" : key,
+                     child->name) >= (int)sizeof(child_key)) {
+            fprintf(stderr, "Aviso: caminho muito longo ignorado: %s/%s\n", fs_path, child->name);
+            continue;
+        }
+        
+        /* Diretórios vindos de links simbólicos ficam de fora, para não
+         * entrar em ciclos */
+        struct stat link_stat;
+        if (S_ISDIR(child->st.st_mode)) {
+            if (lstat(child_path, &link_stat) == 0 && S_ISDIR(link_stat.st_mode)) {
+                result = pack_directory(p, child_path, child_key, &child->st);
+            }
+        } else if (S_ISREG(child->st.st_mode)) {
+            result = pack_file(p, child_path, child_key, &child->st);
+            if (strcmp(child->name, "index.html") == 0) {
+                index_item = p->count - 1;
+            }
+        }
+    }
+    
+    if (result == 0) {
+        if (index_item >= 0) {
+            bundle_entry_t entry = p->items[index_item].entry;
+            entry.flags |= BUNDLE_DIRECTORY;
+            packed_t *item = packer_add(p, key, p->items[index_item].mime_type);
+            if (item == NULL) {
+                perror("Erro ao alocar a tabela");
+                result = -1;
+            } else {
+                item->entry = entry;
+            }
+        } else {
+            result = pack_listing(p, key, children, count, dir_stat);
+        }
+    }
+
+out:
+    for (size_t i = 0; i < count; i++) {
+        free(children[i].name);
+    }
+    free(children);
+    return result;
+}
+
+/* Hash perfeito por deslocamento: os baldes são resolvidos do maior para o
+ * menor, e cada um recebe o primeiro deslocamento que leva todas as suas
+ * chaves a posições ainda livres. slot_items recebe o item de cada
+ * posição (-1 se vazia). Devolve -1 se algum balde não couber com esta
+ * semente. */
+int build_perfect_hash(const packer_t *p, uint64_t seed, uint32_t buckets, uint32_t slots,
+                       uint32_t *displacements, int32_t *slot_items) {
+    uint32_t *bucket_of = malloc(p->count * sizeof(uint32_t));
+    uint32_t *starts = calloc(buckets + 1, sizeof(uint32_t));
+    uint32_t *keys = malloc(p->count * sizeof(uint32_t));
+    uint32_t *order = malloc(buckets * sizeof(uint32_t));
+    int result = -1;
+    if (bucket_of == NULL || starts == NULL || keys == NULL || order == NULL) {
+        goto out;
+    }
+    
+    /* Chaves agrupadas por balde (ordenação por contagem) */
+    for (size_t i = 0; i < p->count; i++) {
+        bucket_of[i] = bundle_hash(p->items[i].path, strlen(p->items[i].path), seed) % buckets;
+        starts[bucket_of[i] + 1]++;
+    }
+    for (uint32_t b = 0; b < buckets; b++) {
+        starts[b + 1] += starts[b];
+    }
+    uint32_t *fill = malloc(buckets * sizeof(uint32_t));
+    if (fill == NULL) goto out;
+    memcpy(fill, starts, buckets * sizeof(uint32_t));
+    for (size_t i = 0; i < p->count; i++) {
+        keys[fill[bucket_of[i]]++] = i;
+    }
+    free(fill);
+    
+    /* Baldes do maior para o menor, também por contagem */
+    uint32_t max_size = 0;
+    for (uint32_t b = 0; b < buckets; b++) {
+        uint32_t size = starts[b + 1] - starts[b];
+        if (size > max_size) max_size = size;
+    }
+    uint32_t position = 0;
+    for (uint32_t size = max_size; size > 0; size--) {
+        for (uint32_t b = 0; b < buckets; b++) {
+            if (starts[b + 1] - starts[b] == size) order[position++] = b;
+        }
+    }
+    
+    for (uint32_t s = 0; s < slots; s++) {
+        slot_items[s] = -1;
+    }
+    memset(displacements, 0, buckets * sizeof(uint32_t));
+    uint32_t tried[64];
+    for (uint32_t i = 0; i < position; i++) {
+        uint32_t b = order[i];
+        uint32_t size = starts[b + 1] - starts[b];
+        if (size > sizeof(tried) / sizeof(tried[0])) goto out;
+        
+        uint32_t d;
+        for (d = 0; d < MAX_DISPLACEMENT; d++) {
+            uint32_t k;
+            for (k = 0; k < size; k++) {
+                const char *path = p->items[keys[starts[b] + k]].path;
+                tried[k] = bundle_slot(path, strlen(path), d, slots);
+                if (slot_items[tried[k]] >= 0) break;
+                uint32_t j;
+                for (j = 0; j < k && tried[j] != tried[k]; j++);
+                if (j < k) break;
+            }
+            if (k == size) break;
+        }
+        if (d == MAX_DISPLACEMENT) goto out;
+        
+        displacements[b] = d;
+        for (uint32_t k = 0; k < size; k++) {
+            slot_items[tried[k]] = keys[starts[b] + k];
+        }
+    }
+    result = 0;
+
+out:
+    free(bucket_of);
+    free(starts);
+    free(keys);
+    free(order);
+    return result;
+}
+
+/* Depois dos corpos: deslocamentos, tabela de entradas, cadeias e, no
+ * início do arquivo, o cabeçalho */
+int write_index(packer_t *p) {
+    bundle_header_t header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, BUNDLE_MAGIC, sizeof(header.magic));
+    header.version = BUNDLE_VERSION;
+    header.count = p->count;
+    header.slots = p->count + p->count / 8 + 1;
+    header.buckets = p->count / BUCKET_KEYS + 1;
+    
+    uint32_t *displacements = malloc(header.buckets * sizeof(uint32_t));
+    int32_t *slot_items = malloc(header.slots * sizeof(int32_t));
+    bundle_entry_t *entries = calloc(header.slots, sizeof(bundle_entry_t));
+    buffer_t strings = { 0 };
+    int result = -1;
+    if (displacements == NULL || slot_items == NULL || entries == NULL) {
+        perror("Erro ao alocar o índice");
+        goto out;
+    }
+    
+    for (header.seed = 1; header.seed <= MAX_SEEDS; header.seed++) {
+        if (build_perfect_hash(p, header.seed, header.buckets, header.slots, displacements, slot_items) == 0) break;
+    }
+    if (header.seed > MAX_SEEDS) {
+        fprintf(stderr, "Erro: não foi possível montar o hash perfeito\n");
+        goto out;
+    }
+    
+    /* Tipos MIME guardados uma vez só */
+    const char *mime_types[64];
+    uint32_t mime_offsets[64];
+    size_t mime_count = 0;
+    for (uint32_t s = 0; s < header.slots; s++) {
+        if (slot_items[s] < 0) continue;
+        const packed_t *item = &p->items[slot_items[s]];
+        entries[s] = item->entry;
+        entries[s].path = strings.len;
+        entries[s].path_len = strlen(item->path);
+        if (buffer_append(&strings, item->path, entries[s].path_len + 1) != 0) goto out;
+        
+        size_t m;
+        for (m = 0; m < mime_count && strcmp(mime_types[m], item->mime_type) != 0; m++);
+        if (m == mime_count) {
+            if (mime_count == sizeof(mime_types) / sizeof(mime_types[0])) goto out;
+            mime_types[m] = item->mime_type;
+            mime_offsets[m] = strings.len;
+            mime_count++;
+            if (buffer_append(&strings, item->mime_type, strlen(item->mime_type) + 1) != 0) goto out;
+        }
+        entries[s].mime_type = mime_offsets[m];
+        if (strings.len > UINT32_MAX) {
+            fprintf(stderr, "Erro: caminhos demais para um bundle\n");
+            goto out;
+        }
+    }
+    
+    header.displacements_offset = (p->end + 7) & ~(uint64_t)7;
+    header.entries_offset = (header.displacements_offset + header.buckets * sizeof(uint32_t) + 7) & ~(uint64_t)7;
+    header.strings_offset = header.entries_offset + header.slots * sizeof(bundle_entry_t);
+    header.strings_size = strings.len;
+    header.size = header.strings_offset + header.strings_size;
+    
+    if (write_at(p->fd, (const char *)displacements, header.buckets * sizeof(uint32_t), header.displacements_offset) != 0 ||
+        write_at(p->fd, (const char *)entries, header.slots * sizeof(bundle_entry_t), header.entries_offset) != 0 ||
+        write_at(p->fd, strings.data, strings.len, header.strings_offset) != 0 ||
+        write_at(p->fd, (const char *)&header, sizeof(header), 0) != 0 ||
+        ftruncate(p->fd, header.size) != 0) {
+        perror("Erro ao gravar o índice");
+        goto out;
+    }
+    p->end = header.size;
+    result = 0;
+
+out:
+    free(displacements);
+    free(slot_items);
+    free(entries);
+    free(strings.data);
+    return result;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc != 3) {
+        fprintf(stderr, "Uso: %s <diretório> <bundle>\n", argv[0]);
+        fprintf(stderr, "Exemplo: %s /home/flavio/meusite site.bundle\n", argv[0]);
+        fprintf(stderr, "Grava o site inteiro num arquivo para o servidor --bundle\n");
+        return 1;
+    }
+    const char *directory = argv[1];
+    const char *output = argv[2];
+    
+    struct stat dir_stat;
+    if (stat(directory, &dir_stat) != 0 || !S_ISDIR(dir_stat.st_mode)) {
+        fprintf(stderr, "Erro: Diretório '%s' não existe ou não é acessível\n", directory);
+        return 1;
+    }
+    char root[MAX_PATH_LENGTH];
+    if (realpath(directory, root) == NULL) {
+        perror("Erro ao resolver o diretório");
+        return 1;
+    }
+    
+    /* Gravado ao lado e renomeado no fim: um servidor que abra o bundle
+     * nunca vê um arquivo pela metade */
+    char temp[MAX_PATH_LENGTH];
+    if (snprintf(temp, sizeof(temp), "%s.tmp", output) >= (int)sizeof(temp)) {
+        fprintf(stderr, "Erro: caminho muito longo: %s\n", output);
+        return 1;
+    }
+    packer_t packer;
+    memset(&packer, 0, sizeof(packer));
+    packer.fd = open(temp, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (packer.fd < 0) {
+        perror("Erro ao criar o bundle");
+        return 1;
+    }
+    packer.end = sizeof(bundle_header_t);
+    memcpy(packer.root, root, sizeof(packer.root));
+    
+    int result = pack_directory(&packer, directory, "/", &dir_stat);
+    if (result == 0) result = write_index(&packer);
+    if (result == 0 && fsync(packer.fd) != 0) {
+        perror("Erro ao gravar o bundle");
+        result = -1;
+    }
+    close(packer.fd);
+    if (result == 0 && rename(temp, output) != 0) {
+        perror("Erro ao renomear o bundle");
+        result = -1;
+    }
+    if (result != 0) {
+        unlink(temp);
+        return 1;
+    }
+    
+    printf("Bundle '%s' gravado: %zu caminhos, %zu com versão gzip, %llu bytes\n",
+           output, packer.count, packer.gzip_count, (unsigned long long)packer.end);
+    for (size_t i = 0; i < packer.count; i++) {
+        free(packer.items[i].path);
+    }
+    free(packer.items);
+    return 0;
+}
@@ -1,351 +1,6206 @@
+#define _GNU_SOURCE
 #include <stdio.h>
+#include <ctype.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <sys/stat.h>
 #include <dirent.h>
 #include <time.h>
 #include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <getopt.h>
+#include <sys/epoll.h>
+#include <sys/sendfile.h>
+#include <sys/inotify.h>
+#include <sys/uio.h>
+#include <zlib.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <linux/io_uring.h>
+#include <linux/openat2.h>
+#include <pthread.h>
+#include <sched.h>
+#include <poll.h>
+#include <stddef.h>
+#include <sys/resource.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+#include "bundle.h"
 
-#define PORT 5050
 #define BUFFER_SIZE 4096
 #define MAX_PATH_LENGTH 2048
+#define MAX_EVENTS 256
+#define CACHE_BUCKETS 4096
+#define MAX_RANGES 16
+#define RANGE_BOUNDARY "SERVIDOR_BYTERANGES"
+#define GETDENTS_BUFFER_SIZE (64 * 1024)
+#define LISTING_DEFAULT_LIMIT 1000
+#define MAX_HEADERS 64
+#define STATS_PATH "/__stats"
+#define LOG_RING_SIZE 4096
+#define LOG_TARGET_SIZE 256
+#define FDS_PER_CONNECTION 4
+#define FDS_RESERVED 64
 
-void url_decode(char *str) {
-    char *src = str, *dst = str;
-    while (*src) {
-        if (src[0] == '%' && src[1] && src[2]) {
-            int hex_val;
-            sscanf(src + 1, "%2x", &hex_val);
-            *dst++ = hex_val;
-            src += 3;
-        } else if (src[0] == '+') {
-            *dst++ = ' ';
+/* Codificações aceitas pelo cliente (máscara de bits) */
+#define ENCODING_GZIP 1
+#define ENCODING_BR 2
+
+/* Arquivo pequeno mantido em memória com o cabeçalho já montado (sem a
+ * linha Connection, que depende da requisição). */
+struct file_cache;
+
+typedef struct cache_entry {
+    struct file_cache *owner;
+    char *key;
+    char *header;
+    size_t header_len;
+    char *data;
+    size_t size;
+    time_t mtime;
+    char etag[80];
+    const char *mime_type;
+    const char *encoding;
+    int vary;
+    void *extra;             /* dados auxiliares (índice de listagens) */
+    size_t extra_size;
+    size_t charge;
+    int dir_wd;
+    int refs;
+    int in_cache;
+    struct cache_entry *hash_next;
+    struct cache_entry *lru_prev;
+    struct cache_entry *lru_next;
+} cache_entry_t;
+
+/* Trecho do arquivo enviado depois dos primeiros data_end bytes de data */
+typedef struct {
+    size_t data_end;
+    off_t offset;
+    off_t length;
+} body_part_t;
+
+/* Resposta montada em memória: cabeçalhos (e corpos gerados, como listagens
+ * e páginas de erro) em data, intercalados com trechos do arquivo em parts.
+ * Os trechos vêm de file_fd, enviados com sendfile sem passar pelo espaço
+ * do usuário, ou de body (entrada do cache ou bundle mapeado). Um corpo
+ * inteiro é um único trecho; respostas multipart/byteranges têm um por
+ * intervalo. */
+typedef struct {
+    char *data;
+    size_t len;
+    size_t cap;
+    size_t sent;
+    int file_fd;
+    int file_shared;         /* file_fd é do bundle e não é fechado aqui */
+    cache_entry_t *entry;
+    const char *body;        /* base dos trechos em memória; NULL para file_fd */
+    body_part_t parts[MAX_RANGES];
+    int part_count;
+    int part_index;
+    off_t part_sent;
+    int pipe_fds[2];
+    size_t pipe_pending;
+    int keep_alive;
+    long long started_us;    /* requisição pronta para ser atendida */
+    long long first_byte_us; /* primeiro byte da resposta enviado */
+    long long finished_us;   /* último byte enviado */
+    uint64_t bytes_sent;
+} response_t;
+
+/* Metadados do arquivo usados para validadores e intervalos */
+typedef struct {
+    off_t size;
+    time_t mtime;
+    char etag[80];
+    const char *mime_type;
+    const char *encoding;    /* Content-Encoding, NULL se identidade */
+    int vary;                /* resposta depende de Accept-Encoding */
+} file_meta_t;
+
+typedef struct {
+    int keepalive_timeout;       /* segundos ociosos antes de fechar; 0 desativa keep-alive */
+    int header_timeout;          /* segundos para receber o cabeçalho da requisição; 0 sem limite */
+    int send_timeout;            /* segundos sem progresso no envio da resposta; 0 sem limite */
+    int max_connections;         /* conexões abertas ao mesmo tempo, somando os workers */
+    int max_connections_per_ip;  /* conexões abertas por endereço de cliente; 0 sem limite */
+    int max_keepalive_requests;  /* requisições atendidas por conexão */
+    size_t cache_size;           /* memória máxima do cache de arquivos; 0 desativa */
+    size_t cache_max_file_size;  /* maior arquivo guardado no cache */
+    size_t gzip_cache_size;      /* memória do cache de objetos comprimidos; 0 desativa gzip dinâmico */
+    size_t gzip_max_file_size;   /* maior arquivo comprimido sob demanda */
+    size_t listing_cache_size;   /* memória do cache de listagens; 0 desativa */
+    const char *access_log;      /* arquivo do log de acesso ("-" para a saída padrão); NULL desativa */
+    int log_json;                /* registros em JSON por linha em vez do Common Log Format */
+    size_t log_max_size;         /* tamanho que provoca a rotação do log; 0 não rotaciona */
+    size_t send_quantum;         /* bytes por conexão a cada vez no rodízio de envio (epoll) */
+    size_t conn_bandwidth;       /* bytes/s por conexão; 0 sem limite */
+    size_t total_bandwidth;      /* bytes/s somando todas as conexões; 0 sem limite */
+    const char *bind_address;    /* IPv4 ou IPv6 literal; "::" escuta nos dois */
+    int ipv6_only;               /* com endereço IPv6, não aceita clientes IPv4 */
+    int port;
+    int backlog;                 /* fila de conexões completas à espera do accept */
+    int accept_batch;            /* accepts seguidos antes de voltar aos outros eventos (epoll) */
+    int defer_accept;            /* TCP_DEFER_ACCEPT: segundos esperando a requisição; 0 desativa */
+    int fastopen;                /* TCP_FASTOPEN: fila de conexões com dados no SYN; 0 desativa */
+    int tcp_nodelay;             /* desativa o algoritmo de Nagle */
+    int sndbuf;                  /* SO_SNDBUF/SO_RCVBUF das conexões; 0 deixa o kernel ajustar */
+    int rcvbuf;
+    size_t request_buffer_size;  /* buffer de leitura por conexão, que limita o tamanho da requisição */
+} server_config_t;
+
+server_config_t config = {
+    .keepalive_timeout = 5,
+    .header_timeout = 10,
+    .send_timeout = 30,
+    .max_connections = 10000,
+    .max_keepalive_requests = 100,
+    .cache_size = 32 * 1024 * 1024,
+    .cache_max_file_size = 1024 * 1024,
+    .gzip_cache_size = 16 * 1024 * 1024,
+    .gzip_max_file_size = 8 * 1024 * 1024,
+    .listing_cache_size = 64 * 1024 * 1024,
+    .log_max_size = 64 * 1024 * 1024,
+    .send_quantum = 64 * 1024,
+    .bind_address = "::",
+    .port = 5050,
+    .backlog = 4096,
+    .accept_batch = 64,
+    .request_buffer_size = BUFFER_SIZE,
+};
+
+/* Caches com contadores de acertos nas estatísticas */
+enum {
+    STATS_CACHE_FILES,
+    STATS_CACHE_GZIP,
+    STATS_CACHE_LISTINGS,
+    STATS_CACHES
+};
+
+const char *stats_cache_names[STATS_CACHES] = { "arquivos", "comprimidos", "listagens" };
+
+/* Cache compartilhado por todos os workers: tabela hash pela chave, lista
+ * LRU e limite de memória. O cache de arquivos usa como chave o caminho da
+ * requisição e é invalidado por inotify nos diretórios dos arquivos
+ * guardados; o cache de objetos comprimidos usa o caminho completo e é
+ * invalidado quando o ETag (tamanho e mtime) do original muda. */
+typedef struct file_cache {
+    pthread_mutex_t lock;
+    cache_entry_t *buckets[CACHE_BUCKETS];
+    cache_entry_t *lru_head;
+    cache_entry_t *lru_tail;
+    size_t used;
+    unsigned long generation;
+    size_t capacity;
+    int inotify_fd;
+    int enabled;
+    int stats_id;
+} file_cache_t;
+
+file_cache_t cache = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .inotify_fd = -1,
+    .stats_id = STATS_CACHE_FILES,
+};
+
+file_cache_t gzip_cache = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .inotify_fd = -1,
+    .stats_id = STATS_CACHE_GZIP,
+};
+
+/* Índices e páginas de listagens de diretório, pelo caminho completo,
+ * válidos enquanto o mtime do diretório não mudar */
+file_cache_t listing_cache = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .inotify_fd = -1,
+    .stats_id = STATS_CACHE_LISTINGS,
+};
+
+/* Diretório base, aberto uma vez em main: os caminhos pedidos são
+ * resolvidos a partir dele, sem realpath a cada requisição */
+int base_dir_fd = -1;
+char resolved_base[MAX_PATH_LENGTH];
+int openat2_available = 1;
+
+/* Trecho de um buffer, sem terminador */
+typedef struct {
+    const char *data;
+    size_t len;
+} str_view_t;
+
+typedef struct {
+    str_view_t name;
+    str_view_t value;
+} http_header_t;
+
+typedef enum {
+    PARSE_REQUEST_LINE,
+    PARSE_HEADERS,
+    PARSE_DONE
+} parse_state_t;
+
+/* Requisição analisada sobre o buffer da conexão, que não é copiado nem
+ * alterado: os campos apontam para ele. A análise é retomada de onde parou
+ * quando chegam mais bytes. */
+typedef struct {
+    parse_state_t state;
+    size_t line_start;       /* início da linha ainda incompleta */
+    size_t scanned;          /* até onde ela já foi examinada */
+    str_view_t method;
+    str_view_t target;
+    str_view_t version;
+    http_header_t headers[MAX_HEADERS];
+    int header_count;
+    size_t length;           /* tamanho total, quando completa */
+    int error;               /* status HTTP de erro, quando malformada */
+} http_request_t;
+
+typedef enum {
+    CONN_READING_REQUEST,
+    CONN_SENDING_HEADERS,
+    CONN_SENDING_BODY,
+    CONN_HTTP2                   /* a sessão HTTP/2 em h2 cuida da conexão */
+} conn_state_t;
+
+/* Roda de temporizadores hierárquica: WHEEL_LEVELS níveis de WHEEL_SLOTS
+ * posições; o primeiro avança um tick (WHEEL_TICK_MS) por posição e cada
+ * nível seguinte cobre uma volta inteira do anterior por posição (~19 dias
+ * no total). Armar e cancelar são O(1): o temporizador fica embutido na
+ * conexão, numa lista duplamente encadeada da posição. Quando um nível
+ * completa uma volta, a próxima posição do nível de cima é redistribuída
+ * nos de baixo. */
+#define WHEEL_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_LEVELS 4
+#define WHEEL_TICK_MS 100
+
+typedef struct wheel_timer {
+    long long expires;               /* tick em que vence */
+    struct wheel_timer *next;
+    struct wheel_timer **pprev;      /* NULL quando desarmado */
+} wheel_timer_t;
+
+typedef struct {
+    long long now;                   /* último tick processado */
+    int count;
+    wheel_timer_t *slots[WHEEL_LEVELS][WHEEL_SLOTS];
+} timer_wheel_t;
+
+/* Prazo que está correndo para a conexão */
+typedef enum {
+    DEADLINE_NONE,
+    DEADLINE_IDLE,               /* esperando a próxima requisição (keep-alive) */
+    DEADLINE_HEADER,             /* recebendo o cabeçalho; não é renovado a cada pedaço */
+    DEADLINE_SEND                /* enviando a resposta; renovado a cada progresso */
+} deadline_t;
+
+/* Balde de fichas de um limite de banda: enche à taxa configurada até
+ * uma rajada de 100 ms (ou um quantum) e cada byte enviado gasta uma
+ * ficha */
+typedef struct {
+    int64_t tokens;
+    long long updated_us;
+} rate_bucket_t;
+
+typedef struct connection {
+    int fd;
+    struct sockaddr_in6 peer;
+    conn_state_t state;
+    int events;
+    size_t request_len;
+    http_request_t parser;
+    size_t current_len;
+    int requests_served;
+    int read_closed;         /* o cliente encerrou o envio (recv devolveu 0) */
+    deadline_t deadline;
+    wheel_timer_t timer;
+    response_t res;
+    struct h2_session *h2;
+    /* espera por fichas dos limites de banda (ver output_park) */
+    struct connection *throttled_prev;
+    struct connection *throttled_next;
+    int throttled;
+    rate_bucket_t rate;
+    /* usados só pelo backend io_uring */
+    struct msghdr msg;
+    struct iovec iov[2];
+    int inflight;            /* operações submetidas e ainda não completadas */
+    int closing;
+    int failed;
+    size_t splice_len;       /* pedido ao splice de entrada em andamento */
+    char request[];          /* config.request_buffer_size bytes */
+} connection_t;
+
+typedef struct {
+    int epoll_fd;
+    int server_sock;
+    const char *base_directory;
+    timer_wheel_t timers;
+    connection_t *throttled_head;    /* conexões esperando os limites de banda */
+    connection_t *throttled_tail;
+} event_loop_t;
+
+/* Histograma de latências em microssegundos no estilo HDR: valores até 31
+ * são exatos e cada potência de 2 acima disso se divide em 16 faixas, com
+ * erro relativo de no máximo 1/16. */
+#define HIST_SUB_BUCKETS 16
+#define HIST_MAX_EXPONENT 40
+#define HIST_BUCKETS (2 * HIST_SUB_BUCKETS + (HIST_MAX_EXPONENT - 4) * HIST_SUB_BUCKETS)
+
+typedef struct {
+    uint64_t counts[HIST_BUCKETS];
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+} histogram_t;
+
+/* Contadores de uma thread. Só a própria thread escreve neles, sem
+ * travas; quem lê (o /__stats) soma os de todas as threads. */
+typedef struct thread_stats {
+    uint64_t responses[600];     /* por status HTTP */
+    uint64_t bytes_sent;
+    uint64_t connections_accepted;
+    int64_t connections_active;
+    uint64_t connections_rejected;   /* recusadas pelos limites de conexões */
+    uint64_t connections_timed_out;  /* fechadas por prazo de cabeçalho ou de envio */
+    uint64_t cache_hits[STATS_CACHES];
+    uint64_t cache_misses[STATS_CACHES];
+    histogram_t ttfb;
+    histogram_t total;
+    struct thread_stats *next;
+} thread_stats_t;
+
+#define STAT_ADD(field, n) __atomic_store_n(&(field), (field) + (n), __ATOMIC_RELAXED)
+#define STAT_SET(field, value) __atomic_store_n(&(field), (value), __ATOMIC_RELAXED)
+#define STAT_GET(field) __atomic_load_n(&(field), __ATOMIC_RELAXED)
+
+__thread thread_stats_t local_stats;
+__thread int local_stats_registered;
+thread_stats_t *stats_threads = NULL;
+pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+
+thread_stats_t *stats_local(void) {
+    if (!local_stats_registered) {
+        pthread_mutex_lock(&stats_lock);
+        local_stats.next = stats_threads;
+        stats_threads = &local_stats;
+        pthread_mutex_unlock(&stats_lock);
+        local_stats_registered = 1;
+    }
+    return &local_stats;
+}
+
+long long monotonic_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+int histogram_index(uint64_t value) {
+    if (value < 2 * HIST_SUB_BUCKETS) return (int)value;
+    int exponent = 63 - __builtin_clzll(value);
+    if (exponent > HIST_MAX_EXPONENT) return HIST_BUCKETS - 1;
+    int sub = (value >> (exponent - 4)) & (HIST_SUB_BUCKETS - 1);
+    return 2 * HIST_SUB_BUCKETS + (exponent - 5) * HIST_SUB_BUCKETS + sub;
+}
+
+/* Maior valor que cai na faixa index */
+uint64_t histogram_upper(int index) {
+    if (index < 2 * HIST_SUB_BUCKETS) return index;
+    int exponent = (index - 2 * HIST_SUB_BUCKETS) / HIST_SUB_BUCKETS + 5;
+    int sub = (index - 2 * HIST_SUB_BUCKETS) % HIST_SUB_BUCKETS;
+    return ((uint64_t)(HIST_SUB_BUCKETS + sub + 1) << (exponent - 4)) - 1;
+}
+
+void histogram_record(histogram_t *h, uint64_t value) {
+    STAT_ADD(h->counts[histogram_index(value)], 1);
+    STAT_ADD(h->count, 1);
+    STAT_ADD(h->sum, value);
+    if (value > h->max) STAT_SET(h->max, value);
+}
+
+void histogram_merge(histogram_t *out, histogram_t *h) {
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        out->counts[i] += STAT_GET(h->counts[i]);
+    }
+    out->count += STAT_GET(h->count);
+    out->sum += STAT_GET(h->sum);
+    uint64_t max = STAT_GET(h->max);
+    if (max > out->max) out->max = max;
+}
+
+uint64_t histogram_percentile(const histogram_t *h, double percentile) {
+    uint64_t target = (uint64_t)(percentile / 100.0 * h->count + 0.5);
+    if (target == 0) target = 1;
+    uint64_t seen = 0;
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        seen += h->counts[i];
+        if (seen >= target) {
+            uint64_t upper = histogram_upper(i);
+            return upper < h->max ? upper : h->max;
+        }
+    }
+    return h->max;
+}
+
+void stats_merge(thread_stats_t *out) {
+    memset(out, 0, sizeof(*out));
+    pthread_mutex_lock(&stats_lock);
+    for (thread_stats_t *t = stats_threads; t != NULL; t = t->next) {
+        for (int i = 0; i < 600; i++) {
+            out->responses[i] += STAT_GET(t->responses[i]);
+        }
+        out->bytes_sent += STAT_GET(t->bytes_sent);
+        out->connections_accepted += STAT_GET(t->connections_accepted);
+        out->connections_active += STAT_GET(t->connections_active);
+        out->connections_rejected += STAT_GET(t->connections_rejected);
+        out->connections_timed_out += STAT_GET(t->connections_timed_out);
+        for (int i = 0; i < STATS_CACHES; i++) {
+            out->cache_hits[i] += STAT_GET(t->cache_hits[i]);
+            out->cache_misses[i] += STAT_GET(t->cache_misses[i]);
+        }
+        histogram_merge(&out->ttfb, &t->ttfb);
+        histogram_merge(&out->total, &t->total);
+    }
+    pthread_mutex_unlock(&stats_lock);
+}
+
+void stats_connection_opened(void) {
+    thread_stats_t *stats = stats_local();
+    STAT_ADD(stats->connections_accepted, 1);
+    STAT_ADD(stats->connections_active, 1);
+}
+
+void stats_connection_closed(void) {
+    thread_stats_t *stats = stats_local();
+    STAT_ADD(stats->connections_active, -1);
+}
+
+void stats_connection_timed_out(void) {
+    thread_stats_t *stats = stats_local();
+    STAT_ADD(stats->connections_timed_out, 1);
+}
+
+/* Limites de conexões abertas, no total e por endereço. A contagem por
+ * endereço fica numa tabela hash compartilhada pelos workers; a entrada
+ * some quando a última conexão do endereço fecha. */
+#define IP_LIMIT_BUCKETS 4096
+
+typedef struct ip_count {
+    struct in6_addr addr;
+    int count;
+    struct ip_count *next;
+} ip_count_t;
+
+int connections_open = 0;
+pthread_mutex_t ip_counts_lock = PTHREAD_MUTEX_INITIALIZER;
+ip_count_t *ip_counts[IP_LIMIT_BUCKETS];
+
+ip_count_t **ip_count_find(const struct in6_addr *addr) {
+    uint32_t words[4];
+    memcpy(words, addr, sizeof(words));
+    uint32_t hash = (words[0] ^ words[1] ^ words[2] ^ ntohl(words[3])) * 2654435761u;
+    ip_count_t **link = &ip_counts[hash % IP_LIMIT_BUCKETS];
+    while (*link != NULL && memcmp(&(*link)->addr, addr, sizeof(*addr)) != 0) {
+        link = &(*link)->next;
+    }
+    return link;
+}
+
+/* Endereços IPv4 (de um socket IPv4 ou de um IPv6 que escuta nos dois)
+ * ficam no formato mapeado ::ffff:a.b.c.d, para limites e log tratarem
+ * todos os clientes do mesmo jeito */
+void peer_normalize(struct sockaddr_in6 *peer) {
+    if (peer->sin6_family != AF_INET) return;
+    
+    struct sockaddr_in v4;
+    memcpy(&v4, peer, sizeof(v4));
+    memset(peer, 0, sizeof(*peer));
+    peer->sin6_family = AF_INET6;
+    peer->sin6_port = v4.sin_port;
+    peer->sin6_addr.s6_addr[10] = 0xff;
+    peer->sin6_addr.s6_addr[11] = 0xff;
+    memcpy(&peer->sin6_addr.s6_addr[12], &v4.sin_addr, 4);
+}
+
+/* Reserva a vaga da conexão; 0 se algum limite já foi atingido */
+int connection_admit(const struct sockaddr_in6 *peer) {
+    if (__atomic_add_fetch(&connections_open, 1, __ATOMIC_RELAXED) > config.max_connections) {
+        __atomic_sub_fetch(&connections_open, 1, __ATOMIC_RELAXED);
+        STAT_ADD(stats_local()->connections_rejected, 1);
+        return 0;
+    }
+    if (config.max_connections_per_ip == 0) {
+        return 1;
+    }
+    
+    int admitted = 1;
+    pthread_mutex_lock(&ip_counts_lock);
+    ip_count_t **link = ip_count_find(&peer->sin6_addr);
+    if (*link == NULL) {
+        *link = calloc(1, sizeof(ip_count_t));
+        if (*link != NULL) {
+            (*link)->addr = peer->sin6_addr;
+        }
+    }
+    if (*link == NULL || (*link)->count >= config.max_connections_per_ip) {
+        admitted = 0;
+    } else {
+        (*link)->count++;
+    }
+    pthread_mutex_unlock(&ip_counts_lock);
+    
+    if (!admitted) {
+        __atomic_sub_fetch(&connections_open, 1, __ATOMIC_RELAXED);
+        STAT_ADD(stats_local()->connections_rejected, 1);
+    }
+    return admitted;
+}
+
+void connection_release(const struct sockaddr_in6 *peer) {
+    __atomic_sub_fetch(&connections_open, 1, __ATOMIC_RELAXED);
+    if (config.max_connections_per_ip == 0) {
+        return;
+    }
+    pthread_mutex_lock(&ip_counts_lock);
+    ip_count_t **link = ip_count_find(&peer->sin6_addr);
+    if (*link != NULL && --(*link)->count == 0) {
+        ip_count_t *entry = *link;
+        *link = entry->next;
+        free(entry);
+    }
+    pthread_mutex_unlock(&ip_counts_lock);
+}
+
+/* Conexão acima dos limites: um 503 sem esperar o socket e o fechamento */
+void connection_reject(int client_sock) {
+    static const char response[] =
+        "HTTP/1.1 503 Service Unavailable\r\n"
+        "Content-Length: 0\r\n"
+        "Retry-After: 1\r\n"
+        "Connection: close\r\n"
+        "\r\n";
+    send(client_sock, response, sizeof(response) - 1, MSG_DONTWAIT | MSG_NOSIGNAL);
+    close(client_sock);
+}
+
+void stats_cache_lookup(int cache_id, int hit) {
+    thread_stats_t *stats = stats_local();
+    if (hit) {
+        STAT_ADD(stats->cache_hits[cache_id], 1);
+    } else {
+        STAT_ADD(stats->cache_misses[cache_id], 1);
+    }
+}
+
+/* Registro do log de acesso, de tamanho fixo para caber no anel */
+typedef struct {
+    unsigned long sequence;      /* controle do anel (ver access_log_record_body) */
+    struct timespec time;
+    struct in6_addr client;
+    int status;
+    char version[9];             /* "HTTP/1.1", "HTTP/2.0"; vazio sem linha de requisição válida */
+    char method[16];
+    char target[LOG_TARGET_SIZE];
+    uint64_t bytes;              /* enviados ao todo, com cabeçalhos e enquadramento */
+    uint64_t body_bytes;         /* só do corpo */
+    uint64_t duration_us;
+} log_record_t;
+
+/* Anel limitado com vários produtores (as threads que atendem) e um
+ * consumidor (a thread de escrita). Cada posição tem um número de
+ * sequência que diz se está livre para a volta atual do produtor ou
+ * pronta para o consumidor; reservar uma posição é um único CAS. */
+typedef struct {
+    log_record_t *records;
+    unsigned long enqueue_pos __attribute__((aligned(64)));
+    uint64_t dropped __attribute__((aligned(64)));
+    uint64_t written;
+    unsigned long dequeue_pos;
+    int fd;
+    off_t size;
+    int enabled;
+} access_log_t;
+
+access_log_t access_log = { .fd = -1 };
+
+void response_init(response_t *res) {
+    memset(res, 0, sizeof(*res));
+    res->file_fd = -1;
+    res->pipe_fds[0] = -1;
+    res->pipe_fds[1] = -1;
+}
+
+void cache_release(cache_entry_t *entry);
+
+void response_free(response_t *res) {
+    int keep_alive = res->keep_alive;
+    if (res->entry != NULL) {
+        cache_release(res->entry);
+    }
+    free(res->data);
+    if (res->file_fd >= 0 && !res->file_shared) {
+        close(res->file_fd);
+    }
+    if (res->pipe_fds[0] >= 0) {
+        close(res->pipe_fds[0]);
+        close(res->pipe_fds[1]);
+    }
+    response_init(res);
+    res->keep_alive = keep_alive;
+}
+
+/* Garante espaço para mais len bytes depois de res->len */
+int response_reserve(response_t *res, size_t len) {
+    if (res->len + len > res->cap) {
+        size_t new_cap = res->cap ? res->cap : BUFFER_SIZE;
+        while (new_cap < res->len + len) {
+            new_cap *= 2;
+        }
+        char *new_data = realloc(res->data, new_cap);
+        if (new_data == NULL) {
+            return -1;
+        }
+        res->data = new_data;
+        res->cap = new_cap;
+    }
+    return 0;
+}
+
+int response_append(response_t *res, const char *data, size_t len) {
+    if (response_reserve(res, len) < 0) {
+        return -1;
+    }
+    memcpy(res->data + res->len, data, len);
+    res->len += len;
+    return 0;
+}
+
+int response_printf(response_t *res, const char *fmt, ...) {
+    char buffer[BUFFER_SIZE];
+    va_list args;
+    va_start(args, fmt);
+    int length = vsnprintf(buffer, sizeof(buffer), fmt, args);
+    va_end(args);
+    if (length < 0 || length >= (int)sizeof(buffer)) {
+        return -1;
+    }
+    return response_append(res, buffer, length);
+}
+
+/* Conta bytes enviados e marca o primeiro byte da resposta */
+void response_sent(response_t *res, size_t bytes) {
+    if (res->first_byte_us == 0) {
+        res->first_byte_us = monotonic_us();
+    }
+    res->bytes_sent += bytes;
+    thread_stats_t *stats = stats_local();
+    STAT_ADD(stats->bytes_sent, bytes);
+}
+
+int response_status(const response_t *res) {
+    return res->len > 12 ? atoi(res->data + 9) : 0;
+}
+
+/* Registra a resposta terminada: status (lido da linha de status) e tempos
+ * até o primeiro byte e total desde que a requisição ficou pronta. */
+void response_done(response_t *res) {
+    if (res->started_us == 0 || res->finished_us != 0) return;
+    thread_stats_t *stats = stats_local();
+    
+    int status = response_status(res);
+    if (status >= 100 && status < 600) {
+        STAT_ADD(stats->responses[status], 1);
+    }
+    
+    long long now = monotonic_us();
+    long long first_byte = res->first_byte_us != 0 ? res->first_byte_us : now;
+    histogram_record(&stats->ttfb, first_byte - res->started_us);
+    histogram_record(&stats->total, now - res->started_us);
+    res->finished_us = now;
+}
+
+/* Alternativa ao sendfile: arquivo → pipe → socket com splice, ainda sem
+ * cópia para o espaço do usuário. */
+ssize_t splice_file(int sock, response_t *res, off_t offset, off_t length) {
+    if (res->pipe_fds[0] < 0 && pipe2(res->pipe_fds, O_NONBLOCK) < 0) {
+        return -1;
+    }
+    
+    if (res->pipe_pending == 0) {
+        loff_t file_offset = offset;
+        ssize_t filled = splice(res->file_fd, &file_offset, res->pipe_fds[1], NULL,
+                                length, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (filled <= 0) {
+            if (filled == 0) errno = EIO;
+            return -1;
+        }
+        res->pipe_pending = filled;
+    }
+    
+    ssize_t sent = splice(res->pipe_fds[0], NULL, sock, NULL, res->pipe_pending,
+                          SPLICE_F_MOVE | SPLICE_F_NONBLOCK | SPLICE_F_MORE);
+    if (sent > 0) {
+        res->pipe_pending -= sent;
+    }
+    return sent;
+}
+
+/* Gasta bytes do orçamento da vez (NULL é sem limite) */
+void budget_spend(size_t *budget, size_t bytes) {
+    if (budget != NULL) {
+        *budget -= bytes < *budget ? bytes : *budget;
+    }
+}
+
+/* Envia o que for possível da resposta, até *budget bytes (sem limite se
+ * budget for NULL). Retorna 1 quando terminou, 0 se o socket (não
+ * bloqueante) não aceita mais dados agora, 2 se o orçamento acabou antes
+ * e -1 em erro. */
+int response_write(int sock, response_t *res, size_t *budget) {
+    int use_splice = 0;
+    
+    while (1) {
+        body_part_t *part = res->part_index < res->part_count ? &res->parts[res->part_index] : NULL;
+        size_t data_end = part != NULL ? part->data_end : res->len;
+        off_t part_left = part != NULL ? part->length - res->part_sent : 0;
+        size_t room = budget != NULL ? *budget : SIZE_MAX;
+        if (room == 0 && (part != NULL || res->sent < data_end)) {
+            return 2;
+        }
+        
+        /* Memória e trechos do cache saem juntos numa só chamada; MSG_MORE
+         * segura o que foi enviado para sair no mesmo segmento que o que vem
+         * em seguida (por exemplo o início do corpo enviado por sendfile) */
+        if (res->sent < data_end || (res->body != NULL && part_left > 0)) {
+            struct iovec iov[2];
+            int iov_count = 0;
+            if (res->sent < data_end) {
+                iov[iov_count].iov_base = res->data + res->sent;
+                iov[iov_count].iov_len = data_end - res->sent;
+                iov_count++;
+            }
+            if (res->body != NULL && part_left > 0) {
+                iov[iov_count].iov_base = (char *)res->body + part->offset + res->part_sent;
+                iov[iov_count].iov_len = part_left;
+                iov_count++;
+            }
+            for (int i = 0; i < iov_count; i++) {
+                if (iov[i].iov_len > room) iov[i].iov_len = room;
+                room -= iov[i].iov_len;
+            }
+            
+            int more = part != NULL &&
+                       (res->body == NULL || res->part_index + 1 < res->part_count || data_end < res->len);
+            struct msghdr msg;
+            memset(&msg, 0, sizeof(msg));
+            msg.msg_iov = iov;
+            msg.msg_iovlen = iov_count;
+            ssize_t sent = sendmsg(sock, &msg, MSG_NOSIGNAL | (more ? MSG_MORE : 0));
+            if (sent < 0) {
+                if (errno == EINTR) continue;
+                if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+                return -1;
+            }
+            
+            response_sent(res, sent);
+            budget_spend(budget, sent);
+            size_t data_part = data_end - res->sent;
+            if ((size_t)sent <= data_part) {
+                res->sent += sent;
+            } else {
+                res->sent = data_end;
+                res->part_sent += sent - data_part;
+            }
+            continue;
+        }
+        
+        if (part == NULL) {
+            break;
+        }
+        
+        if (part_left > 0) {
+            off_t offset = part->offset + res->part_sent;
+            ssize_t sent;
+            if ((size_t)part_left > room) part_left = room;
+            if (!use_splice) {
+                size_t count = part_left > 0x7ffff000 ? 0x7ffff000 : (size_t)part_left;
+                sent = sendfile(sock, res->file_fd, &offset, count);
+                if (sent < 0 && (errno == EINVAL || errno == ENOSYS)) {
+                    use_splice = 1;
+                    continue;
+                }
+            } else {
+                sent = splice_file(sock, res, offset, part_left);
+            }
+            
+            if (sent < 0) {
+                if (errno == EINTR) continue;
+                if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+                return -1;
+            }
+            if (sent == 0) {
+                /* Arquivo encolheu durante o envio */
+                return -1;
+            }
+            response_sent(res, sent);
+            budget_spend(budget, sent);
+            res->part_sent += sent;
+            continue;
+        }
+        
+        res->part_index++;
+        res->part_sent = 0;
+    }
+    
+    if (res->file_fd >= 0 && !res->file_shared) {
+        close(res->file_fd);
+    }
+    res->file_fd = -1;
+    response_done(res);
+    return 1;
+}
+
+/* Copia para buf os próximos bytes da resposta, na mesma ordem em que
+ * response_write os enviaria, lendo os trechos de arquivo com pread. Usado
+ * quando o corpo precisa ser enquadrado (HTTP/2) em vez de ir direto para o
+ * socket. Retorna quantos bytes copiou (0 no fim) ou -1 em erro. */
+ssize_t response_read(response_t *res, char *buf, size_t size) {
+    size_t copied = 0;
+    while (copied < size) {
+        body_part_t *part = res->part_index < res->part_count ? &res->parts[res->part_index] : NULL;
+        size_t data_end = part != NULL ? part->data_end : res->len;
+        if (res->sent < data_end) {
+            size_t n = data_end - res->sent < size - copied ? data_end - res->sent : size - copied;
+            memcpy(buf + copied, res->data + res->sent, n);
+            res->sent += n;
+            copied += n;
+            continue;
+        }
+        if (part == NULL) {
+            break;
+        }
+        
+        off_t part_left = part->length - res->part_sent;
+        if (part_left > 0) {
+            size_t n = (size_t)part_left < size - copied ? (size_t)part_left : size - copied;
+            if (res->body != NULL) {
+                memcpy(buf + copied, res->body + part->offset + res->part_sent, n);
+            } else {
+                ssize_t got = pread(res->file_fd, buf + copied, n, part->offset + res->part_sent);
+                if (got < 0 && errno == EINTR) continue;
+                if (got <= 0) return -1;
+                n = got;
+            }
+            res->part_sent += n;
+            copied += n;
+            continue;
+        }
+        
+        res->part_index++;
+        res->part_sent = 0;
+    }
+    return copied;
+}
+
+/* Adiciona um trecho do corpo depois do que já está em data */
+void response_add_part(response_t *res, off_t offset, off_t length) {
+    if (res->part_count < MAX_RANGES && length > 0) {
+        body_part_t *part = &res->parts[res->part_count++];
+        part->data_end = res->len;
+        part->offset = offset;
+        part->length = length;
+    }
+}
+
+/* Primeira posição em [p, end) com o byte a ou b (ou end), comparando 16
+ * ou 32 bytes por vez. A versão AVX2 é escolhida em parser_init. */
+typedef const char *(*scan_fn_t)(const char *p, const char *end, char a, char b);
+
+const char *scan_bytes_scalar(const char *p, const char *end, char a, char b) {
+    while (p < end && *p != a && *p != b) p++;
+    return p;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sse2")))
+const char *scan_bytes_sse2(const char *p, const char *end, char a, char b) {
+    const __m128i va = _mm_set1_epi8(a);
+    const __m128i vb = _mm_set1_epi8(b);
+    while (end - p >= 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i *)p);
+        int mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(chunk, va), _mm_cmpeq_epi8(chunk, vb)));
+        if (mask != 0) return p + __builtin_ctz(mask);
+        p += 16;
+    }
+    return scan_bytes_scalar(p, end, a, b);
+}
+
+__attribute__((target("avx2")))
+const char *scan_bytes_avx2(const char *p, const char *end, char a, char b) {
+    const __m256i va = _mm256_set1_epi8(a);
+    const __m256i vb = _mm256_set1_epi8(b);
+    while (end - p >= 32) {
+        __m256i chunk = _mm256_loadu_si256((const __m256i *)p);
+        unsigned mask = _mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(chunk, va),
+                                                             _mm256_cmpeq_epi8(chunk, vb)));
+        if (mask != 0) return p + __builtin_ctz(mask);
+        p += 32;
+    }
+    return scan_bytes_sse2(p, end, a, b);
+}
+
+scan_fn_t scan_bytes = scan_bytes_sse2;
+#else
+scan_fn_t scan_bytes = scan_bytes_scalar;
+#endif
+
+void parser_init(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        scan_bytes = scan_bytes_avx2;
+    }
+#endif
+}
+
+/* Valor de cada dígito hexadecimal mais 1; 0 para os demais bytes */
+static const unsigned char hex_table[256] = {
+    ['0'] = 1, ['1'] = 2, ['2'] = 3, ['3'] = 4, ['4'] = 5,
+    ['5'] = 6, ['6'] = 7, ['7'] = 8, ['8'] = 9, ['9'] = 10,
+    ['A'] = 11, ['B'] = 12, ['C'] = 13, ['D'] = 14, ['E'] = 15, ['F'] = 16,
+    ['a'] = 11, ['b'] = 12, ['c'] = 13, ['d'] = 14, ['e'] = 15, ['f'] = 16,
+};
+
+/* Caracteres permitidos em métodos e nomes de cabeçalho (tchar, RFC 9110) */
+int is_token_char(unsigned char c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') ||
+           (c != '\0' && strchr("!#$%&'*+-.^_`|~", c) != NULL);
+}
+
+int view_equals(str_view_t view, const char *str) {
+    size_t len = strlen(str);
+    return view.len == len && memcmp(view.data, str, len) == 0;
+}
+
+void http_parser_reset(http_request_t *req) {
+    req->state = PARSE_REQUEST_LINE;
+    req->method = req->target = req->version = (str_view_t){ "", 0 };
+    req->line_start = 0;
+    req->scanned = 0;
+    req->header_count = 0;
+    req->length = 0;
+    req->error = 0;
+}
+
+int http_parse_error(http_request_t *req, int status) {
+    req->error = status;
+    return -1;
+}
+
+/* "METHOD SP target SP HTTP/1.x" */
+int parse_request_line(http_request_t *req, const char *line, size_t len) {
+    const char *end = line + len;
+    const char *sp = memchr(line, ' ', len);
+    if (sp == NULL || sp == line) return http_parse_error(req, 400);
+    for (const char *c = line; c < sp; c++) {
+        if (!is_token_char(*c)) return http_parse_error(req, 400);
+    }
+    req->method = (str_view_t){ line, sp - line };
+    
+    const char *target = sp + 1;
+    sp = memchr(target, ' ', end - target);
+    if (sp == NULL || sp == target || *target != '/') return http_parse_error(req, 400);
+    if ((size_t)(sp - target) >= MAX_PATH_LENGTH) return http_parse_error(req, 414);
+    req->target = (str_view_t){ target, sp - target };
+    
+    req->version = (str_view_t){ sp + 1, end - sp - 1 };
+    const char *v = req->version.data;
+    if (req->version.len != 8 || memcmp(v, "HTTP/", 5) != 0 ||
+        v[5] < '0' || v[5] > '9' || v[6] != '.' || v[7] < '0' || v[7] > '9') {
+        return http_parse_error(req, 400);
+    }
+    if (v[5] != '1' || (v[7] != '0' && v[7] != '1')) {
+        return http_parse_error(req, 505);
+    }
+    return 0;
+}
+
+/* "name: value", sem continuação de linha (obs-fold) */
+int parse_header_line(http_request_t *req, const char *line, size_t len) {
+    const char *colon = memchr(line, ':', len);
+    if (colon == NULL || colon == line) return http_parse_error(req, 400);
+    for (const char *c = line; c < colon; c++) {
+        if (!is_token_char(*c)) return http_parse_error(req, 400);
+    }
+    if (req->header_count == MAX_HEADERS) return http_parse_error(req, 431);
+    
+    const char *start = colon + 1;
+    const char *end = line + len;
+    while (start < end && (*start == ' ' || *start == '\t')) start++;
+    while (end > start && (end[-1] == ' ' || end[-1] == '\t')) end--;
+    
+    http_header_t *header = &req->headers[req->header_count++];
+    header->name = (str_view_t){ line, colon - line };
+    header->value = (str_view_t){ start, end - start };
+    return 0;
+}
+
+/* Continua a análise da requisição no início de buffer, que agora tem len
+ * bytes. Retorna 1 quando ela está completa (req->length bytes), 0 se
+ * faltam dados e -1 se é inválida (req->error tem o status a responder).
+ * Se o buffer encher sem a requisição completar, o chamador responde com
+ * http_parse_overflow. */
+int http_parse(http_request_t *req, const char *buffer, size_t len) {
+    const char *end = buffer + len;
+    
+    while (req->state != PARSE_DONE) {
+        const char *line = buffer + req->line_start;
+        const char *cr = scan_bytes(buffer + req->scanned, end, '\r', '\n');
+        if (cr == end) {
+            req->scanned = len;
+            return 0;
+        }
+        /* Só CRLF termina linhas; LF ou CR soltos são recusados */
+        if (*cr == '\n') return http_parse_error(req, 400);
+        if (cr + 1 == end) {
+            req->scanned = cr - buffer;
+            return 0;
+        }
+        if (cr[1] != '\n') return http_parse_error(req, 400);
+        
+        size_t line_len = cr - line;
+        req->line_start = req->scanned = cr + 2 - buffer;
+        
+        if (req->state == PARSE_REQUEST_LINE) {
+            if (parse_request_line(req, line, line_len) < 0) return -1;
+            req->state = PARSE_HEADERS;
+        } else if (line_len == 0) {
+            req->state = PARSE_DONE;
+        } else if (*line == ' ' || *line == '\t') {
+            return http_parse_error(req, 400);
+        } else if (parse_header_line(req, line, line_len) < 0) {
+            return -1;
+        }
+    }
+    
+    req->length = req->line_start;
+    return 1;
+}
+
+/* Status para uma requisição que não coube no buffer */
+int http_parse_overflow(const http_request_t *req) {
+    return req->state == PARSE_REQUEST_LINE ? 414 : 431;
+}
+
+const str_view_t *find_header(const http_request_t *req, const char *name) {
+    size_t name_len = strlen(name);
+    for (int i = 0; i < req->header_count; i++) {
+        const http_header_t *header = &req->headers[i];
+        if (header->name.len == name_len && strncasecmp(header->name.data, name, name_len) == 0) {
+            return &header->value;
+        }
+    }
+    return NULL;
+}
+
+/* Copia o valor do cabeçalho name da requisição (sem espaços nas pontas).
+ * Retorna 1 se encontrado. */
+int get_header(const http_request_t *req, const char *name, char *value, size_t value_size) {
+    const str_view_t *view = find_header(req, name);
+    if (view == NULL) return 0;
+    
+    size_t len = view->len;
+    if (len >= value_size) len = value_size - 1;
+    memcpy(value, view->data, len);
+    value[len] = '\0';
+    return 1;
+}
+
+/* Decodifica os escapes %XX (e '+') de src para dst, que tem dst_size
+ * bytes. Retorna o tamanho decodificado ou -1 se houver escape inválido,
+ * byte nulo ou falta de espaço. */
+int url_decode(char *dst, size_t dst_size, const char *src, size_t len) {
+    const char *end = src + len;
+    size_t out = 0;
+    
+    while (src < end) {
+        const char *special = scan_bytes(src, end, '%', '+');
+        size_t run = special - src;
+        if (out + run >= dst_size) return -1;
+        memcpy(dst + out, src, run);
+        out += run;
+        src = special;
+        if (src == end) break;
+        
+        if (out + 1 >= dst_size) return -1;
+        if (*src == '+') {
+            dst[out++] = ' ';
             src++;
-        } else {
-            *dst++ = *src++;
+            continue;
         }
+        if (end - src < 3) return -1;
+        unsigned char high = hex_table[(unsigned char)src[1]];
+        unsigned char low = hex_table[(unsigned char)src[2]];
+        if (high == 0 || low == 0) return -1;
+        char c = (char)(((high - 1) << 4) | (low - 1));
+        if (c == '\0') return -1;
+        dst[out++] = c;
+        src += 3;
+    }
+    
+    dst[out] = '\0';
+    return (int)out;
+}
+
+/* Verifica se um caminho já resolvido fica dentro do diretório base; o
+ * prefixo precisa terminar numa '/' para que /site2 não passe por /site. */
+int is_safe_path(const char *resolved_path) {
+    size_t base_len = strlen(resolved_base);
+    if (strncmp(resolved_path, resolved_base, base_len) != 0) return 0;
+    return base_len == 1 || resolved_path[base_len] == '\0' || resolved_path[base_len] == '/';
+}
+
+/* Abre um caminho relativo ao diretório base numa única resolução: com
+ * RESOLVE_BENEATH o kernel recusa (EXDEV) qualquer "..", link simbólico ou
+ * caminho absoluto que saia da base. Sem openat2 (ENOSYS), resolve com
+ * realpath e confere o prefixo. */
+int open_beneath(const char *path, int flags) {
+    if (*path == '\0') path = ".";
+    
+    if (openat2_available) {
+        struct open_how how;
+        memset(&how, 0, sizeof(how));
+        how.flags = flags | O_CLOEXEC;
+        how.resolve = RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS;
+        int fd = syscall(SYS_openat2, base_dir_fd, path, &how, sizeof(how));
+        if (fd >= 0 || errno != ENOSYS) return fd;
+        openat2_available = 0;
+    }
+    
+    char full_path[MAX_PATH_LENGTH];
+    char resolved[MAX_PATH_LENGTH];
+    if (snprintf(full_path, sizeof(full_path), "%s/%s", resolved_base, path) >= (int)sizeof(full_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    if (realpath(full_path, resolved) == NULL) return -1;
+    if (!is_safe_path(resolved)) {
+        errno = EXDEV;
+        return -1;
+    }
+    return open(resolved, flags | O_CLOEXEC);
+}
+
+const char *connection_value(const response_t *res) {
+    return res->keep_alive ? "keep-alive" : "close";
+}
+
+unsigned long cache_hash(const char *key) {
+    unsigned long hash = 14695981039346656037UL;
+    while (*key) {
+        hash ^= (unsigned char)*key++;
+        hash *= 1099511628211UL;
+    }
+    return hash;
+}
+
+void cache_entry_free(cache_entry_t *entry) {
+    free(entry->key);
+    free(entry->header);
+    free(entry->data);
+    free(entry->extra);
+    free(entry);
+}
+
+void cache_lru_unlink(file_cache_t *c, cache_entry_t *entry) {
+    if (entry->lru_prev != NULL) entry->lru_prev->lru_next = entry->lru_next;
+    else c->lru_head = entry->lru_next;
+    if (entry->lru_next != NULL) entry->lru_next->lru_prev = entry->lru_prev;
+    else c->lru_tail = entry->lru_prev;
+    entry->lru_prev = NULL;
+    entry->lru_next = NULL;
+}
+
+void cache_lru_push_front(file_cache_t *c, cache_entry_t *entry) {
+    entry->lru_next = c->lru_head;
+    if (c->lru_head != NULL) c->lru_head->lru_prev = entry;
+    else c->lru_tail = entry;
+    c->lru_head = entry;
+}
+
+/* Tira a entrada do cache; a memória só é liberada quando nenhuma resposta
+ * em andamento a estiver usando. Chamar com c->lock obtido. */
+void cache_remove_locked(file_cache_t *c, cache_entry_t *entry) {
+    cache_entry_t **link = &c->buckets[cache_hash(entry->key) % CACHE_BUCKETS];
+    while (*link != entry) {
+        link = &(*link)->hash_next;
+    }
+    *link = entry->hash_next;
+    cache_lru_unlink(c, entry);
+    c->used -= entry->charge;
+    entry->in_cache = 0;
+    if (entry->refs == 0) {
+        cache_entry_free(entry);
+    }
+}
+
+void cache_release(cache_entry_t *entry) {
+    file_cache_t *c = entry->owner;
+    pthread_mutex_lock(&c->lock);
+    if (--entry->refs == 0 && !entry->in_cache) {
+        cache_entry_free(entry);
+    }
+    pthread_mutex_unlock(&c->lock);
+}
+
+/* Procura key no cache; com version, só aceita a entrada cujo etag for
+ * igual (uma entrada velha conta como falta e é substituída no insert).
+ * Se encontrada, a entrada volta com uma referência que deve ser
+ * devolvida com cache_release. */
+cache_entry_t *cache_lookup(file_cache_t *c, const char *key, const char *version) {
+    if (!c->enabled) return NULL;
+    
+    pthread_mutex_lock(&c->lock);
+    cache_entry_t *entry = c->buckets[cache_hash(key) % CACHE_BUCKETS];
+    while (entry != NULL && strcmp(entry->key, key) != 0) {
+        entry = entry->hash_next;
+    }
+    if (entry != NULL && version != NULL && strcmp(entry->etag, version) != 0) {
+        entry = NULL;
+    }
+    if (entry != NULL) {
+        entry->refs++;
+        cache_lru_unlink(c, entry);
+        cache_lru_push_front(c, entry);
+    }
+    pthread_mutex_unlock(&c->lock);
+    stats_cache_lookup(c->stats_id, entry != NULL);
+    return entry;
+}
+
+/* Passa a vigiar o diretório do arquivo e devolve o watch descriptor e a
+ * geração atual do cache; se a geração mudar antes de cache_insert, o
+ * conteúdo lido pode estar velho e não é guardado. */
+int cache_watch(const char *path, unsigned long *generation) {
+    char full_path[MAX_PATH_LENGTH];
+    char dir[MAX_PATH_LENGTH];
+    if (snprintf(full_path, sizeof(full_path), "%s/%s", resolved_base, path) >= (int)sizeof(full_path)) {
+        return -1;
+    }
+    if (realpath(full_path, dir) == NULL) return -1;
+    char *slash = strrchr(dir, '/');
+    if (slash == NULL) return -1;
+    if (slash == dir) slash[1] = '\0';
+    else *slash = '\0';
+    
+    pthread_mutex_lock(&cache.lock);
+    *generation = cache.generation;
+    pthread_mutex_unlock(&cache.lock);
+    
+    return inotify_add_watch(cache.inotify_fd, dir,
+                             IN_MODIFY | IN_CLOSE_WRITE | IN_ATTRIB | IN_CREATE | IN_DELETE |
+                             IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF);
+}
+
+/* Guarda uma entrada criada por cache_entry_new, que continua com a
+ * referência de quem a inseriu. Retorna NULL se o cache mudou desde que a
+ * geração foi lida; a entrada então segue válida, só que fora do cache. */
+cache_entry_t *cache_insert(file_cache_t *c, cache_entry_t *entry, unsigned long generation) {
+    entry->owner = c;
+    entry->charge = sizeof(*entry) + strlen(entry->key) + entry->header_len + entry->size + entry->extra_size;
+    
+    pthread_mutex_lock(&c->lock);
+    if (generation != c->generation || entry->charge > c->capacity) {
+        pthread_mutex_unlock(&c->lock);
+        return NULL;
+    }
+    entry->in_cache = 1;
+    
+    cache_entry_t **bucket = &c->buckets[cache_hash(entry->key) % CACHE_BUCKETS];
+    for (cache_entry_t *old = *bucket; old != NULL; old = old->hash_next) {
+        if (strcmp(old->key, entry->key) == 0) {
+            cache_remove_locked(c, old);
+            break;
+        }
+    }
+    
+    while (c->lru_tail != NULL && c->used + entry->charge > c->capacity) {
+        cache_remove_locked(c, c->lru_tail);
+    }
+    
+    entry->hash_next = *bucket;
+    *bucket = entry;
+    cache_lru_push_front(c, entry);
+    c->used += entry->charge;
+    pthread_mutex_unlock(&c->lock);
+    return entry;
+}
+
+/* Invalida as entradas cujos arquivos estão no diretório que mudou */
+void cache_invalidate_dir(int wd) {
+    pthread_mutex_lock(&cache.lock);
+    cache.generation++;
+    cache_entry_t *entry = cache.lru_head;
+    while (entry != NULL) {
+        cache_entry_t *next = entry->lru_next;
+        if (entry->dir_wd == wd) {
+            cache_remove_locked(&cache, entry);
+        }
+        entry = next;
+    }
+    pthread_mutex_unlock(&cache.lock);
+}
+
+void *cache_inotify_main(void *arg) {
+    (void)arg;
+    char events[BUFFER_SIZE] __attribute__((aligned(__alignof__(struct inotify_event))));
+    
+    while (1) {
+        ssize_t len = read(cache.inotify_fd, events, sizeof(events));
+        if (len < 0) {
+            if (errno == EINTR) continue;
+            perror("Erro ao ler eventos do inotify");
+            break;
+        }
+        
+        for (char *ptr = events; ptr < events + len; ) {
+            struct inotify_event *event = (struct inotify_event *)ptr;
+            if (event->mask & IN_Q_OVERFLOW) {
+                /* Eventos perdidos: não dá para saber o que mudou */
+                pthread_mutex_lock(&cache.lock);
+                cache.generation++;
+                while (cache.lru_head != NULL) {
+                    cache_remove_locked(&cache, cache.lru_head);
+                }
+                pthread_mutex_unlock(&cache.lock);
+            } else {
+                cache_invalidate_dir(event->wd);
+            }
+            ptr += sizeof(struct inotify_event) + event->len;
+        }
+    }
+    
+    pthread_mutex_lock(&cache.lock);
+    cache.enabled = 0;
+    pthread_mutex_unlock(&cache.lock);
+    return NULL;
+}
+
+int cache_init(void) {
+    gzip_cache.capacity = config.gzip_cache_size;
+    gzip_cache.enabled = config.gzip_cache_size > 0;
+    listing_cache.capacity = config.listing_cache_size;
+    listing_cache.enabled = config.listing_cache_size > 0;
+    
+    if (config.cache_size == 0) return 0;
+    cache.capacity = config.cache_size;
+    
+    cache.inotify_fd = inotify_init1(IN_CLOEXEC);
+    if (cache.inotify_fd < 0) {
+        perror("Aviso: cache desativado, inotify indisponível");
+        return -1;
+    }
+    
+    pthread_t thread;
+    int err = pthread_create(&thread, NULL, cache_inotify_main, NULL);
+    if (err != 0) {
+        fprintf(stderr, "Aviso: cache desativado: %s\n", strerror(err));
+        close(cache.inotify_fd);
+        cache.inotify_fd = -1;
+        return -1;
+    }
+    pthread_detach(thread);
+    
+    cache.enabled = 1;
+    return 0;
+}
+
+/* Entrada fora de qualquer cache, com uma referência; passa a ser dona de
+ * data. */
+cache_entry_t *cache_entry_new(file_cache_t *c, const char *key, const file_meta_t *meta,
+                               const char *header, size_t header_len, char *data, int dir_wd) {
+    cache_entry_t *entry = calloc(1, sizeof(cache_entry_t));
+    if (entry == NULL) {
+        free(data);
+        return NULL;
+    }
+    entry->owner = c;
+    entry->key = strdup(key);
+    entry->header = malloc(header_len > 0 ? header_len : 1);
+    entry->data = data;
+    entry->header_len = header_len;
+    entry->size = meta->size;
+    entry->mtime = meta->mtime;
+    entry->mime_type = meta->mime_type;
+    entry->encoding = meta->encoding;
+    entry->vary = meta->vary;
+    memcpy(entry->etag, meta->etag, sizeof(entry->etag));
+    entry->dir_wd = dir_wd;
+    entry->refs = 1;
+    if (entry->key == NULL || entry->header == NULL) {
+        cache_entry_free(entry);
+        return NULL;
+    }
+    memcpy(entry->header, header, header_len);
+    return entry;
+}
+
+char *read_whole_file(int fd, size_t size) {
+    char *data = malloc(size > 0 ? size : 1);
+    if (data == NULL) return NULL;
+    
+    size_t done = 0;
+    while (done < size) {
+        ssize_t bytes = pread(fd, data + done, size - done, done);
+        if (bytes < 0 && errno == EINTR) continue;
+        if (bytes <= 0) {
+            free(data);
+            return NULL;
+        }
+        done += bytes;
+    }
+    return data;
+}
+
+/* Comprime para o formato gzip; devolve NULL se falhar */
+char *compress_gzip(const char *data, size_t size, size_t *compressed_size) {
+    z_stream stream;
+    memset(&stream, 0, sizeof(stream));
+    if (deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        return NULL;
+    }
+    
+    size_t bound = deflateBound(&stream, size);
+    char *out = malloc(bound);
+    if (out == NULL) {
+        deflateEnd(&stream);
+        return NULL;
+    }
+    
+    stream.next_in = (Bytef *)data;
+    stream.avail_in = size;
+    stream.next_out = (Bytef *)out;
+    stream.avail_out = bound;
+    int result = deflate(&stream, Z_FINISH);
+    *compressed_size = stream.total_out;
+    deflateEnd(&stream);
+    
+    if (result != Z_STREAM_END) {
+        free(out);
+        return NULL;
+    }
+    return out;
+}
+
+void send_error(response_t *res, int status_code, const char *status_msg, const char *message) {
+    char body[BUFFER_SIZE];
+    int body_len = snprintf(body, sizeof(body),
+        "<html><head><title>%d %s</title></head>\n"
+        "<body><h1>%d %s</h1><p>%s</p></body></html>\n",
+        status_code, status_msg, status_code, status_msg, message);
+    if (body_len >= (int)sizeof(body)) {
+        body_len = sizeof(body) - 1;
+    }
+    
+    response_printf(res,
+        "HTTP/1.1 %d %s\r\n"
+        "Content-Type: text/html; charset=utf-8\r\n"
+        "Content-Length: %d\r\n"
+        "Connection: %s\r\n"
+        "\r\n",
+        status_code, status_msg, body_len, connection_value(res));
+    response_append(res, body, body_len);
+}
+
+void format_http_date(time_t time, char *buffer, size_t size) {
+    struct tm tm;
+    gmtime_r(&time, &tm);
+    strftime(buffer, size, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+}
+
+time_t parse_http_date(const char *value) {
+    struct tm tm;
+    memset(&tm, 0, sizeof(tm));
+    const char *end = strptime(value, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+    if (end == NULL || *end != '\0') return -1;
+    return timegm(&tm);
+}
+
+/* ETag derivado do tamanho e da data de modificação (em nanossegundos) */
+void file_meta_from_stat(file_meta_t *meta, const struct stat *st, const char *mime_type) {
+    meta->size = st->st_size;
+    meta->mtime = st->st_mtim.tv_sec;
+    meta->mime_type = mime_type;
+    snprintf(meta->etag, sizeof(meta->etag), "\"%llx-%llx\"",
+             (unsigned long long)st->st_size,
+             (unsigned long long)st->st_mtim.tv_sec * 1000000000ULL + st->st_mtim.tv_nsec);
+}
+
+/* Compara uma lista de If-None-Match com o ETag (comparação fraca) */
+int etag_matches(const char *list, const char *etag) {
+    const char *ptr = list;
+    while (*ptr != '\0') {
+        while (*ptr == ' ' || *ptr == '\t' || *ptr == ',') ptr++;
+        if (*ptr == '*') return 1;
+        if (strncmp(ptr, "W/", 2) == 0) ptr += 2;
+        
+        const char *end = strchr(ptr, ',');
+        size_t len = end != NULL ? (size_t)(end - ptr) : strlen(ptr);
+        while (len > 0 && (ptr[len - 1] == ' ' || ptr[len - 1] == '\t')) len--;
+        if (len == strlen(etag) && strncmp(ptr, etag, len) == 0) return 1;
+        
+        if (end == NULL) break;
+        ptr = end + 1;
+    }
+    return 0;
+}
+
+/* If-None-Match tem precedência; If-Modified-Since só vale sem ele */
+int is_not_modified(const http_request_t *request, const file_meta_t *meta) {
+    char value[512];
+    if (get_header(request, "If-None-Match", value, sizeof(value))) {
+        return etag_matches(value, meta->etag);
+    }
+    if (get_header(request, "If-Modified-Since", value, sizeof(value))) {
+        time_t since = parse_http_date(value);
+        return since != -1 && meta->mtime <= since;
+    }
+    return 0;
+}
+
+/* Interpreta "Range: bytes=..." em até MAX_RANGES intervalos [início, fim].
+ * Retorna o número de intervalos satisfazíveis, 0 se nenhum for (416) ou
+ * -1 se o cabeçalho deve ser ignorado (ausente, inválido ou If-Range não
+ * confere) e o arquivo enviado inteiro. */
+int parse_ranges(const http_request_t *request, const file_meta_t *meta, off_t starts[], off_t ends[]) {
+    char value[1024];
+    if (!get_header(request, "Range", value, sizeof(value))) return -1;
+    if (strncmp(value, "bytes=", 6) != 0) return -1;
+    
+    char if_range[256];
+    if (get_header(request, "If-Range", if_range, sizeof(if_range))) {
+        if (if_range[0] == '"') {
+            if (strcmp(if_range, meta->etag) != 0) return -1;
+        } else if (parse_http_date(if_range) != meta->mtime) {
+            return -1;
+        }
+    }
+    
+    int count = 0;
+    int specs = 0;
+    char *saveptr;
+    for (char *spec = strtok_r(value + 6, ",", &saveptr); spec != NULL; spec = strtok_r(NULL, ",", &saveptr)) {
+        while (*spec == ' ' || *spec == '\t') spec++;
+        if (++specs > MAX_RANGES) return -1;
+        
+        char *dash = strchr(spec, '-');
+        if (dash == NULL) return -1;
+        char *end_ptr;
+        long long first, last;
+        
+        if (dash == spec) {
+            long long suffix = strtoll(dash + 1, &end_ptr, 10);
+            if (end_ptr == dash + 1 || suffix < 0) return -1;
+            if (suffix == 0 || meta->size == 0) continue;
+            first = suffix > meta->size ? 0 : meta->size - suffix;
+            last = meta->size - 1;
+        } else {
+            first = strtoll(spec, &end_ptr, 10);
+            if (end_ptr != dash || first < 0) return -1;
+            if (dash[1] == '\0' || dash[1] == ' ') {
+                last = meta->size - 1;
+            } else {
+                last = strtoll(dash + 1, &end_ptr, 10);
+                if (end_ptr == dash + 1 || last < first) return -1;
+            }
+            if (first >= meta->size) continue;
+            if (last >= meta->size) last = meta->size - 1;
+        }
+        
+        starts[count] = first;
+        ends[count] = last;
+        count++;
+    }
+    
+    return specs == 0 ? -1 : count;
+}
+
+/* Linhas Content-Encoding/Vary da representação, vazias se não houver */
+void format_encoding_headers(const file_meta_t *meta, char *buffer, size_t size) {
+    snprintf(buffer, size, "%s%s%s%s",
+             meta->encoding != NULL ? "Content-Encoding: " : "",
+             meta->encoding != NULL ? meta->encoding : "",
+             meta->encoding != NULL ? "\r\n" : "",
+             meta->vary ? "Vary: Accept-Encoding\r\n" : "");
+}
+
+/* Cabeçalho da resposta 200 completa, sem a linha Connection */
+int format_header_200(const file_meta_t *meta, char *buffer, size_t size) {
+    char last_modified[64];
+    format_http_date(meta->mtime, last_modified, sizeof(last_modified));
+    char encoding_headers[128];
+    format_encoding_headers(meta, encoding_headers, sizeof(encoding_headers));
+    
+    return snprintf(buffer, size,
+        "HTTP/1.1 200 OK\r\n"
+        "Content-Type: %s\r\n"
+        "Content-Length: %lld\r\n"
+        "Accept-Ranges: bytes\r\n"
+        "ETag: %s\r\n"
+        "Last-Modified: %s\r\n"
+        "%s",
+        meta->mime_type, (long long)meta->size, meta->etag, last_modified, encoding_headers);
+}
+
+/* Responde com o arquivo (fd já em res->file_fd ou corpo em res->body):
+ * 304 se o cliente já tem a versão atual, 206/416 para pedidos de
+ * intervalo e 200 com o corpo inteiro nos demais casos. header_200 é o
+ * cabeçalho pronto da resposta completa, sem a linha Connection. */
+void send_representation(response_t *res, const http_request_t *request, const file_meta_t *meta,
+                         const char *header_200, size_t header_200_len) {
+    char last_modified[64];
+    format_http_date(meta->mtime, last_modified, sizeof(last_modified));
+    char encoding_headers[128];
+    format_encoding_headers(meta, encoding_headers, sizeof(encoding_headers));
+    
+    if (is_not_modified(request, meta)) {
+        response_printf(res,
+            "HTTP/1.1 304 Not Modified\r\n"
+            "ETag: %s\r\n"
+            "Last-Modified: %s\r\n"
+            "%s"
+            "Connection: %s\r\n"
+            "\r\n",
+            meta->etag, last_modified, meta->vary ? "Vary: Accept-Encoding\r\n" : "",
+            connection_value(res));
+        return;
+    }
+    
+    off_t starts[MAX_RANGES], ends[MAX_RANGES];
+    int range_count = parse_ranges(request, meta, starts, ends);
+    
+    if (range_count < 0) {
+        response_append(res, header_200, header_200_len);
+        response_printf(res, "Connection: %s\r\n\r\n", connection_value(res));
+        response_add_part(res, 0, meta->size);
+        return;
+    }
+    
+    if (range_count == 0) {
+        response_printf(res,
+            "HTTP/1.1 416 Range Not Satisfiable\r\n"
+            "Content-Range: bytes */%lld\r\n"
+            "Content-Length: 0\r\n"
+            "%s"
+            "Connection: %s\r\n"
+            "\r\n",
+            (long long)meta->size, encoding_headers, connection_value(res));
+        return;
+    }
+    
+    if (range_count == 1) {
+        response_printf(res,
+            "HTTP/1.1 206 Partial Content\r\n"
+            "Content-Type: %s\r\n"
+            "Content-Range: bytes %lld-%lld/%lld\r\n"
+            "Content-Length: %lld\r\n"
+            "Accept-Ranges: bytes\r\n"
+            "ETag: %s\r\n"
+            "Last-Modified: %s\r\n"
+            "%s"
+            "Connection: %s\r\n"
+            "\r\n",
+            meta->mime_type, (long long)starts[0], (long long)ends[0], (long long)meta->size,
+            (long long)(ends[0] - starts[0] + 1), meta->etag, last_modified, encoding_headers,
+            connection_value(res));
+        response_add_part(res, starts[0], ends[0] - starts[0] + 1);
+        return;
+    }
+    
+    /* multipart/byteranges: os cabeçalhos das partes são montados antes
+     * para calcular o Content-Length total */
+    char part_headers[MAX_RANGES][256];
+    int part_header_lens[MAX_RANGES];
+    long long content_length = 0;
+    for (int i = 0; i < range_count; i++) {
+        part_header_lens[i] = snprintf(part_headers[i], sizeof(part_headers[i]),
+            "\r\n--" RANGE_BOUNDARY "\r\n"
+            "Content-Type: %s\r\n"
+            "Content-Range: bytes %lld-%lld/%lld\r\n"
+            "\r\n",
+            meta->mime_type, (long long)starts[i], (long long)ends[i], (long long)meta->size);
+        content_length += part_header_lens[i] + (ends[i] - starts[i] + 1);
+    }
+    static const char closing[] = "\r\n--" RANGE_BOUNDARY "--\r\n";
+    content_length += sizeof(closing) - 1;
+    
+    response_printf(res,
+        "HTTP/1.1 206 Partial Content\r\n"
+        "Content-Type: multipart/byteranges; boundary=" RANGE_BOUNDARY "\r\n"
+        "Content-Length: %lld\r\n"
+        "Accept-Ranges: bytes\r\n"
+        "ETag: %s\r\n"
+        "Last-Modified: %s\r\n"
+        "%s"
+        "Connection: %s\r\n"
+        "\r\n",
+        content_length, meta->etag, last_modified, encoding_headers, connection_value(res));
+    for (int i = 0; i < range_count; i++) {
+        response_append(res, part_headers[i], part_header_lens[i]);
+        response_add_part(res, starts[i], ends[i] - starts[i] + 1);
+    }
+    response_append(res, closing, sizeof(closing) - 1);
+}
+
+void send_cached_entry(response_t *res, const http_request_t *request, cache_entry_t *entry) {
+    file_meta_t meta;
+    meta.size = entry->size;
+    meta.mtime = entry->mtime;
+    meta.mime_type = entry->mime_type;
+    meta.encoding = entry->encoding;
+    meta.vary = entry->vary;
+    memcpy(meta.etag, entry->etag, sizeof(meta.etag));
+    
+    res->entry = entry;
+    res->body = entry->data;
+    send_representation(res, request, &meta, entry->header, entry->header_len);
+}
+
+/* Responde a partir do cache, sem nenhuma chamada ao sistema de arquivos */
+int send_cached_file(response_t *res, const http_request_t *request, const char *key) {
+    cache_entry_t *entry = cache_lookup(&cache, key, NULL);
+    if (entry == NULL) return 0;
+    
+    send_cached_entry(res, request, entry);
+    return 1;
+}
+
+/* Interpreta Accept-Encoding (com pesos q) e devolve a máscara de
+ * codificações aceitas dentre as que o servidor produz. */
+int accepted_encodings(const http_request_t *request) {
+    char value[512];
+    if (!get_header(request, "Accept-Encoding", value, sizeof(value))) return 0;
+    
+    int accepted = 0;
+    int listed = 0;
+    int wildcard = 0;
+    char *saveptr;
+    for (char *token = strtok_r(value, ",", &saveptr); token != NULL; token = strtok_r(NULL, ",", &saveptr)) {
+        while (*token == ' ' || *token == '\t') token++;
+        
+        double quality = 1.0;
+        char *params = strchr(token, ';');
+        if (params != NULL) {
+            *params++ = '\0';
+            char *q = strstr(params, "q=");
+            if (q != NULL) quality = strtod(q + 2, NULL);
+        }
+        size_t len = strcspn(token, " \t");
+        token[len] = '\0';
+        
+        int encoding = 0;
+        if (strcasecmp(token, "gzip") == 0 || strcasecmp(token, "x-gzip") == 0) {
+            encoding = ENCODING_GZIP;
+        } else if (strcasecmp(token, "br") == 0) {
+            encoding = ENCODING_BR;
+        } else if (strcmp(token, "*") == 0) {
+            wildcard = quality > 0 ? 1 : -1;
+            continue;
+        } else {
+            continue;
+        }
+        
+        listed |= encoding;
+        if (quality > 0) accepted |= encoding;
+    }
+    
+    if (wildcard > 0) {
+        accepted |= (ENCODING_GZIP | ENCODING_BR) & ~listed;
+    }
+    return accepted;
+}
+
+/* Abre a versão pré-comprimida (arquivo.gz/.br) se existir, ajustando meta
+ * para descrevê-la. Retorna o fd ou -1. */
+int open_sidecar(const char *path, const char *suffix, const char *encoding, file_meta_t *meta) {
+    char sidecar_path[MAX_PATH_LENGTH];
+    if (snprintf(sidecar_path, sizeof(sidecar_path), "%s%s", path, suffix) >= (int)sizeof(sidecar_path)) {
+        return -1;
+    }
+    
+    int fd = open_beneath(sidecar_path, O_RDONLY | O_NONBLOCK);
+    if (fd < 0) return -1;
+    
+    struct stat sidecar_stat;
+    if (fstat(fd, &sidecar_stat) != 0 || !S_ISREG(sidecar_stat.st_mode)) {
+        close(fd);
+        return -1;
+    }
+    
+    file_meta_from_stat(meta, &sidecar_stat, meta->mime_type);
+    size_t len = strlen(meta->etag);
+    snprintf(meta->etag + len - 1, sizeof(meta->etag) - len + 1, "-%s\"", suffix + 1);
+    meta->encoding = encoding;
+    meta->vary = 1;
+    return fd;
+}
+
+/* Versão gzip de um arquivo grande demais para o cache de arquivos, vinda
+ * do cache de objetos comprimidos (válida enquanto o ETag do original não
+ * mudar) ou comprimida agora. */
+cache_entry_t *gzip_cache_get(int fd, const char *path, file_meta_t *meta) {
+    char etag[sizeof(meta->etag)];
+    size_t len = strlen(meta->etag);
+    snprintf(etag, sizeof(etag), "%.*s-gzip\"", (int)len - 1, meta->etag);
+    
+    cache_entry_t *entry = cache_lookup(&gzip_cache, path, etag);
+    if (entry != NULL) return entry;
+    
+    char *data = read_whole_file(fd, meta->size);
+    if (data == NULL) return NULL;
+    size_t compressed_size;
+    char *compressed = compress_gzip(data, meta->size, &compressed_size);
+    free(data);
+    if (compressed == NULL) return NULL;
+    
+    file_meta_t gzip_meta = *meta;
+    gzip_meta.size = compressed_size;
+    gzip_meta.encoding = "gzip";
+    memcpy(gzip_meta.etag, etag, sizeof(gzip_meta.etag));
+    
+    char header[BUFFER_SIZE];
+    int header_len = format_header_200(&gzip_meta, header, sizeof(header));
+    entry = cache_entry_new(&gzip_cache, path, &gzip_meta, header, header_len, compressed, -1);
+    if (entry != NULL) {
+        cache_insert(&gzip_cache, entry, gzip_cache.generation);
+    }
+    return entry;
+}
+
+/* fd já vem aberto por build_response (e passa a ser desta função), com o
+ * stat correspondente; path é o caminho relativo à base. cache_key
+ * identifica o caminho e as codificações aceitas pelo cliente: a entrada
+ * guarda a representação escolhida para essa combinação. */
+void send_file(response_t *res, const http_request_t *request, int fd, const struct stat *file_stat,
+               const char *path, const char *filename, const char *cache_key, int accepted) {
+    file_meta_t meta;
+    file_meta_from_stat(&meta, file_stat, get_mime_type(filename));
+    meta.encoding = NULL;
+    meta.vary = is_compressible(meta.mime_type);
+    
+    int compress = 0;
+    if (meta.vary && accepted != 0) {
+        int sidecar_fd = -1;
+        if (accepted & ENCODING_BR) {
+            sidecar_fd = open_sidecar(path, ".br", "br", &meta);
+        }
+        if (sidecar_fd < 0 && (accepted & ENCODING_GZIP)) {
+            sidecar_fd = open_sidecar(path, ".gz", "gzip", &meta);
+        }
+        if (sidecar_fd >= 0) {
+            close(fd);
+            fd = sidecar_fd;
+        } else {
+            compress = (accepted & ENCODING_GZIP) && meta.size >= GZIP_MIN_SIZE;
+        }
+    }
+    
+    if (cache.enabled && (size_t)meta.size <= config.cache_max_file_size) {
+        unsigned long generation;
+        int wd = cache_watch(path, &generation);
+        char *data = wd >= 0 ? read_whole_file(fd, meta.size) : NULL;
+        
+        /* A entrada usa uma cópia: se não der para criá-la, o envio abaixo
+         * segue com o arquivo original e seus metadados */
+        file_meta_t entry_meta = meta;
+        if (data != NULL && compress) {
+            /* Se a compressão falhar, guarda e envia o original mesmo */
+            size_t compressed_size;
+            char *compressed = compress_gzip(data, meta.size, &compressed_size);
+            if (compressed != NULL) {
+                free(data);
+                data = compressed;
+                size_t len = strlen(entry_meta.etag);
+                snprintf(entry_meta.etag + len - 1, sizeof(entry_meta.etag) - len + 1, "-gzip\"");
+                entry_meta.size = compressed_size;
+                entry_meta.encoding = "gzip";
+            } else {
+                compress = 0;
+            }
+        }
+        
+        if (data != NULL) {
+            char header[BUFFER_SIZE];
+            int header_len = format_header_200(&entry_meta, header, sizeof(header));
+            cache_entry_t *entry = cache_entry_new(&cache, cache_key, &entry_meta, header, header_len, data, wd);
+            if (entry != NULL) {
+                close(fd);
+                cache_insert(&cache, entry, generation);
+                send_cached_entry(res, request, entry);
+                return;
+            }
+        }
+    }
+    
+    if (compress && gzip_cache.enabled && (size_t)meta.size <= config.gzip_max_file_size) {
+        cache_entry_t *entry = gzip_cache_get(fd, path, &meta);
+        if (entry != NULL) {
+            close(fd);
+            send_cached_entry(res, request, entry);
+            return;
+        }
+    }
+    
+    char header[BUFFER_SIZE];
+    int header_len = format_header_200(&meta, header, sizeof(header));
+    res->file_fd = fd;
+    send_representation(res, request, &meta, header, header_len);
+}
+
+typedef struct {
+    const char *name;
+    int is_dir;
+    off_t size;
+    time_t mtime;
+} dir_entry_t;
+
+/* Índice de uma listagem: entradas seguidas dos nomes, num só bloco */
+typedef struct {
+    size_t count;
+    dir_entry_t entries[];
+} dir_index_t;
+
+struct linux_dirent64 {
+    ino64_t d_ino;
+    off64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+/* Lê o diretório em lotes com getdents64 e obtém tamanho e data de cada
+ * entrada com fstatat relativo ao fd do diretório. */
+dir_index_t *load_directory(int dir_fd, size_t *index_size) {
+    char *buffer = malloc(GETDENTS_BUFFER_SIZE);
+    size_t cap = 256, count = 0;
+    size_t names_cap = 16 * 1024, names_len = 0;
+    dir_entry_t *entries = malloc(cap * sizeof(dir_entry_t));
+    size_t *name_offsets = malloc(cap * sizeof(size_t));
+    char *names = malloc(names_cap);
+    dir_index_t *index = NULL;
+    
+    if (buffer == NULL || entries == NULL || name_offsets == NULL || names == NULL) {
+        goto out;
+    }
+    
+    while (1) {
+        long bytes = syscall(SYS_getdents64, dir_fd, buffer, GETDENTS_BUFFER_SIZE);
+        if (bytes < 0) goto out;
+        if (bytes == 0) break;
+        
+        for (long pos = 0; pos < bytes; ) {
+            struct linux_dirent64 *dirent = (struct linux_dirent64 *)(buffer + pos);
+            pos += dirent->d_reclen;
+            
+            const char *name = dirent->d_name;
+            if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) continue;
+            
+            struct stat file_stat;
+            if (fstatat(dir_fd, name, &file_stat, 0) != 0) continue;
+            
+            if (count == cap) {
+                cap *= 2;
+                dir_entry_t *new_entries = realloc(entries, cap * sizeof(dir_entry_t));
+                size_t *new_offsets = realloc(name_offsets, cap * sizeof(size_t));
+                if (new_entries != NULL) entries = new_entries;
+                if (new_offsets != NULL) name_offsets = new_offsets;
+                if (new_entries == NULL || new_offsets == NULL) goto out;
+            }
+            size_t name_len = strlen(name) + 1;
+            if (names_len + name_len > names_cap) {
+                while (names_len + name_len > names_cap) names_cap *= 2;
+                char *new_names = realloc(names, names_cap);
+                if (new_names == NULL) goto out;
+                names = new_names;
+            }
+            
+            memcpy(names + names_len, name, name_len);
+            name_offsets[count] = names_len;
+            names_len += name_len;
+            entries[count].is_dir = S_ISDIR(file_stat.st_mode);
+            entries[count].size = file_stat.st_size;
+            entries[count].mtime = file_stat.st_mtime;
+            count++;
+        }
+    }
+    
+    *index_size = sizeof(dir_index_t) + count * sizeof(dir_entry_t) + names_len;
+    index = malloc(*index_size);
+    if (index == NULL) goto out;
+    index->count = count;
+    memcpy(index->entries, entries, count * sizeof(dir_entry_t));
+    char *index_names = (char *)&index->entries[count];
+    memcpy(index_names, names, names_len);
+    for (size_t i = 0; i < count; i++) {
+        index->entries[i].name = index_names + name_offsets[i];
+    }
+    
+out:
+    free(buffer);
+    free(entries);
+    free(name_offsets);
+    free(names);
+    return index;
+}
+
+void format_size(off_t file_size, char *buffer, size_t size) {
+    if (file_size < 1024) {
+        snprintf(buffer, size, "%ld bytes", file_size);
+    } else if (file_size < 1024 * 1024) {
+        snprintf(buffer, size, "%.1f KB", file_size / 1024.0);
+    } else {
+        snprintf(buffer, size, "%.1f MB", file_size / (1024.0 * 1024.0));
+    }
+}
+
+/* Monta as linhas HTML das entradas [from, to) em out */
+void render_listing_html(response_t *out, const dir_index_t *index, const char *request_path,
+                         size_t from, size_t to) {
+    response_printf(out,
+        "<html><head><title>Listagem do Diretório</title></head>\n"
+        "<body><h1>Listagem do Diretório: %s</h1>\n"
+        "<table border='1' style='border-collapse: collapse;'>\n"
+        "<tr><th>Nome</th><th>Tipo</th><th>Tamanho</th><th>Modificado</th></tr>\n",
+        request_path);
+    
+    /* Links absolutos: "/" + caminho do diretório sem a barra final */
+    char link_prefix[MAX_PATH_LENGTH];
+    snprintf(link_prefix, sizeof(link_prefix), "%s%s", request_path[0] != '\0' ? "/" : "", request_path);
+    size_t prefix_len = strlen(link_prefix);
+    while (prefix_len > 0 && link_prefix[prefix_len - 1] == '/') {
+        link_prefix[--prefix_len] = '\0';
+    }
+    char time_str[64];
+    char row[BUFFER_SIZE];
+    
+    for (size_t i = from; i < to; i++) {
+        const dir_entry_t *entry = &index->entries[i];
+        struct tm tm;
+        localtime_r(&entry->mtime, &tm);
+        strftime(time_str, sizeof(time_str), "%Y-%m-%d %H:%M:%S", &tm);
+        
+        int row_len;
+        if (entry->is_dir) {
+            row_len = snprintf(row, sizeof(row),
+                "<tr><td><a href='%s/%s/'>%s/</a></td><td>DIR</td><td>-</td><td>%s</td></tr>\n",
+                link_prefix, entry->name, entry->name, time_str);
+        } else {
+            char size_str[30];
+            format_size(entry->size, size_str, sizeof(size_str));
+            row_len = snprintf(row, sizeof(row),
+                "<tr><td><a href='%s/%s'>%s</a></td><td>FILE</td><td>%s</td><td>%s</td></tr>\n",
+                link_prefix, entry->name, entry->name, size_str, time_str);
+        }
+        
+        if (row_len < (int)sizeof(row)) {
+            response_append(out, row, row_len);
+        }
+    }
+    
+    response_printf(out, "</table>\n");
+    if (from > 0 || to < index->count) {
+        response_printf(out, "<p>Entradas %zu a %zu de %zu</p>\n", from + 1, to, index->count);
+        if (to < index->count) {
+            response_printf(out, "<p><a href='?offset=%zu&limit=%zu'>Próxima página</a></p>\n",
+                            to, to - from);
+        }
+    }
+    response_printf(out, "</body></html>\n");
+}
+
+void json_append_string(response_t *out, const char *str) {
+    response_append(out, "\"", 1);
+    for (const char *ptr = str; *ptr != '\0'; ptr++) {
+        unsigned char c = *ptr;
+        if (c == '"' || c == '\\') {
+            char escaped[2] = { '\\', c };
+            response_append(out, escaped, 2);
+        } else if (c < 0x20) {
+            response_printf(out, "\\u%04x", c);
+        } else {
+            response_append(out, ptr, 1);
+        }
+    }
+    response_append(out, "\"", 1);
+}
+
+void render_listing_json(response_t *out, const dir_index_t *index, const char *request_path,
+                         size_t from, size_t to) {
+    response_printf(out, "{\"path\":");
+    json_append_string(out, request_path);
+    response_printf(out, ",\"total\":%zu,\"offset\":%zu,\"entries\":[", index->count, from);
+    
+    char time_str[64];
+    for (size_t i = from; i < to; i++) {
+        const dir_entry_t *entry = &index->entries[i];
+        struct tm tm;
+        gmtime_r(&entry->mtime, &tm);
+        strftime(time_str, sizeof(time_str), "%Y-%m-%dT%H:%M:%SZ", &tm);
+        
+        response_printf(out, "%s{\"name\":", i > from ? "," : "");
+        json_append_string(out, entry->name);
+        response_printf(out, ",\"type\":\"%s\",\"size\":%lld,\"mtime\":\"%s\"}",
+                        entry->is_dir ? "dir" : "file", (long long)entry->size, time_str);
+    }
+    response_printf(out, "]}\n");
+}
+
+/* Copia o valor de um parâmetro da query string. Retorna 1 se presente. */
+int get_query_param(const char *query, const char *name, char *value, size_t value_size) {
+    size_t name_len = strlen(name);
+    const char *ptr = query;
+    while (ptr != NULL && *ptr != '\0') {
+        if (strncmp(ptr, name, name_len) == 0 && ptr[name_len] == '=') {
+            const char *start = ptr + name_len + 1;
+            size_t len = strcspn(start, "&");
+            if (len >= value_size) len = value_size - 1;
+            memcpy(value, start, len);
+            value[len] = '\0';
+            return 1;
+        }
+        ptr = strchr(ptr, '&');
+        if (ptr != NULL) ptr++;
+    }
+    return 0;
+}
+
+/* Índice do diretório no cache de listagens, sob a chave key; devolve a
+ * entrada com uma referência ou NULL se o diretório não puder ser lido. */
+cache_entry_t *listing_index_get(int dir_fd, const char *key, const char *version) {
+    cache_entry_t *entry = cache_lookup(&listing_cache, key, version);
+    if (entry != NULL) return entry;
+    
+    size_t index_size;
+    dir_index_t *index = load_directory(dir_fd, &index_size);
+    if (index == NULL) return NULL;
+    
+    file_meta_t meta;
+    memset(&meta, 0, sizeof(meta));
+    snprintf(meta.etag, sizeof(meta.etag), "%s", version);
+    entry = cache_entry_new(&listing_cache, key, &meta, "", 0, NULL, -1);
+    if (entry == NULL) {
+        free(index);
+        return NULL;
+    }
+    entry->extra = index;
+    entry->extra_size = index_size;
+    if (listing_cache.enabled) {
+        cache_insert(&listing_cache, entry, listing_cache.generation);
+    }
+    return entry;
+}
+
+void send_listing_page(response_t *res, cache_entry_t *page) {
+    res->entry = page;
+    res->body = page->data;
+    response_append(res, page->header, page->header_len);
+    response_printf(res, "Connection: %s\r\n\r\n", connection_value(res));
+    response_add_part(res, 0, page->size);
+}
+
+/* Listagem a partir do cache, válida enquanto o mtime do diretório não
+ * mudar. O índice das entradas ("I" + caminho) e a página HTML completa
+ * ("H" + caminho) ficam em entradas separadas: as variantes paginadas ou
+ * em JSON são montadas do índice sem depender de o HTML inteiro caber no
+ * cache, e o HTML completo só é montado quando pedido. */
+void send_directory_listing(response_t *res, int dir_fd, const char *base_path, const char *request_path,
+                            const char *query, const struct stat *dir_stat) {
+    char version[80];
+    snprintf(version, sizeof(version), "%llx.%lx-%llx.%lx",
+             (unsigned long long)dir_stat->st_mtim.tv_sec, dir_stat->st_mtim.tv_nsec,
+             (unsigned long long)dir_stat->st_ctim.tv_sec, dir_stat->st_ctim.tv_nsec);
+    
+    char value[32];
+    int json = get_query_param(query, "format", value, sizeof(value)) && strcmp(value, "json") == 0;
+    size_t offset = 0;
+    size_t limit = SIZE_MAX;
+    int paginated = 0;
+    if (get_query_param(query, "offset", value, sizeof(value))) {
+        offset = strtoul(value, NULL, 10);
+        paginated = 1;
+    }
+    if (get_query_param(query, "limit", value, sizeof(value))) {
+        limit = strtoul(value, NULL, 10);
+        paginated = 1;
+    } else if (paginated) {
+        limit = LISTING_DEFAULT_LIMIT;
+    }
+    int full_page = !json && !paginated;
+    
+    char key[MAX_PATH_LENGTH + 1];
+    snprintf(key, sizeof(key), "H%s", base_path);
+    if (full_page) {
+        cache_entry_t *page = cache_lookup(&listing_cache, key, version);
+        if (page != NULL) {
+            send_listing_page(res, page);
+            return;
+        }
+    }
+    
+    key[0] = 'I';
+    cache_entry_t *entry = listing_index_get(dir_fd, key, version);
+    if (entry == NULL) {
+        send_error(res, 500, "Internal Server Error", "Erro ao ler o diretório");
+        return;
+    }
+    const dir_index_t *index = entry->extra;
+    if (offset > index->count) offset = index->count;
+    size_t end = limit > index->count - offset ? index->count : offset + limit;
+    
+    response_t body;
+    response_init(&body);
+    if (json) {
+        render_listing_json(&body, index, request_path, offset, end);
+    } else {
+        render_listing_html(&body, index, request_path, offset, end);
+    }
+    cache_release(entry);
+    
+    if (full_page) {
+        file_meta_t meta;
+        memset(&meta, 0, sizeof(meta));
+        meta.size = body.len;
+        meta.mime_type = "text/html; charset=utf-8";
+        snprintf(meta.etag, sizeof(meta.etag), "%s", version);
+        
+        char header[BUFFER_SIZE];
+        int header_len = snprintf(header, sizeof(header),
+            "HTTP/1.1 200 OK\r\n"
+            "Content-Type: text/html; charset=utf-8\r\n"
+            "Content-Length: %zu\r\n",
+            body.len);
+        
+        key[0] = 'H';
+        cache_entry_t *page = cache_entry_new(&listing_cache, key, &meta, header, header_len, body.data, -1);
+        if (page == NULL) {
+            send_error(res, 500, "Internal Server Error", "Memória insuficiente");
+            return;
+        }
+        if (listing_cache.enabled) {
+            cache_insert(&listing_cache, page, listing_cache.generation);
+        }
+        send_listing_page(res, page);
+        return;
+    }
+    
+    response_printf(res,
+        "HTTP/1.1 200 OK\r\n"
+        "Content-Type: %s\r\n"
+        "Content-Length: %zu\r\n"
+        "Connection: %s\r\n"
+        "\r\n",
+        json ? "application/json" : "text/html; charset=utf-8", body.len, connection_value(res));
+    response_append(res, body.data, body.len);
+    response_free(&body);
+}
+
+void render_histogram_json(response_t *out, const char *name, const histogram_t *h, int last) {
+    response_printf(out,
+        "    \"%s\": {\"count\": %llu, \"mean\": %llu, \"p50\": %llu, \"p90\": %llu, "
+        "\"p99\": %llu, \"p999\": %llu, \"max\": %llu}%s\n",
+        name, (unsigned long long)h->count,
+        (unsigned long long)(h->count > 0 ? h->sum / h->count : 0),
+        (unsigned long long)histogram_percentile(h, 50), (unsigned long long)histogram_percentile(h, 90),
+        (unsigned long long)histogram_percentile(h, 99), (unsigned long long)histogram_percentile(h, 99.9),
+        (unsigned long long)h->max, last ? "" : ",");
+}
+
+void render_stats_json(response_t *out, const thread_stats_t *stats) {
+    uint64_t requests = 0;
+    for (int i = 0; i < 600; i++) requests += stats->responses[i];
+    
+    response_printf(out, "{\n  \"requests\": %llu,\n  \"responses\": {", (unsigned long long)requests);
+    const char *separator = "";
+    for (int i = 0; i < 600; i++) {
+        if (stats->responses[i] == 0) continue;
+        response_printf(out, "%s\"%d\": %llu", separator, i, (unsigned long long)stats->responses[i]);
+        separator = ", ";
+    }
+    response_printf(out,
+        "},\n"
+        "  \"bytes_sent\": %llu,\n"
+        "  \"connections\": {\"accepted\": %llu, \"active\": %lld, \"rejected\": %llu, \"timed_out\": %llu},\n"
+        "  \"cache\": {",
+        (unsigned long long)stats->bytes_sent, (unsigned long long)stats->connections_accepted,
+        (long long)stats->connections_active, (unsigned long long)stats->connections_rejected,
+        (unsigned long long)stats->connections_timed_out);
+    for (int i = 0; i < STATS_CACHES; i++) {
+        response_printf(out, "%s\"%s\": {\"hits\": %llu, \"misses\": %llu}", i > 0 ? ", " : "",
+                        stats_cache_names[i], (unsigned long long)stats->cache_hits[i],
+                        (unsigned long long)stats->cache_misses[i]);
+    }
+    response_printf(out, "},\n  \"latency_us\": {\n");
+    render_histogram_json(out, "ttfb", &stats->ttfb, 0);
+    render_histogram_json(out, "total", &stats->total, 1);
+    response_printf(out, "  },\n  \"access_log\": {\"written\": %llu, \"dropped\": %llu}\n}\n",
+                    (unsigned long long)__atomic_load_n(&access_log.written, __ATOMIC_RELAXED),
+                    (unsigned long long)__atomic_load_n(&access_log.dropped, __ATOMIC_RELAXED));
+}
+
+/* Histograma no formato do Prometheus, com faixas cumulativas em potências
+ * de 2 microssegundos (1 µs a ~67 s), que coincidem com as do HDR */
+void render_histogram_prometheus(response_t *out, const char *name, const char *help, const histogram_t *h) {
+    response_printf(out, "# HELP %s %s\n# TYPE %s histogram\n", name, help, name);
+    uint64_t cumulative = 0;
+    int index = 0;
+    for (int power = 0; power <= 26; power++) {
+        uint64_t limit = (uint64_t)1 << power;
+        while (index < HIST_BUCKETS && histogram_upper(index) < limit) {
+            cumulative += h->counts[index++];
+        }
+        response_printf(out, "%s_bucket{le=\"%g\"} %llu\n", name, limit / 1e6, (unsigned long long)cumulative);
+    }
+    response_printf(out, "%s_bucket{le=\"+Inf\"} %llu\n%s_sum %g\n%s_count %llu\n",
+                    name, (unsigned long long)h->count, name, h->sum / 1e6,
+                    name, (unsigned long long)h->count);
+}
+
+void render_stats_prometheus(response_t *out, const thread_stats_t *stats) {
+    response_printf(out, "# HELP servidor_responses_total Respostas enviadas, por status.\n"
+                         "# TYPE servidor_responses_total counter\n");
+    for (int i = 0; i < 600; i++) {
+        if (stats->responses[i] == 0) continue;
+        response_printf(out, "servidor_responses_total{code=\"%d\"} %llu\n", i,
+                        (unsigned long long)stats->responses[i]);
+    }
+    response_printf(out,
+        "# HELP servidor_bytes_sent_total Bytes enviados (cabeçalhos e corpos).\n"
+        "# TYPE servidor_bytes_sent_total counter\n"
+        "servidor_bytes_sent_total %llu\n"
+        "# HELP servidor_connections_accepted_total Conexões aceitas.\n"
+        "# TYPE servidor_connections_accepted_total counter\n"
+        "servidor_connections_accepted_total %llu\n"
+        "# HELP servidor_connections_active Conexões abertas.\n"
+        "# TYPE servidor_connections_active gauge\n"
+        "servidor_connections_active %lld\n"
+        "# HELP servidor_connections_rejected_total Conexões recusadas pelos limites de conexões.\n"
+        "# TYPE servidor_connections_rejected_total counter\n"
+        "servidor_connections_rejected_total %llu\n"
+        "# HELP servidor_connections_timed_out_total Conexões fechadas por prazo de cabeçalho ou de envio.\n"
+        "# TYPE servidor_connections_timed_out_total counter\n"
+        "servidor_connections_timed_out_total %llu\n",
+        (unsigned long long)stats->bytes_sent, (unsigned long long)stats->connections_accepted,
+        (long long)stats->connections_active, (unsigned long long)stats->connections_rejected,
+        (unsigned long long)stats->connections_timed_out);
+    
+    response_printf(out, "# HELP servidor_cache_hits_total Consultas atendidas pelo cache.\n"
+                         "# TYPE servidor_cache_hits_total counter\n");
+    for (int i = 0; i < STATS_CACHES; i++) {
+        response_printf(out, "servidor_cache_hits_total{cache=\"%s\"} %llu\n",
+                        stats_cache_names[i], (unsigned long long)stats->cache_hits[i]);
+    }
+    response_printf(out, "# HELP servidor_cache_misses_total Consultas que não acharam entrada válida.\n"
+                         "# TYPE servidor_cache_misses_total counter\n");
+    for (int i = 0; i < STATS_CACHES; i++) {
+        response_printf(out, "servidor_cache_misses_total{cache=\"%s\"} %llu\n",
+                        stats_cache_names[i], (unsigned long long)stats->cache_misses[i]);
+    }
+    
+    render_histogram_prometheus(out, "servidor_ttfb_seconds",
+                                "Tempo até o primeiro byte da resposta.", &stats->ttfb);
+    render_histogram_prometheus(out, "servidor_request_duration_seconds",
+                                "Tempo total de atendimento da requisição.", &stats->total);
+    response_printf(out,
+        "# HELP servidor_access_log_dropped_total Registros descartados com o anel do log cheio.\n"
+        "# TYPE servidor_access_log_dropped_total counter\n"
+        "servidor_access_log_dropped_total %llu\n",
+        (unsigned long long)__atomic_load_n(&access_log.dropped, __ATOMIC_RELAXED));
+}
+
+/* Estatísticas de todas as threads, em JSON ou, com ?format=prometheus (ou
+ * Accept: text/plain, como mandam os coletores), no formato do Prometheus */
+void send_stats(response_t *res, const http_request_t *request, const char *query) {
+    thread_stats_t *stats = malloc(sizeof(*stats));
+    if (stats == NULL) {
+        send_error(res, 500, "Internal Server Error", "Memória insuficiente");
+        return;
+    }
+    stats_merge(stats);
+    
+    char value[256];
+    int prometheus;
+    if (get_query_param(query, "format", value, sizeof(value))) {
+        prometheus = strcmp(value, "prometheus") == 0;
+    } else {
+        prometheus = get_header(request, "Accept", value, sizeof(value)) && strstr(value, "text/plain") != NULL;
+    }
+    
+    response_t body;
+    response_init(&body);
+    if (prometheus) {
+        render_stats_prometheus(&body, stats);
+    } else {
+        render_stats_json(&body, stats);
+    }
+    free(stats);
+    
+    response_printf(res,
+        "HTTP/1.1 200 OK\r\n"
+        "Content-Type: %s\r\n"
+        "Content-Length: %zu\r\n"
+        "Cache-Control: no-store\r\n"
+        "Connection: %s\r\n"
+        "\r\n",
+        prometheus ? "text/plain; version=0.0.4; charset=utf-8" : "application/json",
+        body.len, connection_value(res));
+    response_append(res, body.data, body.len);
+    response_free(&body);
+}
+
+/* ---- Bundle pré-empacotado (--bundle) ---- */
+
+/* O bundle inteiro fica mapeado; só o cabeçalho é conferido ao abrir, e
+ * cada entrada é validada quando encontrada, para a abertura não depender
+ * do número de arquivos */
+struct {
+    int fd;
+    const char *data;
+    size_t size;
+    const bundle_header_t *header;
+    const uint32_t *displacements;
+    const bundle_entry_t *entries;
+    const char *strings;
+} bundle = { .fd = -1 };
+
+int bundle_open(const char *path) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        perror("Erro ao abrir o bundle");
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+    if ((size_t)st.st_size < sizeof(bundle_header_t)) {
+        fprintf(stderr, "Erro: '%s' não é um bundle\n", path);
+        close(fd);
+        return -1;
+    }
+    
+    void *data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (data == MAP_FAILED) {
+        perror("Erro ao mapear o bundle");
+        close(fd);
+        return -1;
+    }
+    
+    const bundle_header_t *h = data;
+    uint64_t size = st.st_size;
+    int valid = memcmp(h->magic, BUNDLE_MAGIC, sizeof(h->magic)) == 0 && h->version == BUNDLE_VERSION &&
+                h->size == size && h->slots > 0 && h->buckets > 0 &&
+                h->displacements_offset <= size && h->displacements_offset % sizeof(uint32_t) == 0 &&
+                (size - h->displacements_offset) / sizeof(uint32_t) >= h->buckets &&
+                h->entries_offset <= size && h->entries_offset % sizeof(uint64_t) == 0 &&
+                (size - h->entries_offset) / sizeof(bundle_entry_t) >= h->slots &&
+                h->strings_offset <= size && h->strings_size > 0 && h->strings_size <= size - h->strings_offset &&
+                ((const char *)data)[h->strings_offset + h->strings_size - 1] == '\0';
+    if (!valid) {
+        fprintf(stderr, "Erro: '%s' não é um bundle válido ou é de outra versão\n", path);
+        munmap(data, st.st_size);
+        close(fd);
+        return -1;
+    }
+    
+    /* O índice é lido a cada requisição: que já venha para a memória */
+    madvise((char *)data + (h->displacements_offset & ~(uint64_t)(BUNDLE_ALIGN - 1)),
+            h->strings_offset + h->strings_size - (h->displacements_offset & ~(uint64_t)(BUNDLE_ALIGN - 1)),
+            MADV_WILLNEED);
+    
+    bundle.fd = fd;
+    bundle.data = data;
+    bundle.size = st.st_size;
+    bundle.header = h;
+    bundle.displacements = (const uint32_t *)(bundle.data + h->displacements_offset);
+    bundle.entries = (const bundle_entry_t *)(bundle.data + h->entries_offset);
+    bundle.strings = bundle.data + h->strings_offset;
+    return 0;
+}
+
+/* Um cálculo de hash e uma comparação, sem tocar o sistema de arquivos */
+const bundle_entry_t *bundle_lookup(const char *path, size_t len) {
+    const bundle_header_t *h = bundle.header;
+    uint32_t displacement = bundle.displacements[bundle_hash(path, len, h->seed) % h->buckets];
+    const bundle_entry_t *entry = &bundle.entries[bundle_slot(path, len, displacement, h->slots)];
+    
+    if (entry->path_len != len || entry->path >= h->strings_size || len >= h->strings_size - entry->path ||
+        memcmp(bundle.strings + entry->path, path, len) != 0) {
+        return NULL;
+    }
+    if (entry->mime_type >= h->strings_size ||
+        entry->offset > bundle.size || entry->length > bundle.size - entry->offset ||
+        entry->gzip_offset > bundle.size || entry->gzip_length > bundle.size - entry->gzip_offset ||
+        memchr(entry->etag, '\0', sizeof(entry->etag)) == NULL ||
+        memchr(entry->gzip_etag, '\0', sizeof(entry->gzip_etag)) == NULL) {
+        return NULL;
+    }
+    return entry;
+}
+
+/* path é o caminho decodificado da requisição, com a '/' inicial. Corpos
+ * pequenos saem da memória mapeada junto com o cabeçalho num só sendmsg;
+ * os maiores com sendfile a partir do fd do bundle. */
+void send_bundle_file(response_t *res, const http_request_t *request, const char *path, int accepted) {
+    size_t len = strlen(path);
+    while (len > 1 && path[len - 1] == '/') {
+        len--;
+    }
+    const bundle_entry_t *entry = bundle_lookup(path, len);
+    if (entry == NULL) {
+        send_error(res, 404, "Not Found", "Arquivo ou diretório não encontrado");
+        return;
+    }
+    
+    file_meta_t meta;
+    meta.mtime = entry->mtime;
+    meta.mime_type = bundle.strings + entry->mime_type;
+    meta.vary = (entry->flags & BUNDLE_VARY) != 0;
+    uint64_t offset;
+    if (entry->gzip_length > 0 && (accepted & ENCODING_GZIP)) {
+        offset = entry->gzip_offset;
+        meta.size = entry->gzip_length;
+        meta.encoding = "gzip";
+        snprintf(meta.etag, sizeof(meta.etag), "%s", entry->gzip_etag);
+    } else {
+        offset = entry->offset;
+        meta.size = entry->length;
+        meta.encoding = NULL;
+        snprintf(meta.etag, sizeof(meta.etag), "%s", entry->etag);
+    }
+    
+    char header[BUFFER_SIZE];
+    int header_len = format_header_200(&meta, header, sizeof(header));
+    send_representation(res, request, &meta, header, header_len);
+    
+    /* Os trechos foram calculados a partir do início do corpo */
+    for (int i = 0; i < res->part_count; i++) {
+        res->parts[i].offset += offset;
+    }
+    if ((size_t)meta.size <= config.cache_max_file_size) {
+        res->body = bundle.data;
+    } else {
+        res->file_fd = bundle.fd;
+        res->file_shared = 1;
+    }
+}
+
+void build_response(const http_request_t *request, const char *base_directory, response_t *res) {
+    if (!view_equals(request->method, "GET")) {
+        res->keep_alive = 0;
+        send_error(res, 405, "Method Not Allowed", "Apenas método GET é suportado");
+        return;
+    }
+    
+    str_view_t path = request->target;
+    char query[512] = "";
+    const char *query_start = memchr(path.data, '?', path.len);
+    if (query_start != NULL) {
+        snprintf(query, sizeof(query), "%.*s", (int)(path.data + path.len - query_start - 1), query_start + 1);
+        path.len = query_start - path.data;
+    }
+    
+    char requested_path[MAX_PATH_LENGTH];
+    if (url_decode(requested_path, sizeof(requested_path), path.data, path.len) < 0) {
+        res->keep_alive = 0;
+        send_error(res, 400, "Bad Request", "Requisição malformada");
+        return;
+    }
+    
+    if (strcmp(requested_path, STATS_PATH) == 0) {
+        send_stats(res, request, query);
+        return;
+    }
+    
+    if (bundle.data != NULL) {
+        send_bundle_file(res, request, requested_path, accepted_encodings(request));
+        return;
+    }
+    
+    if (strcmp(requested_path, "/") == 0) {
+        strcpy(requested_path, "");
+    } else {
+        memmove(requested_path, requested_path + 1, strlen(requested_path));
+    }
+    
+    /* Arquivos não comprimíveis têm uma só representação; os demais (e
+     * caminhos sem extensão, como diretórios) uma por conjunto de
+     * codificações aceitas */
+    int accepted = accepted_encodings(request);
+    const char *last_segment = strrchr(requested_path, '/');
+    last_segment = last_segment != NULL ? last_segment + 1 : requested_path;
+    int variant = is_compressible(get_mime_type(requested_path)) || strchr(last_segment, '.') == NULL
+                  ? accepted : 0;
+    
+    char cache_key[MAX_PATH_LENGTH + 8];
+    snprintf(cache_key, sizeof(cache_key), "%d:%s", variant, requested_path);
+    if (send_cached_file(res, request, cache_key)) {
+        return;
+    }
+    
+    char full_path[MAX_PATH_LENGTH];
+    if (snprintf(full_path, sizeof(full_path), "%s/%s", base_directory, requested_path) >= (int)sizeof(full_path)) {
+        send_error(res, 414, "URI Too Long", "Caminho muito longo");
+        return;
+    }
+    
+    int fd = open_beneath(requested_path, O_RDONLY | O_NONBLOCK);
+    if (fd < 0) {
+        if (errno == EXDEV || errno == ELOOP || errno == EACCES || errno == EPERM) {
+            send_error(res, 403, "Forbidden", "Acesso ao caminho negado");
+        } else {
+            send_error(res, 404, "Not Found", "Arquivo ou diretório não encontrado");
+        }
+        return;
+    }
+    
+    struct stat path_stat;
+    if (fstat(fd, &path_stat) != 0) {
+        close(fd);
+        send_error(res, 500, "Internal Server Error", "Erro ao ler o arquivo");
+        return;
+    }
+    
+    if (S_ISDIR(path_stat.st_mode)) {
+        char index_path[MAX_PATH_LENGTH];
+        size_t path_len = strlen(requested_path);
+        const char *separator = path_len > 0 && requested_path[path_len - 1] != '/' ? "/" : "";
+        if (snprintf(index_path, sizeof(index_path), "%s%sindex.html", requested_path, separator) >= (int)sizeof(index_path)) {
+            close(fd);
+            send_error(res, 500, "Internal Server Error", "Caminho muito longo");
+            return;
+        }
+        
+        struct stat index_stat;
+        int index_fd = open_beneath(index_path, O_RDONLY | O_NONBLOCK);
+        if (index_fd >= 0 && (fstat(index_fd, &index_stat) != 0 || !S_ISREG(index_stat.st_mode))) {
+            close(index_fd);
+            index_fd = -1;
+        }
+        
+        if (index_fd >= 0) {
+            close(fd);
+            send_file(res, request, index_fd, &index_stat, index_path, "index.html", cache_key, accepted);
+        } else {
+            send_directory_listing(res, fd, full_path, requested_path, query, &path_stat);
+            close(fd);
+        }
+    } else if (S_ISREG(path_stat.st_mode)) {
+        send_file(res, request, fd, &path_stat, requested_path, requested_path, cache_key, accepted);
+    } else {
+        close(fd);
+        send_error(res, 403, "Forbidden", "Acesso ao caminho negado");
+    }
+}
+
+/* Bytes do corpo já enviados numa resposta HTTP/1.1: os cabeçalhos são os
+ * primeiros bytes de data e ficam de fora */
+uint64_t response_body_sent(const response_t *res) {
+    const char *end = res->len > 0 ? memmem(res->data, res->len, "\r\n\r\n", 4) : NULL;
+    size_t header_len = end != NULL ? (size_t)(end + 4 - res->data) : res->len;
+    return res->bytes_sent > header_len ? res->bytes_sent - header_len : 0;
+}
+
+/* Copia os dados da requisição atendida para o anel. Nunca bloqueia: se o
+ * anel estiver cheio o registro é descartado e contado. body_bytes é o
+ * tamanho do corpo enviado, o %b do Common Log Format. */
+void access_log_record_body(const struct sockaddr_in6 *peer, const http_request_t *request, const response_t *res,
+                            uint64_t body_bytes) {
+    if (!access_log.enabled || res->started_us == 0) return;
+    
+    unsigned long pos = __atomic_load_n(&access_log.enqueue_pos, __ATOMIC_RELAXED);
+    log_record_t *record;
+    while (1) {
+        record = &access_log.records[pos & (LOG_RING_SIZE - 1)];
+        unsigned long sequence = __atomic_load_n(&record->sequence, __ATOMIC_ACQUIRE);
+        long diff = (long)(sequence - pos);
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&access_log.enqueue_pos, &pos, pos + 1, 1,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                break;
+            }
+        } else if (diff < 0) {
+            __atomic_fetch_add(&access_log.dropped, 1, __ATOMIC_RELAXED);
+            return;
+        } else {
+            pos = __atomic_load_n(&access_log.enqueue_pos, __ATOMIC_RELAXED);
+        }
+    }
+    
+    clock_gettime(CLOCK_REALTIME, &record->time);
+    record->client = peer->sin6_addr;
+    record->status = response_status(res);
+    const char *v = request->version.data;
+    int valid_version = request->version.len == 8 && memcmp(v, "HTTP/", 5) == 0 &&
+                        v[5] >= '0' && v[5] <= '9' && v[6] == '.' && v[7] >= '0' && v[7] <= '9';
+    snprintf(record->version, sizeof(record->version), "%.*s", valid_version ? 8 : 0, request->version.data);
+    snprintf(record->method, sizeof(record->method), "%.*s", (int)request->method.len, request->method.data);
+    snprintf(record->target, sizeof(record->target), "%.*s", (int)request->target.len, request->target.data);
+    record->bytes = res->bytes_sent;
+    record->body_bytes = body_bytes;
+    long long finished = res->finished_us != 0 ? res->finished_us : monotonic_us();
+    record->duration_us = finished - res->started_us;
+    
+    __atomic_store_n(&record->sequence, pos + 1, __ATOMIC_RELEASE);
+}
+
+/* Registro de uma resposta HTTP/1.1 */
+void access_log_record(const struct sockaddr_in6 *peer, const http_request_t *request, const response_t *res) {
+    if (!access_log.enabled) return;
+    access_log_record_body(peer, request, res, response_body_sent(res));
+}
+
+void format_log_record(response_t *out, const log_record_t *record) {
+    char client[INET6_ADDRSTRLEN];
+    if (IN6_IS_ADDR_V4MAPPED(&record->client)) {
+        inet_ntop(AF_INET, &record->client.s6_addr[12], client, sizeof(client));
+    } else {
+        inet_ntop(AF_INET6, &record->client, client, sizeof(client));
+    }
+    struct tm tm;
+    gmtime_r(&record->time.tv_sec, &tm);
+    char time_str[64];
+    
+    if (config.log_json) {
+        strftime(time_str, sizeof(time_str), "%Y-%m-%dT%H:%M:%S", &tm);
+        response_printf(out, "{\"time\":\"%s.%03ldZ\",\"client\":\"%s\",\"method\":",
+                        time_str, record->time.tv_nsec / 1000000, client);
+        json_append_string(out, record->method);
+        response_printf(out, ",\"target\":");
+        json_append_string(out, record->target);
+        response_printf(out, ",\"version\":\"%s\",\"status\":%d,\"bytes\":%llu,\"bytes_sent\":%llu,"
+                        "\"duration_us\":%llu}\n",
+                        record->version, record->status, (unsigned long long)record->body_bytes,
+                        (unsigned long long)record->bytes, (unsigned long long)record->duration_us);
+    } else {
+        strftime(time_str, sizeof(time_str), "%d/%b/%Y:%H:%M:%S +0000", &tm);
+        /* %b: tamanho do corpo, "-" sem corpo */
+        char bytes[24] = "-";
+        if (record->body_bytes > 0) {
+            snprintf(bytes, sizeof(bytes), "%llu", (unsigned long long)record->body_bytes);
+        }
+        if (record->version[0] == '\0') {
+            response_printf(out, "%s - - [%s] \"-\" %d %s\n", client, time_str, record->status, bytes);
+        } else {
+            response_printf(out, "%s - - [%s] \"%s %s %s\" %d %s\n", client, time_str,
+                            record->method, record->target, record->version, record->status, bytes);
+        }
+    }
+}
+
+int access_log_open(void) {
+    if (strcmp(config.access_log, "-") == 0) {
+        access_log.fd = STDOUT_FILENO;
+        return 0;
+    }
+    access_log.fd = open(config.access_log, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (access_log.fd < 0) {
+        perror("Erro ao abrir o log de acesso");
+        return -1;
+    }
+    struct stat log_stat;
+    access_log.size = fstat(access_log.fd, &log_stat) == 0 ? log_stat.st_size : 0;
+    return 0;
+}
+
+/* Renomeia o log atual para <arquivo>.1 (substituindo o anterior) e
+ * começa um novo */
+void access_log_rotate(void) {
+    char rotated[MAX_PATH_LENGTH];
+    snprintf(rotated, sizeof(rotated), "%s.1", config.access_log);
+    close(access_log.fd);
+    if (rename(config.access_log, rotated) != 0) {
+        perror("Erro ao rotacionar o log de acesso");
+    }
+    access_log_open();
+}
+
+void access_log_write(const char *data, size_t len) {
+    if (access_log.fd != STDOUT_FILENO && config.log_max_size > 0 &&
+        access_log.size > 0 && access_log.size + (off_t)len > (off_t)config.log_max_size) {
+        access_log_rotate();
+    }
+    while (len > 0 && access_log.fd >= 0) {
+        ssize_t written = write(access_log.fd, data, len);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            perror("Erro ao escrever o log de acesso");
+            return;
+        }
+        data += written;
+        len -= written;
+        access_log.size += written;
+    }
+}
+
+/* Thread de escrita: esvazia o anel formatando os registros num buffer e
+ * grava cada lote com um único write; sem registros, dorme um pouco. */
+void *access_log_main(void *arg) {
+    (void)arg;
+    response_t batch;
+    response_init(&batch);
+    
+    while (1) {
+        int count = 0;
+        while (count < LOG_RING_SIZE) {
+            unsigned long pos = access_log.dequeue_pos;
+            log_record_t *record = &access_log.records[pos & (LOG_RING_SIZE - 1)];
+            if (__atomic_load_n(&record->sequence, __ATOMIC_ACQUIRE) != pos + 1) break;
+            
+            format_log_record(&batch, record);
+            __atomic_store_n(&record->sequence, pos + LOG_RING_SIZE, __ATOMIC_RELEASE);
+            access_log.dequeue_pos = pos + 1;
+            count++;
+        }
+        
+        if (batch.len > 0) {
+            access_log_write(batch.data, batch.len);
+            batch.len = 0;
+            __atomic_fetch_add(&access_log.written, count, __ATOMIC_RELAXED);
+        }
+        if (count == 0) {
+            struct timespec pause = { .tv_nsec = 10 * 1000 * 1000 };
+            nanosleep(&pause, NULL);
+        }
+    }
+    return NULL;
+}
+
+int access_log_init(void) {
+    if (config.access_log == NULL) return 0;
+    
+    access_log.records = calloc(LOG_RING_SIZE, sizeof(log_record_t));
+    if (access_log.records == NULL) {
+        perror("Erro ao alocar o log de acesso");
+        return -1;
+    }
+    for (unsigned long i = 0; i < LOG_RING_SIZE; i++) {
+        access_log.records[i].sequence = i;
+    }
+    if (access_log_open() < 0) return -1;
+    
+    pthread_t thread;
+    int err = pthread_create(&thread, NULL, access_log_main, NULL);
+    if (err != 0) {
+        fprintf(stderr, "Erro ao criar a thread do log de acesso: %s\n", strerror(err));
+        return -1;
+    }
+    pthread_detach(thread);
+    access_log.enabled = 1;
+    return 0;
+}
+
+/* HTTP/1.1 mantém a conexão por padrão e HTTP/1.0 só com
+ * "Connection: keep-alive"; "Connection: close" sempre encerra. */
+int wants_keep_alive(const http_request_t *request) {
+    int keep_alive = view_equals(request->version, "HTTP/1.1");
+    
+    char value[256];
+    if (get_header(request, "Connection", value, sizeof(value))) {
+        if (strcasestr(value, "close") != NULL) {
+            keep_alive = 0;
+        } else if (strcasestr(value, "keep-alive") != NULL) {
+            keep_alive = 1;
+        }
+    }
+    
+    return keep_alive;
+}
+
+/* Monta em res a resposta da requisição já analisada, decidindo se a
+ * conexão continua aberta depois dela. */
+void serve_request(const http_request_t *request, int requests_served,
+                   const char *base_directory, response_t *res) {
+    response_free(res);
+    res->started_us = monotonic_us();
+    res->keep_alive = config.keepalive_timeout > 0 &&
+                      requests_served + 1 < config.max_keepalive_requests &&
+                      wants_keep_alive(request);
+    build_response(request, base_directory, res);
+}
+
+/* Resposta de erro para uma requisição malformada; a conexão é encerrada
+ * porque não dá para saber onde começa a próxima. */
+void send_parse_error(response_t *res, int status) {
+    response_free(res);
+    res->started_us = monotonic_us();
+    res->keep_alive = 0;
+    switch (status) {
+    case 414:
+        send_error(res, 414, "URI Too Long", "Caminho muito longo");
+        break;
+    case 431:
+        send_error(res, 431, "Request Header Fields Too Large", "Requisição muito grande");
+        break;
+    case 505:
+        send_error(res, 505, "HTTP Version Not Supported", "Versão do HTTP não suportada");
+        break;
+    default:
+        send_error(res, 400, "Bad Request", "Requisição malformada");
+        break;
+    }
+}
+
+/* Fecha com RST no lugar de FIN: o que ainda estava no buffer de envio de
+ * um cliente que parou de ler é descartado na hora */
+void socket_abort(int fd) {
+    struct linger linger = { .l_onoff = 1, .l_linger = 0 };
+    setsockopt(fd, SOL_SOCKET, SO_LINGER, &linger, sizeof(linger));
+}
+
+/* Prazo absoluto (ms monotônicos) daqui a `seconds`; -1 sem prazo */
+long long deadline_after(int seconds) {
+    return seconds > 0 ? monotonic_us() / 1000 + (long long)seconds * 1000 : -1;
+}
+
+/* Espera o socket ficar pronto (POLLIN ou POLLOUT) até o prazo; 0 se
+ * ele venceu */
+int wait_socket(int fd, short events, long long deadline) {
+    while (1) {
+        int timeout = -1;
+        if (deadline >= 0) {
+            long long remaining = deadline - monotonic_us() / 1000;
+            if (remaining <= 0) return 0;
+            timeout = remaining > INT_MAX ? INT_MAX : (int)remaining;
+        }
+        struct pollfd pfd = { .fd = fd, .events = events };
+        int ready = poll(&pfd, 1, timeout);
+        if (ready > 0) return 1;
+        if (ready < 0 && errno != EINTR) return 1;
+    }
+}
+
+/* Envia a resposta inteira pelo socket não bloqueante; 0 se o cliente
+ * ficou send_timeout segundos sem ler nada (SO_SNDTIMEO não vale para o
+ * sendfile) */
+int response_write_all(int sock, response_t *res) {
+    while (1) {
+        int result = response_write(sock, res, NULL);
+        if (result != 0) return result;
+        if (!wait_socket(sock, POLLOUT, deadline_after(config.send_timeout))) return 0;
+    }
+}
+
+/* ---- HTTP/2 sem TLS (h2c) ---- */
+
+/* Uma sessão HTTP/2 não depende do transporte: o laço que a atende lê do
+ * socket para in, chama h2_session_process e envia out com
+ * h2_session_write. Cada stream é uma requisição remontada no formato
+ * HTTP/1.1 e atendida por build_response, como as demais; o corpo sai em
+ * quadros DATA, um por stream em rodízio, dentro das janelas de controle de
+ * fluxo da conexão e de cada stream. */
+#define H2_PREFACE "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define H2_PREFACE_LEN 24
+#define H2_PREFACE_LINE_LEN 16           /* "PRI * HTTP/2.0\r\n" */
+#define H2_FRAME_HEADER_SIZE 9
+#define H2_MAX_FRAME_SIZE 16384          /* maior quadro recebido e enviado */
+#define H2_MAX_STREAMS 100               /* SETTINGS_MAX_CONCURRENT_STREAMS */
+#define H2_DEFAULT_WINDOW 65535
+#define H2_MAX_WINDOW 0x7fffffff
+#define H2_HEADER_BLOCK_SIZE (16 * 1024) /* HEADERS + CONTINUATION de uma requisição */
+#define H2_OUTPUT_HIGH_WATER (64 * 1024) /* não enquadra mais DATA com isto pendente */
+#define H2_OUTPUT_MAX (4 * H2_OUTPUT_HIGH_WATER) /* para de ler do cliente com isto pendente */
+#define HPACK_STATIC_COUNT 61
+#define HPACK_TABLE_SIZE 4096            /* tabela dinâmica, em cada sentido */
+#define HPACK_TABLE_ENTRIES (HPACK_TABLE_SIZE / 32 + 1)
+
+enum {
+    H2_DATA,
+    H2_HEADERS,
+    H2_PRIORITY,
+    H2_RST_STREAM,
+    H2_SETTINGS,
+    H2_PUSH_PROMISE,
+    H2_PING,
+    H2_GOAWAY,
+    H2_WINDOW_UPDATE,
+    H2_CONTINUATION
+};
+
+#define H2_FLAG_END_STREAM 0x1
+#define H2_FLAG_ACK 0x1
+#define H2_FLAG_END_HEADERS 0x4
+#define H2_FLAG_PADDED 0x8
+#define H2_FLAG_PRIORITY 0x20
+
+enum {
+    H2_NO_ERROR = 0x0,
+    H2_PROTOCOL_ERROR = 0x1,
+    H2_INTERNAL_ERROR = 0x2,
+    H2_FLOW_CONTROL_ERROR = 0x3,
+    H2_STREAM_CLOSED = 0x5,
+    H2_FRAME_SIZE_ERROR = 0x6,
+    H2_REFUSED_STREAM = 0x7,
+    H2_COMPRESSION_ERROR = 0x9,
+    H2_ENHANCE_YOUR_CALM = 0xb
+};
+
+enum {
+    H2_SETTINGS_HEADER_TABLE_SIZE = 0x1,
+    H2_SETTINGS_ENABLE_PUSH = 0x2,
+    H2_SETTINGS_MAX_CONCURRENT_STREAMS = 0x3,
+    H2_SETTINGS_INITIAL_WINDOW_SIZE = 0x4,
+    H2_SETTINGS_MAX_FRAME_SIZE = 0x5
+};
+
+/* Tabela estática do HPACK (RFC 7541, apêndice A): o índice i está em
+ * hpack_static[i - 1] */
+const char *hpack_static[HPACK_STATIC_COUNT][2] = {
+    {":authority", ""},
+    {":method", "GET"},
+    {":method", "POST"},
+    {":path", "/"},
+    {":path", "/index.html"},
+    {":scheme", "http"},
+    {":scheme", "https"},
+    {":status", "200"},
+    {":status", "204"},
+    {":status", "206"},
+    {":status", "304"},
+    {":status", "400"},
+    {":status", "404"},
+    {":status", "500"},
+    {"accept-charset", ""},
+    {"accept-encoding", "gzip, deflate"},
+    {"accept-language", ""},
+    {"accept-ranges", ""},
+    {"accept", ""},
+    {"access-control-allow-origin", ""},
+    {"age", ""},
+    {"allow", ""},
+    {"authorization", ""},
+    {"cache-control", ""},
+    {"content-disposition", ""},
+    {"content-encoding", ""},
+    {"content-language", ""},
+    {"content-length", ""},
+    {"content-location", ""},
+    {"content-range", ""},
+    {"content-type", ""},
+    {"cookie", ""},
+    {"date", ""},
+    {"etag", ""},
+    {"expect", ""},
+    {"expires", ""},
+    {"from", ""},
+    {"host", ""},
+    {"if-match", ""},
+    {"if-modified-since", ""},
+    {"if-none-match", ""},
+    {"if-range", ""},
+    {"if-unmodified-since", ""},
+    {"last-modified", ""},
+    {"link", ""},
+    {"location", ""},
+    {"max-forwards", ""},
+    {"proxy-authenticate", ""},
+    {"proxy-authorization", ""},
+    {"range", ""},
+    {"referer", ""},
+    {"refresh", ""},
+    {"retry-after", ""},
+    {"server", ""},
+    {"set-cookie", ""},
+    {"strict-transport-security", ""},
+    {"transfer-encoding", ""},
+    {"user-agent", ""},
+    {"vary", ""},
+    {"via", ""},
+    {"www-authenticate", ""},
+};
+
+/* Código de Huffman do HPACK (RFC 7541, apêndice B) de cada byte, com o
+ * tamanho em bits; o EOS (símbolo 256) é 0x3fffffff com 30 bits */
+const uint32_t hpack_huffman_codes[256] = {
+    0x1ff8, 0x7fffd8, 0xfffffe2, 0xfffffe3, 0xfffffe4, 0xfffffe5, 0xfffffe6, 0xfffffe7,
+    0xfffffe8, 0xffffea, 0x3ffffffc, 0xfffffe9, 0xfffffea, 0x3ffffffd, 0xfffffeb, 0xfffffec,
+    0xfffffed, 0xfffffee, 0xfffffef, 0xffffff0, 0xffffff1, 0xffffff2, 0x3ffffffe, 0xffffff3,
+    0xffffff4, 0xffffff5, 0xffffff6, 0xffffff7, 0xffffff8, 0xffffff9, 0xffffffa, 0xffffffb,
+    0x14, 0x3f8, 0x3f9, 0xffa, 0x1ff9, 0x15, 0xf8, 0x7fa,
+    0x3fa, 0x3fb, 0xf9, 0x7fb, 0xfa, 0x16, 0x17, 0x18,
+    0x0, 0x1, 0x2, 0x19, 0x1a, 0x1b, 0x1c, 0x1d,
+    0x1e, 0x1f, 0x5c, 0xfb, 0x7ffc, 0x20, 0xffb, 0x3fc,
+    0x1ffa, 0x21, 0x5d, 0x5e, 0x5f, 0x60, 0x61, 0x62,
+    0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69, 0x6a,
+    0x6b, 0x6c, 0x6d, 0x6e, 0x6f, 0x70, 0x71, 0x72,
+    0xfc, 0x73, 0xfd, 0x1ffb, 0x7fff0, 0x1ffc, 0x3ffc, 0x22,
+    0x7ffd, 0x3, 0x23, 0x4, 0x24, 0x5, 0x25, 0x26,
+    0x27, 0x6, 0x74, 0x75, 0x28, 0x29, 0x2a, 0x7,
+    0x2b, 0x76, 0x2c, 0x8, 0x9, 0x2d, 0x77, 0x78,
+    0x79, 0x7a, 0x7b, 0x7ffe, 0x7fc, 0x3ffd, 0x1ffd, 0xffffffc,
+    0xfffe6, 0x3fffd2, 0xfffe7, 0xfffe8, 0x3fffd3, 0x3fffd4, 0x3fffd5, 0x7fffd9,
+    0x3fffd6, 0x7fffda, 0x7fffdb, 0x7fffdc, 0x7fffdd, 0x7fffde, 0xffffeb, 0x7fffdf,
+    0xffffec, 0xffffed, 0x3fffd7, 0x7fffe0, 0xffffee, 0x7fffe1, 0x7fffe2, 0x7fffe3,
+    0x7fffe4, 0x1fffdc, 0x3fffd8, 0x7fffe5, 0x3fffd9, 0x7fffe6, 0x7fffe7, 0xffffef,
+    0x3fffda, 0x1fffdd, 0xfffe9, 0x3fffdb, 0x3fffdc, 0x7fffe8, 0x7fffe9, 0x1fffde,
+    0x7fffea, 0x3fffdd, 0x3fffde, 0xfffff0, 0x1fffdf, 0x3fffdf, 0x7fffeb, 0x7fffec,
+    0x1fffe0, 0x1fffe1, 0x3fffe0, 0x1fffe2, 0x7fffed, 0x3fffe1, 0x7fffee, 0x7fffef,
+    0xfffea, 0x3fffe2, 0x3fffe3, 0x3fffe4, 0x7ffff0, 0x3fffe5, 0x3fffe6, 0x7ffff1,
+    0x3ffffe0, 0x3ffffe1, 0xfffeb, 0x7fff1, 0x3fffe7, 0x7ffff2, 0x3fffe8, 0x1ffffec,
+    0x3ffffe2, 0x3ffffe3, 0x3ffffe4, 0x7ffffde, 0x7ffffdf, 0x3ffffe5, 0xfffff1, 0x1ffffed,
+    0x7fff2, 0x1fffe3, 0x3ffffe6, 0x7ffffe0, 0x7ffffe1, 0x3ffffe7, 0x7ffffe2, 0xfffff2,
+    0x1fffe4, 0x1fffe5, 0x3ffffe8, 0x3ffffe9, 0xffffffd, 0x7ffffe3, 0x7ffffe4, 0x7ffffe5,
+    0xfffec, 0xfffff3, 0xfffed, 0x1fffe6, 0x3fffe9, 0x1fffe7, 0x1fffe8, 0x7ffff3,
+    0x3fffea, 0x3fffeb, 0x1ffffee, 0x1ffffef, 0xfffff4, 0xfffff5, 0x3ffffea, 0x7ffff4,
+    0x3ffffeb, 0x7ffffe6, 0x3ffffec, 0x3ffffed, 0x7ffffe7, 0x7ffffe8, 0x7ffffe9, 0x7ffffea,
+    0x7ffffeb, 0xffffffe, 0x7ffffec, 0x7ffffed, 0x7ffffee, 0x7ffffef, 0x7fffff0, 0x3ffffee,
+};
+
+const uint8_t hpack_huffman_lengths[256] = {
+    13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+    28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+    6, 10, 10, 12, 13, 6, 8, 11, 10, 10, 8, 11, 8, 6, 6, 6,
+    5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 7, 8, 15, 6, 12, 10,
+    13, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+    7, 7, 7, 7, 7, 7, 7, 7, 8, 7, 8, 13, 19, 13, 14, 6,
+    15, 5, 6, 5, 6, 5, 6, 6, 6, 5, 7, 7, 6, 6, 6, 5,
+    6, 7, 6, 5, 5, 6, 7, 7, 7, 7, 7, 15, 11, 14, 13, 28,
+    20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+    24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+    22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+    21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+    26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+    19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+    20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+    26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+};
+
+/* Nós internos da árvore de Huffman montada em hpack_init; filhos
+ * negativos são folhas -(símbolo + 1) */
+int16_t hpack_huffman_tree[256][2];
+
+void hpack_init(void) {
+    int nodes = 1;
+    for (int symbol = 0; symbol <= 256; symbol++) {
+        uint32_t code = symbol < 256 ? hpack_huffman_codes[symbol] : 0x3fffffff;
+        int length = symbol < 256 ? hpack_huffman_lengths[symbol] : 30;
+        int node = 0;
+        for (int bit = length - 1; bit > 0; bit--) {
+            int b = (code >> bit) & 1;
+            if (hpack_huffman_tree[node][b] == 0) {
+                hpack_huffman_tree[node][b] = nodes++;
+            }
+            node = hpack_huffman_tree[node][b];
+        }
+        hpack_huffman_tree[node][code & 1] = -(symbol + 1);
+    }
+}
+
+/* Tabela dinâmica do HPACK: um anel em que a entrada mais nova (índice
+ * 62) fica em entries[first] */
+typedef struct {
+    char *name;                  /* nome e valor num só bloco, com terminadores */
+    char *value;
+    size_t name_len;
+    size_t value_len;
+} hpack_field_t;
+
+typedef struct {
+    hpack_field_t entries[HPACK_TABLE_ENTRIES];
+    int first;
+    int count;
+    size_t size;                 /* nome + valor + 32 por entrada (RFC 7541, 4.1) */
+    size_t max_size;
+} hpack_table_t;
+
+hpack_field_t *hpack_table_get(hpack_table_t *table, int i) {
+    return &table->entries[(table->first + i) % HPACK_TABLE_ENTRIES];
+}
+
+void hpack_table_evict(hpack_table_t *table, size_t max_size) {
+    while (table->count > 0 && table->size > max_size) {
+        hpack_field_t *oldest = hpack_table_get(table, table->count - 1);
+        table->size -= oldest->name_len + oldest->value_len + 32;
+        free(oldest->name);
+        table->count--;
+    }
+}
+
+void hpack_table_resize(hpack_table_t *table, size_t max_size) {
+    table->max_size = max_size;
+    hpack_table_evict(table, max_size);
+}
+
+/* Uma entrada maior que a tabela inteira só a esvazia. A cópia é feita
+ * antes de despejar as antigas, porque name pode estar numa delas. */
+int hpack_table_add(hpack_table_t *table, const char *name, size_t name_len,
+                    const char *value, size_t value_len) {
+    size_t size = name_len + value_len + 32;
+    if (size > table->max_size) {
+        hpack_table_evict(table, 0);
+        return 0;
+    }
+    char *copy = malloc(name_len + value_len + 2);
+    if (copy == NULL) {
+        return -1;
+    }
+    memcpy(copy, name, name_len);
+    copy[name_len] = '\0';
+    memcpy(copy + name_len + 1, value, value_len);
+    copy[name_len + 1 + value_len] = '\0';
+    
+    hpack_table_evict(table, table->max_size - size);
+    table->first = (table->first + HPACK_TABLE_ENTRIES - 1) % HPACK_TABLE_ENTRIES;
+    hpack_field_t *field = &table->entries[table->first];
+    field->name = copy;
+    field->value = copy + name_len + 1;
+    field->name_len = name_len;
+    field->value_len = value_len;
+    table->count++;
+    table->size += size;
+    return 0;
+}
+
+/* Nome e valor do índice, na tabela estática ou na dinâmica; 0 se ele não
+ * existe */
+int hpack_lookup(hpack_table_t *table, uint32_t index, const char **name, size_t *name_len,
+                 const char **value, size_t *value_len) {
+    if (index == 0) return 0;
+    if (index <= HPACK_STATIC_COUNT) {
+        *name = hpack_static[index - 1][0];
+        *value = hpack_static[index - 1][1];
+        *name_len = strlen(*name);
+        *value_len = strlen(*value);
+        return 1;
+    }
+    index -= HPACK_STATIC_COUNT + 1;
+    if (index >= (uint32_t)table->count) return 0;
+    hpack_field_t *field = hpack_table_get(table, index);
+    *name = field->name;
+    *value = field->value;
+    *name_len = field->name_len;
+    *value_len = field->value_len;
+    return 1;
+}
+
+/* Índice da entrada com name e value (0 se não houver) e, em name_index,
+ * o de uma entrada só com o mesmo nome */
+int hpack_find(hpack_table_t *table, const char *name, const char *value, uint32_t *name_index) {
+    *name_index = 0;
+    for (int i = 0; i < HPACK_STATIC_COUNT; i++) {
+        if (strcmp(hpack_static[i][0], name) == 0) {
+            if (strcmp(hpack_static[i][1], value) == 0) return i + 1;
+            if (*name_index == 0) *name_index = i + 1;
+        }
+    }
+    for (int i = 0; i < table->count; i++) {
+        hpack_field_t *field = hpack_table_get(table, i);
+        if (strcmp(field->name, name) == 0) {
+            if (strcmp(field->value, value) == 0) return HPACK_STATIC_COUNT + 1 + i;
+            if (*name_index == 0) *name_index = HPACK_STATIC_COUNT + 1 + i;
+        }
+    }
+    return 0;
+}
+
+/* Inteiro com prefixo de prefix_bits bits (RFC 7541, 5.1) */
+int hpack_decode_int(const uint8_t **p, const uint8_t *end, int prefix_bits, uint32_t *value) {
+    if (*p >= end) return -1;
+    uint32_t max = (1u << prefix_bits) - 1;
+    uint32_t result = *(*p)++ & max;
+    if (result == max) {
+        int shift = 0;
+        uint8_t byte;
+        do {
+            if (*p >= end || shift > 21) return -1;
+            byte = *(*p)++;
+            result += (uint32_t)(byte & 0x7f) << shift;
+            shift += 7;
+        } while (byte & 0x80);
+    }
+    *value = result;
+    return 0;
+}
+
+void hpack_encode_int(response_t *out, uint8_t first, int prefix_bits, uint32_t value) {
+    uint8_t bytes[8];
+    size_t n = 0;
+    uint32_t max = (1u << prefix_bits) - 1;
+    if (value < max) {
+        bytes[n++] = first | value;
+    } else {
+        bytes[n++] = first | max;
+        value -= max;
+        while (value >= 0x80) {
+            bytes[n++] = (value & 0x7f) | 0x80;
+            value >>= 7;
+        }
+        bytes[n++] = value;
+    }
+    response_append(out, (const char *)bytes, n);
+}
+
+/* Percorre a árvore bit a bit; o que sobra depois do último símbolo deve
+ * ser preenchimento de até 7 bits 1 (o início do EOS). Retorna o tamanho
+ * decodificado ou -1. */
+int hpack_huffman_decode(const uint8_t *in, size_t len, char *out, size_t out_size) {
+    size_t n = 0;
+    int node = 0;
+    int pending_bits = 0;
+    int all_ones = 1;
+    for (size_t i = 0; i < len; i++) {
+        for (int bit = 7; bit >= 0; bit--) {
+            int b = (in[i] >> bit) & 1;
+            int next = hpack_huffman_tree[node][b];
+            pending_bits++;
+            all_ones &= b;
+            if (next < 0) {
+                if (next == -257 || n == out_size) return -1;
+                out[n++] = -next - 1;
+                node = 0;
+                pending_bits = 0;
+                all_ones = 1;
+            } else {
+                node = next;
+            }
+        }
+    }
+    if (pending_bits > 7 || !all_ones) return -1;
+    return n;
+}
+
+/* Literal de string: com Huffman quando fica menor */
+void hpack_encode_string(response_t *out, const char *str, size_t len) {
+    size_t bits = 0;
+    for (size_t i = 0; i < len; i++) {
+        bits += hpack_huffman_lengths[(uint8_t)str[i]];
+    }
+    size_t huffman_len = (bits + 7) / 8;
+    if (huffman_len >= len) {
+        hpack_encode_int(out, 0x00, 7, len);
+        response_append(out, str, len);
+        return;
+    }
+    
+    hpack_encode_int(out, 0x80, 7, huffman_len);
+    char chunk[256];
+    size_t n = 0;
+    uint64_t acc = 0;
+    int acc_bits = 0;
+    for (size_t i = 0; i < len; i++) {
+        uint8_t c = str[i];
+        acc = (acc << hpack_huffman_lengths[c]) | hpack_huffman_codes[c];
+        acc_bits += hpack_huffman_lengths[c];
+        while (acc_bits >= 8) {
+            acc_bits -= 8;
+            chunk[n++] = acc >> acc_bits;
+            if (n == sizeof(chunk)) {
+                response_append(out, chunk, n);
+                n = 0;
+            }
+        }
+    }
+    if (acc_bits > 0) {
+        chunk[n++] = (acc << (8 - acc_bits)) | (0xff >> acc_bits);
+    }
+    response_append(out, chunk, n);
+}
+
+int hpack_decode_string(const uint8_t **p, const uint8_t *end, char *out, size_t out_size) {
+    if (*p >= end) return -1;
+    int huffman = **p & 0x80;
+    uint32_t len;
+    if (hpack_decode_int(p, end, 7, &len) < 0 || len > (size_t)(end - *p)) return -1;
+    const uint8_t *data = *p;
+    *p += len;
+    if (huffman) return hpack_huffman_decode(data, len, out, out_size);
+    if (len > out_size) return -1;
+    memcpy(out, data, len);
+    return len;
+}
+
+/* Requisição recebida em HEADERS, remontada como HTTP/1.1 por
+ * h2_request_format */
+typedef struct {
+    char method[32];
+    char path[MAX_PATH_LENGTH];
+    char authority[256];
+    char headers[BUFFER_SIZE];
+    size_t headers_len;
+    int status;                  /* != 0: recusada com este status */
+} h2_request_t;
+
+/* Pseudo-cabeçalhos vão para os campos próprios e os demais viram linhas
+ * "nome: valor". CR, LF e NUL não podem aparecer (RFC 9113, 8.2.1): a
+ * requisição remontada seria outra. */
+void h2_request_add(h2_request_t *req, const char *name, size_t name_len,
+                    const char *value, size_t value_len) {
+    if (req->status != 0) return;
+    if (name_len == 0 || memchr(value, '\r', value_len) != NULL ||
+        memchr(value, '\n', value_len) != NULL || memchr(value, '\0', value_len) != NULL) {
+        req->status = 400;
+        return;
+    }
+    
+    if (name[0] == ':') {
+        char *field = NULL;
+        size_t field_size = 0;
+        if (name_len == 7 && memcmp(name, ":method", 7) == 0) {
+            field = req->method;
+            field_size = sizeof(req->method);
+        } else if (name_len == 5 && memcmp(name, ":path", 5) == 0) {
+            field = req->path;
+            field_size = sizeof(req->path);
+        } else if (name_len == 10 && memcmp(name, ":authority", 10) == 0) {
+            field = req->authority;
+            field_size = sizeof(req->authority);
+        } else if (name_len == 7 && memcmp(name, ":scheme", 7) == 0) {
+            return;
+        } else {
+            req->status = 400;
+            return;
+        }
+        if (value_len >= field_size) {
+            req->status = field == req->path ? 414 : 431;
+            return;
+        }
+        memcpy(field, value, value_len);
+        field[value_len] = '\0';
+        return;
+    }
+    
+    for (size_t i = 0; i < name_len; i++) {
+        if (!is_token_char(name[i])) {
+            req->status = 400;
+            return;
+        }
+    }
+    /* Cabeçalhos da conexão HTTP/1.1 não têm sentido num stream */
+    static const char *const hop_by_hop[] = { "connection", "keep-alive", "upgrade", "transfer-encoding" };
+    for (size_t i = 0; i < sizeof(hop_by_hop) / sizeof(hop_by_hop[0]); i++) {
+        if (name_len == strlen(hop_by_hop[i]) && memcmp(name, hop_by_hop[i], name_len) == 0) return;
+    }
+    if (req->headers_len + name_len + value_len + 4 > sizeof(req->headers)) {
+        req->status = 431;
+        return;
+    }
+    char *out = req->headers + req->headers_len;
+    memcpy(out, name, name_len);
+    memcpy(out + name_len, ": ", 2);
+    memcpy(out + name_len + 2, value, value_len);
+    memcpy(out + name_len + 2 + value_len, "\r\n", 2);
+    req->headers_len += name_len + value_len + 4;
+}
+
+/* Escreve em buffer a requisição no formato HTTP/1.1 que http_parse
+ * entende; devolve o tamanho, ou 0 com req->status preenchido */
+size_t h2_request_format(h2_request_t *req, char *buffer, size_t size) {
+    if (req->status == 0 && (req->method[0] == '\0' || req->path[0] == '\0')) {
+        req->status = 400;
+    }
+    if (req->status != 0) return 0;
+    
+    int len = snprintf(buffer, size, "%s %s HTTP/1.1\r\n", req->method, req->path);
+    if (req->authority[0] != '\0' && len >= 0 && (size_t)len < size) {
+        len += snprintf(buffer + len, size - len, "Host: %s\r\n", req->authority);
+    }
+    if (len < 0 || (size_t)len + req->headers_len + 2 > size) {
+        req->status = 431;
+        return 0;
+    }
+    memcpy(buffer + len, req->headers, req->headers_len);
+    memcpy(buffer + len + req->headers_len, "\r\n", 2);
+    return len + req->headers_len + 2;
+}
+
+typedef struct h2_stream {
+    uint32_t id;
+    long long window;            /* janela de envio; fica negativa se o cliente a reduzir */
+    long long body_left;         /* bytes do corpo ainda não enquadrados */
+    uint64_t body_sent;          /* bytes do corpo já enquadrados, para o log */
+    char request[BUFFER_SIZE];   /* requisição no formato HTTP/1.1 */
+    http_request_t parser;
+    response_t res;
+    struct h2_stream *next;
+} h2_stream_t;
+
+typedef struct h2_session {
+    const char *base_directory;
+    struct sockaddr_in6 peer;
+    int preface_received;
+    uint8_t in[H2_FRAME_HEADER_SIZE + H2_MAX_FRAME_SIZE];
+    size_t in_len;
+    response_t out;              /* quadros prontos para o socket (data, len, sent) */
+    hpack_table_t decoder;
+    hpack_table_t encoder;
+    int encoder_resized;         /* o novo tamanho vai no início do próximo bloco */
+    uint8_t block[H2_HEADER_BLOCK_SIZE]; /* bloco de cabeçalhos sendo montado */
+    size_t block_len;
+    uint32_t block_stream;       /* stream do bloco sendo montado; 0 se nenhum */
+    char strings[2][H2_HEADER_BLOCK_SIZE]; /* nome e valor sendo decodificados */
+    long long window;            /* janela de envio da conexão */
+    long long initial_window;    /* janela inicial dos streams, anunciada pelo cliente */
+    uint32_t max_frame_size;     /* anunciado pelo cliente */
+    uint32_t last_stream;        /* maior stream aberto pelo cliente */
+    uint32_t last_served;        /* último stream que recebeu DATA, para o rodízio */
+    h2_stream_t *streams;        /* em andamento, em ordem crescente de id */
+    int stream_count;
+    int closing;                 /* GOAWAY enviado ou recebido: termina os streams e fecha */
+    int failed;                  /* erro de conexão: o restante da entrada é ignorado */
+} h2_session_t;
+
+void h2_put16(uint8_t *p, uint32_t value) {
+    p[0] = value >> 8;
+    p[1] = value;
+}
+
+void h2_put32(uint8_t *p, uint32_t value) {
+    p[0] = value >> 24;
+    p[1] = value >> 16;
+    p[2] = value >> 8;
+    p[3] = value;
+}
+
+uint32_t h2_get32(const uint8_t *p) {
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+void h2_frame_header(uint8_t *p, size_t length, int type, int flags, uint32_t stream_id) {
+    p[0] = length >> 16;
+    p[1] = length >> 8;
+    p[2] = length;
+    p[3] = type;
+    p[4] = flags;
+    h2_put32(p + 5, stream_id);
+}
+
+void h2_queue_frame(h2_session_t *s, int type, int flags, uint32_t stream_id,
+                    const void *payload, size_t length) {
+    uint8_t header[H2_FRAME_HEADER_SIZE];
+    h2_frame_header(header, length, type, flags, stream_id);
+    response_append(&s->out, (const char *)header, sizeof(header));
+    response_append(&s->out, payload, length);
+}
+
+void h2_reset_stream(h2_session_t *s, uint32_t stream_id, uint32_t error) {
+    uint8_t payload[4];
+    h2_put32(payload, error);
+    h2_queue_frame(s, H2_RST_STREAM, 0, stream_id, payload, sizeof(payload));
+}
+
+h2_stream_t *h2_find_stream(h2_session_t *s, uint32_t stream_id) {
+    for (h2_stream_t *stream = s->streams; stream != NULL; stream = stream->next) {
+        if (stream->id == stream_id) return stream;
+    }
+    return NULL;
+}
+
+/* Tira o stream da sessão; completed diz se a resposta foi inteira (só
+ * então ela conta nas estatísticas), mas o log registra as duas */
+void h2_stream_close(h2_session_t *s, h2_stream_t *stream, int completed) {
+    h2_stream_t **link = &s->streams;
+    while (*link != stream) {
+        link = &(*link)->next;
+    }
+    *link = stream->next;
+    s->stream_count--;
+    
+    if (completed) {
+        response_done(&stream->res);
+    }
+    access_log_record_body(&s->peer, &stream->parser, &stream->res, stream->body_sent);
+    response_free(&stream->res);
+    free(stream);
+}
+
+/* Erro de conexão: GOAWAY com o último stream aceito, e os streams em
+ * andamento são abandonados */
+void h2_goaway(h2_session_t *s, uint32_t error) {
+    if (s->failed) return;
+    uint8_t payload[8];
+    h2_put32(payload, s->last_stream);
+    h2_put32(payload + 4, error);
+    h2_queue_frame(s, H2_GOAWAY, 0, 0, payload, sizeof(payload));
+    s->closing = 1;
+    if (error != H2_NO_ERROR) {
+        s->failed = 1;
+        while (s->streams != NULL) {
+            h2_stream_close(s, s->streams, 0);
+        }
+    }
+}
+
+h2_stream_t *h2_stream_new(h2_session_t *s, uint32_t stream_id) {
+    h2_stream_t *stream = malloc(sizeof(h2_stream_t));
+    if (stream == NULL) return NULL;
+    stream->id = stream_id;
+    stream->window = s->initial_window;
+    stream->body_left = 0;
+    stream->body_sent = 0;
+    stream->next = NULL;
+    http_parser_reset(&stream->parser);
+    response_init(&stream->res);
+    
+    h2_stream_t **link = &s->streams;
+    while (*link != NULL) {
+        link = &(*link)->next;
+    }
+    *link = stream;
+    s->stream_count++;
+    return stream;
+}
+
+/* Cabeçalho da resposta montada por build_response em HPACK: o status
+ * vira :status, os nomes ficam em minúsculas e os cabeçalhos da conexão
+ * HTTP/1.1 somem. Os que se repetem de uma resposta para outra (tipo,
+ * servidor, cache) entram na tabela dinâmica e nas próximas custam um
+ * byte cada; os que mudam sempre não são indexados para não despejá-los. */
+void h2_encode_field(h2_session_t *s, response_t *block, const char *name, const char *value) {
+    uint32_t name_index;
+    int index = hpack_find(&s->encoder, name, value, &name_index);
+    if (index != 0) {
+        hpack_encode_int(block, 0x80, 7, index);
+        return;
+    }
+    int indexed = strcmp(name, "content-length") != 0 && strcmp(name, "content-range") != 0 &&
+                  strcmp(name, "etag") != 0 && strcmp(name, "last-modified") != 0;
+    /* Sem memória para a cópia, a entrada vai sem indexação e as duas
+     * tabelas continuam iguais */
+    if (indexed && hpack_table_add(&s->encoder, name, strlen(name), value, strlen(value)) < 0) {
+        indexed = 0;
+    }
+    hpack_encode_int(block, indexed ? 0x40 : 0x00, indexed ? 6 : 4, name_index);
+    if (name_index == 0) {
+        hpack_encode_string(block, name, strlen(name));
+    }
+    hpack_encode_string(block, value, strlen(value));
+}
+
+void h2_send_headers(h2_session_t *s, h2_stream_t *stream) {
+    response_t *res = &stream->res;
+    const char *header_end = memmem(res->data, res->len, "\r\n\r\n", 4);
+    size_t header_len = header_end != NULL ? (size_t)(header_end - res->data) + 4 : res->len;
+    
+    response_t block;
+    response_init(&block);
+    if (s->encoder_resized) {
+        hpack_encode_int(&block, 0x20, 5, s->encoder.max_size);
+        s->encoder_resized = 0;
+    }
+    char status[8];
+    snprintf(status, sizeof(status), "%d", response_status(res));
+    h2_encode_field(s, &block, ":status", status);
+    
+    const char *line = memchr(res->data, '\n', header_len);
+    line = line != NULL ? line + 1 : res->data + header_len;
+    while (line + 2 < res->data + header_len) {
+        const char *eol = memmem(line, res->data + header_len - line, "\r\n", 2);
+        const char *colon = memchr(line, ':', eol - line);
+        char name[64];
+        char value[BUFFER_SIZE];
+        if (colon != NULL && (size_t)(colon - line) < sizeof(name)) {
+            size_t name_len = colon - line;
+            for (size_t i = 0; i < name_len; i++) {
+                name[i] = tolower((unsigned char)line[i]);
+            }
+            name[name_len] = '\0';
+            const char *start = colon + 1;
+            while (start < eol && *start == ' ') start++;
+            snprintf(value, sizeof(value), "%.*s", (int)(eol - start), start);
+            if (strcmp(name, "connection") != 0 && strcmp(name, "keep-alive") != 0 &&
+                strcmp(name, "transfer-encoding") != 0 && strcmp(name, "upgrade") != 0) {
+                h2_encode_field(s, &block, name, value);
+            }
+        }
+        line = eol + 2;
+    }
+    
+    res->sent = header_len;
+    stream->body_left = res->len - header_len;
+    for (int i = 0; i < res->part_count; i++) {
+        stream->body_left += res->parts[i].length;
+    }
+    
+    /* Blocos maiores que o quadro do cliente seguem em CONTINUATION */
+    size_t offset = 0;
+    int type = H2_HEADERS;
+    do {
+        size_t length = block.len - offset < s->max_frame_size ? block.len - offset : s->max_frame_size;
+        int flags = offset + length == block.len ? H2_FLAG_END_HEADERS : 0;
+        if (type == H2_HEADERS && stream->body_left == 0) {
+            flags |= H2_FLAG_END_STREAM;
+        }
+        h2_queue_frame(s, type, flags, stream->id, block.data + offset, length);
+        response_sent(res, H2_FRAME_HEADER_SIZE + length);
+        offset += length;
+        type = H2_CONTINUATION;
+    } while (offset < block.len);
+    response_free(&block);
+    
+    if (stream->body_left == 0) {
+        h2_stream_close(s, stream, 1);
+    }
+}
+
+/* Atende o stream cuja requisição está em stream->request (len bytes);
+ * status != 0 recusa a requisição com esse erro */
+void h2_stream_start(h2_session_t *s, h2_stream_t *stream, size_t len, int status) {
+    int parsed = status == 0 ? http_parse(&stream->parser, stream->request, len) : -1;
+    if (parsed == 1) {
+        stream->parser.version = (str_view_t){ "HTTP/2.0", 8 };
+        stream->res.started_us = monotonic_us();
+        stream->res.keep_alive = 1;
+        build_response(&stream->parser, s->base_directory, &stream->res);
+    } else {
+        send_parse_error(&stream->res, status != 0 ? status : parsed < 0 ? stream->parser.error : 400);
+    }
+    h2_send_headers(s, stream);
+}
+
+/* Decodifica o bloco montado em s->block. Toda representação é aplicada
+ * à tabela dinâmica mesmo se a requisição for recusada, para ela não
+ * divergir da do cliente. */
+int h2_decode_block(h2_session_t *s, h2_request_t *req) {
+    const uint8_t *p = s->block;
+    const uint8_t *end = s->block + s->block_len;
+    char *name_buf = s->strings[0];
+    char *value_buf = s->strings[1];
+    
+    while (p < end) {
+        uint8_t first = *p;
+        uint32_t index;
+        const char *name, *value;
+        size_t name_len, value_len;
+        
+        if (first & 0x80) {
+            if (hpack_decode_int(&p, end, 7, &index) < 0 ||
+                !hpack_lookup(&s->decoder, index, &name, &name_len, &value, &value_len)) {
+                return -1;
+            }
+            h2_request_add(req, name, name_len, value, value_len);
+            continue;
+        }
+        if ((first & 0xe0) == 0x20) {
+            if (hpack_decode_int(&p, end, 5, &index) < 0 || index > HPACK_TABLE_SIZE) return -1;
+            hpack_table_resize(&s->decoder, index);
+            continue;
+        }
+        
+        int indexing = (first & 0xc0) == 0x40;
+        if (hpack_decode_int(&p, end, indexing ? 6 : 4, &index) < 0) return -1;
+        if (index != 0) {
+            if (!hpack_lookup(&s->decoder, index, &name, &name_len, &value, &value_len)) return -1;
+            memcpy(name_buf, name, name_len);
+        } else {
+            int n = hpack_decode_string(&p, end, name_buf, H2_HEADER_BLOCK_SIZE);
+            if (n < 0) return -1;
+            name_len = n;
+        }
+        int n = hpack_decode_string(&p, end, value_buf, H2_HEADER_BLOCK_SIZE);
+        if (n < 0) return -1;
+        value_len = n;
+        h2_request_add(req, name_buf, name_len, value_buf, value_len);
+        if (indexing && hpack_table_add(&s->decoder, name_buf, name_len, value_buf, value_len) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+void h2_on_header_block(h2_session_t *s) {
+    uint32_t stream_id = s->block_stream;
+    s->block_stream = 0;
+    
+    h2_request_t req;
+    req.method[0] = req.path[0] = req.authority[0] = '\0';
+    req.headers_len = 0;
+    req.status = 0;
+    if (h2_decode_block(s, &req) < 0) {
+        h2_goaway(s, H2_COMPRESSION_ERROR);
+        return;
+    }
+    /* Trailers de um stream já aberto não mudam nada aqui */
+    if (stream_id <= s->last_stream) return;
+    s->last_stream = stream_id;
+    if (s->closing) return;
+    
+    h2_stream_t *stream = s->stream_count < H2_MAX_STREAMS ? h2_stream_new(s, stream_id) : NULL;
+    if (stream == NULL) {
+        h2_reset_stream(s, stream_id, H2_REFUSED_STREAM);
+        return;
+    }
+    size_t len = h2_request_format(&req, stream->request, sizeof(stream->request));
+    h2_stream_start(s, stream, len, req.status);
+}
+
+/* Aplica os parâmetros de SETTINGS (ou do HTTP2-Settings do upgrade) */
+int h2_apply_settings(h2_session_t *s, const uint8_t *payload, size_t length) {
+    for (size_t i = 0; i + 6 <= length; i += 6) {
+        int id = payload[i] << 8 | payload[i + 1];
+        uint32_t value = h2_get32(payload + i + 2);
+        switch (id) {
+        case H2_SETTINGS_HEADER_TABLE_SIZE: {
+            /* O codificador pode usar menos do que o cliente permite */
+            size_t size = value < HPACK_TABLE_SIZE ? value : HPACK_TABLE_SIZE;
+            if (size != s->encoder.max_size) {
+                hpack_table_resize(&s->encoder, size);
+                s->encoder_resized = 1;
+            }
+            break;
+        }
+        case H2_SETTINGS_INITIAL_WINDOW_SIZE:
+            if (value > H2_MAX_WINDOW) {
+                h2_goaway(s, H2_FLOW_CONTROL_ERROR);
+                return -1;
+            }
+            for (h2_stream_t *stream = s->streams; stream != NULL; stream = stream->next) {
+                stream->window += (long long)value - s->initial_window;
+            }
+            s->initial_window = value;
+            break;
+        case H2_SETTINGS_MAX_FRAME_SIZE:
+            if (value < H2_MAX_FRAME_SIZE || value > 0xffffff) {
+                h2_goaway(s, H2_PROTOCOL_ERROR);
+                return -1;
+            }
+            s->max_frame_size = value;
+            break;
+        }
+    }
+    return 0;
+}
+
+void h2_on_window_update(h2_session_t *s, uint32_t stream_id, const uint8_t *payload, uint32_t length) {
+    if (length != 4) {
+        h2_goaway(s, H2_FRAME_SIZE_ERROR);
+        return;
+    }
+    uint32_t increment = h2_get32(payload) & 0x7fffffff;
+    if (stream_id == 0) {
+        s->window += increment;
+        if (increment == 0 || s->window > H2_MAX_WINDOW) {
+            h2_goaway(s, increment == 0 ? H2_PROTOCOL_ERROR : H2_FLOW_CONTROL_ERROR);
+        }
+        return;
+    }
+    h2_stream_t *stream = h2_find_stream(s, stream_id);
+    if (stream == NULL) return;
+    stream->window += increment;
+    if (increment == 0 || stream->window > H2_MAX_WINDOW) {
+        h2_reset_stream(s, stream_id, increment == 0 ? H2_PROTOCOL_ERROR : H2_FLOW_CONTROL_ERROR);
+        h2_stream_close(s, stream, 0);
+    }
+}
+
+void h2_on_frame(h2_session_t *s, int type, int flags, uint32_t stream_id,
+                 const uint8_t *payload, uint32_t length) {
+    /* Um bloco de cabeçalhos só pode ser seguido pelas suas CONTINUATION */
+    if (s->block_stream != 0 && (type != H2_CONTINUATION || stream_id != s->block_stream)) {
+        h2_goaway(s, H2_PROTOCOL_ERROR);
+        return;
+    }
+    
+    switch (type) {
+    case H2_DATA:
+        /* Corpos de requisição são descartados, mas a janela da conexão é
+         * devolvida para o cliente não travar */
+        if (stream_id == 0 || stream_id > s->last_stream) {
+            h2_goaway(s, H2_PROTOCOL_ERROR);
+        } else if (length > 0) {
+            uint8_t increment[4];
+            h2_put32(increment, length);
+            h2_queue_frame(s, H2_WINDOW_UPDATE, 0, 0, increment, sizeof(increment));
+        }
+        break;
+        
+    case H2_HEADERS: {
+        if (stream_id == 0 || stream_id % 2 == 0) {
+            h2_goaway(s, H2_PROTOCOL_ERROR);
+            break;
+        }
+        size_t pad = 0;
+        if (flags & H2_FLAG_PADDED) {
+            if (length < 1) {
+                h2_goaway(s, H2_PROTOCOL_ERROR);
+                break;
+            }
+            pad = payload[0];
+            payload++;
+            length--;
+        }
+        if (flags & H2_FLAG_PRIORITY) {
+            if (length < 5) {
+                h2_goaway(s, H2_PROTOCOL_ERROR);
+                break;
+            }
+            payload += 5;
+            length -= 5;
+        }
+        if (pad > length) {
+            h2_goaway(s, H2_PROTOCOL_ERROR);
+            break;
+        }
+        length -= pad;
+        memcpy(s->block, payload, length);
+        s->block_len = length;
+        s->block_stream = stream_id;
+        if (flags & H2_FLAG_END_HEADERS) {
+            h2_on_header_block(s);
+        }
+        break;
+    }
+        
+    case H2_CONTINUATION:
+        if (s->block_stream == 0) {
+            h2_goaway(s, H2_PROTOCOL_ERROR);
+            break;
+        }
+        if (s->block_len + length > sizeof(s->block)) {
+            h2_goaway(s, H2_ENHANCE_YOUR_CALM);
+            break;
+        }
+        memcpy(s->block + s->block_len, payload, length);
+        s->block_len += length;
+        if (flags & H2_FLAG_END_HEADERS) {
+            h2_on_header_block(s);
+        }
+        break;
+        
+    case H2_RST_STREAM: {
+        if (length != 4 || stream_id == 0) {
+            h2_goaway(s, length != 4 ? H2_FRAME_SIZE_ERROR : H2_PROTOCOL_ERROR);
+            break;
+        }
+        h2_stream_t *stream = h2_find_stream(s, stream_id);
+        if (stream != NULL) {
+            h2_stream_close(s, stream, 0);
+        }
+        break;
+    }
+        
+    case H2_SETTINGS:
+        if (stream_id != 0) {
+            h2_goaway(s, H2_PROTOCOL_ERROR);
+        } else if (flags & H2_FLAG_ACK) {
+            if (length != 0) h2_goaway(s, H2_FRAME_SIZE_ERROR);
+        } else if (length % 6 != 0) {
+            h2_goaway(s, H2_FRAME_SIZE_ERROR);
+        } else if (h2_apply_settings(s, payload, length) == 0) {
+            h2_queue_frame(s, H2_SETTINGS, H2_FLAG_ACK, 0, NULL, 0);
+        }
+        break;
+        
+    case H2_PING:
+        if (length != 8 || stream_id != 0) {
+            h2_goaway(s, length != 8 ? H2_FRAME_SIZE_ERROR : H2_PROTOCOL_ERROR);
+        } else if (!(flags & H2_FLAG_ACK)) {
+            h2_queue_frame(s, H2_PING, H2_FLAG_ACK, 0, payload, length);
+        }
+        break;
+        
+    case H2_GOAWAY:
+        s->closing = 1;
+        break;
+        
+    case H2_WINDOW_UPDATE:
+        h2_on_window_update(s, stream_id, payload, length);
+        break;
+        
+    case H2_PUSH_PROMISE:
+        h2_goaway(s, H2_PROTOCOL_ERROR);
+        break;
+        
+    default:
+        /* PRIORITY e tipos desconhecidos são ignorados */
+        break;
+    }
+}
+
+/* Processa os quadros completos em s->in. Retorna -1 se a conexão não
+ * começou com o prefácio do HTTP/2 (e deve ser fechada sem resposta). */
+int h2_session_process(h2_session_t *s) {
+    size_t offset = 0;
+    if (!s->preface_received) {
+        size_t n = s->in_len < H2_PREFACE_LEN ? s->in_len : H2_PREFACE_LEN;
+        if (memcmp(s->in, H2_PREFACE, n) != 0) return -1;
+        if (n < H2_PREFACE_LEN) return 0;
+        s->preface_received = 1;
+        offset = H2_PREFACE_LEN;
+    }
+    
+    while (!s->failed && s->in_len - offset >= H2_FRAME_HEADER_SIZE) {
+        const uint8_t *frame = s->in + offset;
+        uint32_t length = frame[0] << 16 | frame[1] << 8 | frame[2];
+        if (length > H2_MAX_FRAME_SIZE) {
+            h2_goaway(s, H2_FRAME_SIZE_ERROR);
+            break;
+        }
+        if (s->in_len - offset < H2_FRAME_HEADER_SIZE + length) break;
+        h2_on_frame(s, frame[3], frame[4], h2_get32(frame + 5) & 0x7fffffff,
+                    frame + H2_FRAME_HEADER_SIZE, length);
+        offset += H2_FRAME_HEADER_SIZE + length;
+    }
+    
+    if (s->failed) {
+        s->in_len = 0;
+    } else {
+        s->in_len -= offset;
+        memmove(s->in, s->in + offset, s->in_len);
+    }
+    return 0;
+}
+
+/* Próximo stream com corpo a enviar e janela aberta, depois do último
+ * atendido */
+h2_stream_t *h2_next_stream(h2_session_t *s) {
+    h2_stream_t *first = NULL;
+    for (h2_stream_t *stream = s->streams; stream != NULL; stream = stream->next) {
+        if (stream->body_left == 0 || stream->window <= 0) continue;
+        if (stream->id > s->last_served) return stream;
+        if (first == NULL) first = stream;
+    }
+    return first;
+}
+
+/* Enquadra os corpos em DATA, um quadro por stream em rodízio, até
+ * acumular H2_OUTPUT_HIGH_WATER bytes ou esgotar as janelas. Os bytes vão
+ * do arquivo (ou do cache) direto para o buffer de saída. */
+void h2_session_fill(h2_session_t *s) {
+    if (s->out.sent > 0) {
+        s->out.len -= s->out.sent;
+        memmove(s->out.data, s->out.data + s->out.sent, s->out.len);
+        s->out.sent = 0;
+    }
+    
+    while (s->out.len < H2_OUTPUT_HIGH_WATER && s->window > 0) {
+        h2_stream_t *stream = h2_next_stream(s);
+        if (stream == NULL) break;
+        
+        long long size = stream->body_left;
+        if (size > stream->window) size = stream->window;
+        if (size > s->window) size = s->window;
+        if (size > s->max_frame_size) size = s->max_frame_size;
+        if (size > H2_MAX_FRAME_SIZE) size = H2_MAX_FRAME_SIZE;
+        if (response_reserve(&s->out, H2_FRAME_HEADER_SIZE + size) < 0) break;
+        
+        ssize_t got = response_read(&stream->res, s->out.data + s->out.len + H2_FRAME_HEADER_SIZE, size);
+        if (got <= 0) {
+            /* Arquivo encolheu durante o envio */
+            h2_reset_stream(s, stream->id, H2_INTERNAL_ERROR);
+            h2_stream_close(s, stream, 0);
+            continue;
+        }
+        stream->body_left -= got;
+        stream->body_sent += got;
+        stream->window -= got;
+        s->window -= got;
+        int end_stream = stream->body_left == 0;
+        h2_frame_header((uint8_t *)s->out.data + s->out.len, got, H2_DATA,
+                        end_stream ? H2_FLAG_END_STREAM : 0, stream->id);
+        s->out.len += H2_FRAME_HEADER_SIZE + got;
+        response_sent(&stream->res, H2_FRAME_HEADER_SIZE + got);
+        s->last_served = stream->id;
+        if (end_stream) {
+            h2_stream_close(s, stream, 1);
+        }
+    }
+}
+
+/* Envia o que estiver pronto, enquadrando mais DATA enquanto o socket
+ * aceitar e houver orçamento (como em response_write). Retorna 1 quando
+ * não sobrou nada para enviar agora, 0 se o socket (não bloqueante)
+ * encheu, 2 se o orçamento acabou e -1 em erro. */
+int h2_session_write(h2_session_t *s, int sock, size_t *budget) {
+    while (1) {
+        h2_session_fill(s);
+        if (s->out.sent == s->out.len) return 1;
+        size_t len = s->out.len - s->out.sent;
+        if (budget != NULL && len > *budget) len = *budget;
+        if (len == 0) return 2;
+        ssize_t sent = send(sock, s->out.data + s->out.sent, len, MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+            return -1;
+        }
+        s->out.sent += sent;
+        budget_spend(budget, sent);
+    }
+}
+
+/* Muita saída acumulada (um cliente que manda PING sem ler, por exemplo):
+ * a leitura fica suspensa até ela ser enviada */
+int h2_output_full(const h2_session_t *s) {
+    return s->out.len - s->out.sent >= H2_OUTPUT_MAX;
+}
+
+int h2_session_finished(const h2_session_t *s) {
+    return s->closing && s->stream_count == 0 && s->out.sent == s->out.len;
+}
+
+/* Streams em andamento ou saída pendente: o prazo da conexão é o de envio */
+int h2_session_busy(const h2_session_t *s) {
+    return s->stream_count > 0 || s->out.sent < s->out.len;
+}
+
+void h2_session_free(h2_session_t *s) {
+    while (s->streams != NULL) {
+        h2_stream_close(s, s->streams, 0);
+    }
+    hpack_table_evict(&s->decoder, 0);
+    hpack_table_evict(&s->encoder, 0);
+    response_free(&s->out);
+    free(s);
+}
+
+/* HTTP2-Settings vem em base64url, sem preenchimento */
+int base64url_decode(const char *in, size_t len, uint8_t *out, size_t out_size) {
+    uint32_t acc = 0;
+    int bits = 0;
+    size_t n = 0;
+    for (size_t i = 0; i < len && in[i] != '='; i++) {
+        char c = in[i];
+        int value;
+        if (c >= 'A' && c <= 'Z') value = c - 'A';
+        else if (c >= 'a' && c <= 'z') value = c - 'a' + 26;
+        else if (c >= '0' && c <= '9') value = c - '0' + 52;
+        else if (c == '-' || c == '+') value = 62;
+        else if (c == '_' || c == '/') value = 63;
+        else return -1;
+        acc = acc << 6 | value;
+        bits += 6;
+        if (bits >= 8) {
+            bits -= 8;
+            if (n == out_size) return -1;
+            out[n++] = acc >> bits;
+        }
+    }
+    return n;
+}
+
+/* A conexão começou com o prefácio do HTTP/2 (conhecimento prévio, sem
+ * upgrade): http_parse recusa a linha "PRI * HTTP/2.0" e ela é reconhecida
+ * aqui */
+int h2_is_preface(const char *buffer, size_t len) {
+    return len >= H2_PREFACE_LINE_LEN && memcmp(buffer, H2_PREFACE, H2_PREFACE_LINE_LEN) == 0;
+}
+
+/* Requisição HTTP/1.1 pedindo a troca para h2c (RFC 7540, 3.2) */
+int h2_wants_upgrade(const http_request_t *request) {
+    char value[64];
+    /* A requisição vira o stream 1 e precisa caber no buffer dele */
+    return request->length <= BUFFER_SIZE && get_header(request, "Upgrade", value, sizeof(value)) && strcasestr(value, "h2c") != NULL &&
+           find_header(request, "HTTP2-Settings") != NULL;
+}
+
+/* Cria a sessão para os len bytes já lidos de buffer. Com upgrade, a
+ * requisição HTTP/1.1 analisada no início do buffer recebe o 101 e vira o
+ * stream 1; o que vem depois dela é a entrada da sessão. O SETTINGS do
+ * servidor é sempre o primeiro quadro. */
+h2_session_t *h2_session_new(const char *base_directory, const struct sockaddr_in6 *peer,
+                             const http_request_t *upgrade, const char *buffer, size_t len) {
+    if (len - (upgrade != NULL ? upgrade->length : 0) > sizeof(((h2_session_t *)0)->in)) {
+        return NULL;
+    }
+    h2_session_t *s = calloc(1, sizeof(h2_session_t));
+    if (s == NULL) {
+        return NULL;
+    }
+    s->base_directory = base_directory;
+    s->peer = *peer;
+    response_init(&s->out);
+    s->decoder.max_size = s->encoder.max_size = HPACK_TABLE_SIZE;
+    s->window = s->initial_window = H2_DEFAULT_WINDOW;
+    s->max_frame_size = H2_MAX_FRAME_SIZE;
+    
+    if (upgrade != NULL) {
+        response_printf(&s->out, "HTTP/1.1 101 Switching Protocols\r\nConnection: Upgrade\r\nUpgrade: h2c\r\n\r\n");
+    }
+    uint8_t settings[6];
+    h2_put16(settings, H2_SETTINGS_MAX_CONCURRENT_STREAMS);
+    h2_put32(settings + 2, H2_MAX_STREAMS);
+    h2_queue_frame(s, H2_SETTINGS, 0, 0, settings, sizeof(settings));
+    
+    size_t consumed = 0;
+    if (upgrade != NULL) {
+        const str_view_t *value = find_header(upgrade, "HTTP2-Settings");
+        uint8_t client_settings[256];
+        int n = base64url_decode(value->data, value->len, client_settings, sizeof(client_settings));
+        if (n > 0 && n % 6 == 0) {
+            h2_apply_settings(s, client_settings, n);
+        }
+        s->last_stream = 1;
+        h2_stream_t *stream = h2_stream_new(s, 1);
+        if (stream != NULL) {
+            memcpy(stream->request, buffer, upgrade->length);
+            h2_stream_start(s, stream, upgrade->length, 0);
+        }
+        consumed = upgrade->length;
+    }
+    memcpy(s->in, buffer + consumed, len - consumed);
+    s->in_len = len - consumed;
+    return s;
+}
+
+/* HTTP/2 no modo bloqueante: a mesma sessão, com as esperas feitas por
+ * poll. Com streams em andamento vale o prazo de envio; ociosa, o do
+ * keep-alive. */
+void h2_serve_blocking(int client_sock, h2_session_t *s) {
+    while (1) {
+        if (h2_session_process(s) < 0) break;
+        int result = h2_session_write(s, client_sock, NULL);
+        if (result < 0 || h2_session_finished(s)) break;
+        
+        int busy = h2_session_busy(s);
+        short events = (h2_output_full(s) ? 0 : POLLIN) | (result == 0 ? POLLOUT : 0);
+        if (!wait_socket(client_sock, events, deadline_after(busy ? config.send_timeout : config.keepalive_timeout))) {
+            if (busy) {
+                stats_connection_timed_out();
+                socket_abort(client_sock);
+            }
+            break;
+        }
+        if (!(events & POLLIN)) continue;
+        ssize_t bytes = recv(client_sock, s->in + s->in_len, sizeof(s->in) - s->in_len, 0);
+        if (bytes < 0 && (errno == EAGAIN || errno == EINTR)) continue;
+        if (bytes <= 0) break;
+        s->in_len += bytes;
+    }
+}
+
+/* O socket do cliente chega não bloqueante e as esperas são feitas com
+ * poll até o prazo da vez. O cabeçalho tem um prazo total desde o
+ * primeiro byte (ou da conexão, na primeira requisição), e não por
+ * leitura: um cliente que manda um byte de cada vez não segura o
+ * servidor. */
+void handle_request(int client_sock, const struct sockaddr_in6 *peer, const char *base_directory) {
+    char *buffer = malloc(config.request_buffer_size);
+    if (buffer == NULL) {
+        close(client_sock);
+        return;
+    }
+    size_t buffered = 0;
+    int requests_served = 0;
+    long long deadline = deadline_after(config.header_timeout);
+    
+    stats_connection_opened();
+    response_t res;
+    response_init(&res);
+    http_request_t request;
+    http_parser_reset(&request);
+    
+    while (1) {
+        int parsed = http_parse(&request, buffer, buffered);
+        int upgrade = parsed == 1 && h2_wants_upgrade(&request);
+        if (upgrade || (parsed < 0 && requests_served == 0 && h2_is_preface(buffer, buffered))) {
+            h2_session_t *session = h2_session_new(base_directory, peer, upgrade ? &request : NULL,
+                                                   buffer, buffered);
+            if (session != NULL) {
+                h2_serve_blocking(client_sock, session);
+                h2_session_free(session);
+            }
+            break;
+        }
+        if (parsed < 0 || (parsed == 0 && buffered == config.request_buffer_size)) {
+            send_parse_error(&res, parsed < 0 ? request.error : http_parse_overflow(&request));
+            response_write_all(client_sock, &res);
+            access_log_record(peer, &request, &res);
+            break;
+        }
+        if (parsed == 0) {
+            if (!wait_socket(client_sock, POLLIN, deadline)) {
+                if (buffered > 0 || requests_served == 0) {
+                    stats_connection_timed_out();
+                    socket_abort(client_sock);
+                }
+                break;
+            }
+            int bytes_received = recv(client_sock, buffer + buffered, config.request_buffer_size - buffered, 0);
+            if (bytes_received < 0 && (errno == EAGAIN || errno == EINTR)) {
+                continue;
+            }
+            if (bytes_received <= 0) {
+                break;
+            }
+            if (buffered == 0 && requests_served > 0) {
+                deadline = deadline_after(config.header_timeout);
+            }
+            buffered += bytes_received;
+            continue;
+        }
+        
+        serve_request(&request, requests_served++, base_directory, &res);
+        int result = response_write_all(client_sock, &res);
+        access_log_record(peer, &request, &res);
+        if (result == 0) {
+            stats_connection_timed_out();
+            socket_abort(client_sock);
+        }
+        if (result != 1 || !res.keep_alive) {
+            break;
+        }
+        
+        /* Requisições encadeadas (pipelining) já lidas continuam no buffer */
+        buffered -= request.length;
+        memmove(buffer, buffer + request.length, buffered);
+        http_parser_reset(&request);
+        deadline = deadline_after(buffered > 0 ? config.header_timeout : config.keepalive_timeout);
+    }
+    
+    stats_connection_closed();
+    response_free(&res);
+    free(buffer);
+    close(client_sock);
+}
+
+int set_nonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0) return -1;
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+long long monotonic_ms(void) {
+    return monotonic_us() / 1000;
+}
+
+void timer_wheel_init(timer_wheel_t *wheel) {
+    memset(wheel, 0, sizeof(*wheel));
+    wheel->now = monotonic_ms() / WHEEL_TICK_MS;
+}
+
+/* Põe o temporizador no nível mais baixo cuja volta ainda alcança o
+ * vencimento; vencido, vai para a posição atual e sai na próxima consulta */
+void timer_wheel_insert(timer_wheel_t *wheel, wheel_timer_t *timer) {
+    long long delta = timer->expires - wheel->now;
+    long long when = delta > 0 ? timer->expires : wheel->now;
+    int level = 0;
+    while (level < WHEEL_LEVELS - 1 && delta >= 1LL << (WHEEL_BITS * (level + 1))) {
+        level++;
+    }
+    wheel_timer_t **slot = &wheel->slots[level][(when >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1)];
+    timer->next = *slot;
+    if (*slot != NULL) (*slot)->pprev = &timer->next;
+    *slot = timer;
+    timer->pprev = slot;
+}
+
+void timer_wheel_cancel(timer_wheel_t *wheel, wheel_timer_t *timer) {
+    if (timer->pprev == NULL) return;
+    *timer->pprev = timer->next;
+    if (timer->next != NULL) timer->next->pprev = timer->pprev;
+    timer->next = NULL;
+    timer->pprev = NULL;
+    wheel->count--;
+}
+
+void timer_wheel_arm(timer_wheel_t *wheel, wheel_timer_t *timer, long long timeout_ms) {
+    timer_wheel_cancel(wheel, timer);
+    if (wheel->count == 0) {
+        wheel->now = monotonic_ms() / WHEEL_TICK_MS;
+    }
+    long long ticks = (timeout_ms + WHEEL_TICK_MS - 1) / WHEEL_TICK_MS;
+    long long limit = (1LL << (WHEEL_BITS * WHEEL_LEVELS)) - 1;
+    timer->expires = (monotonic_ms() + WHEEL_TICK_MS - 1) / WHEEL_TICK_MS + (ticks < limit ? ticks : limit);
+    timer_wheel_insert(wheel, timer);
+    wheel->count++;
+}
+
+/* Avança a roda até now_ms e devolve um temporizador vencido, já
+ * desarmado, ou NULL quando não há mais nenhum. Sem temporizadores
+ * armados, pula direto para o tick atual. */
+wheel_timer_t *timer_wheel_expire(timer_wheel_t *wheel, long long now_ms) {
+    long long target = now_ms / WHEEL_TICK_MS;
+    while (1) {
+        wheel_timer_t *timer = wheel->slots[0][wheel->now & (WHEEL_SLOTS - 1)];
+        if (timer != NULL) {
+            timer_wheel_cancel(wheel, timer);
+            return timer;
+        }
+        if (wheel->now >= target) return NULL;
+        if (wheel->count == 0) {
+            wheel->now = target;
+            return NULL;
+        }
+        
+        wheel->now++;
+        for (int level = 1; level < WHEEL_LEVELS; level++) {
+            if (wheel->now & ((1LL << (WHEEL_BITS * level)) - 1)) break;
+            wheel_timer_t **slot = &wheel->slots[level][(wheel->now >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1)];
+            wheel_timer_t *moving = *slot;
+            *slot = NULL;
+            while (moving != NULL) {
+                wheel_timer_t *next = moving->next;
+                timer_wheel_insert(wheel, moving);
+                moving = next;
+            }
+        }
+    }
+}
+
+/* Milissegundos até a roda ter algo a fazer: o próximo temporizador do
+ * primeiro nível ou, sem nenhum nele, a próxima redistribuição (-1 com a
+ * roda vazia) */
+int timer_wheel_timeout(const timer_wheel_t *wheel, long long now_ms) {
+    if (wheel->count == 0) return -1;
+    long long ticks = WHEEL_SLOTS - (wheel->now & (WHEEL_SLOTS - 1));
+    for (long long i = 0; i < ticks; i++) {
+        if (wheel->slots[0][(wheel->now + i) & (WHEEL_SLOTS - 1)] != NULL) {
+            ticks = i;
+            break;
+        }
+    }
+    long long remaining = (wheel->now + ticks) * WHEEL_TICK_MS - now_ms;
+    return remaining > 0 ? (int)remaining : 0;
+}
+
+connection_t *connection_of_timer(wheel_timer_t *timer) {
+    return (connection_t *)((char *)timer - offsetof(connection_t, timer));
+}
+
+/* Começa a contar o prazo `deadline` da conexão. O do cabeçalho não é
+ * renovado enquanto o mesmo cabeçalho chega aos pedaços. */
+void connection_set_deadline(timer_wheel_t *wheel, connection_t *conn, deadline_t deadline) {
+    if (deadline == DEADLINE_HEADER && conn->deadline == DEADLINE_HEADER) return;
+    int seconds = deadline == DEADLINE_IDLE ? config.keepalive_timeout :
+                  deadline == DEADLINE_HEADER ? config.header_timeout :
+                  deadline == DEADLINE_SEND ? config.send_timeout : 0;
+    conn->deadline = deadline;
+    if (seconds > 0) {
+        timer_wheel_arm(wheel, &conn->timer, (long long)seconds * 1000);
+    } else {
+        timer_wheel_cancel(wheel, &conn->timer);
+    }
+}
+
+/* Prazos de cabeçalho e de envio indicam cliente lento ou hostil: entram
+ * nas estatísticas e a conexão é abortada */
+void connection_expired(connection_t *conn) {
+    if (conn->deadline == DEADLINE_HEADER || conn->deadline == DEADLINE_SEND) {
+        stats_connection_timed_out();
+        socket_abort(conn->fd);
+    }
+}
+
+/* ---- Escalonamento da saída (laço epoll) ---- */
+
+/* Cada evento dá à conexão uma vez de no máximo config.send_quantum
+ * bytes. Se o socket ainda aceitar dados, o EPOLLOUT (por nível) a traz de
+ * volta na próxima espera, junto com as demais conexões prontas: o kernel
+ * devolve a lista de prontas em rodízio, então um download de vários GB
+ * avança um quantum por vez sem atrasar as respostas pequenas, que
+ * terminam já na primeira. Quem esgota as fichas dos limites de banda sai
+ * do epoll e espera em loop->throttled, revisitada a cada
+ * OUTPUT_THROTTLE_MS. */
+#define OUTPUT_THROTTLE_MS 10
+
+/* Limite de banda total, compartilhado pelos workers */
+struct {
+    pthread_mutex_t lock;
+    rate_bucket_t bucket;
+} total_rate = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+void rate_bucket_refill(rate_bucket_t *bucket, size_t rate, long long now_us) {
+    int64_t burst = rate / 10 > config.send_quantum ? (int64_t)(rate / 10) : (int64_t)config.send_quantum;
+    long long elapsed = now_us - bucket->updated_us;
+    if (bucket->updated_us == 0 || elapsed > 1000000) {
+        elapsed = 1000000;
+    }
+    /* Sem fichas inteiras a acrescentar o relógio do balde não avança,
+     * para o tempo não se perder em arredondamentos */
+    int64_t added = (int64_t)((double)elapsed * rate / 1000000);
+    if (added == 0 && bucket->tokens < burst) return;
+    bucket->tokens = bucket->tokens + added > burst ? burst : bucket->tokens + added;
+    bucket->updated_us = now_us;
+}
+
+/* Bytes que a conexão pode enviar nesta vez: um quantum, limitado pelas
+ * fichas dos limites de banda. Sobras pequenas demais esperam acumular,
+ * para não virar uma chamada ao sistema por poucos bytes. */
+size_t output_budget(connection_t *conn) {
+    int64_t budget = config.send_quantum;
+    if (config.conn_bandwidth == 0 && config.total_bandwidth == 0) return budget;
+    
+    long long now = monotonic_us();
+    if (config.conn_bandwidth > 0) {
+        rate_bucket_refill(&conn->rate, config.conn_bandwidth, now);
+        if (conn->rate.tokens < budget) budget = conn->rate.tokens;
+    }
+    if (config.total_bandwidth > 0) {
+        pthread_mutex_lock(&total_rate.lock);
+        rate_bucket_refill(&total_rate.bucket, config.total_bandwidth, now);
+        if (total_rate.bucket.tokens < budget) budget = total_rate.bucket.tokens;
+        pthread_mutex_unlock(&total_rate.lock);
+    }
+    int64_t minimum = config.send_quantum < BUFFER_SIZE ? (int64_t)config.send_quantum : BUFFER_SIZE;
+    return budget < minimum ? 0 : (size_t)budget;
+}
+
+/* Desconta o que foi enviado na vez. Com vários workers o limite total
+ * pode ser ultrapassado em até um quantum por worker. */
+void output_charge(connection_t *conn, size_t bytes) {
+    if (config.conn_bandwidth > 0) {
+        conn->rate.tokens -= bytes;
+    }
+    if (config.total_bandwidth > 0 && bytes > 0) {
+        pthread_mutex_lock(&total_rate.lock);
+        total_rate.bucket.tokens -= bytes;
+        pthread_mutex_unlock(&total_rate.lock);
+    }
+}
+
+void connection_watch(event_loop_t *loop, connection_t *conn, int events);
+
+void output_park(event_loop_t *loop, connection_t *conn) {
+    connection_watch(loop, conn, 0);
+    conn->throttled = 1;
+    conn->throttled_next = NULL;
+    conn->throttled_prev = loop->throttled_tail;
+    if (loop->throttled_tail != NULL) loop->throttled_tail->throttled_next = conn;
+    else loop->throttled_head = conn;
+    loop->throttled_tail = conn;
+}
+
+void output_unpark(event_loop_t *loop, connection_t *conn) {
+    if (!conn->throttled) return;
+    if (conn->throttled_prev != NULL) conn->throttled_prev->throttled_next = conn->throttled_next;
+    else loop->throttled_head = conn->throttled_next;
+    if (conn->throttled_next != NULL) conn->throttled_next->throttled_prev = conn->throttled_prev;
+    else loop->throttled_tail = conn->throttled_prev;
+    conn->throttled_prev = NULL;
+    conn->throttled_next = NULL;
+    conn->throttled = 0;
+}
+
+/* Fim da vez com orçamento esgotado: sem limites de banda no caminho a
+ * conexão volta a esperar o socket; barrada por eles, espera as fichas */
+void output_yield(event_loop_t *loop, connection_t *conn, size_t budget, int events) {
+    if (budget < config.send_quantum) {
+        output_park(loop, conn);
+    } else {
+        connection_watch(loop, conn, events);
+    }
+}
+
+void connection_close(event_loop_t *loop, connection_t *conn) {
+    stats_connection_closed();
+    output_unpark(loop, conn);
+    connection_release(&conn->peer);
+    timer_wheel_cancel(&loop->timers, &conn->timer);
+    epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+    close(conn->fd);
+    response_free(&conn->res);
+    if (conn->h2 != NULL) {
+        h2_session_free(conn->h2);
+    }
+    free(conn);
+}
+
+void connection_watch(event_loop_t *loop, connection_t *conn, int events) {
+    if (conn->events == events) return;
+    
+    struct epoll_event ev;
+    ev.events = events;
+    ev.data.ptr = conn;
+    epoll_ctl(loop->epoll_fd, EPOLL_CTL_MOD, conn->fd, &ev);
+    conn->events = events;
+}
+
+void connection_on_h2(event_loop_t *loop, connection_t *conn, int events) {
+    h2_session_t *s = conn->h2;
+    if (h2_session_process(s) < 0) {
+        connection_close(loop, conn);
+        return;
+    }
+    while ((events & (EPOLLIN | EPOLLHUP | EPOLLERR)) && !h2_output_full(s)) {
+        ssize_t bytes = recv(conn->fd, s->in + s->in_len, sizeof(s->in) - s->in_len, 0);
+        if (bytes < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            connection_close(loop, conn);
+            return;
+        }
+        if (bytes == 0) {
+            connection_close(loop, conn);
+            return;
+        }
+        s->in_len += bytes;
+        if (h2_session_process(s) < 0) {
+            connection_close(loop, conn);
+            return;
+        }
+    }
+    
+    size_t budget = output_budget(conn);
+    size_t left = budget;
+    int result = h2_session_write(s, conn->fd, &left);
+    output_charge(conn, budget - left);
+    if (result < 0 || h2_session_finished(s)) {
+        connection_close(loop, conn);
+        return;
+    }
+    if (result == 2) {
+        output_yield(loop, conn, budget, (h2_output_full(s) ? 0 : EPOLLIN) | EPOLLOUT);
+    } else {
+        connection_watch(loop, conn, (h2_output_full(s) ? 0 : EPOLLIN) | (result == 0 ? EPOLLOUT : 0));
+    }
+    connection_set_deadline(&loop->timers, conn, h2_session_busy(s) ? DEADLINE_SEND : DEADLINE_IDLE);
+}
+
+/* A conexão passa a falar HTTP/2 (prefácio ou upgrade); o que já estava
+ * no buffer vai para a sessão */
+void connection_start_h2(event_loop_t *loop, connection_t *conn, const http_request_t *upgrade) {
+    conn->h2 = h2_session_new(loop->base_directory, &conn->peer, upgrade, conn->request, conn->request_len);
+    if (conn->h2 == NULL) {
+        connection_close(loop, conn);
+        return;
+    }
+    conn->request_len = 0;
+    conn->state = CONN_HTTP2;
+    connection_on_h2(loop, conn, 0);
+}
+
+/* Atende as requisições completas que estiverem no buffer, na ordem em que
+ * chegaram, até esvaziá-lo, até o socket não aceitar mais dados ou até
+ * gastar a vez no escalonador de saída. */
+void connection_process(event_loop_t *loop, connection_t *conn) {
+    size_t budget = output_budget(conn);
+    size_t left = budget;
+    while (1) {
+        if (conn->state == CONN_READING_REQUEST) {
+            int parsed = http_parse(&conn->parser, conn->request, conn->request_len);
+            if (parsed == 0 && conn->request_len < config.request_buffer_size) {
+                /* Com o envio do cliente encerrado, o que sobrou no buffer
+                 * nunca vai se completar */
+                if (conn->read_closed) {
+                    connection_close(loop, conn);
+                } else {
+                    connection_watch(loop, conn, EPOLLIN);
+                }
+                return;
+            }
+            if ((parsed == 1 && h2_wants_upgrade(&conn->parser)) ||
+                (parsed < 0 && conn->requests_served == 0 && h2_is_preface(conn->request, conn->request_len))) {
+                connection_start_h2(loop, conn, parsed == 1 ? &conn->parser : NULL);
+                return;
+            }
+            if (parsed == 1) {
+                serve_request(&conn->parser, conn->requests_served, loop->base_directory, &conn->res);
+                conn->current_len = conn->parser.length;
+            } else {
+                send_parse_error(&conn->res, parsed < 0 ? conn->parser.error
+                                                        : http_parse_overflow(&conn->parser));
+                conn->current_len = conn->request_len;
+            }
+            
+            conn->state = CONN_SENDING_HEADERS;
+        }
+        
+        /* Cada chamada vem de um EPOLLOUT (ou do início da resposta), logo
+         * com espaço no socket: o prazo de envio recomeça */
+        connection_set_deadline(&loop->timers, conn, DEADLINE_SEND);
+        size_t before = left;
+        int result = response_write(conn->fd, &conn->res, &left);
+        output_charge(conn, before - left);
+        if (result == 1 || result < 0) {
+            access_log_record(&conn->peer, &conn->parser, &conn->res);
+        }
+        if (result < 0) {
+            connection_close(loop, conn);
+            return;
+        }
+        if (result != 1) {
+            conn->state = conn->res.sent < conn->res.len ? CONN_SENDING_HEADERS : CONN_SENDING_BODY;
+            if (result == 2) {
+                output_yield(loop, conn, budget, EPOLLOUT);
+            } else {
+                connection_watch(loop, conn, EPOLLOUT);
+            }
+            return;
+        }
+        if (!conn->res.keep_alive) {
+            connection_close(loop, conn);
+            return;
+        }
+        
+        conn->request_len -= conn->current_len;
+        memmove(conn->request, conn->request + conn->current_len, conn->request_len);
+        http_parser_reset(&conn->parser);
+        conn->requests_served++;
+        conn->state = CONN_READING_REQUEST;
+        connection_set_deadline(&loop->timers, conn, conn->request_len > 0 ? DEADLINE_HEADER : DEADLINE_IDLE);
+    }
+}
+
+void connection_on_readable(event_loop_t *loop, connection_t *conn) {
+    while (conn->request_len < config.request_buffer_size) {
+        ssize_t bytes = recv(conn->fd, conn->request + conn->request_len,
+                             config.request_buffer_size - conn->request_len, 0);
+        if (bytes < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            connection_close(loop, conn);
+            return;
+        }
+        if (bytes == 0) {
+            /* Meia conexão fechada (shutdown(SHUT_WR)): as requisições
+             * completas no buffer ainda são atendidas antes de fechar */
+            conn->read_closed = 1;
+            break;
+        }
+        conn->request_len += bytes;
+    }
+    
+    connection_set_deadline(&loop->timers, conn, DEADLINE_HEADER);
+    connection_process(loop, conn);
+}
+
+/* Aceita até config.accept_batch conexões; se sobrarem, o socket de
+ * escuta continua pronto e o epoll o devolve depois dos outros eventos */
+void accept_connections(event_loop_t *loop) {
+    for (int accepted = 0; accepted < config.accept_batch; accepted++) {
+        struct sockaddr_in6 client_addr;
+        socklen_t client_len = sizeof(client_addr);
+        
+        int client_sock = accept4(loop->server_sock, (struct sockaddr*)&client_addr, &client_len, SOCK_NONBLOCK);
+        if (client_sock < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                perror("Erro ao aceitar conexão");
+            }
+            return;
+        }
+        peer_normalize(&client_addr);
+        if (!connection_admit(&client_addr)) {
+            connection_reject(client_sock);
+            continue;
+        }
+        
+        connection_t *conn = calloc(1, sizeof(connection_t) + config.request_buffer_size);
+        if (conn == NULL) {
+            connection_release(&client_addr);
+            close(client_sock);
+            continue;
+        }
+        conn->fd = client_sock;
+        conn->peer = client_addr;
+        conn->state = CONN_READING_REQUEST;
+        conn->events = EPOLLIN;
+        http_parser_reset(&conn->parser);
+        response_init(&conn->res);
+        
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.ptr = conn;
+        if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, client_sock, &ev) < 0) {
+            perror("Erro no epoll_ctl");
+            connection_release(&client_addr);
+            close(client_sock);
+            free(conn);
+            continue;
+        }
+        stats_connection_opened();
+        connection_set_deadline(&loop->timers, conn, DEADLINE_HEADER);
+    }
+}
+
+/* Fecha as conexões com prazo vencido e devolve quantos milissegundos o
+ * epoll pode esperar (-1 se nenhum prazo está correndo). */
+int expire_connections(event_loop_t *loop) {
+    long long now = monotonic_ms();
+    wheel_timer_t *timer;
+    while ((timer = timer_wheel_expire(&loop->timers, now)) != NULL) {
+        connection_t *conn = connection_of_timer(timer);
+        connection_expired(conn);
+        connection_close(loop, conn);
+    }
+    return timer_wheel_timeout(&loop->timers, now);
+}
+
+/* Dá uma vez a cada conexão barrada pelos limites de banda que já tenha
+ * fichas; as que continuam sem elas guardam o lugar na fila, e as
+ * atendidas, se voltarem, vão para o fim */
+void output_retry_throttled(event_loop_t *loop) {
+    connection_t *conn = loop->throttled_head;
+    connection_t *tail = loop->throttled_tail;
+    while (conn != NULL) {
+        connection_t *next = conn->throttled_next;
+        int last = conn == tail;
+        if (output_budget(conn) > 0) {
+            output_unpark(loop, conn);
+            if (conn->state == CONN_HTTP2) {
+                connection_on_h2(loop, conn, EPOLLIN);
+            } else {
+                connection_process(loop, conn);
+            }
+        }
+        if (last) break;
+        conn = next;
+    }
+}
+
+int run_event_loop(int server_sock, const char *base_directory) {
+    if (set_nonblocking(server_sock) < 0) {
+        perror("Erro ao configurar socket");
+        return -1;
+    }
+    
+    event_loop_t loop;
+    memset(&loop, 0, sizeof(loop));
+    loop.server_sock = server_sock;
+    loop.base_directory = base_directory;
+    timer_wheel_init(&loop.timers);
+    loop.epoll_fd = epoll_create1(0);
+    if (loop.epoll_fd < 0) {
+        perror("Erro ao criar epoll");
+        return -1;
+    }
+    
+    /* data.ptr == NULL identifica o socket de escuta */
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    if (epoll_ctl(loop.epoll_fd, EPOLL_CTL_ADD, server_sock, &ev) < 0) {
+        perror("Erro no epoll_ctl");
+        close(loop.epoll_fd);
+        return -1;
+    }
+    
+    struct epoll_event events[MAX_EVENTS];
+    while (1) {
+        int timeout = expire_connections(&loop);
+        if (loop.throttled_head != NULL && (timeout < 0 || timeout > OUTPUT_THROTTLE_MS)) {
+            timeout = OUTPUT_THROTTLE_MS;
+        }
+        int n = epoll_wait(loop.epoll_fd, events, MAX_EVENTS, timeout);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("Erro no epoll_wait");
+            break;
+        }
+        
+        for (int i = 0; i < n; i++) {
+            connection_t *conn = events[i].data.ptr;
+            if (conn == NULL) {
+                accept_connections(&loop);
+            } else if (conn->throttled) {
+                /* fora do epoll só chegam EPOLLERR e EPOLLHUP */
+                connection_close(&loop, conn);
+            } else if (conn->state == CONN_HTTP2) {
+                connection_on_h2(&loop, conn, events[i].events);
+            } else if (conn->state == CONN_READING_REQUEST) {
+                connection_on_readable(&loop, conn);
+            } else {
+                connection_process(&loop, conn);
+            }
+        }
+        if (loop.throttled_head != NULL) {
+            output_retry_throttled(&loop);
+        }
+    }
+    
+    close(loop.epoll_fd);
+    return -1;
+}
+
+/* Backend io_uring, falando direto com o kernel pelas syscalls (sem
+ * liburing). Um accept multishot recebe as conexões; cada recv usa um
+ * buffer do anel de buffers registrado; os corpos de arquivo vão por um par
+ * encadeado de splices (arquivo → pipe → socket) e o restante por sendmsg.
+ * Um io_uring_enter submete tudo o que foi preparado e espera completações. */
+#define URING_ENTRIES 1024
+#define URING_RECV_BUFFERS 256
+#define URING_PIPE_CHUNK (64 * 1024)
+#define URING_TICK_MS 500
+
+/* Tipo da operação nos 3 bits baixos do user_data (o resto é a conexão) */
+enum {
+    URING_OP_ACCEPT = 1,
+    URING_OP_RECV,
+    URING_OP_SEND,
+    URING_OP_SPLICE_IN,
+    URING_OP_SPLICE_OUT,
+    URING_OP_TICK
+};
+
+typedef struct {
+    int ring_fd;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned sq_mask;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned sq_local_tail;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe *cqes;
+    unsigned to_submit;
+    struct io_uring_buf_ring *buf_ring;
+    char *buffers;
+    int server_sock;
+    const char *base_directory;
+    timer_wheel_t timers;
+    struct __kernel_timespec tick;
+} uring_loop_t;
+
+int uring_enter(uring_loop_t *loop, unsigned min_complete) {
+    __atomic_store_n(loop->sq_tail, loop->sq_local_tail, __ATOMIC_RELEASE);
+    int ret = syscall(__NR_io_uring_enter, loop->ring_fd, loop->to_submit, min_complete,
+                      min_complete > 0 ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    if (ret >= 0) {
+        loop->to_submit -= ret;
+    }
+    return ret;
+}
+
+/* Próxima SQE livre, já zerada; submete o que estiver pendente se o anel
+ * de submissão encher */
+struct io_uring_sqe *uring_get_sqe(uring_loop_t *loop) {
+    while (loop->sq_local_tail - __atomic_load_n(loop->sq_head, __ATOMIC_ACQUIRE) > loop->sq_mask) {
+        if (uring_enter(loop, 0) < 0 && errno != EINTR && errno != EBUSY) {
+            return NULL;
+        }
+    }
+    unsigned index = loop->sq_local_tail & loop->sq_mask;
+    struct io_uring_sqe *sqe = &loop->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    loop->sq_array[index] = index;
+    loop->sq_local_tail++;
+    loop->to_submit++;
+    return sqe;
+}
+
+struct io_uring_sqe *uring_prep(uring_loop_t *loop, connection_t *conn, int op, int opcode, int fd) {
+    struct io_uring_sqe *sqe = uring_get_sqe(loop);
+    if (sqe == NULL) return NULL;
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->user_data = (uint64_t)(uintptr_t)conn | op;
+    if (conn != NULL) conn->inflight++;
+    return sqe;
+}
+
+void uring_recycle_buffer(uring_loop_t *loop, unsigned short bid) {
+    unsigned short tail = loop->buf_ring->tail;
+    struct io_uring_buf *buf = &loop->buf_ring->bufs[tail & (URING_RECV_BUFFERS - 1)];
+    buf->addr = (uint64_t)(uintptr_t)(loop->buffers + (size_t)bid * config.request_buffer_size);
+    buf->len = config.request_buffer_size;
+    buf->bid = bid;
+    __atomic_store_n(&loop->buf_ring->tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+void uring_arm_accept(uring_loop_t *loop) {
+    struct io_uring_sqe *sqe = uring_prep(loop, NULL, URING_OP_ACCEPT, IORING_OP_ACCEPT, loop->server_sock);
+    if (sqe == NULL) return;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_CLOEXEC;
+}
+
+void uring_arm_tick(uring_loop_t *loop) {
+    struct io_uring_sqe *sqe = uring_prep(loop, NULL, URING_OP_TICK, IORING_OP_TIMEOUT, -1);
+    if (sqe == NULL) return;
+    sqe->addr = (uint64_t)(uintptr_t)&loop->tick;
+    sqe->len = 1;
+}
+
+/* Fecha a conexão assim que não houver operações dela no anel; as que
+ * estiverem pendentes terminam logo depois do shutdown. */
+void uring_close(uring_loop_t *loop, connection_t *conn) {
+    timer_wheel_cancel(&loop->timers, &conn->timer);
+    if (!conn->closing) {
+        conn->closing = 1;
+        if (conn->inflight > 0) {
+            shutdown(conn->fd, SHUT_RDWR);
+        }
+    }
+    if (conn->inflight > 0) return;
+    
+    stats_connection_closed();
+    connection_release(&conn->peer);
+    close(conn->fd);
+    response_free(&conn->res);
+    free(conn);
+}
+
+void uring_arm_recv(uring_loop_t *loop, connection_t *conn) {
+    struct io_uring_sqe *sqe = uring_prep(loop, conn, URING_OP_RECV, IORING_OP_RECV, conn->fd);
+    if (sqe == NULL) {
+        uring_close(loop, conn);
+        return;
+    }
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = 0;
+    sqe->len = config.request_buffer_size - conn->request_len;
+}
+
+/* Submete a próxima operação de envio da resposta, seguindo a mesma ordem
+ * de response_write. Retorna 1 se a resposta já terminou. */
+int uring_send_next(uring_loop_t *loop, connection_t *conn) {
+    response_t *res = &conn->res;
+    
+    while (1) {
+        body_part_t *part = res->part_index < res->part_count ? &res->parts[res->part_index] : NULL;
+        size_t data_end = part != NULL ? part->data_end : res->len;
+        off_t part_left = part != NULL ? part->length - res->part_sent : 0;
+        
+        if (res->sent < data_end || (res->body != NULL && part_left > 0)) {
+            int iov_count = 0;
+            if (res->sent < data_end) {
+                conn->iov[iov_count].iov_base = res->data + res->sent;
+                conn->iov[iov_count].iov_len = data_end - res->sent;
+                iov_count++;
+            }
+            if (res->body != NULL && part_left > 0) {
+                conn->iov[iov_count].iov_base = (char *)res->body + part->offset + res->part_sent;
+                conn->iov[iov_count].iov_len = part_left;
+                iov_count++;
+            }
+            memset(&conn->msg, 0, sizeof(conn->msg));
+            conn->msg.msg_iov = conn->iov;
+            conn->msg.msg_iovlen = iov_count;
+            
+            int more = part != NULL &&
+                       (res->body == NULL || res->part_index + 1 < res->part_count || data_end < res->len);
+            struct io_uring_sqe *sqe = uring_prep(loop, conn, URING_OP_SEND, IORING_OP_SENDMSG, conn->fd);
+            if (sqe == NULL) return -1;
+            sqe->addr = (uint64_t)(uintptr_t)&conn->msg;
+            sqe->len = 1;
+            sqe->msg_flags = MSG_NOSIGNAL | (more ? MSG_MORE : 0);
+            return 0;
+        }
+        
+        if (part == NULL) {
+            return 1;
+        }
+        
+        if (part_left > 0) {
+            if (res->pipe_fds[0] < 0 && pipe2(res->pipe_fds, O_CLOEXEC) < 0) {
+                return -1;
+            }
+            int more = res->part_index + 1 < res->part_count || data_end < res->len;
+            unsigned out_flags = SPLICE_F_MOVE | (more ? SPLICE_F_MORE : 0);
+            
+            conn->splice_len = 0;
+            if (res->pipe_pending == 0) {
+                size_t chunk = part_left > URING_PIPE_CHUNK ? URING_PIPE_CHUNK : (size_t)part_left;
+                struct io_uring_sqe *sqe = uring_prep(loop, conn, URING_OP_SPLICE_IN, IORING_OP_SPLICE,
+                                                      res->pipe_fds[1]);
+                if (sqe == NULL) return -1;
+                sqe->splice_fd_in = res->file_fd;
+                sqe->splice_off_in = part->offset + res->part_sent;
+                sqe->off = (uint64_t)-1;
+                sqe->len = chunk;
+                sqe->splice_flags = SPLICE_F_MOVE;
+                sqe->flags = IOSQE_IO_LINK;
+                res->pipe_pending = chunk;
+                conn->splice_len = chunk;
+            }
+            
+            struct io_uring_sqe *sqe = uring_prep(loop, conn, URING_OP_SPLICE_OUT, IORING_OP_SPLICE, conn->fd);
+            if (sqe == NULL) return -1;
+            sqe->splice_fd_in = res->pipe_fds[0];
+            sqe->splice_off_in = (uint64_t)-1;
+            sqe->off = (uint64_t)-1;
+            sqe->len = res->pipe_pending;
+            sqe->splice_flags = out_flags;
+            return 0;
+        }
+        
+        res->part_index++;
+        res->part_sent = 0;
+    }
+}
+
+void uring_process(uring_loop_t *loop, connection_t *conn);
+
+/* Avança a resposta; terminada, registra e segue para a próxima requisição */
+void uring_continue_response(uring_loop_t *loop, connection_t *conn) {
+    int result = uring_send_next(loop, conn);
+    if (result == 0) return;
+    
+    if (result == 1) {
+        response_done(&conn->res);
+    }
+    access_log_record(&conn->peer, &conn->parser, &conn->res);
+    if (result < 0 || !conn->res.keep_alive) {
+        uring_close(loop, conn);
+        return;
+    }
+    
+    conn->request_len -= conn->current_len;
+    memmove(conn->request, conn->request + conn->current_len, conn->request_len);
+    http_parser_reset(&conn->parser);
+    conn->requests_served++;
+    conn->state = CONN_READING_REQUEST;
+    connection_set_deadline(&loop->timers, conn, conn->request_len > 0 ? DEADLINE_HEADER : DEADLINE_IDLE);
+    uring_process(loop, conn);
+}
+
+void uring_process(uring_loop_t *loop, connection_t *conn) {
+    int parsed = http_parse(&conn->parser, conn->request, conn->request_len);
+    if (parsed == 0 && conn->request_len < config.request_buffer_size) {
+        uring_arm_recv(loop, conn);
+        return;
+    }
+    if (parsed == 1) {
+        serve_request(&conn->parser, conn->requests_served, loop->base_directory, &conn->res);
+        conn->current_len = conn->parser.length;
+    } else {
+        send_parse_error(&conn->res, parsed < 0 ? conn->parser.error : http_parse_overflow(&conn->parser));
+        conn->current_len = conn->request_len;
+    }
+    
+    conn->state = CONN_SENDING_HEADERS;
+    connection_set_deadline(&loop->timers, conn, DEADLINE_SEND);
+    uring_continue_response(loop, conn);
+}
+
+void uring_on_accept(uring_loop_t *loop, struct io_uring_cqe *cqe) {
+    if (!(cqe->flags & IORING_CQE_F_MORE)) {
+        uring_arm_accept(loop);
+    }
+    if (cqe->res < 0) {
+        if (cqe->res != -EINTR && cqe->res != -EAGAIN && cqe->res != -ECANCELED) {
+            errno = -cqe->res;
+            perror("Erro ao aceitar conexão");
+        }
+        return;
+    }
+    
+    struct sockaddr_in6 peer;
+    memset(&peer, 0, sizeof(peer));
+    if (access_log.enabled || config.max_connections_per_ip > 0) {
+        socklen_t peer_len = sizeof(peer);
+        getpeername(cqe->res, (struct sockaddr *)&peer, &peer_len);
+        peer_normalize(&peer);
+    }
+    if (!connection_admit(&peer)) {
+        connection_reject(cqe->res);
+        return;
+    }
+    
+    connection_t *conn = calloc(1, sizeof(connection_t) + config.request_buffer_size);
+    if (conn == NULL) {
+        connection_release(&peer);
+        close(cqe->res);
+        return;
     }
-    *dst = '\0';
+    conn->fd = cqe->res;
+    conn->peer = peer;
+    conn->state = CONN_READING_REQUEST;
+    http_parser_reset(&conn->parser);
+    response_init(&conn->res);
+    stats_connection_opened();
+    connection_set_deadline(&loop->timers, conn, DEADLINE_HEADER);
+    uring_arm_recv(loop, conn);
 }
 
-const char* get_mime_type(const char *filename) {
-    const char *ext = strrchr(filename, '.');
-    if (ext == NULL) return "application/octet-stream";
+void uring_on_recv(uring_loop_t *loop, connection_t *conn, struct io_uring_cqe *cqe) {
+    if (cqe->flags & IORING_CQE_F_BUFFER) {
+        unsigned short bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+        if (cqe->res > 0) {
+            memcpy(conn->request + conn->request_len, loop->buffers + (size_t)bid * config.request_buffer_size, cqe->res);
+            conn->request_len += cqe->res;
+        }
+        uring_recycle_buffer(loop, bid);
+    }
     
-    if (strcmp(ext, ".html") == 0 || strcmp(ext, ".htm") == 0)
-        return "text/html";
-    else if (strcmp(ext, ".jpg") == 0 || strcmp(ext, ".jpeg") == 0)
-        return "image/jpeg";
-    else if (strcmp(ext, ".png") == 0)
-        return "image/png";
-    else if (strcmp(ext, ".gif") == 0)
-        return "image/gif";
-    else if (strcmp(ext, ".css") == 0)
-        return "text/css";
-    else if (strcmp(ext, ".js") == 0)
-        return "application/javascript";
-    else if (strcmp(ext, ".txt") == 0)
-        return "text/plain";
-    else if (strcmp(ext, ".pdf") == 0)
-        return "application/pdf";
-    else
-        return "application/octet-stream";
+    if (cqe->res == -ENOBUFS) {
+        /* Todos os buffers em uso: tenta de novo na próxima volta */
+        uring_arm_recv(loop, conn);
+        return;
+    }
+    if (cqe->res <= 0) {
+        uring_close(loop, conn);
+        return;
+    }
+    connection_set_deadline(&loop->timers, conn, DEADLINE_HEADER);
+    uring_process(loop, conn);
 }
 
-int is_safe_path(const char *base_path, const char *requested_path) {
-    char full_path[MAX_PATH_LENGTH];
-    if (snprintf(full_path, sizeof(full_path), "%s/%s", base_path, requested_path) >= (int)sizeof(full_path)) {
-        return 0;
+void uring_on_send(uring_loop_t *loop, connection_t *conn, struct io_uring_cqe *cqe) {
+    if (cqe->res <= 0) {
+        uring_close(loop, conn);
+        return;
     }
     
-    char resolved_base[MAX_PATH_LENGTH];
-    char resolved_full[MAX_PATH_LENGTH];
-    
-    if (realpath(base_path, resolved_base) == NULL) return 0;
-    if (realpath(full_path, resolved_full) == NULL) return 0;
-    
-    return strncmp(resolved_full, resolved_base, strlen(resolved_base)) == 0;
+    response_t *res = &conn->res;
+    response_sent(res, cqe->res);
+    connection_set_deadline(&loop->timers, conn, DEADLINE_SEND);
+    body_part_t *part = res->part_index < res->part_count ? &res->parts[res->part_index] : NULL;
+    size_t data_end = part != NULL ? part->data_end : res->len;
+    size_t data_part = data_end - res->sent;
+    if ((size_t)cqe->res <= data_part) {
+        res->sent += cqe->res;
+    } else {
+        res->sent = data_end;
+        res->part_sent += cqe->res - data_part;
+    }
+    uring_continue_response(loop, conn);
 }
 
-void send_error(int client_sock, int status_code, const char *status_msg, const char *message) {
-    char response[BUFFER_SIZE];
-    int length = snprintf(response, sizeof(response),
-        "HTTP/1.1 %d %s\r\n"
-        "Content-Type: text/html; charset=utf-8\r\n"
-        "Connection: close\r\n"
-        "\r\n"
-        "<html><head><title>%d %s</title></head>\n"
-        "<body><h1>%d %s</h1><p>%s</p></body></html>\n",
-        status_code, status_msg, status_code, status_msg, status_code, status_msg, message);
+/* Os dois splices encadeados completam em qualquer ordem; o envio só
+ * continua quando ambos voltaram. pipe_pending foi contado como se a
+ * entrada viesse inteira: uma entrada curta o corrige e cancela a saída. */
+void uring_on_splice(uring_loop_t *loop, connection_t *conn, int op, struct io_uring_cqe *cqe) {
+    response_t *res = &conn->res;
+    if (op == URING_OP_SPLICE_IN) {
+        if (cqe->res <= 0) {
+            conn->failed = 1;
+        }
+        size_t moved = cqe->res > 0 ? (size_t)cqe->res : 0;
+        res->pipe_pending -= conn->splice_len - moved;
+    } else if (cqe->res > 0) {
+        res->pipe_pending -= cqe->res;
+        res->part_sent += cqe->res;
+        response_sent(res, cqe->res);
+        connection_set_deadline(&loop->timers, conn, DEADLINE_SEND);
+    } else if (cqe->res != -ECANCELED) {
+        conn->failed = 1;
+    }
     
-    send(client_sock, response, length, 0);
+    if (conn->inflight > 0) return;
+    if (conn->failed) {
+        uring_close(loop, conn);
+    } else {
+        uring_continue_response(loop, conn);
+    }
 }
 
-void send_file(int client_sock, const char *full_path, const char *filename) {
-    FILE *file = fopen(full_path, "rb");
-    if (file == NULL) {
-        send_error(client_sock, 404, "Not Found", "Arquivo não encontrado");
-        return;
+void uring_on_tick(uring_loop_t *loop) {
+    long long now = monotonic_ms();
+    wheel_timer_t *timer;
+    while ((timer = timer_wheel_expire(&loop->timers, now)) != NULL) {
+        connection_t *conn = connection_of_timer(timer);
+        connection_expired(conn);
+        uring_close(loop, conn);
+    }
+    uring_arm_tick(loop);
+}
+
+/* Cria o anel e registra os buffers de recepção. Retorna -1 (sem mensagem)
+ * se o kernel não oferece o necessário, para o chamador usar o epoll. */
+int uring_setup(uring_loop_t *loop) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+    params.cq_entries = URING_ENTRIES * 4;
+    loop->ring_fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+    if (loop->ring_fd < 0 && errno == EINVAL) {
+        params.flags = IORING_SETUP_CQSIZE;
+        loop->ring_fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+    }
+    if (loop->ring_fd < 0) return -1;
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP) || !(params.features & IORING_FEAT_NODROP)) {
+        close(loop->ring_fd);
+        errno = ENOSYS;
+        return -1;
     }
     
-    fseek(file, 0, SEEK_END);
-    long file_size = ftell(file);
-    fseek(file, 0, SEEK_SET);
-    
-    const char *mime_type = get_mime_type(filename);
-    
-    char header[BUFFER_SIZE];
-    int header_len = snprintf(header, sizeof(header),
-        "HTTP/1.1 200 OK\r\n"
-        "Content-Type: %s\r\n"
-        "Content-Length: %ld\r\n"
-        "Connection: close\r\n"
-        "\r\n",
-        mime_type, file_size);
-    
-    send(client_sock, header, header_len, 0);
-    
-    char buffer[BUFFER_SIZE];
-    size_t bytes_read;
-    while ((bytes_read = fread(buffer, 1, sizeof(buffer), file)) > 0) {
-        send(client_sock, buffer, bytes_read, 0);
+    size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    size_t ring_size = sq_size > cq_size ? sq_size : cq_size;
+    char *ring = mmap(NULL, ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      loop->ring_fd, IORING_OFF_SQ_RING);
+    struct io_uring_sqe *sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe),
+                                     PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                     loop->ring_fd, IORING_OFF_SQES);
+    if (ring == MAP_FAILED || sqes == MAP_FAILED) {
+        close(loop->ring_fd);
+        return -1;
     }
+    loop->sq_head = (unsigned *)(ring + params.sq_off.head);
+    loop->sq_tail = (unsigned *)(ring + params.sq_off.tail);
+    loop->sq_mask = *(unsigned *)(ring + params.sq_off.ring_mask);
+    loop->sq_array = (unsigned *)(ring + params.sq_off.array);
+    loop->sq_local_tail = *loop->sq_tail;
+    loop->sqes = sqes;
+    loop->cq_head = (unsigned *)(ring + params.cq_off.head);
+    loop->cq_tail = (unsigned *)(ring + params.cq_off.tail);
+    loop->cq_mask = *(unsigned *)(ring + params.cq_off.ring_mask);
+    loop->cqes = (struct io_uring_cqe *)(ring + params.cq_off.cqes);
     
-    fclose(file);
+    /* Anel de buffers fornecidos (grupo 0): o kernel escolhe um buffer
+     * livre só quando chegam dados, em vez de um por conexão ociosa */
+    size_t buf_ring_size = URING_RECV_BUFFERS * sizeof(struct io_uring_buf);
+    loop->buf_ring = mmap(NULL, buf_ring_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    loop->buffers = malloc((size_t)URING_RECV_BUFFERS * config.request_buffer_size);
+    if (loop->buf_ring == MAP_FAILED || loop->buffers == NULL) {
+        close(loop->ring_fd);
+        return -1;
+    }
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)loop->buf_ring;
+    reg.ring_entries = URING_RECV_BUFFERS;
+    reg.bgid = 0;
+    if (syscall(__NR_io_uring_register, loop->ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        int err = errno;
+        close(loop->ring_fd);
+        errno = err;
+        return -1;
+    }
+    loop->buf_ring->tail = 0;
+    for (unsigned short bid = 0; bid < URING_RECV_BUFFERS; bid++) {
+        uring_recycle_buffer(loop, bid);
+    }
+    return 0;
 }
 
-void send_directory_listing(int client_sock, const char *base_path, const char *request_path) {
-    DIR *dir = opendir(base_path);
-    if (dir == NULL) {
-        send_error(client_sock, 403, "Forbidden", "Acesso negado ao diretório");
-        return;
+/* Sem io_uring no kernel (ou sem anéis de buffers, 5.19+), usa o epoll */
+int run_uring_loop(int server_sock, const char *base_directory) {
+    uring_loop_t loop;
+    memset(&loop, 0, sizeof(loop));
+    loop.server_sock = server_sock;
+    loop.base_directory = base_directory;
+    loop.tick.tv_nsec = URING_TICK_MS * 1000000LL;
+    if (uring_setup(&loop) < 0) {
+        fprintf(stderr, "Aviso: io_uring indisponível (%s); usando epoll\n", strerror(errno));
+        return run_event_loop(server_sock, base_directory);
     }
     
-    char header[] = 
-        "HTTP/1.1 200 OK\r\n"
-        "Content-Type: text/html; charset=utf-8\r\n"
-        "Connection: close\r\n"
-        "\r\n";
-    
-    send(client_sock, header, strlen(header), 0);
-    
-    char html_start[BUFFER_SIZE];
-    int html_len = snprintf(html_start, sizeof(html_start),
-        "<html><head><title>Listagem do Diretório</title></head>\n"
-        "<body><h1>Listagem do Diretório: %s</h1>\n"
-        "<table border='1' style='border-collapse: collapse;'>\n"
-        "<tr><th>Nome</th><th>Tipo</th><th>Tamanho</th><th>Modificado</th></tr>\n",
-        request_path);
-    
-    send(client_sock, html_start, html_len, 0);
+    timer_wheel_init(&loop.timers);
+    uring_arm_accept(&loop);
+    uring_arm_tick(&loop);
     
-    struct dirent *entry;
-    struct stat file_stat;
-    char full_path[MAX_PATH_LENGTH];
-    char time_str[64];
-    
-    while ((entry = readdir(dir)) != NULL) {
-        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
-            continue;
-        
-        if (snprintf(full_path, sizeof(full_path), "%s/%s", base_path, entry->d_name) >= (int)sizeof(full_path)) {
-            continue;
+    while (1) {
+        /* EBUSY: completações represadas; basta consumi-las */
+        if (uring_enter(&loop, 1) < 0 && errno != EINTR && errno != EBUSY) {
+            perror("Erro no io_uring_enter");
+            break;
         }
         
-        if (stat(full_path, &file_stat) == 0) {
-            strftime(time_str, sizeof(time_str), "%Y-%m-%d %H:%M:%S", 
-                     localtime(&file_stat.st_mtime));
-            
-            char row[BUFFER_SIZE];
-            const char *type = S_ISDIR(file_stat.st_mode) ? "DIR" : "FILE";
-            off_t file_size = file_stat.st_size;
+        unsigned head = *loop.cq_head;
+        unsigned tail = __atomic_load_n(loop.cq_tail, __ATOMIC_ACQUIRE);
+        while (head != tail) {
+            struct io_uring_cqe cqe = loop.cqes[head & loop.cq_mask];
+            head++;
+            __atomic_store_n(loop.cq_head, head, __ATOMIC_RELEASE);
             
-            char link_path[MAX_PATH_LENGTH];
-            if (snprintf(link_path, sizeof(link_path), "%s/%s", 
-                         strcmp(request_path, "/") == 0 ? "" : request_path, 
-                         entry->d_name) >= (int)sizeof(link_path)) {
+            int op = cqe.user_data & 7;
+            connection_t *conn = (connection_t *)(uintptr_t)(cqe.user_data & ~(uint64_t)7);
+            if (op == URING_OP_ACCEPT) {
+                uring_on_accept(&loop, &cqe);
+                continue;
+            }
+            if (op == URING_OP_TICK) {
+                uring_on_tick(&loop);
                 continue;
             }
             
-            int row_len;
-            if (S_ISDIR(file_stat.st_mode)) {
-                row_len = snprintf(row, sizeof(row),
-                    "<tr><td><a href='%s/'>%s/</a></td><td>%s</td><td>-</td><td>%s</td></tr>\n",
-                    link_path, entry->d_name, type, time_str);
-            } else {
-                char size_str[30];
-                if (file_size < 1024) {
-                    snprintf(size_str, sizeof(size_str), "%ld bytes", file_size);
-                } else if (file_size < 1024 * 1024) {
-                    snprintf(size_str, sizeof(size_str), "%.1f KB", file_size / 1024.0);
-                } else {
-                    snprintf(size_str, sizeof(size_str), "%.1f MB", file_size / (1024.0 * 1024.0));
+            conn->inflight--;
+            if (conn->closing) {
+                if (cqe.flags & IORING_CQE_F_BUFFER) {
+                    uring_recycle_buffer(&loop, cqe.flags >> IORING_CQE_BUFFER_SHIFT);
                 }
-                row_len = snprintf(row, sizeof(row),
-                    "<tr><td><a href='%s'>%s</a></td><td>%s</td><td>%s</td><td>%s</td></tr>\n",
-                    link_path, entry->d_name, type, size_str, time_str);
+                uring_close(&loop, conn);
+                continue;
             }
-            
-            if (row_len < (int)sizeof(row)) {
-                send(client_sock, row, row_len, 0);
+            if (op == URING_OP_RECV) {
+                uring_on_recv(&loop, conn, &cqe);
+            } else if (op == URING_OP_SEND) {
+                uring_on_send(&loop, conn, &cqe);
+            } else {
+                uring_on_splice(&loop, conn, op, &cqe);
             }
         }
     }
     
-    closedir(dir);
+    close(loop.ring_fd);
+    return -1;
+}
+
+/* Endereço de escuta a partir de config.bind_address e config.port:
+ * IPv4 ou IPv6 literal, este opcionalmente entre colchetes */
+int listen_address(struct sockaddr_storage *addr, socklen_t *addr_len) {
+    char host[INET6_ADDRSTRLEN];
+    const char *bind_address = config.bind_address;
+    size_t len = strlen(bind_address);
+    if (len >= 2 && bind_address[0] == '[' && bind_address[len - 1] == ']') {
+        bind_address++;
+        len -= 2;
+    }
+    if (len >= sizeof(host)) return -1;
+    memcpy(host, bind_address, len);
+    host[len] = '\0';
     
-    char html_end[] = "</table></body></html>\n";
-    send(client_sock, html_end, strlen(html_end), 0);
+    memset(addr, 0, sizeof(*addr));
+    struct sockaddr_in *v4 = (struct sockaddr_in *)addr;
+    struct sockaddr_in6 *v6 = (struct sockaddr_in6 *)addr;
+    if (inet_pton(AF_INET, host, &v4->sin_addr) == 1) {
+        v4->sin_family = AF_INET;
+        v4->sin_port = htons(config.port);
+        *addr_len = sizeof(*v4);
+        return 0;
+    }
+    if (inet_pton(AF_INET6, host, &v6->sin6_addr) == 1) {
+        v6->sin6_family = AF_INET6;
+        v6->sin6_port = htons(config.port);
+        *addr_len = sizeof(*v6);
+        return 0;
+    }
+    return -1;
 }
 
-void handle_request(int client_sock, const char *base_directory) {
-    char buffer[BUFFER_SIZE];
-    int bytes_received = recv(client_sock, buffer, sizeof(buffer) - 1, 0);
+/* Cria o socket de escuta. As opções de TCP e os tamanhos de buffer são
+ * configurados nele e herdados pelas conexões aceitas, sem uma chamada a
+ * mais por accept. */
+int create_server_socket(int reuse_port) {
+    struct sockaddr_storage server_addr;
+    socklen_t addr_len;
+    listen_address(&server_addr, &addr_len);
     
-    if (bytes_received <= 0) {
-        close(client_sock);
-        return;
+    int server_sock = socket(server_addr.ss_family, SOCK_STREAM, 0);
+    if (server_sock < 0 && errno == EAFNOSUPPORT && server_addr.ss_family == AF_INET6 &&
+        IN6_IS_ADDR_UNSPECIFIED(&((struct sockaddr_in6 *)&server_addr)->sin6_addr)) {
+        /* Sem IPv6 no kernel, "::" vira 0.0.0.0 */
+        struct sockaddr_in *v4 = (struct sockaddr_in *)&server_addr;
+        memset(&server_addr, 0, sizeof(server_addr));
+        v4->sin_family = AF_INET;
+        v4->sin_addr.s_addr = INADDR_ANY;
+        v4->sin_port = htons(config.port);
+        addr_len = sizeof(*v4);
+        server_sock = socket(AF_INET, SOCK_STREAM, 0);
+    }
+    if (server_sock < 0) {
+        perror("Erro ao criar socket");
+        return -1;
     }
     
-    buffer[bytes_received] = '\0';
+    int opt = 1;
+    if (setsockopt(server_sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0) {
+        perror("Erro ao configurar socket");
+        close(server_sock);
+        return -1;
+    }
     
-    if (strncmp(buffer, "GET ", 4) != 0) {
-        send_error(client_sock, 405, "Method Not Allowed", "Apenas método GET é suportado");
-        close(client_sock);
-        return;
+    if (reuse_port && setsockopt(server_sock, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) < 0) {
+        perror("Erro ao configurar SO_REUSEPORT");
+        close(server_sock);
+        return -1;
     }
     
-    char *path_start = buffer + 4;
-    char *path_end = strchr(path_start, ' ');
-    if (path_end == NULL) {
-        send_error(client_sock, 400, "Bad Request", "Requisição malformada");
-        close(client_sock);
-        return;
+    if (server_addr.ss_family == AF_INET6 &&
+        setsockopt(server_sock, IPPROTO_IPV6, IPV6_V6ONLY, &config.ipv6_only, sizeof(config.ipv6_only)) < 0) {
+        perror("Erro ao configurar IPV6_V6ONLY");
+        close(server_sock);
+        return -1;
     }
     
-    *path_end = '\0';
-    char requested_path[MAX_PATH_LENGTH];
+    /* O SO_RCVBUF precisa vir antes do listen para valer na escala de
+     * janela anunciada no SYN-ACK */
+    if ((config.sndbuf > 0 && setsockopt(server_sock, SOL_SOCKET, SO_SNDBUF, &config.sndbuf, sizeof(config.sndbuf)) < 0) ||
+        (config.rcvbuf > 0 && setsockopt(server_sock, SOL_SOCKET, SO_RCVBUF, &config.rcvbuf, sizeof(config.rcvbuf)) < 0)) {
+        perror("Erro ao configurar os buffers do socket");
+        close(server_sock);
+        return -1;
+    }
     
-    strncpy(requested_path, path_start, sizeof(requested_path) - 1);
-    requested_path[sizeof(requested_path) - 1] = '\0';
-    url_decode(requested_path);
+    if (config.tcp_nodelay && setsockopt(server_sock, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt)) < 0) {
+        perror("Erro ao configurar TCP_NODELAY");
+        close(server_sock);
+        return -1;
+    }
     
-    if (strcmp(requested_path, "/") == 0) {
-        strcpy(requested_path, "");
-    } else {
-        memmove(requested_path, requested_path + 1, strlen(requested_path));
+    /* Com TCP_DEFER_ACCEPT o accept só acorda quando a requisição chega */
+    if (config.defer_accept > 0 &&
+        setsockopt(server_sock, IPPROTO_TCP, TCP_DEFER_ACCEPT, &config.defer_accept, sizeof(config.defer_accept)) < 0) {
+        perror("Erro ao configurar TCP_DEFER_ACCEPT");
+        close(server_sock);
+        return -1;
     }
     
-    char full_path[MAX_PATH_LENGTH];
-    if (snprintf(full_path, sizeof(full_path), "%s/%s", base_directory, requested_path) >= (int)sizeof(full_path)) {
-        send_error(client_sock, 414, "URI Too Long", "Caminho muito longo");
-        close(client_sock);
-        return;
+    if (config.fastopen > 0 &&
+        setsockopt(server_sock, IPPROTO_TCP, TCP_FASTOPEN, &config.fastopen, sizeof(config.fastopen)) < 0) {
+        perror("Erro ao configurar TCP_FASTOPEN");
+        close(server_sock);
+        return -1;
     }
     
-    if (!is_safe_path(base_directory, requested_path)) {
-        send_error(client_sock, 403, "Forbidden", "Acesso ao caminho negado");
-        close(client_sock);
-        return;
+    if (bind(server_sock, (struct sockaddr*)&server_addr, addr_len) < 0) {
+        perror("Erro no bind");
+        close(server_sock);
+        return -1;
     }
     
-    struct stat path_stat;
-    if (stat(full_path, &path_stat) != 0) {
-        send_error(client_sock, 404, "Not Found", "Arquivo ou diretório não encontrado");
-        close(client_sock);
-        return;
+    if (listen(server_sock, config.backlog) < 0) {
+        perror("Erro no listen");
+        close(server_sock);
+        return -1;
     }
     
-    if (S_ISDIR(path_stat.st_mode)) {
-        char index_path[MAX_PATH_LENGTH];
-        if (snprintf(index_path, sizeof(index_path), "%s/index.html", full_path) >= (int)sizeof(index_path)) {
-            send_error(client_sock, 500, "Internal Server Error", "Caminho muito longo");
-            close(client_sock);
-            return;
+    return server_sock;
+}
+
+/* Mostra os valores em vigor no socket de escuta, lidos de volta do
+ * kernel (que pode arredondar ou limitar o que foi pedido) */
+void print_listener(int server_sock) {
+    struct sockaddr_storage addr;
+    socklen_t addr_len = sizeof(addr);
+    char host[INET6_ADDRSTRLEN] = "?";
+    int v6only = 0;
+    getsockname(server_sock, (struct sockaddr *)&addr, &addr_len);
+    if (addr.ss_family == AF_INET6) {
+        inet_ntop(AF_INET6, &((struct sockaddr_in6 *)&addr)->sin6_addr, host, sizeof(host));
+        socklen_t len = sizeof(v6only);
+        getsockopt(server_sock, IPPROTO_IPV6, IPV6_V6ONLY, &v6only, &len);
+    } else {
+        inet_ntop(AF_INET, &((struct sockaddr_in *)&addr)->sin_addr, host, sizeof(host));
+    }
+    
+    int backlog = config.backlog;
+    FILE *somaxconn = fopen("/proc/sys/net/core/somaxconn", "r");
+    if (somaxconn != NULL) {
+        int limit;
+        if (fscanf(somaxconn, "%d", &limit) == 1 && limit < backlog) {
+            backlog = limit;
         }
+        fclose(somaxconn);
+    }
+    
+    int sndbuf = 0, rcvbuf = 0, nodelay = 0, defer_accept = 0, fastopen = 0;
+    socklen_t len = sizeof(int);
+    getsockopt(server_sock, SOL_SOCKET, SO_SNDBUF, &sndbuf, &len);
+    getsockopt(server_sock, SOL_SOCKET, SO_RCVBUF, &rcvbuf, &len);
+    getsockopt(server_sock, IPPROTO_TCP, TCP_NODELAY, &nodelay, &len);
+    getsockopt(server_sock, IPPROTO_TCP, TCP_DEFER_ACCEPT, &defer_accept, &len);
+    getsockopt(server_sock, IPPROTO_TCP, TCP_FASTOPEN, &fastopen, &len);
+    
+    printf("Servidor HTTP rodando em http://localhost:%d\n", config.port);
+    printf("Escutando em %s%s%s:%d%s, backlog %d%s\n",
+           addr.ss_family == AF_INET6 ? "[" : "", host, addr.ss_family == AF_INET6 ? "]" : "", config.port,
+           addr.ss_family == AF_INET6 && !v6only ? " (IPv6 e IPv4)" : "",
+           backlog, backlog < config.backlog ? " (limitado por net.core.somaxconn)" : "");
+    printf("TCP: nodelay %s, defer-accept %d s, fastopen %d, SO_SNDBUF %d%s, SO_RCVBUF %d%s\n",
+           nodelay ? "sim" : "não", defer_accept, fastopen,
+           sndbuf, config.sndbuf > 0 ? "" : " (automático)", rcvbuf, config.rcvbuf > 0 ? "" : " (automático)");
+    printf("Buffer de requisição: %zu KB; accept em lotes de até %d conexões\n",
+           config.request_buffer_size / 1024, config.accept_batch);
+}
+
+void run_blocking_loop(int server_sock, const char *base_directory) {
+    while (1) {
+        struct sockaddr_in6 client_addr;
+        socklen_t client_len = sizeof(client_addr);
         
-        if (access(index_path, F_OK) == 0) {
-            send_file(client_sock, index_path, "index.html");
-        } else {
-            send_directory_listing(client_sock, full_path, requested_path);
+        int client_sock = accept4(server_sock, (struct sockaddr*)&client_addr, &client_len, SOCK_NONBLOCK);
+        if (client_sock < 0) {
+            perror("Erro ao aceitar conexão");
+            continue;
+        }
+        peer_normalize(&client_addr);
+        if (!connection_admit(&client_addr)) {
+            connection_reject(client_sock);
+            continue;
+        }
+        
+        handle_request(client_sock, &client_addr, base_directory);
+        connection_release(&client_addr);
+    }
+}
+
+typedef struct {
+    int id;
+    int server_sock;
+    int cpu;
+    int use_epoll;
+    int use_uring;
+    const char *base_directory;
+    pthread_t thread;
+} worker_t;
+
+void *worker_main(void *arg) {
+    worker_t *worker = arg;
+    
+    if (worker->cpu >= 0) {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(worker->cpu, &cpus);
+        int err = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+        if (err != 0) {
+            fprintf(stderr, "Aviso: não foi possível fixar o worker %d na CPU %d: %s\n",
+                    worker->id, worker->cpu, strerror(err));
         }
+    }
+    
+    if (worker->use_uring) {
+        run_uring_loop(worker->server_sock, worker->base_directory);
+    } else if (worker->use_epoll) {
+        run_event_loop(worker->server_sock, worker->base_directory);
     } else {
-        send_file(client_sock, full_path, requested_path);
+        run_blocking_loop(worker->server_sock, worker->base_directory);
+    }
+    return NULL;
+}
+
+/* Escolhe a CPU do worker entre as permitidas ao processo, em rodízio. */
+int worker_cpu(int index) {
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+        return -1;
+    }
+    int count = CPU_COUNT(&allowed);
+    if (count == 0) {
+        return -1;
+    }
+    int target = index % count;
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, &allowed) && target-- == 0) {
+            return cpu;
+        }
+    }
+    return -1;
+}
+
+/* Lê o arquivo de --config: uma opção longa por linha, sem os "--", como
+ * "port = 8080" ou só "epoll"; linhas vazias e o que vem depois de '#' são
+ * ignorados. As opções voltam em *args no formato da linha de comando
+ * ("--port=8080"), para passarem pelo mesmo getopt_long. */
+int config_file_load(const char *path, const struct option *options, char ***args, int *count) {
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        fprintf(stderr, "Erro: não foi possível abrir o arquivo de configuração '%s': %s\n", path, strerror(errno));
+        return -1;
     }
     
-    close(client_sock);
+    char line[1024];
+    int line_number = 0;
+    while (fgets(line, sizeof(line), file) != NULL) {
+        line_number++;
+        char *comment = strchr(line, '#');
+        if (comment != NULL) *comment = '\0';
+        
+        char *key = line;
+        while (isspace((unsigned char)*key)) key++;
+        if (*key == '\0') continue;
+        char *value = strchr(key, '=');
+        char *key_end = value != NULL ? value : key + strlen(key);
+        while (key_end > key && isspace((unsigned char)key_end[-1])) key_end--;
+        *key_end = '\0';
+        if (value != NULL) {
+            value++;
+            while (isspace((unsigned char)*value)) value++;
+            char *value_end = value + strlen(value);
+            while (value_end > value && isspace((unsigned char)value_end[-1])) value_end--;
+            *value_end = '\0';
+        }
+        
+        const struct option *option = options;
+        while (option->name != NULL && strcmp(option->name, key) != 0) option++;
+        const char *error = NULL;
+        if (option->name == NULL || strcmp(key, "config") == 0) {
+            error = "opção desconhecida";
+        } else if (option->has_arg == required_argument && (value == NULL || *value == '\0')) {
+            error = "falta o valor da opção";
+        } else if (option->has_arg == no_argument && value != NULL) {
+            error = "a opção não recebe valor";
+        }
+        if (error != NULL) {
+            fprintf(stderr, "Erro: %s:%d: %s: %s\n", path, line_number, error, key);
+            fclose(file);
+            return -1;
+        }
+        
+        char *arg;
+        char **grown = realloc(*args, (*count + 1) * sizeof(char *));
+        if (grown == NULL || asprintf(&arg, "--%s%s%s", key, value != NULL ? "=" : "", value != NULL ? value : "") < 0) {
+            perror("Erro ao ler o arquivo de configuração");
+            fclose(file);
+            return -1;
+        }
+        *args = grown;
+        (*args)[(*count)++] = arg;
+    }
+    
+    fclose(file);
+    return 0;
+}
+
+void print_usage(const char *program) {
+    fprintf(stderr, "Uso: %s [opções] <diretório>\n", program);
+    fprintf(stderr, "     %s [opções] --bundle ARQ\n", program);
+    fprintf(stderr, "Exemplo: %s /home/flavio/meusite\n", program);
+    fprintf(stderr, "Opções:\n");
+    fprintf(stderr, "  --config ARQ     lê opções de ARQ, uma por linha (\"port = 8080\", \"epoll\");\n");
+    fprintf(stderr, "                   as da linha de comando prevalecem\n");
+    fprintf(stderr, "  --bind ENDEREÇO  endereço IPv4 ou IPv6 de escuta (padrão %s, IPv6 e IPv4)\n", config.bind_address);
+    fprintf(stderr, "  --ipv6-only      com endereço IPv6, não aceita clientes IPv4\n");
+    fprintf(stderr, "  --port N         porta de escuta (padrão %d)\n", config.port);
+    fprintf(stderr, "  --backlog N      fila de conexões à espera do accept (padrão %d)\n", config.backlog);
+    fprintf(stderr, "  --accept-batch N conexões aceitas de uma vez antes de atender os outros eventos\n");
+    fprintf(stderr, "                   (--epoll; padrão %d)\n", config.accept_batch);
+    fprintf(stderr, "  --defer-accept S só aceita a conexão quando a requisição chegar, esperando até S\n");
+    fprintf(stderr, "                   segundos (TCP_DEFER_ACCEPT; 0 desativa; padrão 0)\n");
+    fprintf(stderr, "  --fastopen N     aceita dados no SYN (TCP_FASTOPEN), com fila de N conexões\n");
+    fprintf(stderr, "                   (0 desativa; padrão 0)\n");
+    fprintf(stderr, "  --tcp-nodelay    desativa o algoritmo de Nagle (TCP_NODELAY)\n");
+    fprintf(stderr, "  --sndbuf KB      SO_SNDBUF das conexões (0 ajuste automático; padrão 0)\n");
+    fprintf(stderr, "  --rcvbuf KB      SO_RCVBUF das conexões (0 ajuste automático; padrão 0)\n");
+    fprintf(stderr, "  --request-buffer KB\n");
+    fprintf(stderr, "                   buffer de leitura por conexão, que limita o tamanho da requisição\n");
+    fprintf(stderr, "                   (padrão %zu)\n", config.request_buffer_size / 1024);
+    fprintf(stderr, "  --epoll          usa o laço de eventos com epoll e sockets não bloqueantes\n");
+    fprintf(stderr, "  --io-uring       usa io_uring (accept multishot, buffers registrados, splice encadeado);\n");
+    fprintf(stderr, "                   sem suporte no kernel, usa o epoll\n");
+    fprintf(stderr, "  --workers N      inicia N workers, cada um com seu socket SO_REUSEPORT\n");
+    fprintf(stderr, "  --cpu-affinity   fixa cada worker em uma CPU\n");
+    fprintf(stderr, "  --keepalive-timeout S\n");
+    fprintf(stderr, "                   segundos ociosos antes de fechar conexões persistentes (0 desativa; padrão %d)\n",
+            config.keepalive_timeout);
+    fprintf(stderr, "  --max-requests N máximo de requisições por conexão (padrão %d)\n",
+            config.max_keepalive_requests);
+    fprintf(stderr, "  --header-timeout S\n");
+    fprintf(stderr, "                   segundos para o cliente enviar o cabeçalho inteiro da requisição (0 sem limite; padrão %d)\n",
+            config.header_timeout);
+    fprintf(stderr, "  --send-timeout S segundos que o cliente pode ficar sem ler a resposta (0 sem limite; padrão %d)\n",
+            config.send_timeout);
+    fprintf(stderr, "  --max-connections N\n");
+    fprintf(stderr, "                   conexões abertas ao mesmo tempo, somando os workers (padrão %d)\n",
+            config.max_connections);
+    fprintf(stderr, "  --max-per-ip N   conexões abertas por endereço de cliente (0 sem limite; padrão 0)\n");
+    fprintf(stderr, "  --cache-size MB  memória do cache de arquivos pequenos (0 desativa; padrão %zu)\n",
+            config.cache_size / (1024 * 1024));
+    fprintf(stderr, "  --listing-cache-size MB\n");
+    fprintf(stderr, "                   memória do cache de listagens de diretório (0 desativa; padrão %zu)\n",
+            config.listing_cache_size / (1024 * 1024));
+    fprintf(stderr, "  --gzip-cache-size MB\n");
+    fprintf(stderr, "                   memória do cache de objetos comprimidos (0 desativa gzip dinâmico; padrão %zu)\n",
+            config.gzip_cache_size / (1024 * 1024));
+    fprintf(stderr, "  --send-quantum KB\n");
+    fprintf(stderr, "                   KB enviados por conexão a cada vez no rodízio de envio (--epoll; padrão %zu)\n",
+            config.send_quantum / 1024);
+    fprintf(stderr, "  --conn-bandwidth KB\n");
+    fprintf(stderr, "                   limite de KB/s por conexão (--epoll; 0 sem limite; padrão 0)\n");
+    fprintf(stderr, "  --total-bandwidth KB\n");
+    fprintf(stderr, "                   limite de KB/s somando todas as conexões (--epoll; 0 sem limite; padrão 0)\n");
+    fprintf(stderr, "  --bundle ARQ     serve o bundle gerado pelo empacotador, mapeado em memória,\n");
+    fprintf(stderr, "                   em vez de um diretório\n");
+    fprintf(stderr, "  --access-log ARQ grava o log de acesso em ARQ (\"-\" para a saída padrão)\n");
+    fprintf(stderr, "  --log-format F   formato do log: clf (padrão) ou json\n");
+    fprintf(stderr, "  --log-max-size MB\n");
+    fprintf(stderr, "                   tamanho que faz o log ser rotacionado para ARQ.1 (0 não rotaciona; padrão %zu)\n",
+            config.log_max_size / (1024 * 1024));
 }
 
 int main(int argc, char *argv[]) {
-    if (argc != 2) {
-        fprintf(stderr, "Uso: %s <diretório>\n", argv[0]);
-        fprintf(stderr, "Exemplo: %s /home/flavio/meusite\n", argv[0]);
-        return 1;
+    static const struct option long_options[] = {
+        {"config", required_argument, NULL, 'f'},
+        {"bind", required_argument, NULL, 'A'},
+        {"ipv6-only", no_argument, NULL, '6'},
+        {"port", required_argument, NULL, 'p'},
+        {"backlog", required_argument, NULL, 'q'},
+        {"accept-batch", required_argument, NULL, 'N'},
+        {"defer-accept", required_argument, NULL, 'D'},
+        {"fastopen", required_argument, NULL, 'O'},
+        {"tcp-nodelay", no_argument, NULL, 'n'},
+        {"sndbuf", required_argument, NULL, 's'},
+        {"rcvbuf", required_argument, NULL, 'r'},
+        {"request-buffer", required_argument, NULL, 'I'},
+        {"epoll", no_argument, NULL, 'e'},
+        {"io-uring", no_argument, NULL, 'u'},
+        {"workers", required_argument, NULL, 'w'},
+        {"cpu-affinity", no_argument, NULL, 'a'},
+        {"keepalive-timeout", required_argument, NULL, 'k'},
+        {"max-requests", required_argument, NULL, 'm'},
+        {"header-timeout", required_argument, NULL, 'H'},
+        {"send-timeout", required_argument, NULL, 'S'},
+        {"max-connections", required_argument, NULL, 'C'},
+        {"max-per-ip", required_argument, NULL, 'P'},
+        {"cache-size", required_argument, NULL, 'c'},
+        {"gzip-cache-size", required_argument, NULL, 'z'},
+        {"listing-cache-size", required_argument, NULL, 'l'},
+        {"access-log", required_argument, NULL, 'L'},
+        {"log-format", required_argument, NULL, 'F'},
+        {"log-max-size", required_argument, NULL, 'R'},
+        {"send-quantum", required_argument, NULL, 'Q'},
+        {"conn-bandwidth", required_argument, NULL, 'B'},
+        {"total-bandwidth", required_argument, NULL, 'T'},
+        {"bundle", required_argument, NULL, 'b'},
+        {NULL, 0, NULL, 0}
+    };
+    
+    int use_epoll = 0;
+    int use_uring = 0;
+    int num_workers = 0;
+    int cpu_affinity = 0;
+    int max_connections_set = 0;
+    const char *bundle_path = NULL;
+    
+    /* As opções do arquivo de --config vêm antes das da linha de comando,
+     * que assim prevalecem sobre elas */
+    const char *config_path = NULL;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--config") == 0 && i + 1 < argc) {
+            config_path = argv[i + 1];
+        } else if (strncmp(argv[i], "--config=", 9) == 0) {
+            config_path = argv[i] + 9;
+        }
+    }
+    if (config_path != NULL) {
+        char **file_args = NULL;
+        int file_count = 0;
+        if (config_file_load(config_path, long_options, &file_args, &file_count) < 0) {
+            return 1;
+        }
+        char **all_args = malloc((argc + file_count + 1) * sizeof(char *));
+        if (all_args == NULL) {
+            perror("Erro ao ler o arquivo de configuração");
+            return 1;
+        }
+        all_args[0] = argv[0];
+        memcpy(all_args + 1, file_args, file_count * sizeof(char *));
+        memcpy(all_args + 1 + file_count, argv + 1, argc * sizeof(char *));
+        argv = all_args;
+        argc += file_count;
+        free(file_args);
     }
     
-    const char *base_directory = argv[1];
+    int option;
+    while ((option = getopt_long(argc, argv, "", long_options, NULL)) != -1) {
+        switch (option) {
+            case 'f':
+                break;
+            case 'A':
+                config.bind_address = optarg;
+                break;
+            case '6':
+                config.ipv6_only = 1;
+                break;
+            case 'p':
+                config.port = atoi(optarg);
+                if (config.port < 1 || config.port > 65535) {
+                    fprintf(stderr, "Erro: porta inválida: %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'q':
+                config.backlog = atoi(optarg);
+                if (config.backlog < 1) {
+                    fprintf(stderr, "Erro: backlog inválido: %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'N':
+                config.accept_batch = atoi(optarg);
+                if (config.accept_batch < 1) {
+                    fprintf(stderr, "Erro: lote de accept inválido: %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'D':
+                config.defer_accept = atoi(optarg);
+                if (config.defer_accept < 0) {
+                    fprintf(stderr, "Erro: tempo de defer-accept inválido: %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'O':
+                config.fastopen = atoi(optarg);
+                if (config.fastopen < 0) {
+                    fprintf(stderr, "Erro: fila de fastopen inválida: %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'n':
+                config.tcp_nodelay = 1;
+                break;
+            case 's':
+                if (atoi(optarg) < 0 || atoi(optarg) > INT_MAX / 1024) {
+                    fprintf(stderr, "Erro: tamanho de buffer inválido: %s\n", optarg);
+                    return 1;
+                }
+                config.sndbuf = atoi(optarg) * 1024;
+                break;
+            case 'r':
+                if (atoi(optarg) < 0 || atoi(optarg) > INT_MAX / 1024) {
+                    fprintf(stderr, "Erro: tamanho de buffer inválido: %s\n", optarg);
+                    return 1;
+                }
+                config.rcvbuf = atoi(optarg) * 1024;
+                break;
+            case 'I':
+                if (atoi(optarg) < 1 || atoi(optarg) > 1024) {
+                    fprintf(stderr, "Erro: tamanho de buffer de requisição inválido: %s (de 1 a 1024 KB)\n", optarg);
+                    return 1;
+                }
+                config.request_buffer_size = (size_t)atoi(optarg) * 1024;
+                break;
+            case 'e':
+                use_epoll = 1;
+                break;
+            case 'u':
+                use_uring = 1;
+                break;
+            case 'w':
+                num_workers = atoi(optarg);
+                if (num_workers < 1) {
+                    fprintf(stderr, "Erro: número de workers inválido: %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'a':
+                cpu_affinity = 1;
+                break;
+            case 'k':
+                config.keepalive_timeout = atoi(optarg);
+                if (config.keepalive_timeout < 0) {
+                    fprintf(stderr, "Erro: timeout de keep-alive inválido: %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'm':
+                config.max_keepalive_requests = atoi(optarg);
+                if (config.max_keepalive_requests < 1) {
+                    fprintf(stderr, "Erro: número máximo de requisições inválido: %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'H':
+                config.header_timeout = atoi(optarg);
+                if (config.header_timeout < 0) {
+                    fprintf(stderr, "Erro: timeout de cabeçalho inválido: %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'S':
+                config.send_timeout = atoi(optarg);
+                if (config.send_timeout < 0) {
+                    fprintf(stderr, "Erro: timeout de envio inválido: %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'C':
+                config.max_connections = atoi(optarg);
+                if (config.max_connections < 1) {
+                    fprintf(stderr, "Erro: número máximo de conexões inválido: %s\n", optarg);
+                    return 1;
+                }
+                max_connections_set = 1;
+                break;
+            case 'P':
+                config.max_connections_per_ip = atoi(optarg);
+                if (config.max_connections_per_ip < 0) {
+                    fprintf(stderr, "Erro: número máximo de conexões por endereço inválido: %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'c':
+                if (atoi(optarg) < 0) {
+                    fprintf(stderr, "Erro: tamanho de cache inválido: %s\n", optarg);
+                    return 1;
+                }
+                config.cache_size = (size_t)atoi(optarg) * 1024 * 1024;
+                if (config.cache_max_file_size > config.cache_size / 8) {
+                    config.cache_max_file_size = config.cache_size / 8;
+                }
+                break;
+            case 'z':
+                if (atoi(optarg) < 0) {
+                    fprintf(stderr, "Erro: tamanho de cache inválido: %s\n", optarg);
+                    return 1;
+                }
+                config.gzip_cache_size = (size_t)atoi(optarg) * 1024 * 1024;
+                if (config.gzip_max_file_size > config.gzip_cache_size / 2) {
+                    config.gzip_max_file_size = config.gzip_cache_size / 2;
+                }
+                break;
+            case 'l':
+                if (atoi(optarg) < 0) {
+                    fprintf(stderr, "Erro: tamanho de cache inválido: %s\n", optarg);
+                    return 1;
+                }
+                config.listing_cache_size = (size_t)atoi(optarg) * 1024 * 1024;
+                break;
+            case 'L':
+                config.access_log = optarg;
+                break;
+            case 'F':
+                if (strcmp(optarg, "json") == 0) {
+                    config.log_json = 1;
+                } else if (strcmp(optarg, "clf") == 0) {
+                    config.log_json = 0;
+                } else {
+                    fprintf(stderr, "Erro: formato de log inválido: %s (use clf ou json)\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'R':
+                if (atoi(optarg) < 0) {
+                    fprintf(stderr, "Erro: tamanho de log inválido: %s\n", optarg);
+                    return 1;
+                }
+                config.log_max_size = (size_t)atoi(optarg) * 1024 * 1024;
+                break;
+            case 'Q':
+                if (atoi(optarg) < 1) {
+                    fprintf(stderr, "Erro: quantum de envio inválido: %s\n", optarg);
+                    return 1;
+                }
+                config.send_quantum = (size_t)atoi(optarg) * 1024;
+                break;
+            case 'B':
+                if (atoi(optarg) < 0) {
+                    fprintf(stderr, "Erro: limite de banda inválido: %s\n", optarg);
+                    return 1;
+                }
+                config.conn_bandwidth = (size_t)atoi(optarg) * 1024;
+                break;
+            case 'T':
+                if (atoi(optarg) < 0) {
+                    fprintf(stderr, "Erro: limite de banda inválido: %s\n", optarg);
+                    return 1;
+                }
+                config.total_bandwidth = (size_t)atoi(optarg) * 1024;
+                break;
+            case 'b':
+                bundle_path = optarg;
+                break;
+            default:
+                print_usage(argv[0]);
+                return 1;
+        }
+    }
     
-    struct stat dir_stat;
-    if (stat(base_directory, &dir_stat) != 0 || !S_ISDIR(dir_stat.st_mode)) {
-        fprintf(stderr, "Erro: Diretório '%s' não existe ou não é acessível\n", base_directory);
+    if (optind != argc - (bundle_path == NULL)) {
+        print_usage(argv[0]);
         return 1;
     }
     
-    int server_sock = socket(AF_INET, SOCK_STREAM, 0);
-    if (server_sock < 0) {
-        perror("Erro ao criar socket");
+    const char *base_directory = bundle_path != NULL ? bundle_path : argv[optind];
+    
+    struct sockaddr_storage listen_addr;
+    socklen_t listen_addr_len;
+    if (listen_address(&listen_addr, &listen_addr_len) < 0) {
+        fprintf(stderr, "Erro: endereço de escuta inválido: %s (use um IPv4 ou IPv6 literal)\n", config.bind_address);
         return 1;
     }
     
-    int opt = 1;
-    if (setsockopt(server_sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0) {
-        perror("Erro ao configurar socket");
-        close(server_sock);
-        return 1;
+    if ((config.conn_bandwidth > 0 || config.total_bandwidth > 0) && (!use_epoll || use_uring)) {
+        fprintf(stderr, "Aviso: os limites de banda só valem com --epoll\n");
     }
     
-    struct sockaddr_in server_addr;
-    memset(&server_addr, 0, sizeof(server_addr));
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_addr.s_addr = INADDR_ANY;
-    server_addr.sin_port = htons(PORT);
+    if (bundle_path != NULL) {
+        if (bundle_open(bundle_path) < 0) {
+            return 1;
+        }
+    } else {
+        base_dir_fd = open(base_directory, O_PATH | O_DIRECTORY | O_CLOEXEC);
+        if (base_dir_fd < 0 || realpath(base_directory, resolved_base) == NULL) {
+            fprintf(stderr, "Erro: Diretório '%s' não existe ou não é acessível\n", base_directory);
+            return 1;
+        }
+    }
     
-    if (bind(server_sock, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
-        perror("Erro no bind");
-        close(server_sock);
+    /* Cada conexão pode usar até FDS_PER_CONNECTION descritores (socket,
+     * arquivo e pipe do splice): o limite de conexões cabe no de arquivos
+     * abertos, para o accept nunca falhar com EMFILE */
+    struct rlimit files;
+    if (getrlimit(RLIMIT_NOFILE, &files) == 0) {
+        files.rlim_cur = files.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &files);
+        getrlimit(RLIMIT_NOFILE, &files);
+        if (files.rlim_cur != RLIM_INFINITY &&
+            (rlim_t)config.max_connections * FDS_PER_CONNECTION + FDS_RESERVED > files.rlim_cur) {
+            int fitting = files.rlim_cur > FDS_RESERVED + FDS_PER_CONNECTION ?
+                          (int)((files.rlim_cur - FDS_RESERVED) / FDS_PER_CONNECTION) : 1;
+            if (max_connections_set) {
+                fprintf(stderr, "Aviso: o limite de %llu arquivos abertos comporta %d conexões; "
+                        "usando --max-connections %d\n", (unsigned long long)files.rlim_cur, fitting, fitting);
+            }
+            config.max_connections = fitting;
+        }
+    }
+    
+    /* Com a saída redirecionada para um arquivo, as mensagens de partida
+     * (com os valores em vigor) são gravadas nele na hora, e não só
+     * quando o buffer enche */
+    setvbuf(stdout, NULL, _IOLBF, 0);
+    signal(SIGPIPE, SIG_IGN);
+    parser_init();
+    hpack_init();
+    if (bundle_path == NULL) {
+        cache_init();
+    }
+    if (access_log_init() < 0) {
         return 1;
     }
     
-    if (listen(server_sock, 10) < 0) {
-        perror("Erro no listen");
+    if (num_workers == 0) {
+        int server_sock = create_server_socket(0);
+        if (server_sock < 0) {
+            return 1;
+        }
+        
+        print_listener(server_sock);
+        if (bundle_path != NULL) {
+            printf("Servindo o bundle: %s (%u caminhos)\n", bundle_path, bundle.header->count);
+        } else {
+            printf("Servindo arquivos do diretório: %s\n", base_directory);
+        }
+        printf("Pressione Ctrl+C para parar o servidor\n");
+        
+        if (use_uring) {
+            run_uring_loop(server_sock, base_directory);
+        } else if (use_epoll) {
+            run_event_loop(server_sock, base_directory);
+        } else {
+            run_blocking_loop(server_sock, base_directory);
+        }
         close(server_sock);
         return 1;
     }
     
-    printf("Servidor HTTP rodando em http://localhost:%d\n", PORT);
-    printf("Servindo arquivos do diretório: %s\n", base_directory);
+    /* Cada worker tem seu próprio socket de escuta; com SO_REUSEPORT o
+     * kernel distribui as conexões novas entre eles. */
+    worker_t *workers = calloc(num_workers, sizeof(worker_t));
+    if (workers == NULL) {
+        perror("Erro ao alocar workers");
+        return 1;
+    }
+    
+    for (int i = 0; i < num_workers; i++) {
+        workers[i].id = i;
+        workers[i].use_epoll = use_epoll;
+        workers[i].use_uring = use_uring;
+        workers[i].base_directory = base_directory;
+        workers[i].cpu = cpu_affinity ? worker_cpu(i) : -1;
+        workers[i].server_sock = create_server_socket(1);
+        if (workers[i].server_sock < 0) {
+            return 1;
+        }
+    }
+    
+    print_listener(workers[0].server_sock);
+    if (bundle_path != NULL) {
+        printf("Servindo o bundle: %s (%u caminhos)\n", bundle_path, bundle.header->count);
+    } else {
+        printf("Servindo arquivos do diretório: %s\n", base_directory);
+    }
+    printf("Workers: %d%s\n", num_workers, cpu_affinity ? " (fixados em CPUs)" : "");
     printf("Pressione Ctrl+C para parar o servidor\n");
     
-    while (1) {
-        struct sockaddr_in client_addr;
-        socklen_t client_len = sizeof(client_addr);
-        
-        int client_sock = accept(server_sock, (struct sockaddr*)&client_addr, &client_len);
-        if (client_sock < 0) {
-            perror("Erro ao aceitar conexão");
-            continue;
+    for (int i = 0; i < num_workers; i++) {
+        int err = pthread_create(&workers[i].thread, NULL, worker_main, &workers[i]);
+        if (err != 0) {
+            fprintf(stderr, "Erro ao criar worker %d: %s\n", i, strerror(err));
+            return 1;
         }
-        
-        printf("Conexão aceita de %s:%d\n", 
-               inet_ntoa(client_addr.sin_addr), ntohs(client_addr.sin_port));
-        
-        handle_request(client_sock, base_directory);
     }
     
-    close(server_sock);
-    return 0;
-}
\ No newline at end of file
+    for (int i = 0; i < num_workers; i++) {
+        pthread_join(workers[i].thread, NULL);
+        close(workers[i].server_sock);
+    }
+    
+    free(workers);
+    return 1;
+}